@@ -1,5 +1,6 @@
 #include "BaseUtil.h"
 #include "SvmUtil.h"
+#include "SvmInsn.h"
 
 VOID SetvCpuMode(PVIRTUAL_PROCESSOR_DATA pVpdata, CPU_MODE CpuMode)
 {
@@ -128,6 +129,12 @@ VOID SaveGuestVmcb12FromGuestVmcb02(_Inout_ PVIRTUAL_PROCESSOR_DATA VpData, _Ino
     pVmcbGuest12va->StateSaveArea.Rip = pVmcbGuest02va->StateSaveArea.Rip; // save L2 rip => vmcb12
     pVmcbGuest12va->ControlArea.NRip = pVmcbGuest02va->ControlArea.NRip; // save L2 next rip => vmcb12
 
+    // decode assists, advertised to L1 by SV_NESTED_SVM_FEATURES
+    pVmcbGuest12va->ControlArea.NumOfBytesFetched = pVmcbGuest02va->ControlArea.NumOfBytesFetched;
+    RtlCopyMemory(pVmcbGuest12va->ControlArea.GuestInstructionBytes,
+        pVmcbGuest02va->ControlArea.GuestInstructionBytes,
+        sizeof(pVmcbGuest12va->ControlArea.GuestInstructionBytes));
+
     pVmcbGuest12va->ControlArea.ExitCode = pVmcbGuest02va->ControlArea.ExitCode;
     pVmcbGuest12va->ControlArea.ExitInfo1 = pVmcbGuest02va->ControlArea.ExitInfo1;
     pVmcbGuest12va->ControlArea.ExitInfo2 = pVmcbGuest02va->ControlArea.ExitInfo2;
@@ -138,8 +145,12 @@ VOID SaveGuestVmcb12FromGuestVmcb02(_Inout_ PVIRTUAL_PROCESSOR_DATA VpData, _Ino
 
     GuestContext->VpRegs->Rax = VmmpGetVcpuVmx(VpData)->vmcb_guest_12_pa; //  L2 rax, vmcb12pa
     pVmcbGuest02va->StateSaveArea.Rsp = VpData->GuestVmcb.StateSaveArea.Rsp; // L2 host rsp 
-    pVmcbGuest02va->StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip; // L2 host ip 
+    if (!SvGetNextGuestRip(VpData, &VpData->GuestVmcb, &pVmcbGuest02va->StateSaveArea.Rip)) // L2 host ip 
+    {
+        pVmcbGuest02va->StateSaveArea.Rip = VpData->GuestVmcb.StateSaveArea.Rip;
+    }
     pVmcbGuest02va->StateSaveArea.Rflags = VpData->GuestVmcb.StateSaveArea.Rflags; // not right , but can not find
+    pVmcbGuest02va->ControlArea.IopmBasePa = VpData->GuestVmcb.ControlArea.IopmBasePa; // L1 host runs with 01 io int
 
     SvDebugPrint("[SaveGuestVmcb12FromGuestVmcb02] pVmcbGuest12va->StateSaveArea.Rax  : %I64X \r\n", pVmcbGuest12va->StateSaveArea.Rax);
     SvDebugPrint("[SaveGuestVmcb12FromGuestVmcb02] pVmcbGuest12va->StateSaveArea.Rsp  : %I64X \r\n", pVmcbGuest12va->StateSaveArea.Rsp);
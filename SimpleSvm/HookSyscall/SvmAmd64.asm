@@ -1,5 +1,6 @@
 
 EXTERN NtSyscallHandler64:DQ
+EXTERN g_HookBitmap:DWORD
 EXTERN SysCallNum:DQ
 EXTERN HookPort64 : PROC
 
@@ -55,15 +56,6 @@ NT_CREATE_FILE = 052h
 
 .CODE
 
-GetRax PROC
-	ret
-GetRax ENDP
-
-GetR10 PROC
-	mov rax, r10
-	ret
-GetR10 ENDP
-
 ; *********************************************************
 ;
 ; Return to the original NTOSKRNL syscall handler
@@ -71,10 +63,16 @@ GetR10 ENDP
 ;
 ; *********************************************************
 MyKiSystemCall64 PROC
+	; Unhooked syscalls go straight to the original handler without touching
+	; GS, the stack or any register but flags, which SYSCALL already saved.
+	; Only EAX is checked as the kernel ignores the upper half of RAX.
+	cmp       eax, SYSCALL_MAX_INDEX      ; Is the index larger than the array size?
+	jae         PassThrough
+	bt        dword ptr [g_HookBitmap], eax ; Is the syscall hooked?
+	jnc         PassThrough
+
 	swapgs                                  ; swap GS base to kernel PCR
     mov       gs:[USERMD_STACK_GS], rsp   ; save user stack pointer
-	cmp       rax, SYSCALL_MAX_INDEX      ; Is the index larger than the array size?
-	jge         EntryPoint  
 
 	;cmp       eax, NT_CREATE_FILE
 	;jne         EntryPoint
@@ -83,10 +81,6 @@ MyKiSystemCall64 PROC
 
 	; hook_fun
 	PUSHAQ                  ; -8 * 16
-	mov rcx,   gs:[USERMD_STACK_GS] ; user stack to param
-	;rdx
-	;r8
-	;r9
 	; save volatile XMM registers
     sub rsp, 60h
     movaps xmmword ptr [rsp - 0], xmm0
@@ -97,6 +91,16 @@ MyKiSystemCall64 PROC
     movaps xmmword ptr [rsp - 50h], xmm5
 
     sub rsp, 200h
+	; HookPort64(SysNum, param1, param2, param3, param4, pstack). SYSCALL
+	; left the number in RAX and the first argument in R10, so move both into
+	; argument registers here rather than let compiled code read them back.
+	mov rcx,   rax          ; SysNum
+	mov rax,   gs:[USERMD_STACK_GS] ; user stack
+	mov [rsp + 28h], rax
+	mov [rsp + 20h], r9     ; param4
+	mov r9,    r8           ; param3
+	mov r8,    rdx          ; param2
+	mov rdx,   r10          ; param1
 	call HookPort64
 	add rsp, 200h
 
@@ -115,6 +119,9 @@ EntryPoint:
 	swapgs                                  ; Switch to usermode GS
 	jmp         [NtSyscallHandler64]          ; Jump back to the old syscall handler
 
+PassThrough:
+	jmp         [NtSyscallHandler64]          ; Not hooked; GS was never swapped
+
 MyKiSystemCall64 ENDP
 
 END
\ No newline at end of file
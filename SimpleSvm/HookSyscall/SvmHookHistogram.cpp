@@ -0,0 +1,294 @@
+#include "SvmHookMsr.h"
+
+//
+// Syscall latency histograms.
+//
+// HookPort64 reads the TSC as a measured syscall enters and arms a post
+// record for it; the post record's kernel routine reads the TSC again as the
+// system service returns to user mode and adds the difference to a histogram
+// of the processor it runs on. Each processor has its own cells, so recording
+// only touches cache lines no other processor writes. Cells are summed up
+// only when queried.
+//
+// A run is identified by a generation number that post records capture when
+// armed. Records armed by an earlier run, which may be delivered long after
+// it stopped, do not match the current generation and are ignored.
+//
+
+static const ULONG kHistogramPoolTag = 'sHvS';
+static const UCHAR kHistogramNoSlot = MAXUCHAR;
+
+static_assert(SYSCALL_HISTOGRAM_MAX_SYSCALLS < kHistogramNoSlot,
+              "SYSCALL_HISTOGRAM_MAX_SYSCALLS is too large");
+
+//
+// One histogram of one processor. Padded to cache lines so that processors
+// never share one.
+//
+typedef struct DECLSPEC_CACHEALIGN _HISTOGRAM_CELL
+{
+	volatile LONG64 Count;
+	volatile LONG64 TotalCycles;
+	volatile LONG64 Buckets[SYSCALL_HISTOGRAM_BUCKETS];
+}HISTOGRAM_CELL, *PHISTOGRAM_CELL;
+
+//
+// g_HistogramCells holds SYSCALL_HISTOGRAM_MAX_SYSCALLS cells per possible
+// processor. It is allocated by the first start and kept until termination,
+// since records of a stopped run may still be delivered.
+//
+static PHISTOGRAM_CELL g_HistogramCells;
+static ULONG g_HistogramProcessorCount;
+
+//
+// The cell index of each measured syscall, or kHistogramNoSlot.
+//
+static UCHAR g_HistogramSlots[SYSCALL_MAX_INDEX];
+
+//
+// The generation of the current run, or 0 while stopped. g_HistogramLast is
+// the generation of the last run, whose results queries return.
+//
+static volatile LONG g_HistogramGeneration;
+static ULONG g_HistogramLast;
+static FAST_MUTEX g_HistogramMutex;
+
+// Initializes histograms; called by SyscallHookInitialization
+VOID
+SyscallHistogramInitialization(
+	VOID
+	)
+{
+	PAGED_CODE();
+
+	ExInitializeFastMutex(&g_HistogramMutex);
+	RtlFillMemory(g_HistogramSlots, sizeof(g_HistogramSlots), kHistogramNoSlot);
+	g_HistogramCells = nullptr;
+	g_HistogramProcessorCount = 0;
+	g_HistogramGeneration = 0;
+	g_HistogramLast = 0;
+}
+
+// Frees the histograms. No post record may be outstanding.
+VOID
+SyscallHistogramTermination(
+	VOID
+	)
+{
+	PAGED_CODE();
+
+	g_HistogramGeneration = 0;
+	if (g_HistogramCells != nullptr)
+	{
+		ExFreePoolWithTag(g_HistogramCells, kHistogramPoolTag);
+		g_HistogramCells = nullptr;
+	}
+}
+
+// Starts measuring syscalls in Numbers and clears previous results
+_Use_decl_annotations_
+NTSTATUS
+NTAPI
+SyscallHistogramStart(
+	const ULONG* Numbers,
+	ULONG Count
+	)
+{
+	NTSTATUS status;
+	SIZE_T size;
+	UCHAR slot;
+
+	PAGED_CODE();
+
+	if (Numbers == nullptr || Count == 0 || Count > SYSCALL_HISTOGRAM_MAX_SYSCALLS)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	for (ULONG i = 0; i < Count; i++)
+	{
+		if (Numbers[i] >= SYSCALL_MAX_INDEX)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+		if (!SyscallPostIsSupported(Numbers[i]))
+		{
+			return STATUS_NOT_SUPPORTED;
+		}
+	}
+
+	ExAcquireFastMutex(&g_HistogramMutex);
+	if (g_HistogramGeneration != 0)
+	{
+		status = STATUS_UNSUCCESSFUL;
+		goto Exit;
+	}
+
+	g_HistogramProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	size = sizeof(HISTOGRAM_CELL) * SYSCALL_HISTOGRAM_MAX_SYSCALLS *
+		g_HistogramProcessorCount;
+	if (g_HistogramCells == nullptr)
+	{
+		//
+		// At least a page, and thus cache line aligned.
+		//
+		g_HistogramCells = reinterpret_cast<PHISTOGRAM_CELL>(ExAllocatePoolWithTag(
+			NonPagedPool, ROUND_TO_PAGES(size), kHistogramPoolTag));
+		if (g_HistogramCells == nullptr)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			goto Exit;
+		}
+	}
+
+	//
+	// A record of the previous run that checked its generation just before it
+	// was cleared may still add one sample to the new run.
+	//
+	RtlZeroMemory(g_HistogramCells, size);
+	RtlFillMemory(g_HistogramSlots, sizeof(g_HistogramSlots), kHistogramNoSlot);
+	slot = 0;
+	for (ULONG i = 0; i < Count; i++)
+	{
+		if (g_HistogramSlots[Numbers[i]] == kHistogramNoSlot)
+		{
+			g_HistogramSlots[Numbers[i]] = slot++;
+		}
+	}
+
+	g_HistogramLast = (g_HistogramLast + 1 != 0) ? g_HistogramLast + 1 : 1;
+	InterlockedExchange(&g_HistogramGeneration, static_cast<LONG>(g_HistogramLast));
+
+	//
+	// Let measured syscalls into HookPort64 only once the cells exist.
+	//
+	SyscallHookSetMonitored(HookMonitorHistogram, Numbers, Count);
+	status = STATUS_SUCCESS;
+
+Exit:
+	ExReleaseFastMutex(&g_HistogramMutex);
+	return status;
+}
+
+// Stops measuring syscalls; results remain available to queries
+_Use_decl_annotations_
+VOID
+NTAPI
+SyscallHistogramStop(
+	VOID
+	)
+{
+	PAGED_CODE();
+
+	ExAcquireFastMutex(&g_HistogramMutex);
+	if (g_HistogramGeneration != 0)
+	{
+		InterlockedExchange(&g_HistogramGeneration, 0);
+		SyscallHookClearMonitored(HookMonitorHistogram);
+	}
+	ExReleaseFastMutex(&g_HistogramMutex);
+}
+
+// Sums up the histograms of all processors for SysNum in the last run
+_Use_decl_annotations_
+NTSTATUS
+NTAPI
+SyscallHistogramQuery(
+	ULONG SysNum,
+	PSYSCALL_HISTOGRAM Histogram
+	)
+{
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Histogram, sizeof(*Histogram));
+	Histogram->SysNum = SysNum;
+	if (SysNum >= SYSCALL_MAX_INDEX)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	ExAcquireFastMutex(&g_HistogramMutex);
+	const auto slot = g_HistogramSlots[SysNum];
+	if (g_HistogramCells == nullptr || slot == kHistogramNoSlot)
+	{
+		status = STATUS_NOT_FOUND;
+		goto Exit;
+	}
+
+	//
+	// Cells are read while they may still be updated; each value is read
+	// once, so the sum is consistent enough for a histogram.
+	//
+	for (ULONG i = 0; i < g_HistogramProcessorCount; i++)
+	{
+		const auto cell = &g_HistogramCells[i * SYSCALL_HISTOGRAM_MAX_SYSCALLS + slot];
+		Histogram->Count += cell->Count;
+		Histogram->TotalCycles += cell->TotalCycles;
+		for (ULONG j = 0; j < SYSCALL_HISTOGRAM_BUCKETS; j++)
+		{
+			Histogram->Buckets[j] += cell->Buckets[j];
+		}
+	}
+	status = STATUS_SUCCESS;
+
+Exit:
+	ExReleaseFastMutex(&g_HistogramMutex);
+	return status;
+}
+
+// Returns the generation a post record armed now belongs to, or 0
+ULONG
+SyscallHistogramGeneration(
+	VOID
+	)
+{
+	return static_cast<ULONG>(g_HistogramGeneration);
+}
+
+// Adds a sample to the current processor's histogram; called by post records
+_Use_decl_annotations_
+VOID
+SyscallHistogramRecord(
+	ULONG SysNum,
+	ULONG Generation,
+	ULONG64 Cycles
+	)
+{
+	ULONG bucket;
+
+	if (Generation == 0 || Generation != static_cast<ULONG>(g_HistogramGeneration))
+	{
+		return;
+	}
+
+	const auto slot = g_HistogramSlots[SysNum];
+	const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+	if (slot == kHistogramNoSlot || processor >= g_HistogramProcessorCount)
+	{
+		return;
+	}
+
+	//
+	// A thread that resumed on another processor may see a slightly smaller
+	// TSC than at entry if TSCs are not perfectly in sync.
+	//
+	if (static_cast<LONG64>(Cycles) < 0)
+	{
+		Cycles = 0;
+	}
+	if (!_BitScanReverse64(&bucket, Cycles))
+	{
+		bucket = 0;
+	}
+	bucket = min(bucket, SYSCALL_HISTOGRAM_BUCKETS - 1);
+
+	//
+	// Still interlocked, since a thread at APC_LEVEL can be preempted by
+	// another one recording on the same processor; the line stays local.
+	//
+	const auto cell = &g_HistogramCells[processor * SYSCALL_HISTOGRAM_MAX_SYSCALLS + slot];
+	InterlockedIncrement64(&cell->Buckets[bucket]);
+	InterlockedIncrement64(&cell->Count);
+	InterlockedAdd64(&cell->TotalCycles, static_cast<LONG64>(Cycles));
+}
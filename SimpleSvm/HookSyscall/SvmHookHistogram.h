@@ -0,0 +1,57 @@
+#pragma once
+
+#include "../SvmHead.h"
+#include "interface.h"
+
+//
+// Number of syscalls that can be measured at once.
+//
+#define SYSCALL_HISTOGRAM_MAX_SYSCALLS 64
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SyscallHistogramInitialization(
+	VOID
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SyscallHistogramTermination(
+	VOID
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+NTAPI
+SyscallHistogramStart(
+	_In_reads_(Count) const ULONG* Numbers,
+	_In_ ULONG Count
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+NTAPI
+SyscallHistogramStop(
+	VOID
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+NTAPI
+SyscallHistogramQuery(
+	_In_ ULONG SysNum,
+	_Out_ PSYSCALL_HISTOGRAM Histogram
+	);
+
+ULONG
+SyscallHistogramGeneration(
+	VOID
+	);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+SyscallHistogramRecord(
+	_In_ ULONG SysNum,
+	_In_ ULONG Generation,
+	_In_ ULONG64 Cycles
+	);
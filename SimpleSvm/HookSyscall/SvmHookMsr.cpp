@@ -4,88 +4,617 @@
 #pragma warning(disable: 4127)
 
 extern "C" VOID MyKiSystemCall64();
-extern "C" uint GetRax();
-extern "C" uint GetR10();
 
 ULONG64 NtSyscallHandler64 = 0;
 ULONG64 g_pVmcbGuest02 = NULL;
 ULONG64 SysCallNum = 0;
-KSPIN_LOCK g_InterfaceSplock;
-LIST_ENTRY g_HookList = {0};
 uint g_HookCnt = 0;
-long g_ListStatus = LIST_STATUS::Free;
-long g_RunningCnt = 0;
+static BOOLEAN g_HookEnabled = FALSE;
 
-VOID __stdcall HookPort64(uint pstack, uint param2, uint param3, uint param4)
+//
+// TRUE while the system sleeps with the hook enabled. See SyscallHookSuspend.
+//
+static BOOLEAN g_HookSuspended = FALSE;
+
+//
+// A per-processor count of HookPort64 calls in flight. Padded to a cache line
+// so that a syscall only ever touches a line its own processor owns.
+//
+// HookPort64 runs with interrupts disabled from the increment to the
+// decrement, so it can neither block nor be preempted and migrated in
+// between. Hook functions that may block run later, from APCs that hold a
+// reference to their entry instead (see SvmHookPost.cpp).
+//
+typedef struct DECLSPEC_CACHEALIGN _HOOK_INFLIGHT
 {
-    UNREFERENCED_PARAMETER(pstack);
-    UNREFERENCED_PARAMETER(param2);
-    UNREFERENCED_PARAMETER(param3);
-    UNREFERENCED_PARAMETER(param4);
-	uint SysNum = GetRax();
-	uint param1 = GetR10();
-	UNREFERENCED_PARAMETER(SysNum);
-    UNREFERENCED_PARAMETER(param1);
+	volatile LONG Count;
+}HOOK_INFLIGHT, *PHOOK_INFLIGHT;
+static_assert(sizeof(HOOK_INFLIGHT) == SYSTEM_CACHE_ALIGNMENT_SIZE,
+              "HOOK_INFLIGHT Size Mismatch");
 
-	if (KeGetCurrentIrql() > PASSIVE_LEVEL)
+static PHOOK_INFLIGHT g_HookInFlight;
+static ULONG g_HookInFlightCount;
+
+//
+// The hook table. Indexed by a syscall number and read without a lock by
+// HookPort64. Writers are serialized by g_HookTableMutex, publish an entry with
+// a single pointer exchange, and free a retired entry only after every
+// HookPort64 that might have loaded it has returned.
+//
+static PHOOK_ENTRY volatile g_HookTable[SYSCALL_MAX_INDEX];
+static FAST_MUTEX g_HookTableMutex;
+
+//
+// A bit per syscall number, set while the syscall has a hook. Tested by
+// MyKiSystemCall64 before it saves any register, so syscalls without a hook
+// cost only a compare and a bit test. A bit is set after its entry is
+// published and cleared before the entry is retired; HookPort64 tolerates
+// seeing a set bit with no entry.
+//
+extern "C" DECLSPEC_CACHEALIGN volatile LONG g_HookBitmap[SYSCALL_MAX_INDEX / 32];
+
+//
+// A bit per syscall number for each HOOK_MONITOR, set while the syscall is
+// traced or measured. Always a subset of g_HookBitmap.
+//
+static DECLSPEC_CACHEALIGN volatile LONG g_MonitorBitmaps[HookMonitorMaximum][SYSCALL_MAX_INDEX / 32];
+
+static const ULONG kHookPoolTag = 'kHvS';
+
+//
+// RFLAGS.IF; clear on entry to HookPort64.
+//
+static const ULONG64 kRflagsInterruptFlag = 0x200;
+
+//
+// Copies syscall arguments from the user stack for hook thunks. Called at
+// APC_LEVEL in the context of the calling thread, never from HookPort64.
+//
+static
+bool
+SvHookpCopyFromUser(
+	_Out_writes_bytes_(Size) void* Destination,
+	_In_ const void* Source,
+	_In_ size_t Size
+	)
+{
+	__try
+	{
+		ProbeForRead(const_cast<void*>(Source), Size, 1);
+		RtlCopyMemory(Destination, Source, Size);
+		return true;
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		return false;
+	}
+}
+
+typedef HOOK_THUNK_TABLE<SvHookpCopyFromUser> HookThunks;
+
+static
+BOOLEAN
+SvHookpIsMonitored(
+	_In_ HOOK_MONITOR Monitor,
+	_In_ ULONG SysNum
+	)
+{
+	return _bittest(const_cast<LONG*>(&g_MonitorBitmaps[Monitor][SysNum / 32]),
+		SysNum % 32);
+}
+
+//
+// Checks if any HOOK_MONITOR still needs HookPort64 to see SysNum.
+//
+static
+BOOLEAN
+SvHookpIsMonitoredByAny(
+	_In_ ULONG SysNum
+	)
+{
+	for (ULONG i = 0; i < HookMonitorMaximum; i++)
+	{
+		if (SvHookpIsMonitored(static_cast<HOOK_MONITOR>(i), SysNum))
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+//
+// Called by MyKiSystemCall64 for a syscall set in g_HookBitmap, before the
+// original handler. The SYSCALL mask has cleared IF, and KiSystemCall64 has
+// not built its trap frame yet, so this must not fault, block, take a lock or
+// enable interrupts: it only reads its arguments and nonpaged driver data.
+// Hooks are called later, once KiSystemCall64 has enabled interrupts; this
+// only arms them with SyscallPostArm.
+//
+// MyKiSystemCall64 passes the syscall's RAX, R10, RDX, R8 and R9 and the user
+// RSP as they were at SYSCALL.
+//
+VOID __stdcall HookPort64(uint SysNum, uint param1, uint param2, uint param3, uint param4, uint pstack)
+{
+	SysNum = static_cast<ULONG>(SysNum);  // The kernel ignores the upper half
+
+	if (SysNum >= SYSCALL_MAX_INDEX)
 	{
 		return;
 	}
 
-	if (LIST_STATUS::Fixing == g_ListStatus) // һЩ¼ǼȵĻĿܣ֪Ϊɶ
+	if (KeGetCurrentIrql() > PASSIVE_LEVEL)
 	{
 		return;
 	}
 
-	InterlockedIncrement(&g_RunningCnt);
+	NT_ASSERT((__readeflags() & kRflagsInterruptFlag) == 0);
+
+	//
+	// Announce this call before loading the entry so that a writer retiring
+	// the entry waits for it. The interlocked increment is a full barrier and
+	// only touches this processor's line. Interrupts stay disabled until the
+	// decrement, so it hits the same counter.
+	//
+	const auto inFlight = &g_HookInFlight[KeGetCurrentProcessorNumberEx(nullptr)];
+	InterlockedIncrement(&inFlight->Count);
+
+	if (SvHookpIsMonitored(HookMonitorTrace, static_cast<ULONG>(SysNum)))
+	{
+		SyscallTraceWrite(static_cast<ULONG>(SysNum), param1, param2, param3, param4);
+	}
+
+	const auto entryTsc = __rdtsc();
+	const auto timed = SvHookpIsMonitored(HookMonitorHistogram, static_cast<ULONG>(SysNum));
+	auto entry = g_HookTable[SysNum];
+	if (entry != nullptr &&
+		entry->Scoped &&
+		!SyscallScopeContains(HandleToULong(PsGetCurrentProcessId())))
+	{
+		entry = nullptr;
+	}
+
+	//
+	// The record takes its own reference to the entry before the decrement
+	// lets a writer retire it.
+	//
+	if (entry != nullptr || timed)
+	{
+		const HOOK_SYSCALL_FRAME frame = { { param1, param2, param3, param4 }, pstack };
+		SyscallPostArm(entry, static_cast<ULONG>(SysNum), &frame, entryTsc, timed);
+	}
 
-	InterlockedDecrement(&g_RunningCnt);
+	InterlockedDecrement(&inFlight->Count);
 }
 
-// Enables syscall hook for all processors
-NTSTATUS SyscallHookEnable() 
+//
+// Waits until no HookPort64 may still be using anything unpublished before
+// this call, such as an entry removed from the hook table.
+//
+// A counter seen zero after the removal proves that every call counted on it
+// before the removal has returned, and any later call loads the table after
+// the removal. So each counter only needs to be seen zero once, not all of
+// them at the same time, and busy processors cannot starve the writer.
+//
+VOID
+SyscallHookWaitForReaders()
 {
+	LARGE_INTEGER interval;
+
 	PAGED_CODE();
 
-	if (NtSyscallHandler64 != NULL)
+	KeMemoryBarrier();
+	interval.QuadPart = -10000;  // 1 ms
+	for (ULONG i = 0; i < g_HookInFlightCount; i++)
 	{
-		DbgPrint("[HookMsr]hook already start\n");
-		return STATUS_UNSUCCESSFUL;
+		while (g_HookInFlight[i].Count != 0)
+		{
+			KeDelayExecutionThread(KernelMode, FALSE, &interval);
+		}
 	}
+}
 
-	NtSyscallHandler64 = (ULONG64)UtilReadMsr64(Msr::kIa32Lstar);
+VOID SyscallHookReferenceEntry(PHOOK_ENTRY Entry)
+{
+	InterlockedIncrement(&Entry->References);
+}
+
+VOID SyscallHookDereferenceEntry(PHOOK_ENTRY Entry)
+{
+	if (InterlockedDecrement(&Entry->References) == 0)
+	{
+		ExFreePoolWithTag(Entry, kHookPoolTag);
+	}
+}
+
+//
+// Drops the table's reference to an entry no HookPort64 can reach anymore,
+// after making sure no APC is still running its Function or PostFunction.
+//
+static
+VOID
+SvHookpRetireEntry(
+	_In_ PHOOK_ENTRY Entry
+	)
+{
+	LARGE_INTEGER interval;
 
+	PAGED_CODE();
+
+	InterlockedExchange(&Entry->Retired, TRUE);
+	interval.QuadPart = -10000;  // 1 ms
+	while (InterlockedCompareExchange(&Entry->Active, 0, 0) != 0)
+	{
+		KeDelayExecutionThread(KernelMode, FALSE, &interval);
+	}
+	SyscallHookDereferenceEntry(Entry);
+}
+
+// Initializes the hook table; must be called before any other function here
+NTSTATUS SyscallHookInitialization()
+{
+	SIZE_T size;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	//
+	// Cover processors that may be hot-added later as well. The allocation is
+	// at least a page so that it is page, and thus cache line, aligned.
+	//
+	g_HookInFlightCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	size = ROUND_TO_PAGES(g_HookInFlightCount * sizeof(HOOK_INFLIGHT));
+	g_HookInFlight = reinterpret_cast<PHOOK_INFLIGHT>(ExAllocatePoolWithTag(
+		NonPagedPool, size, kHookPoolTag));
+	if (g_HookInFlight == nullptr)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(g_HookInFlight, size);
+
+	status = SyscallPostInitialization();
+	if (!NT_SUCCESS(status))
+	{
+		ExFreePoolWithTag(g_HookInFlight, kHookPoolTag);
+		g_HookInFlight = nullptr;
+		return status;
+	}
+
+	status = SyscallScopeInitialization();
+	if (!NT_SUCCESS(status))
+	{
+		SyscallPostTermination();
+		ExFreePoolWithTag(g_HookInFlight, kHookPoolTag);
+		g_HookInFlight = nullptr;
+		return status;
+	}
+
+	ExInitializeFastMutex(&g_HookTableMutex);
+	RtlZeroMemory(const_cast<PHOOK_ENTRY*>(g_HookTable), sizeof(g_HookTable));
+	RtlZeroMemory(const_cast<LONG*>(g_HookBitmap), sizeof(g_HookBitmap));
+	RtlZeroMemory(const_cast<LONG*>(&g_MonitorBitmaps[0][0]), sizeof(g_MonitorBitmaps));
 	g_HookCnt = 0;
-	g_InterfaceSplock = 0;
-	g_ListStatus = LIST_STATUS::Free;
-	g_RunningCnt = 0;
-	InitializeListHead(&g_HookList);
+	SyscallTraceInitialization();
+	SyscallHistogramInitialization();
+	return STATUS_SUCCESS;
+}
+
+// Frees resources allocated by SyscallHookInitialization
+VOID SyscallHookTermination()
+{
+	PAGED_CODE();
+
+	SyscallScopeTermination();
+	SyscallPostTermination();
+	SyscallHistogramTermination();
+	if (g_HookInFlight != nullptr)
+	{
+		ExFreePoolWithTag(g_HookInFlight, kHookPoolTag);
+		g_HookInFlight = nullptr;
+	}
+}
+
+// Installs a hook for a syscall; fails if the syscall is already hooked
+NTSTATUS NTAPI AddHook(PHOOK_PARAM pList)
+{
+	PHOOK_ENTRY entry;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	if (pList == nullptr ||
+		pList->SysNum >= SYSCALL_MAX_INDEX ||
+		pList->ParamNum > SYSCALL_MAX_PARAM ||
+		(pList->pFun == nullptr && pList->pPostFun == nullptr))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (pList->pPostFun != nullptr &&
+		!SyscallPostIsSupported(static_cast<ULONG>(pList->SysNum)))
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	entry = reinterpret_cast<PHOOK_ENTRY>(ExAllocatePoolWithTag(
+		NonPagedPool, sizeof(HOOK_ENTRY), kHookPoolTag));
+	if (entry == nullptr)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	entry->SysNum = pList->SysNum;
+	entry->ParamNum = pList->ParamNum;
+	entry->Function = pList->pFun;
+	entry->Thunk = (pList->pFun != nullptr) ? HookThunks::Get(pList->ParamNum) : nullptr;
+	entry->PostFunction = reinterpret_cast<HOOK_POST_ROUTINE>(pList->pPostFun);
+	entry->Scoped = BooleanFlagOn(pList->Flags, HOOK_FLAG_SCOPED);
+	entry->References = 1;
+	entry->Retired = FALSE;
+	entry->Active = 0;
+
+	ExAcquireFastMutex(&g_HookTableMutex);
+	if (g_HookTable[entry->SysNum] != nullptr)
+	{
+		status = STATUS_OBJECT_NAME_COLLISION;
+	}
+	else
+	{
+		InterlockedExchangePointer(
+			reinterpret_cast<PVOID volatile*>(&g_HookTable[entry->SysNum]), entry);
+		InterlockedBitTestAndSet(&g_HookBitmap[entry->SysNum / 32],
+			static_cast<LONG>(entry->SysNum % 32));
+		g_HookCnt++;
+		status = STATUS_SUCCESS;
+	}
+	ExReleaseFastMutex(&g_HookTableMutex);
+
+	if (!NT_SUCCESS(status))
+	{
+		ExFreePoolWithTag(entry, kHookPoolTag);
+	}
+	return status;
+}
+
+// Removes a hook installed by AddHook with the same SysNum, pFun and pPostFun
+VOID NTAPI RmHook(PHOOK_PARAM pList)
+{
+	PHOOK_ENTRY entry;
+
+	PAGED_CODE();
+
+	if (pList == nullptr || pList->SysNum >= SYSCALL_MAX_INDEX)
+	{
+		return;
+	}
+
+	entry = nullptr;
+	ExAcquireFastMutex(&g_HookTableMutex);
+	if (g_HookTable[pList->SysNum] != nullptr &&
+		g_HookTable[pList->SysNum]->Function == pList->pFun &&
+		g_HookTable[pList->SysNum]->PostFunction ==
+			reinterpret_cast<HOOK_POST_ROUTINE>(pList->pPostFun))
+	{
+		if (!SvHookpIsMonitoredByAny(static_cast<ULONG>(pList->SysNum)))
+		{
+			InterlockedBitTestAndReset(&g_HookBitmap[pList->SysNum / 32],
+				static_cast<LONG>(pList->SysNum % 32));
+		}
+		entry = reinterpret_cast<PHOOK_ENTRY>(InterlockedExchangePointer(
+			reinterpret_cast<PVOID volatile*>(&g_HookTable[pList->SysNum]), nullptr));
+		g_HookCnt--;
+	}
+	ExReleaseFastMutex(&g_HookTableMutex);
+
+	if (entry != nullptr)
+	{
+		SyscallHookWaitForReaders();
+		SvHookpRetireEntry(entry);
+	}
+}
+
+// Returns the interface other drivers use to install hooks
+VOID SyscallHookQueryExtension(PHOOK_EXTENSION Extension)
+{
+	Extension->AddHook = AddHook;
+	Extension->RmHook = RmHook;
+	Extension->TraceStart = SyscallTraceStart;
+	Extension->TraceStop = SyscallTraceStop;
+	Extension->AddTargetProcess = SyscallScopeAddProcess;
+	Extension->RmTargetProcess = SyscallScopeRemoveProcess;
+	Extension->HistogramStart = SyscallHistogramStart;
+	Extension->HistogramStop = SyscallHistogramStop;
+	Extension->HistogramQuery = SyscallHistogramQuery;
+}
+
+// Marks syscalls in Numbers, or all syscalls when Numbers is NULL, as
+// monitored by Monitor
+VOID SyscallHookSetMonitored(HOOK_MONITOR Monitor, const ULONG* Numbers, ULONG Count)
+{
+	PAGED_CODE();
+
+	ExAcquireFastMutex(&g_HookTableMutex);
+	if (Numbers == nullptr)
+	{
+		RtlFillMemory(const_cast<LONG*>(g_MonitorBitmaps[Monitor]),
+			sizeof(g_MonitorBitmaps[Monitor]), 0xff);
+		RtlFillMemory(const_cast<LONG*>(g_HookBitmap), sizeof(g_HookBitmap), 0xff);
+	}
+	else
+	{
+		for (ULONG i = 0; i < Count; i++)
+		{
+			InterlockedBitTestAndSet(&g_MonitorBitmaps[Monitor][Numbers[i] / 32],
+				static_cast<LONG>(Numbers[i] % 32));
+			InterlockedBitTestAndSet(&g_HookBitmap[Numbers[i] / 32],
+				static_cast<LONG>(Numbers[i] % 32));
+		}
+	}
+	ExReleaseFastMutex(&g_HookTableMutex);
+}
+
+// Clears all marks of Monitor and waits for HookPort64 calls that may still
+// act on them
+VOID SyscallHookClearMonitored(HOOK_MONITOR Monitor)
+{
+	PAGED_CODE();
+
+	ExAcquireFastMutex(&g_HookTableMutex);
+	RtlZeroMemory(const_cast<LONG*>(g_MonitorBitmaps[Monitor]),
+		sizeof(g_MonitorBitmaps[Monitor]));
+	for (ULONG i = 0; i < SYSCALL_MAX_INDEX; i++)
+	{
+		if (g_HookTable[i] == nullptr && !SvHookpIsMonitoredByAny(i))
+		{
+			InterlockedBitTestAndReset(&g_HookBitmap[i / 32], static_cast<LONG>(i % 32));
+		}
+	}
+	ExReleaseFastMutex(&g_HookTableMutex);
+	SyscallHookWaitForReaders();
+}
+
+//
+// Puts back the original LSTAR of each processor.
+//
+static
+NTSTATUS
+SvHookpRestoreLstar()
+{
+	PAGED_CODE();
 
 	return UtilForEachProcessor(
 		[](void* context) {
-		//UNREFERENCED_PARAMETER(context);
-		context = (void *)MyKiSystemCall64;
-		return UtilVmCall(HypercallNumber::kHookSyscall, context);
+		UNREFERENCED_PARAMETER(context);
+		return UtilVmCall(HypercallNumber::kUnhookSyscall, nullptr);
 	},
 		nullptr);
-
 }
 
-// Disables syscall hook for all processors
-NTSTATUS SyscallHookDisable()
+//
+// Points LSTAR of each processor to MyKiSystemCall64 in one hypercall per
+// processor. If one fails, puts back those that already switched.
+//
+static
+NTSTATUS
+SvHookpSwitchLstar()
 {
 	PAGED_CODE();
+
 	NTSTATUS status = UtilForEachProcessor(
 		[](void* context) {
 		UNREFERENCED_PARAMETER(context);
-		return UtilVmCall(HypercallNumber::kUnhookSyscall, nullptr);
+		return UtilVmCall(HypercallNumber::kHookSyscall,
+			reinterpret_cast<void*>(MyKiSystemCall64));
 	},
 		nullptr);
+	if (!NT_SUCCESS(status))
+	{
+		SvHookpRestoreLstar();
+	}
+	return status;
+}
+
+// Enables syscall hook for all processors
+NTSTATUS SyscallHookEnable() 
+{
+	PAGED_CODE();
+
+	if (g_HookEnabled)
+	{
+		DbgPrint("[HookMsr]hook already start\n");
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	//
+	// The hypervisor keeps answering LSTAR reads with the original value, so
+	// this is the system's handler even if a previous hook was left on.
+	//
+	NtSyscallHandler64 = (ULONG64)UtilReadMsr64(Msr::kIa32Lstar);
+
+	NTSTATUS status = SvHookpSwitchLstar();
+	if (NT_SUCCESS(status))
+	{
+		g_HookEnabled = TRUE;
+	}
+	return status;
+}
+
+//
+// Puts back the original LSTAR on all processors for the system to sleep.
+// Hooks stay installed and SyscallHookResume points LSTAR to
+// MyKiSystemCall64 again, so the system saves and restores its own handler
+// and the hook survives the power transition.
+//
+VOID SyscallHookSuspend()
+{
+	PAGED_CODE();
+
+	if (!g_HookEnabled)
+	{
+		return;
+	}
+
+	//
+	// Devirtualizing restores it as well; this does it while the hook state
+	// is known to be consistent on every processor.
+	//
+	SvHookpRestoreLstar();
+	g_HookEnabled = FALSE;
+	g_HookSuspended = TRUE;
+}
+
+//
+// Re-enables the hook suspended by SyscallHookSuspend once all processors are
+// virtualized again.
+//
+NTSTATUS SyscallHookResume()
+{
+	PAGED_CODE();
+
+	if (!g_HookSuspended)
+	{
+		return STATUS_SUCCESS;
+	}
+	g_HookSuspended = FALSE;
+
+	NTSTATUS status = SvHookpSwitchLstar();
+	if (NT_SUCCESS(status))
+	{
+		g_HookEnabled = TRUE;
+	}
+	return status;
+}
+
+// Disables syscall hook for all processors
+NTSTATUS SyscallHookDisable()
+{
+	PAGED_CODE();
+	NTSTATUS status = SvHookpRestoreLstar();
+
+	//
+	// Retire all remaining hooks. No new call enters HookPort64 once LSTAR is
+	// restored on every processor, so it is enough to wait for calls already
+	// in it before freeing entries they may be using.
+	//
+	ExAcquireFastMutex(&g_HookTableMutex);
+	RtlZeroMemory(const_cast<LONG*>(g_HookBitmap), sizeof(g_HookBitmap));
+	RtlZeroMemory(const_cast<LONG*>(&g_MonitorBitmaps[0][0]), sizeof(g_MonitorBitmaps));
+	SyscallHookWaitForReaders();
+	for (ULONG i = 0; i < SYSCALL_MAX_INDEX; i++)
+	{
+		if (g_HookTable[i] != nullptr)
+		{
+			SvHookpRetireEntry(g_HookTable[i]);
+			g_HookTable[i] = nullptr;
+		}
+	}
+	ExReleaseFastMutex(&g_HookTableMutex);
 
-	NtSyscallHandler64 = NULL;
+	//
+	// NtSyscallHandler64 is left as is; a syscall that entered
+	// MyKiSystemCall64 right before LSTAR was restored may not have reached
+	// its jump through it yet.
+	//
+	g_HookEnabled = FALSE;
+	g_HookSuspended = FALSE;
 	g_HookCnt = 0;
-	g_ListStatus = LIST_STATUS::Free;
-	g_RunningCnt = 0;
 
 	return status;
 }
@@ -2,7 +2,12 @@
 
 #include "../SvmUtil.h"
 
-//#include "interface.h"
+#include "interface.h"
+#include "SvmHookTrace.h"
+#include "SvmHookThunk.h"
+#include "SvmHookPost.h"
+#include "SvmHookScope.h"
+#include "SvmHookHistogram.h"
 
 #ifdef  _WIN64
 typedef UINT64   uint;
@@ -13,40 +18,78 @@ typedef UINT32   uint;
 extern "C" extern ULONG64 NtSyscallHandler64;
 extern "C" extern ULONG64 g_pVmcbGuest02;
 extern "C" extern ULONG64 SysCallNum;
-extern "C" VOID __stdcall HookPort64(uint pstack, uint param2, uint param3, uint param4);
+extern "C" extern volatile LONG g_HookBitmap[];
+extern "C" VOID __stdcall HookPort64(uint SysNum, uint param1, uint param2, uint param3, uint param4, uint pstack);
 
 #define MSR_LSTAR 0xc0000082          /* long mode SYSCALL target */
 
-typedef uint(*_CallStub0)();
-typedef uint(*_CallStub1)(uint);
-typedef uint(*_CallStub2)(uint, uint);
-typedef uint(*_CallStub3)(uint, uint, uint);
-typedef uint(*_CallStub4)(uint, uint, uint, uint);
-typedef uint(*_CallStub5)(uint, uint, uint, uint, uint);
-typedef uint(*_CallStub6)(uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub7)(uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub8)(uint, uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub9)(uint, uint, uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub10)(uint, uint, uint, uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub11)(uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub12)(uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub13)(uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub14)(uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint);
-typedef uint(*_CallStub15)(uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint, uint);
-
-#define CallStubX(a)  (_CallStub##a)
-
-typedef enum _LIST_STATUS
+//
+// Must match SYSCALL_MAX_INDEX in SvmAmd64.asm.
+//
+#define SYSCALL_MAX_INDEX 4096
+
+//
+// The largest ParamNum a hook may take.
+//
+#define SYSCALL_MAX_PARAM HOOK_THUNK_MAX_PARAM
+
+//
+// A driver owned copy of HOOK_PARAM published in the hook table. An entry is
+// immutable once published; replacing a hook retires the entry and publishes
+// a new one.
+//
+// The table holds one reference and each pending hooked syscall holds one, so
+// a retired entry outlives DPCs and APCs still queued for it. Retired is set
+// once the entry leaves the table; Function and PostFunction are then no
+// longer called.
+//
+typedef struct _HOOK_ENTRY
 {
-	Free = 0,
-	Running,
-	Fixing
-}LIST_STATUS;
+	ULONG64 SysNum;
+	ULONG64 ParamNum;
+	PVOID Function;
+	HOOK_THUNK Thunk;       // Calls Function with ParamNum arguments
+	HOOK_POST_ROUTINE PostFunction;
+	BOOLEAN Scoped;         // Applies only to processes in the scope set
+	volatile LONG References;
+	volatile LONG Retired;
+	volatile LONG Active;   // Calls running Function or PostFunction now
+}HOOK_ENTRY, *PHOOK_ENTRY;
+
+NTSTATUS SyscallHookInitialization();
+
+VOID SyscallHookTermination();
 
 NTSTATUS SyscallHookEnable();
 
 NTSTATUS SyscallHookDisable();
 
-//NTSTATUS AddHook(PHOOK_PARAM pList);
+VOID SyscallHookSuspend();
+
+NTSTATUS SyscallHookResume();
+
+NTSTATUS NTAPI AddHook(PHOOK_PARAM pList);
+
+VOID NTAPI RmHook(PHOOK_PARAM pList);
+
+VOID SyscallHookQueryExtension(PHOOK_EXTENSION Extension);
+
+//
+// Reasons other than a hook for HookPort64 to see a syscall.
+//
+typedef enum _HOOK_MONITOR
+{
+	HookMonitorTrace,
+	HookMonitorHistogram,
+	HookMonitorMaximum
+}HOOK_MONITOR;
+
+VOID SyscallHookSetMonitored(HOOK_MONITOR Monitor, const ULONG* Numbers, ULONG Count);
+
+VOID SyscallHookClearMonitored(HOOK_MONITOR Monitor);
+
+VOID SyscallHookWaitForReaders();
+
+VOID SyscallHookReferenceEntry(PHOOK_ENTRY Entry);
 
-//NTSTATUS RmHook(PHOOK_PARAM pList);
\ No newline at end of file
+VOID SyscallHookDereferenceEntry(PHOOK_ENTRY Entry);
\ No newline at end of file
@@ -0,0 +1,656 @@
+#include "SvmHookMsr.h"
+#include <ntimage.h>
+
+//
+// How hooks are dispatched.
+//
+// HookPort64 runs before the system service with interrupts disabled (the
+// SYSCALL mask clears IF), on the thread's kernel stack but before
+// KiSystemCall64 has built the trap frame. Nothing there may fault, block or
+// take a lock, so SyscallPostArm only fills a record from the pool with what
+// registers tell, pushes it to this processor's pending list and queues this
+// processor's DPC. KeInsertQueueDpc may be called at any IRQL and keeps
+// interrupts disabled while it holds the DPC queue lock.
+//
+// The DPC is delivered as soon as KiSystemCall64 enables interrupts, before
+// it calls the service and before any other thread can run on the
+// processor. It queues a special kernel APC to the thread of each record,
+// which is delivered right after the DPC as the processor returns to
+// PASSIVE_LEVEL. The kernel routine of that APC runs at APC_LEVEL in the
+// context of the calling thread with the trap frame built, so it may touch
+// pageable and user memory: it copies stack arguments and calls the hook.
+//
+// It then queues a user-mode APC to the thread and sets UserApcPending with
+// KeTestAlertThread. When the service returns, the system service exit path
+// sees the pending APC, saves the service's return value to the trap frame
+// and delivers the APC. Its kernel routine runs the post-hook, which may
+// rewrite the value in the trap frame before the exit path reloads RAX from
+// it. The kernel routine clears the normal routine, so nothing is ever
+// dispatched to user mode.
+//
+// Measured syscalls are armed the same way, with or without hooks; the
+// kernel routine of the user-mode APC records how long the syscall took
+// before running the post-hook.
+//
+// The trap frame sits at the top of the kernel stack, right below RspBase,
+// which HookPort64 records at entry.
+//
+// A pending user-mode APC breaks an alertable wait with STATUS_USER_APC, and
+// KeTestAlertThread consumes the thread's user-mode alert. Syscalls that wait
+// alertably, test or deliver alerts, or do not return a status through RAX
+// (NtContinue and the like) are therefore never armed for a post-hook or a
+// measurement; AddHook and SyscallHistogramStart refuse them. Their numbers
+// are read from the system service stubs of ntdll at initialization.
+//
+
+static const ULONG kPostPoolTag = 'oPvS';
+
+//
+// Offset of KPRCB::RspBase from the GS base; the same as KERNEL_STACK_GS in
+// SvmAmd64.asm.
+//
+static const ULONG kKernelStackGsOffset = 0x1A8;
+
+//
+// Bookkeeping for a hooked syscall. Taken from a pool preallocated at
+// initialization, never allocated on the syscall path. FreeEntry links the
+// record into the free list or into a processor's pending list.
+//
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _HOOK_POST_RECORD
+{
+	SLIST_ENTRY FreeEntry;
+	KAPC DispatchApc;               // Calls the hook once interrupts are on
+	KAPC Apc;                       // Calls the post-hook on the way out
+	PKTHREAD Thread;
+	PHOOK_ENTRY Entry;              // NULL when only measured
+	ULONG HistogramGeneration;      // 0 when not measured
+	PKTRAP_FRAME TrapFrame;
+	HOOK_SYSCALL_FRAME Frame;
+	HOOK_POST_CONTEXT Context;
+}HOOK_POST_RECORD, *PHOOK_POST_RECORD;
+
+//
+// Records armed by HookPort64 on a processor and the DPC that hands them to
+// their threads. Indexed by a processor index.
+//
+typedef struct DECLSPEC_CACHEALIGN _HOOK_POST_PROCESSOR
+{
+	SLIST_HEADER Pending;
+	KDPC Dpc;
+}HOOK_POST_PROCESSOR, *PHOOK_POST_PROCESSOR;
+
+static PHOOK_POST_RECORD g_PostRecords;
+static DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) SLIST_HEADER g_PostFreeList;
+static PHOOK_POST_PROCESSOR g_PostProcessors;
+static ULONG g_PostProcessorCount;
+
+//
+// Number of records taken from the pool. Unloading must wait for it to reach
+// zero since pending DPCs and APCs point to code in this driver.
+//
+static volatile LONG g_PostOutstanding;
+
+//
+// Number of syscalls that ran without their post-hook for lack of a record.
+//
+static volatile LONG64 g_PostDropped;
+
+//
+// A bit per syscall number that may not be armed; see above. If the numbers
+// could not be read, g_PostRefusedKnown stays FALSE and every syscall is
+// refused.
+//
+static LONG g_PostRefused[SYSCALL_MAX_INDEX / 32];
+static BOOLEAN g_PostRefusedKnown;
+
+static const PCSTR kPostRefusedNames[] =
+{
+	// Wait alertably
+	"NtWaitForSingleObject",
+	"NtWaitForMultipleObjects",
+	"NtWaitForMultipleObjects32",
+	"NtSignalAndWaitForSingleObject",
+	"NtDelayExecution",
+	"NtRemoveIoCompletionEx",
+	"NtWaitForAlertByThreadId",
+	"NtWaitForKeyedEvent",
+	"NtReleaseKeyedEvent",
+	"NtWaitForDebugEvent",
+	"NtWaitForWorkViaWorkerFactory",
+	// Test or deliver alerts and APCs
+	"NtTestAlert",
+	"NtAlertThread",
+	"NtAlertResumeThread",
+	// Do not return a status in RAX
+	"NtContinue",
+	"NtContinueEx",
+	"NtRaiseException",
+	"NtCallbackReturn",
+	"NtSetContextThread",
+};
+
+//
+// Returns the number a system service stub of ntdll loads into EAX, or
+// MAXULONG if Stub is not one: mov r10, rcx; mov eax, imm32.
+//
+static
+ULONG
+SvHookpPostStubNumber(
+	_In_reads_bytes_(8) const UCHAR* Stub
+	)
+{
+	static const UCHAR kPrefix[] = { 0x4C, 0x8B, 0xD1, 0xB8 };
+
+	if (RtlCompareMemory(Stub, kPrefix, sizeof(kPrefix)) != sizeof(kPrefix))
+	{
+		return MAXULONG;
+	}
+	return *reinterpret_cast<const ULONG UNALIGNED*>(Stub + sizeof(kPrefix));
+}
+
+//
+// Sets the bit of each syscall in kPostRefusedNames found in the exports of
+// a mapped image of ntdll. Base is a user-mode address; the caller guards
+// against faults.
+//
+static
+NTSTATUS
+SvHookpPostReadStubs(
+	_In_ const UCHAR* Base,
+	_In_ SIZE_T ViewSize
+	)
+{
+	const auto dos = reinterpret_cast<const IMAGE_DOS_HEADER*>(Base);
+	if (ViewSize < sizeof(IMAGE_DOS_HEADER) ||
+		dos->e_magic != IMAGE_DOS_SIGNATURE ||
+		static_cast<ULONG>(dos->e_lfanew) > ViewSize - sizeof(IMAGE_NT_HEADERS64))
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+	const auto nt = reinterpret_cast<const IMAGE_NT_HEADERS64*>(Base + dos->e_lfanew);
+	if (nt->Signature != IMAGE_NT_SIGNATURE ||
+		nt->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC ||
+		nt->OptionalHeader.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_EXPORT)
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+	const auto directory = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+	if (directory->VirtualAddress == 0 ||
+		directory->VirtualAddress > ViewSize - sizeof(IMAGE_EXPORT_DIRECTORY))
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+	const auto exports = reinterpret_cast<const IMAGE_EXPORT_DIRECTORY*>(
+		Base + directory->VirtualAddress);
+	if (exports->NumberOfNames > ViewSize / sizeof(ULONG) ||
+		exports->NumberOfFunctions > ViewSize / sizeof(ULONG) ||
+		exports->AddressOfNames > ViewSize - exports->NumberOfNames * sizeof(ULONG) ||
+		exports->AddressOfNameOrdinals > ViewSize - exports->NumberOfNames * sizeof(USHORT) ||
+		exports->AddressOfFunctions > ViewSize - exports->NumberOfFunctions * sizeof(ULONG))
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+	const auto names = reinterpret_cast<const ULONG*>(Base + exports->AddressOfNames);
+	const auto ordinals = reinterpret_cast<const USHORT*>(Base + exports->AddressOfNameOrdinals);
+	const auto functions = reinterpret_cast<const ULONG*>(Base + exports->AddressOfFunctions);
+
+	for (ULONG i = 0; i < exports->NumberOfNames; i++)
+	{
+		if (names[i] >= ViewSize || ordinals[i] >= exports->NumberOfFunctions)
+		{
+			continue;
+		}
+		const auto name = reinterpret_cast<PCSTR>(Base + names[i]);
+		for (ULONG j = 0; j < RTL_NUMBER_OF(kPostRefusedNames); j++)
+		{
+			//
+			// Export names are in the image, which ends with the view.
+			//
+			if (strncmp(name, kPostRefusedNames[j], ViewSize - names[i]) != 0)
+			{
+				continue;
+			}
+			const auto rva = functions[ordinals[i]];
+			if (rva > ViewSize - 8)
+			{
+				return STATUS_INVALID_IMAGE_FORMAT;
+			}
+			const auto number = SvHookpPostStubNumber(Base + rva);
+			if (number == MAXULONG)
+			{
+				return STATUS_INVALID_IMAGE_FORMAT;
+			}
+			if (number < SYSCALL_MAX_INDEX)
+			{
+				_bittestandset(&g_PostRefused[number / 32], number % 32);
+			}
+			break;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+//
+// Fills g_PostRefused from the system service stubs of the known DLL ntdll,
+// mapped for a moment into the current process.
+//
+static
+VOID
+SvHookpPostFindRefused(
+	VOID
+	)
+{
+	UNICODE_STRING name = RTL_CONSTANT_STRING(L"\\KnownDlls\\ntdll.dll");
+	OBJECT_ATTRIBUTES attributes;
+	HANDLE section;
+	PVOID base = nullptr;
+	SIZE_T viewSize = 0;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(g_PostRefused, sizeof(g_PostRefused));
+	g_PostRefusedKnown = FALSE;
+
+	InitializeObjectAttributes(&attributes, &name,
+		OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+	status = ZwOpenSection(&section, SECTION_MAP_READ | SECTION_QUERY, &attributes);
+	if (!NT_SUCCESS(status))
+	{
+		return;
+	}
+	status = ZwMapViewOfSection(section, ZwCurrentProcess(), &base, 0, 0,
+		nullptr, &viewSize, ViewUnmap, 0, PAGE_READONLY);
+	ZwClose(section);
+	if (!NT_SUCCESS(status))
+	{
+		return;
+	}
+
+	__try
+	{
+		status = SvHookpPostReadStubs(static_cast<const UCHAR*>(base), viewSize);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		status = GetExceptionCode();
+	}
+	ZwUnmapViewOfSection(ZwCurrentProcess(), base);
+
+	g_PostRefusedKnown = NT_SUCCESS(status);
+}
+
+// Checks if a syscall may be armed for a post-hook or a measurement
+BOOLEAN
+SyscallPostIsSupported(
+	ULONG SysNum
+	)
+{
+	return g_PostRefusedKnown &&
+		SysNum < SYSCALL_MAX_INDEX &&
+		!_bittest(&g_PostRefused[SysNum / 32], SysNum % 32);
+}
+
+static
+VOID
+SvHookpPostRelease(
+	_In_ PHOOK_POST_RECORD Record
+	)
+{
+	if (Record->Entry != nullptr)
+	{
+		SyscallHookDereferenceEntry(Record->Entry);
+		Record->Entry = nullptr;
+	}
+	InterlockedPushEntrySList(&g_PostFreeList, &Record->FreeEntry);
+	InterlockedDecrement(&g_PostOutstanding);
+}
+
+//
+// Never runs; a user-mode APC needs a normal routine to be queued, and the
+// kernel routine always clears it.
+//
+static
+VOID
+NTAPI
+SvHookpPostNormalRoutine(
+	_In_opt_ PVOID NormalContext,
+	_In_opt_ PVOID SystemArgument1,
+	_In_opt_ PVOID SystemArgument2
+	)
+{
+	UNREFERENCED_PARAMETER(NormalContext);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+}
+
+//
+// Runs the post-hook as the system service returns to user mode.
+//
+static
+VOID
+NTAPI
+SvHookpPostKernelRoutine(
+	_In_ PKAPC Apc,
+	_Inout_ PKNORMAL_ROUTINE* NormalRoutine,
+	_Inout_ PVOID* NormalContext,
+	_Inout_ PVOID* SystemArgument1,
+	_Inout_ PVOID* SystemArgument2
+	)
+{
+	const auto exitTsc = __rdtsc();
+	const auto record = CONTAINING_RECORD(Apc, HOOK_POST_RECORD, Apc);
+	const auto entry = record->Entry;
+
+	UNREFERENCED_PARAMETER(NormalContext);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	*NormalRoutine = nullptr;
+
+	if (record->HistogramGeneration != 0)
+	{
+		SyscallHistogramRecord(static_cast<ULONG>(record->Context.SysNum),
+			record->HistogramGeneration, exitTsc - record->Context.EntryTsc);
+	}
+	if (entry == nullptr)
+	{
+		SvHookpPostRelease(record);
+		return;
+	}
+
+	//
+	// Announce the call before checking Retired so that RmHook, which sets
+	// Retired before waiting for Active to drain, either sees this call or
+	// makes it skip the post-hook.
+	//
+	InterlockedIncrement(&entry->Active);
+	if (InterlockedCompareExchange(&entry->Retired, 0, 0) == 0)
+	{
+		const auto status = static_cast<NTSTATUS>(record->TrapFrame->Rax);
+		record->Context.Status = status;
+		entry->PostFunction(&record->Context);
+		if (record->Context.Status != status)
+		{
+			record->TrapFrame->Rax = static_cast<ULONG>(record->Context.Status);
+		}
+	}
+	InterlockedDecrement(&entry->Active);
+
+	SvHookpPostRelease(record);
+}
+
+//
+// Frees a record whose thread exited before the APC was delivered.
+//
+static
+VOID
+NTAPI
+SvHookpPostRundownRoutine(
+	_In_ PKAPC Apc
+	)
+{
+	SvHookpPostRelease(CONTAINING_RECORD(Apc, HOOK_POST_RECORD, Apc));
+}
+
+static
+VOID
+NTAPI
+SvHookpDispatchRundownRoutine(
+	_In_ PKAPC Apc
+	)
+{
+	SvHookpPostRelease(CONTAINING_RECORD(Apc, HOOK_POST_RECORD, DispatchApc));
+}
+
+//
+// Calls the hook of a record, then queues the user-mode APC for its
+// post-hook or measurement. Runs at APC_LEVEL in the context of the calling
+// thread, before the system service.
+//
+static
+VOID
+NTAPI
+SvHookpDispatchKernelRoutine(
+	_In_ PKAPC Apc,
+	_Inout_ PKNORMAL_ROUTINE* NormalRoutine,
+	_Inout_ PVOID* NormalContext,
+	_Inout_ PVOID* SystemArgument1,
+	_Inout_ PVOID* SystemArgument2
+	)
+{
+	const auto record = CONTAINING_RECORD(Apc, HOOK_POST_RECORD, DispatchApc);
+	const auto entry = record->Entry;
+
+	UNREFERENCED_PARAMETER(NormalRoutine);
+	UNREFERENCED_PARAMETER(NormalContext);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	if (entry != nullptr && entry->Thunk != nullptr)
+	{
+		//
+		// Same protocol as the post-hook; see SvHookpPostKernelRoutine.
+		//
+		InterlockedIncrement(&entry->Active);
+		if (InterlockedCompareExchange(&entry->Retired, 0, 0) == 0)
+		{
+			HOOK_ARG result;
+			entry->Thunk(entry->Function, &record->Frame, &result);
+		}
+		InterlockedDecrement(&entry->Active);
+	}
+
+	//
+	// A measured syscall needs the user-mode APC for its exit TSC even when
+	// it has no post-hook.
+	//
+	if (entry != nullptr && entry->PostFunction == nullptr)
+	{
+		SyscallHookDereferenceEntry(entry);
+		record->Entry = nullptr;
+	}
+	if (record->Entry == nullptr && record->HistogramGeneration == 0)
+	{
+		SvHookpPostRelease(record);
+		return;
+	}
+
+	KeInitializeApc(&record->Apc,
+		KeGetCurrentThread(),
+		OriginalApcEnvironment,
+		SvHookpPostKernelRoutine,
+		SvHookpPostRundownRoutine,
+		SvHookpPostNormalRoutine,
+		UserMode,
+		nullptr);
+	if (!KeInsertQueueApc(&record->Apc, nullptr, nullptr, 0))
+	{
+		SvHookpPostRelease(record);
+		return;
+	}
+
+	//
+	// A user-mode APC is only delivered on return to user mode when
+	// UserApcPending is set, which KeInsertQueueApc does not do for a thread
+	// that is not in an alertable wait.
+	//
+	KeTestAlertThread(UserMode);
+}
+
+//
+// Hands records HookPort64 armed on this processor to their threads. Runs as
+// soon as KiSystemCall64 enables interrupts.
+//
+static
+VOID
+SvHookpPostDpcRoutine(
+	_In_ PKDPC Dpc,
+	_In_opt_ PVOID DeferredContext,
+	_In_opt_ PVOID SystemArgument1,
+	_In_opt_ PVOID SystemArgument2
+	)
+{
+	const auto processor = reinterpret_cast<PHOOK_POST_PROCESSOR>(DeferredContext);
+
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	auto pending = InterlockedFlushSList(&processor->Pending);
+	while (pending != nullptr)
+	{
+		const auto record = CONTAINING_RECORD(pending, HOOK_POST_RECORD, FreeEntry);
+		pending = pending->Next;
+
+		KeInitializeApc(&record->DispatchApc,
+			record->Thread,
+			OriginalApcEnvironment,
+			SvHookpDispatchKernelRoutine,
+			SvHookpDispatchRundownRoutine,
+			nullptr,
+			KernelMode,
+			nullptr);
+		if (!KeInsertQueueApc(&record->DispatchApc, nullptr, nullptr, 0))
+		{
+			SvHookpPostRelease(record);
+		}
+	}
+}
+
+// Allocates the post-hook record pool and a DPC for each processor
+NTSTATUS
+SyscallPostInitialization(
+	VOID
+	)
+{
+	SIZE_T size;
+
+	PAGED_CODE();
+
+	//
+	// Cover processors that may be hot-added later as well. The allocation is
+	// at least a page so that it is page, and thus cache line, aligned.
+	//
+	g_PostProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	size = ROUND_TO_PAGES(g_PostProcessorCount * sizeof(HOOK_POST_PROCESSOR));
+	g_PostProcessors = reinterpret_cast<PHOOK_POST_PROCESSOR>(ExAllocatePoolWithTag(
+		NonPagedPool, size, kPostPoolTag));
+	if (g_PostProcessors == nullptr)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(g_PostProcessors, size);
+	for (ULONG i = 0; i < g_PostProcessorCount; i++)
+	{
+		//
+		// Untargeted, so that the DPC runs on the processor that queued it.
+		//
+		InitializeSListHead(&g_PostProcessors[i].Pending);
+		KeInitializeDpc(&g_PostProcessors[i].Dpc, SvHookpPostDpcRoutine,
+			&g_PostProcessors[i]);
+		KeSetImportanceDpc(&g_PostProcessors[i].Dpc, HighImportance);
+	}
+
+	g_PostRecords = reinterpret_cast<PHOOK_POST_RECORD>(ExAllocatePoolWithTag(
+		NonPagedPool, sizeof(HOOK_POST_RECORD) * SYSCALL_POST_POOL_SIZE, kPostPoolTag));
+	if (g_PostRecords == nullptr)
+	{
+		ExFreePoolWithTag(g_PostProcessors, kPostPoolTag);
+		g_PostProcessors = nullptr;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(g_PostRecords, sizeof(HOOK_POST_RECORD) * SYSCALL_POST_POOL_SIZE);
+
+	InitializeSListHead(&g_PostFreeList);
+	for (ULONG i = 0; i < SYSCALL_POST_POOL_SIZE; i++)
+	{
+		InterlockedPushEntrySList(&g_PostFreeList, &g_PostRecords[i].FreeEntry);
+	}
+	g_PostOutstanding = 0;
+	g_PostDropped = 0;
+	SvHookpPostFindRefused();
+	return STATUS_SUCCESS;
+}
+
+// Waits for all pending post-hooks and frees the pool. Hooks must already be
+// disabled so that no new post-hook is armed.
+VOID
+SyscallPostTermination(
+	VOID
+	)
+{
+	LARGE_INTEGER interval;
+
+	PAGED_CODE();
+
+	if (g_PostRecords == nullptr)
+	{
+		return;
+	}
+
+	//
+	// A thread blocked in a hooked syscall holds its record until it returns
+	// or exits; the code the APC points to must stay until then. A record
+	// still in a pending list is released by the DPC or the APC it queues.
+	//
+	interval.QuadPart = -10000;  // 1 ms
+	while (g_PostOutstanding != 0)
+	{
+		KeDelayExecutionThread(KernelMode, FALSE, &interval);
+	}
+	KeFlushQueuedDpcs();
+	ExFreePoolWithTag(g_PostRecords, kPostPoolTag);
+	g_PostRecords = nullptr;
+	ExFreePoolWithTag(g_PostProcessors, kPostPoolTag);
+	g_PostProcessors = nullptr;
+}
+
+// Arms the hook and post-hook of Entry, if any, for the current syscall and
+// has it measured when Timed; called by HookPort64 with interrupts disabled.
+// Only touches the record pool and this processor's pending list and DPC.
+VOID
+SyscallPostArm(
+	PHOOK_ENTRY Entry,
+	ULONG SysNum,
+	const HOOK_SYSCALL_FRAME* Frame,
+	ULONG64 EntryTsc,
+	BOOLEAN Timed
+	)
+{
+	const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+	if (index >= g_PostProcessorCount)
+	{
+		return;
+	}
+
+	const auto freeEntry = InterlockedPopEntrySList(&g_PostFreeList);
+	if (freeEntry == nullptr)
+	{
+		InterlockedIncrement64(&g_PostDropped);
+		return;
+	}
+
+	const auto record = CONTAINING_RECORD(freeEntry, HOOK_POST_RECORD, FreeEntry);
+	InterlockedIncrement(&g_PostOutstanding);
+	if (Entry != nullptr)
+	{
+		SyscallHookReferenceEntry(Entry);
+	}
+	record->Thread = KeGetCurrentThread();
+	record->Entry = Entry;
+	record->HistogramGeneration = Timed ? SyscallHistogramGeneration() : 0;
+	record->TrapFrame = reinterpret_cast<PKTRAP_FRAME>(
+		__readgsqword(kKernelStackGsOffset) - sizeof(KTRAP_FRAME));
+	record->Frame = *Frame;
+	record->Context.SysNum = SysNum;
+	for (ULONG i = 0; i < RTL_NUMBER_OF(record->Context.Arguments); i++)
+	{
+		record->Context.Arguments[i] = Frame->Registers[i];
+	}
+	record->Context.EntryTsc = EntryTsc;
+	record->Context.Status = STATUS_SUCCESS;
+
+	InterlockedPushEntrySList(&g_PostProcessors[index].Pending, &record->FreeEntry);
+	KeInsertQueueDpc(&g_PostProcessors[index].Dpc, nullptr, nullptr);
+}
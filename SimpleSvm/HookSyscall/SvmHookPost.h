@@ -0,0 +1,97 @@
+#pragma once
+
+#include "../SvmHead.h"
+#include "SvmHookThunk.h"
+
+//
+// APC routines exported by ntoskrnl but not declared by the WDK.
+//
+typedef enum _KAPC_ENVIRONMENT
+{
+	OriginalApcEnvironment,
+	AttachedApcEnvironment,
+	CurrentApcEnvironment,
+	InsertApcEnvironment
+}KAPC_ENVIRONMENT;
+
+typedef
+VOID
+(NTAPI *PKKERNEL_ROUTINE)(
+	_In_ PKAPC Apc,
+	_Inout_ PKNORMAL_ROUTINE* NormalRoutine,
+	_Inout_ PVOID* NormalContext,
+	_Inout_ PVOID* SystemArgument1,
+	_Inout_ PVOID* SystemArgument2
+	);
+
+typedef
+VOID
+(NTAPI *PKRUNDOWN_ROUTINE)(
+	_In_ PKAPC Apc
+	);
+
+extern "C"
+NTKERNELAPI
+VOID
+KeInitializeApc(
+	_Out_ PKAPC Apc,
+	_In_ PKTHREAD Thread,
+	_In_ KAPC_ENVIRONMENT Environment,
+	_In_ PKKERNEL_ROUTINE KernelRoutine,
+	_In_opt_ PKRUNDOWN_ROUTINE RundownRoutine,
+	_In_opt_ PKNORMAL_ROUTINE NormalRoutine,
+	_In_opt_ KPROCESSOR_MODE ProcessorMode,
+	_In_opt_ PVOID NormalContext
+	);
+
+extern "C"
+NTKERNELAPI
+BOOLEAN
+KeInsertQueueApc(
+	_Inout_ PKAPC Apc,
+	_In_opt_ PVOID SystemArgument1,
+	_In_opt_ PVOID SystemArgument2,
+	_In_ KPRIORITY Increment
+	);
+
+extern "C"
+NTKERNELAPI
+BOOLEAN
+KeTestAlertThread(
+	_In_ KPROCESSOR_MODE AlertMode
+	);
+
+//
+// Number of hooked syscalls that can be pending at once, from HookPort64 to
+// the return to user mode. A syscall entered while all of them are in use
+// runs without its hooks and is not measured.
+//
+#define SYSCALL_POST_POOL_SIZE 2048
+
+struct _HOOK_ENTRY;
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+SyscallPostInitialization(
+	VOID
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SyscallPostTermination(
+	VOID
+	);
+
+BOOLEAN
+SyscallPostIsSupported(
+	_In_ ULONG SysNum
+	);
+
+VOID
+SyscallPostArm(
+	_In_opt_ struct _HOOK_ENTRY* Entry,
+	_In_ ULONG SysNum,
+	_In_ const HOOK_SYSCALL_FRAME* Frame,
+	_In_ ULONG64 EntryTsc,
+	_In_ BOOLEAN Timed
+	);
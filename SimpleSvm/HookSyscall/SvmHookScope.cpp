@@ -0,0 +1,273 @@
+#include "SvmHookMsr.h"
+
+//
+// The set of processes scoped hooks apply to: an open-addressed hash of PIDs
+// with linear probing, read without a lock by HookPort64.
+//
+// A slot holds a PID, kScopeEmpty or kScopeTombstone. Writers are serialized
+// by g_ScopeMutex and update a slot with a single interlocked store, so a
+// lookup never sees a torn value. Removal leaves a tombstone so that probes
+// for other PIDs keep going. When tombstones pile up, the set is rebuilt
+// into the other of two buffers and published with a pointer store; the old
+// buffer is reused only after HookPort64 calls that may be reading it have
+// returned.
+//
+
+static const ULONG kScopeEmpty = 0;
+static const ULONG kScopeTombstone = MAXULONG;
+
+//
+// Uses the top bits of a multiplicative hash as the index.
+//
+static const ULONG kScopeHashShift = 24;
+static_assert((1ul << (32 - kScopeHashShift)) == SYSCALL_SCOPE_SLOTS,
+              "kScopeHashShift does not match SYSCALL_SCOPE_SLOTS");
+
+typedef struct DECLSPEC_CACHEALIGN _SCOPE_SET
+{
+	volatile LONG Slots[SYSCALL_SCOPE_SLOTS];
+}SCOPE_SET, *PSCOPE_SET;
+
+static SCOPE_SET g_ScopeSets[2];
+static PSCOPE_SET volatile g_ScopeActive;
+static ULONG g_ScopeUsed;
+static ULONG g_ScopeTombstones;
+static FAST_MUTEX g_ScopeMutex;
+static BOOLEAN g_ScopeNotifyRegistered;
+
+static
+ULONG
+SvScopepHash(
+	_In_ ULONG ProcessId
+	)
+{
+	//
+	// PIDs are multiples of four.
+	//
+	return ((ProcessId >> 2) * 0x9E3779B1ul) >> kScopeHashShift;
+}
+
+//
+// Stores ProcessId in the first free slot of its probe sequence. The caller
+// guarantees that ProcessId is not in the set and that the set is not full.
+//
+static
+VOID
+SvScopepInsert(
+	_Inout_ PSCOPE_SET Set,
+	_In_ ULONG ProcessId
+	)
+{
+	auto index = SvScopepHash(ProcessId);
+
+	for (;;)
+	{
+		const auto value = static_cast<ULONG>(Set->Slots[index]);
+		if (value == kScopeEmpty || value == kScopeTombstone)
+		{
+			InterlockedExchange(&Set->Slots[index], static_cast<LONG>(ProcessId));
+			return;
+		}
+		index = (index + 1) & (SYSCALL_SCOPE_SLOTS - 1);
+	}
+}
+
+//
+// Returns the slot holding ProcessId, or nullptr.
+//
+static
+volatile LONG*
+SvScopepFind(
+	_In_ PSCOPE_SET Set,
+	_In_ ULONG ProcessId
+	)
+{
+	auto index = SvScopepHash(ProcessId);
+
+	for (ULONG i = 0; i < SYSCALL_SCOPE_SLOTS; i++)
+	{
+		const auto value = static_cast<ULONG>(Set->Slots[index]);
+		if (value == ProcessId)
+		{
+			return &Set->Slots[index];
+		}
+		if (value == kScopeEmpty)
+		{
+			break;
+		}
+		index = (index + 1) & (SYSCALL_SCOPE_SLOTS - 1);
+	}
+	return nullptr;
+}
+
+//
+// Copies live PIDs into the inactive buffer without tombstones and makes it
+// active.
+//
+static
+VOID
+SvScopepRebuild(
+	VOID
+	)
+{
+	const auto active = g_ScopeActive;
+	const auto next = (active == &g_ScopeSets[0]) ? &g_ScopeSets[1] : &g_ScopeSets[0];
+
+	PAGED_CODE();
+
+	RtlZeroMemory(next, sizeof(*next));
+	for (ULONG i = 0; i < SYSCALL_SCOPE_SLOTS; i++)
+	{
+		const auto value = static_cast<ULONG>(active->Slots[i]);
+		if (value != kScopeEmpty && value != kScopeTombstone)
+		{
+			SvScopepInsert(next, value);
+		}
+	}
+	InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&g_ScopeActive), next);
+	g_ScopeTombstones = 0;
+
+	//
+	// The old buffer is rebuilt into next time; wait for its readers.
+	//
+	SyscallHookWaitForReaders();
+}
+
+//
+// Drops processes from the set as they exit so that a recycled PID does not
+// inherit the scope.
+//
+static
+VOID
+SvScopepProcessNotifyRoutine(
+	_In_ HANDLE ParentId,
+	_In_ HANDLE ProcessId,
+	_In_ BOOLEAN Create
+	)
+{
+	UNREFERENCED_PARAMETER(ParentId);
+
+	if (!Create)
+	{
+		SyscallScopeRemoveProcess(ProcessId);
+	}
+}
+
+// Initializes an empty set and starts watching process exits
+NTSTATUS
+SyscallScopeInitialization(
+	VOID
+	)
+{
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	ExInitializeFastMutex(&g_ScopeMutex);
+	RtlZeroMemory(g_ScopeSets, sizeof(g_ScopeSets));
+	g_ScopeActive = &g_ScopeSets[0];
+	g_ScopeUsed = 0;
+	g_ScopeTombstones = 0;
+
+	status = PsSetCreateProcessNotifyRoutine(SvScopepProcessNotifyRoutine, FALSE);
+	g_ScopeNotifyRegistered = NT_SUCCESS(status);
+	return status;
+}
+
+// Stops watching process exits
+VOID
+SyscallScopeTermination(
+	VOID
+	)
+{
+	PAGED_CODE();
+
+	if (g_ScopeNotifyRegistered)
+	{
+		PsSetCreateProcessNotifyRoutine(SvScopepProcessNotifyRoutine, TRUE);
+		g_ScopeNotifyRegistered = FALSE;
+	}
+}
+
+// Adds a process to the set scoped hooks apply to
+_Use_decl_annotations_
+NTSTATUS
+NTAPI
+SyscallScopeAddProcess(
+	HANDLE ProcessId
+	)
+{
+	NTSTATUS status;
+	const auto pid = HandleToULong(ProcessId);
+
+	PAGED_CODE();
+
+	if (pid == kScopeEmpty || pid == kScopeTombstone)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	ExAcquireFastMutex(&g_ScopeMutex);
+	if (SvScopepFind(g_ScopeActive, pid) != nullptr)
+	{
+		status = STATUS_SUCCESS;
+	}
+	else if (g_ScopeUsed >= SYSCALL_SCOPE_MAX_TARGETS)
+	{
+		status = STATUS_QUOTA_EXCEEDED;
+	}
+	else
+	{
+		//
+		// Keep at least a quarter of slots empty so that failed lookups,
+		// which is what processes outside the set do, end quickly.
+		//
+		if ((g_ScopeUsed + g_ScopeTombstones + 1) * 4 > SYSCALL_SCOPE_SLOTS * 3)
+		{
+			SvScopepRebuild();
+		}
+		SvScopepInsert(g_ScopeActive, pid);
+		g_ScopeUsed++;
+		status = STATUS_SUCCESS;
+	}
+	ExReleaseFastMutex(&g_ScopeMutex);
+	return status;
+}
+
+// Removes a process from the set scoped hooks apply to
+_Use_decl_annotations_
+VOID
+NTAPI
+SyscallScopeRemoveProcess(
+	HANDLE ProcessId
+	)
+{
+	const auto pid = HandleToULong(ProcessId);
+
+	PAGED_CODE();
+
+	if (pid == kScopeEmpty || pid == kScopeTombstone)
+	{
+		return;
+	}
+
+	ExAcquireFastMutex(&g_ScopeMutex);
+	const auto slot = SvScopepFind(g_ScopeActive, pid);
+	if (slot != nullptr)
+	{
+		InterlockedExchange(slot, static_cast<LONG>(kScopeTombstone));
+		g_ScopeUsed--;
+		g_ScopeTombstones++;
+	}
+	ExReleaseFastMutex(&g_ScopeMutex);
+}
+
+// Checks if scoped hooks apply to a process; called by HookPort64 with
+// interrupts disabled, so it only reads the nonpaged set
+BOOLEAN
+SyscallScopeContains(
+	_In_ ULONG ProcessId
+	)
+{
+	return SvScopepFind(g_ScopeActive, ProcessId) != nullptr;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../SvmHead.h"
+
+//
+// Number of slots of the target process set; a power of two. At most
+// SYSCALL_SCOPE_MAX_TARGETS processes can be targeted at once so that the
+// set stays at most half full and lookups stay short.
+//
+#define SYSCALL_SCOPE_SLOTS 256
+#define SYSCALL_SCOPE_MAX_TARGETS (SYSCALL_SCOPE_SLOTS / 2)
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+SyscallScopeInitialization(
+	VOID
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SyscallScopeTermination(
+	VOID
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+NTAPI
+SyscallScopeAddProcess(
+	_In_ HANDLE ProcessId
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+NTAPI
+SyscallScopeRemoveProcess(
+	_In_ HANDLE ProcessId
+	);
+
+BOOLEAN
+SyscallScopeContains(
+	_In_ ULONG ProcessId
+	);
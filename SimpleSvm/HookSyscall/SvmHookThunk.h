@@ -0,0 +1,123 @@
+#pragma once
+
+//
+// Compile-time generated dispatch thunks for syscall hooks.
+//
+// HOOK_THUNK_TABLE<Copy>::Get(N) returns a thunk calling a hook that takes N
+// arguments, for N in [0, HOOK_THUNK_MAX_PARAM]. Each thunk is generated from
+// one template: the first four arguments come from registers, and the rest
+// are read from the user stack with a single bounded call to Copy of exactly
+// (N - 4) slots. There is no switch on the number of arguments at call time;
+// AddHook picks the thunk once and HookPort64 calls it through a pointer.
+//
+// This file does not depend on the WDK. The kernel instantiates it with a
+// probing copy routine; other environments may supply a plain one.
+//
+#include <stddef.h>
+
+typedef unsigned long long HOOK_ARG;
+
+#define HOOK_THUNK_MAX_PARAM 15
+
+//
+// Offset of the fifth syscall argument from the user stack pointer at the
+// SYSCALL instruction; a return address and home space for four registers
+// precede it.
+//
+#define HOOK_USER_STACK_ARG_OFFSET 0x28
+
+//
+// What HookPort64 knows about a syscall when it calls a thunk.
+//
+typedef struct _HOOK_SYSCALL_FRAME
+{
+	HOOK_ARG Registers[4];  // r10, rdx, r8 and r9
+	HOOK_ARG UserStack;     // rsp at the SYSCALL instruction
+}HOOK_SYSCALL_FRAME, *PHOOK_SYSCALL_FRAME;
+
+//
+// Copies Size bytes of the user stack. Returns false if it is inaccessible.
+//
+typedef bool (*HOOK_STACK_COPY)(void* Destination, const void* Source, size_t Size);
+
+//
+// Calls Function with arguments in Frame. Returns false without calling it
+// when stack arguments could not be read.
+//
+typedef bool (*HOOK_THUNK)(const void* Function, const HOOK_SYSCALL_FRAME* Frame, HOOK_ARG* Result);
+
+template <unsigned... Indexes>
+struct HookIndexSequence
+{
+};
+
+template <unsigned N, unsigned... Indexes>
+struct HookMakeIndexSequence : HookMakeIndexSequence<N - 1, N - 1, Indexes...>
+{
+};
+
+template <unsigned... Indexes>
+struct HookMakeIndexSequence<0, Indexes...>
+{
+	typedef HookIndexSequence<Indexes...> Type;
+};
+
+template <unsigned>
+struct HookArgOf
+{
+	typedef HOOK_ARG Type;
+};
+
+template <unsigned N, HOOK_STACK_COPY Copy>
+struct HookThunk
+{
+	static_assert(N <= HOOK_THUNK_MAX_PARAM, "Too many hook parameters");
+
+	static const unsigned kInRegisters = (N < 4) ? N : 4;
+	static const unsigned kOnStack = N - kInRegisters;
+
+	static bool Invoke(const void* Function, const HOOK_SYSCALL_FRAME* Frame, HOOK_ARG* Result)
+	{
+		HOOK_ARG args[(N != 0) ? N : 1];
+
+		for (unsigned i = 0; i < kInRegisters; i++)
+		{
+			args[i] = Frame->Registers[i];
+		}
+		if (kOnStack != 0 &&
+			!Copy(&args[kInRegisters],
+				reinterpret_cast<const void*>(Frame->UserStack + HOOK_USER_STACK_ARG_OFFSET),
+				kOnStack * sizeof(HOOK_ARG)))
+		{
+			return false;
+		}
+
+		*Result = Call(Function, args, typename HookMakeIndexSequence<N>::Type());
+		return true;
+	}
+
+private:
+	template <unsigned... Indexes>
+	static HOOK_ARG Call(const void* Function, const HOOK_ARG* Args, HookIndexSequence<Indexes...>)
+	{
+		typedef HOOK_ARG (*Target)(typename HookArgOf<Indexes>::Type...);
+		return reinterpret_cast<Target>(const_cast<void*>(Function))(Args[Indexes]...);
+	}
+};
+
+template <HOOK_STACK_COPY Copy, typename Sequence =
+	typename HookMakeIndexSequence<HOOK_THUNK_MAX_PARAM + 1>::Type>
+struct HOOK_THUNK_TABLE;
+
+template <HOOK_STACK_COPY Copy, unsigned... Arities>
+struct HOOK_THUNK_TABLE<Copy, HookIndexSequence<Arities...>>
+{
+	//
+	// Returns a thunk for hooks taking ParamNum arguments, or nullptr.
+	//
+	static HOOK_THUNK Get(unsigned long long ParamNum)
+	{
+		static const HOOK_THUNK thunks[] = { &HookThunk<Arities, Copy>::Invoke... };
+		return (ParamNum < sizeof(thunks) / sizeof(thunks[0])) ? thunks[ParamNum] : nullptr;
+	}
+};
@@ -0,0 +1,168 @@
+#include "SvmHookMsr.h"
+#include "SvmHookTrace.h"
+
+static const ULONG kTracePoolTag = 'rTvS';
+
+//
+// The trace section and its per-processor rings. g_TraceRings is published
+// only after every ring is initialized, and is read by SyscallTraceWrite on
+// the syscall path without a lock.
+//
+static ExportSection g_TraceSection;
+static RingHeader* volatile* volatile g_TraceRings;
+static FAST_MUTEX g_TraceMutex;
+
+// Initializes tracing; called by SyscallHookInitialization
+VOID
+SyscallTraceInitialization(
+	VOID
+	)
+{
+	PAGED_CODE();
+
+	ExInitializeFastMutex(&g_TraceMutex);
+	g_TraceRings = nullptr;
+}
+
+// Starts tracing syscalls in Numbers, or all of them when Numbers is NULL
+_Use_decl_annotations_
+NTSTATUS
+NTAPI
+SyscallTraceStart(
+	const ULONG* Numbers,
+	ULONG Count
+	)
+{
+	NTSTATUS status;
+	RingDirectory* directory;
+	RingHeader** rings;
+	SIZE_T ringSize, ringStride;
+	ULONG ringCount;
+
+	PAGED_CODE();
+
+	for (ULONG i = 0; Numbers != nullptr && i < Count; i++)
+	{
+		if (Numbers[i] >= SYSCALL_MAX_INDEX)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	ExAcquireFastMutex(&g_TraceMutex);
+	if (g_TraceRings != nullptr)
+	{
+		status = STATUS_UNSUCCESSFUL;
+		goto Exit;
+	}
+
+	//
+	// One ring per possible processor, each starting on its own page so that
+	// processors never write to the same cache line.
+	//
+	ringCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	ringSize = static_cast<SIZE_T>(RingGetSize(
+		sizeof(RingSlotHeader) + sizeof(SYSCALL_TRACE_RECORD),
+		SYSCALL_TRACE_SLOT_COUNT));
+	ringStride = ROUND_TO_PAGES(ringSize);
+	rings = reinterpret_cast<RingHeader**>(ExAllocatePoolWithTag(
+		NonPagedPool, ringCount * sizeof(RingHeader*), kTracePoolTag));
+	if (rings == nullptr)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Exit;
+	}
+
+	status = ExportCreateSection(SVMNEST_TRACE_SECTION_NAME,
+		PAGE_SIZE + ringStride * ringCount, &g_TraceSection);
+	if (!NT_SUCCESS(status))
+	{
+		ExFreePoolWithTag(rings, kTracePoolTag);
+		goto Exit;
+	}
+
+	for (ULONG i = 0; i < ringCount; i++)
+	{
+		rings[i] = ExportInitializeRing(
+			static_cast<PUCHAR>(g_TraceSection.base) + PAGE_SIZE + ringStride * i,
+			sizeof(RingSlotHeader) + sizeof(SYSCALL_TRACE_RECORD),
+			SYSCALL_TRACE_SLOT_COUNT);
+	}
+	directory = static_cast<RingDirectory*>(g_TraceSection.base);
+	directory->version = kRingVersion;
+	directory->ring_count = ringCount;
+	directory->ring_offset = PAGE_SIZE;
+	directory->ring_stride = ringStride;
+	KeMemoryBarrier();
+	directory->magic = kRingDirectoryMagic;
+
+	InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&g_TraceRings), rings);
+
+	//
+	// Let traced syscalls into HookPort64 only once the rings exist.
+	//
+	SyscallHookSetMonitored(HookMonitorTrace, Numbers, Count);
+
+Exit:
+	ExReleaseFastMutex(&g_TraceMutex);
+	return status;
+}
+
+// Stops tracing and deletes the trace section
+_Use_decl_annotations_
+VOID
+NTAPI
+SyscallTraceStop(
+	VOID
+	)
+{
+	RingHeader** rings;
+
+	PAGED_CODE();
+
+	ExAcquireFastMutex(&g_TraceMutex);
+	rings = reinterpret_cast<RingHeader**>(InterlockedExchangePointer(
+		reinterpret_cast<PVOID volatile*>(&g_TraceRings), nullptr));
+	if (rings != nullptr)
+	{
+		//
+		// This waits for HookPort64 calls that may still be writing records.
+		//
+		SyscallHookClearMonitored(HookMonitorTrace);
+
+		ExportDeleteSection(&g_TraceSection);
+		ExFreePoolWithTag(rings, kTracePoolTag);
+	}
+	ExReleaseFastMutex(&g_TraceMutex);
+}
+
+// Writes a record to the current processor's ring; called by HookPort64 with
+// interrupts disabled. The ring is locked, so nothing here can fault.
+VOID
+SyscallTraceWrite(
+	ULONG SysNum,
+	ULONG64 Param1,
+	ULONG64 Param2,
+	ULONG64 Param3,
+	ULONG64 Param4
+	)
+{
+	SYSCALL_TRACE_RECORD record;
+	const auto rings = g_TraceRings;
+
+	if (rings == nullptr)
+	{
+		return;
+	}
+
+	record.ProcessId = HandleToULong(PsGetCurrentProcessId());
+	record.ThreadId = HandleToULong(PsGetCurrentThreadId());
+	record.SysNum = SysNum;
+	record.ArgumentCount = SYSCALL_TRACE_MAX_ARGUMENTS;
+	record.Arguments[0] = Param1;
+	record.Arguments[1] = Param2;
+	record.Arguments[2] = Param3;
+	record.Arguments[3] = Param4;
+	ExportRingWrite(rings[KeGetCurrentProcessorNumberEx(nullptr)], &record,
+		sizeof(record));
+}
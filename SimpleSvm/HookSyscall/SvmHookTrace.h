@@ -0,0 +1,68 @@
+#pragma once
+
+//
+// Layout of the syscall trace section. A consumer opens "Global\SvmNestTrace"
+// with FILE_MAP_READ, finds one ring per processor through the RingDirectory
+// at the beginning of the section, and reads SYSCALL_TRACE_RECORDs out of
+// each ring with RingRead(). The TSC and the processor index of each record
+// are in its RingSlotHeader.
+//
+// Everything above the _KERNEL_MODE section does not depend on the WDK so
+// that a user-mode consumer can include this file as is.
+//
+#include "../log/ring.h"
+
+#define SYSCALL_TRACE_MAX_ARGUMENTS 4
+
+typedef struct _SYSCALL_TRACE_RECORD
+{
+	RingU32 ProcessId;
+	RingU32 ThreadId;
+	RingU32 SysNum;
+	RingU32 ArgumentCount;
+	RingU64 Arguments[SYSCALL_TRACE_MAX_ARGUMENTS];
+}SYSCALL_TRACE_RECORD, *PSYSCALL_TRACE_RECORD;
+static_assert(sizeof(SYSCALL_TRACE_RECORD) == 48, "SYSCALL_TRACE_RECORD Size Mismatch");
+
+#if defined(_KERNEL_MODE)
+
+#include "../SvmHead.h"
+
+#define SVMNEST_TRACE_SECTION_NAME L"\\BaseNamedObjects\\SvmNestTrace"
+
+//
+// Number of records each processor's ring holds.
+//
+#define SYSCALL_TRACE_SLOT_COUNT 2048
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SyscallTraceInitialization(
+	VOID
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+NTAPI
+SyscallTraceStart(
+	_In_reads_opt_(Count) const ULONG* Numbers,
+	_In_ ULONG Count
+	);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+NTAPI
+SyscallTraceStop(
+	VOID
+	);
+
+VOID
+SyscallTraceWrite(
+	_In_ ULONG SysNum,
+	_In_ ULONG64 Param1,
+	_In_ ULONG64 Param2,
+	_In_ ULONG64 Param3,
+	_In_ ULONG64 Param4
+	);
+
+#endif
@@ -1,14 +1,54 @@
 #pragma once
 #include <ntdef.h>
 
+//
+// Passed to a post-hook. Status is what the system service returned; a
+// post-hook may change it to change what the caller sees.
+//
+typedef struct _HOOK_POST_CONTEXT
+{
+	unsigned long long SysNum;
+	unsigned long long Arguments[4];  // The register arguments at entry
+	unsigned long long EntryTsc;      // TSC when the syscall was entered
+	NTSTATUS Status;
+}HOOK_POST_CONTEXT, *PHOOK_POST_CONTEXT;
+
+typedef
+VOID
+(NTAPI *HOOK_POST_ROUTINE)(PHOOK_POST_CONTEXT Context);
+
+//
+// Describes a syscall hook. AddHook copies it, so the caller may free it as
+// soon as AddHook returns. pFun is called with ParamNum arguments of the
+// syscall before the system service runs. pPostFun, if not NULL, is called
+// when the system service returns to user mode. Either may be NULL, but not
+// both.
+//
+// Both are called at APC_LEVEL in the context of the calling thread, with
+// interrupts enabled and the syscall's trap frame built, so they may touch
+// pageable memory. Neither runs in the SYSCALL entry path itself, which has
+// interrupts disabled and may not fault. Arguments past the fourth are probed
+// and copied from the user stack first; pFun is not called if that fails.
+//
+// With HOOK_FLAG_SCOPED in Flags, neither pFun nor pPostFun is called unless
+// the calling process was added with AddTargetProcess.
+//
+// A post-hook is delivered as a user-mode APC, which would break an alertable
+// wait with STATUS_USER_APC. AddHook fails with STATUS_NOT_SUPPORTED for a
+// post-hook of a syscall that may wait alertably (e.g. NtWaitForSingleObject),
+// tests or delivers alerts, or does not return a status (e.g. NtContinue).
+//
 typedef struct _HOOK_PARAM
 {
-	LIST_ENTRY ListEntry;
 	unsigned long long SysNum;
 	unsigned long long ParamNum;
 	unsigned long long * pFun;
+	unsigned long long * pPostFun;
+	unsigned long long Flags;
 }HOOK_PARAM, *PHOOK_PARAM;
 
+#define HOOK_FLAG_SCOPED 0x1
+
 typedef
 NTSTATUS
 (NTAPI *ADDHOOK)(PHOOK_PARAM pList);
@@ -17,8 +57,73 @@ typedef
 VOID
 (NTAPI *RMHOOK)(PHOOK_PARAM pList);
 
+//
+// Starts tracing syscalls in Numbers, or all syscalls when Numbers is NULL.
+// Records are exported through the section described in SvmHookTrace.h.
+//
+typedef
+NTSTATUS
+(NTAPI *TRACESTART)(const ULONG* Numbers, ULONG Count);
+
+typedef
+VOID
+(NTAPI *TRACESTOP)(VOID);
+
+//
+// Adds a process to, or removes one from, the set scoped hooks apply to.
+// Processes are removed automatically when they exit.
+//
+typedef
+NTSTATUS
+(NTAPI *ADDTARGETPROCESS)(HANDLE ProcessId);
+
+typedef
+VOID
+(NTAPI *RMTARGETPROCESS)(HANDLE ProcessId);
+
+//
+// Counts of how long syscalls took, from entry to the return to user mode, in
+// TSC cycles. Buckets[i] counts calls that took [2^i, 2^(i+1)) cycles; the
+// first bucket also counts calls under a cycle and the last one all calls
+// longer than its lower bound.
+//
+#define SYSCALL_HISTOGRAM_BUCKETS 32
+
+typedef struct _SYSCALL_HISTOGRAM
+{
+	unsigned long long SysNum;
+	unsigned long long Count;
+	unsigned long long TotalCycles;
+	unsigned long long Buckets[SYSCALL_HISTOGRAM_BUCKETS];
+}SYSCALL_HISTOGRAM, *PSYSCALL_HISTOGRAM;
+
+//
+// Starts measuring syscalls in Numbers; clears previous results. Timing uses
+// the same mechanism as post-hooks, so it fails with STATUS_NOT_SUPPORTED if
+// Numbers has a syscall AddHook would not post-hook. Results remain
+// available through HistogramQuery after HistogramStop until the next start.
+//
+typedef
+NTSTATUS
+(NTAPI *HISTOGRAMSTART)(const ULONG* Numbers, ULONG Count);
+
+typedef
+VOID
+(NTAPI *HISTOGRAMSTOP)(VOID);
+
+typedef
+NTSTATUS
+(NTAPI *HISTOGRAMQUERY)(ULONG SysNum, PSYSCALL_HISTOGRAM Histogram);
+
 typedef struct _HOOK_EXTENSION
 {
 	ADDHOOK AddHook;
 	RMHOOK RmHook;
+	TRACESTART TraceStart;
+	TRACESTOP TraceStop;
+	ADDTARGETPROCESS AddTargetProcess;
+	RMTARGETPROCESS RmTargetProcess;
+	HISTOGRAMSTART HistogramStart;
+	HISTOGRAMSTOP HistogramStop;
+	HISTOGRAMQUERY HistogramQuery;
 }HOOK_EXTENSION, *PHOOK_EXTENSION;
\ No newline at end of file
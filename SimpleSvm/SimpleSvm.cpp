@@ -12,6 +12,9 @@
 
 #include "SvmStruct.h"
 #include "SvmTraps.h"
+#include "SvmCpuid.h"
+#include "SvmXstate.h"
+#include "SvmInsn.h"
 #include "SvmUtil.h"
 #include "HookSyscall/SvmHookMsr.h"
 #include "BaseUtil.h"
@@ -20,11 +23,41 @@ EXTERN_C DRIVER_INITIALIZE DriverEntry;
 static DRIVER_UNLOAD SvDriverUnload;
 static CALLBACK_FUNCTION SvPowerCallbackRoutine;
 
+#define SV_LARGE_PAGE_SIZE  0x200000
+
+//
+// Set to 0 to allocate each processor's slot on its own instead of carving
+// slots out of large-page regions, to compare exit latency of both layouts
+// (see tools/exitlat.cpp).
+//
+#ifndef SV_SLOT_REGIONS
+#define SV_SLOT_REGIONS     1
+#endif
+
+//
+// Everything the hypervisor keeps for one processor. See
+// SvAllocateProcessorData.
+//
+typedef struct _PROCESSOR_SLOT
+{
+    VIRTUAL_PROCESSOR_DATA VpData;
+    DECLSPEC_ALIGN(PAGE_SIZE) UINT8 NestData[PAGE_SIZE];    // ProcessorNestData
+    DECLSPEC_ALIGN(PAGE_SIZE) UINT8 CpuidCache[PAGE_SIZE];  // SV_CPUID_CACHE
+    DECLSPEC_ALIGN(PAGE_SIZE) UINT8 FetchCache[PAGE_SIZE];  // SV_FETCH_CACHE
+    DECLSPEC_ALIGN(PAGE_SIZE) UINT8 HostArena[SV_HOST_ARENA_PAGES * PAGE_SIZE];
+    DECLSPEC_ALIGN(PAGE_SIZE) UINT8 GuestXsaveArea[SV_XSAVE_AREA_PAGES * PAGE_SIZE];
+} PROCESSOR_SLOT, *PPROCESSOR_SLOT;
+
 //
 // A power state callback handle.
 //
 static PVOID g_PowerCallbackRegistration;
 
+//
+// Shared data kept while the system sleeps. See SvSuspendAllProcessors.
+//
+static PSHARED_VIRTUAL_PROCESSOR_DATA g_SuspendedSharedVpData;
+
 /*!
     @brief      Allocates page aligned, zero filled physical memory.
 
@@ -95,6 +128,8 @@ SvFreePageAlingedPhysicalMemory (
                 allocated memory is executable.
 
     @param[in]  NumberOfBytes - A size of memory to allocate in byte.
+    @param[in]  PreferredNode - A NUMA node to allocate memory from when it
+                has enough free pages; or MM_ANY_NODE_OK.
 
     @result     A pointer to the allocated memory filled with zero; or NULL when
                 there is insufficient memory to allocate requested size.
@@ -107,7 +142,8 @@ _Must_inspect_result_
 static
 PVOID
 SvAllocateContiguousMemory (
-    _In_ SIZE_T NumberOfBytes
+    _In_ SIZE_T NumberOfBytes,
+    _In_ NODE_REQUIREMENT PreferredNode
     )
 {
     PVOID memory;
@@ -122,7 +158,7 @@ SvAllocateContiguousMemory (
                                                         highest,
                                                         boundary,
                                                         MmCached,
-                                                        MM_ANY_NODE_OK);
+                                                        PreferredNode);
     if (memory != nullptr)
     {
         RtlZeroMemory(memory, NumberOfBytes);
@@ -130,6 +166,56 @@ SvAllocateContiguousMemory (
     return memory;
 }
 
+#if SV_SLOT_REGIONS
+/*!
+    @brief      Tells whether a virtual address is mapped with a 2 MB or 1 GB
+                page.
+
+    @details    This function walks the page tables of the current address
+                space, which map the system address space the same way in
+                every process.
+
+    @param[in]  VirtualAddress - A system address to check.
+
+    @result     TRUE if VirtualAddress is mapped with a large page.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+BOOLEAN
+SvIsLargePageMapped (
+    _In_ PVOID VirtualAddress
+    )
+{
+    static const UINT64 presentFlag = 1ull << 0;
+    static const UINT64 pageSizeFlag = 1ull << 7;
+    static const UINT64 tableAddressMask = 0x000ffffffffff000ull;
+    UINT64 address, entry;
+    PUINT64 table;
+
+    address = reinterpret_cast<UINT64>(VirtualAddress);
+    entry = __readcr3();
+    for (ULONG shift = 39; shift >= 21; shift -= 9)
+    {
+        table = static_cast<PUINT64>(UtilVaFromPa(entry & tableAddressMask));
+        if (table == nullptr)
+        {
+            return FALSE;
+        }
+        entry = table[(address >> shift) & 0x1ff];
+        if ((entry & presentFlag) == 0)
+        {
+            return FALSE;
+        }
+        if ((shift != 39) && ((entry & pageSizeFlag) != 0))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+#endif
+
 /*!
     @brief      Frees memory allocated by SvAllocateContiguousMemory.
 
@@ -146,12 +232,79 @@ SvFreeContiguousMemory (
     MmFreeContiguousMemory(BaseAddress);
 }
 
+/*!
+    @brief          Counts a #VMEXIT for the statistics CPUID leaves.
+
+    @details        Counters are per processor and only updated here, in the
+                    host with interrupts disabled, so they need no atomics.
+
+    @param[inout]   VpData - Per processor data.
+    @param[in]      Mode - Whether L1 or L2 was running.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvCountVmExit (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ VMX_MODE Mode
+    )
+{
+    PSV_STATS stats;
+    UINT64 exitCode;
+    ULONG counter;
+
+    stats = &VpData->HostStackLayout.pProcessNestData->Stats;
+    if (CPU_MODE::VmxMode != VpData->HostStackLayout.pProcessNestData->CpuMode)
+    {
+        exitCode = VpData->GuestVmcb.ControlArea.ExitCode;
+    }
+    else
+    {
+        exitCode = GetCurrentVmcbGuest02(VpData)->ControlArea.ExitCode;
+    }
+
+    switch (exitCode)
+    {
+    case VMEXIT_CPUID:
+        counter = SV_STATS_CPUID_EXITS;
+        break;
+    case VMEXIT_MSR:
+        counter = SV_STATS_MSR_EXITS;
+        break;
+    case VMEXIT_VMRUN:
+        counter = SV_STATS_VMRUN_EXITS;
+        break;
+    case VMEXIT_VMMCALL:
+        counter = SV_STATS_VMMCALL_EXITS;
+        break;
+    case VMEXIT_NPF:
+        counter = SV_STATS_NPF_EXITS;
+        break;
+    case VMEXIT_IOIO:
+        counter = SV_STATS_IOIO_EXITS;
+        break;
+    default:
+        counter = SV_STATS_OTHER_EXITS;
+        break;
+    }
+
+    stats->Counters[SV_STATS_TOTAL_EXITS]++;
+    stats->Counters[counter]++;
+    if (Mode == VMX_MODE::GuestMode)
+    {
+        stats->Counters[SV_STATS_L2_EXITS]++;
+    }
+}
+
 /*!
     @brief          Handles #VMEXIT due to execution of the CPUID instructions.
 
     @details        This function returns unmodified results of the CPUID
                     instruction, except for few cases to indicate presence of
-                    the hypervisor, and to process an unload request.
+                    the hypervisor, and to process an unload request. Results
+                    are served from a per processor snapshot taken before
+                    virtualization, and CPUID is executed only for leaves not
+                    in it.
 
                     CPUID leaf 0x40000000 and 0x40000001 return modified values
                     to conform to the hypervisor interface to some extent. See
@@ -173,57 +326,26 @@ SvHandleCpuid (
     int registers[4];   // EAX, EBX, ECX, and EDX
     int leaf, subLeaf;
     SEGMENT_ATTRIBUTE attribute;
+    BOOLEAN cached;
 
     //
-    // Execute CPUID as requested.
+    // Look up the result in the per processor snapshot, which already has the
+    // hypervisor's changes applied. See SvmCpuid.cpp.
     //
     leaf = static_cast<int>(GuestContext->VpRegs->Rax);
     subLeaf = static_cast<int>(GuestContext->VpRegs->Rcx);
-    __cpuidex(registers, leaf, subLeaf);
+    cached = SvCpuidQuery(VpData, leaf, subLeaf, registers);
 
-    switch (leaf)
+    if ((leaf == CPUID_UNLOAD_SIMPLE_SVM) && (subLeaf == CPUID_UNLOAD_SIMPLE_SVM))
     {
-    case CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS:
-        //
-        // Indicate presence of a hypervisor by setting the bit that are
-        // reserved for use by hypervisor to indicate guest status. See "CPUID
-        // Fn0000_0001_ECX Feature Identifiers".
-        //
-        registers[3] |= CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT;
-        break;
-    case CPUID_HV_VENDOR_AND_MAX_FUNCTIONS:
-        //
-        // Return a maximum supported hypervisor CPUID leaf range and a vendor
-        // ID signature as required by the spec.
         //
-        registers[0] = CPUID_HV_MAX;
-        registers[1] = 'NmvS';  // "SvmNest     "
-        registers[2] = ' tse';
-        registers[3] = '    ';
-        break;
-    case CPUID_HV_INTERFACE:
-        //
-        // Return non Hv#1 value. This indicate that the SimpleSvm does NOT
-        // conform to the Microsoft hypervisor interface.
+        // Unload itself if the request is from the kernel mode.
         //
-        registers[0] = '0#vH';  // Hv#0
-        registers[1] = registers[2] = registers[3] = 0;
-        break;
-    case CPUID_UNLOAD_SIMPLE_SVM:
-        if (subLeaf == CPUID_UNLOAD_SIMPLE_SVM)
+        attribute.AsUInt16 = VpData->GuestVmcb.StateSaveArea.SsAttrib;
+        if (attribute.Fields.Dpl == DPL_SYSTEM)
         {
-            //
-            // Unload itself if the request is from the kernel mode.
-            //
-            attribute.AsUInt16 = VpData->GuestVmcb.StateSaveArea.SsAttrib;
-            if (attribute.Fields.Dpl == DPL_SYSTEM)
-            {
-                GuestContext->ExitVm = EXIT_REASON::EXIT_EXIT;
-            }
-            break;
+            GuestContext->ExitVm = EXIT_REASON::EXIT_EXIT;
         }
-    default:
-        break;
     }
 
     //
@@ -243,9 +365,10 @@ SvHandleCpuid (
     //
     // This code is not exception and violating this rule. The reasons for this
     // code are to demonstrate a bad example, and simply show that the SimpleSvm
-    // is functioning for a test purpose.
+    // is functioning for a test purpose. Only results not served from the
+    // snapshot are printed so that the common path stays a table lookup.
     //
-    if (KeGetCurrentIrql() <= DISPATCH_LEVEL)
+    if ((cached == FALSE) && (KeGetCurrentIrql() <= DISPATCH_LEVEL))
     {
         SvDebugPrint("[SvmNest] CPUID: %08x-%08x : %08x %08x %08x %08x\n",
                      leaf,
@@ -259,8 +382,7 @@ SvHandleCpuid (
     //
     // Then, advance RIP to "complete" the instruction.
     //
-    VpData->GuestVmcb.StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip;
-	//VpData->GuestVmcb.StateSaveArea.Rip += 2;
+    SvAdvanceGuestRip(VpData, &VpData->GuestVmcb);
 }
 
 _IRQL_requires_same_
@@ -341,6 +463,10 @@ SvHandleVmExit (
     )
 {
     GUEST_CONTEXT guestContext;
+    VMX_MODE modeBefore, modeAfter;
+    UINT64 entryTsc;
+
+    entryTsc = __rdtsc();
 
     //
     // Load some host state that are not loaded on #VMEXIT.
@@ -357,6 +483,13 @@ SvHandleVmExit (
 
     NT_ASSERT(VpData->HostStackLayout.Reserved1 == MAXUINT64);
 
+    //
+    // Count this #VMEXIT for the statistics CPUID leaves before handling it,
+    // so that a sample includes the exit that took it.
+    //
+    modeBefore = VmxGetVmxMode(VmmpGetVcpuVmx(VpData));
+    SvCountVmExit(VpData, modeBefore);
+
     //
     // Handle #VMEXIT according with its reason.
     //
@@ -387,7 +520,10 @@ SvHandleVmExit (
 			SvHandleVmmcall(VpData, &guestContext);
 			break;
 		case VMEXIT_NPF:
-			SV_DEBUG_BREAK();
+			SvHandleNestedPageFault(VpData, &guestContext);
+			break;
+		case VMEXIT_IOIO:
+			SvHandleIoio(VpData, &guestContext);
 			break;
 		default:
 			SV_DEBUG_BREAK();
@@ -423,6 +559,9 @@ SvHandleVmExit (
         case VMEXIT_EXCEPTION_BP:
             SvHandleBreakPointExceptionNest(VpData, &guestContext);
             break;
+		case VMEXIT_IOIO:
+			SvHandleIoioNest(VpData, &guestContext);
+			break;
 		default:
 			SV_DEBUG_BREAK();
 #pragma prefast(disable : __WARNING_USE_OTHER_FUNCTION, "Unrecoverble path.")
@@ -430,6 +569,12 @@ SvHandleVmExit (
 		}
 	}
 
+    //
+    // Restore the guest's extended state if a handler used extended
+    // registers. Code below this point must not.
+    //
+    SvXstateRelease(VpData);
+
     //
     // Terminate the SimpleSvm hypervisor if requested.
     //
@@ -444,10 +589,19 @@ SvHandleVmExit (
         //  EDX:EAX = An address of per processor data to be freed by the caller
         //
         guestContext.VpRegs->Rax = reinterpret_cast<UINT64>(VpData) & MAXUINT32;
-        guestContext.VpRegs->Rbx = VpData->GuestVmcb.ControlArea.NRip;
+        guestContext.VpRegs->Rbx = VpData->GuestVmcb.StateSaveArea.Rip;
         guestContext.VpRegs->Rcx = VpData->GuestVmcb.StateSaveArea.Rsp;
         guestContext.VpRegs->Rdx = reinterpret_cast<UINT64>(VpData) >> 32;
 
+        //
+        // Put back the guest's LSTAR if the syscall hook is still on. The
+        // processor must never run MyKiSystemCall64 without the hypervisor:
+        // the original value lives only in ProcessorNestData, which is freed
+        // once this returns, and the driver may be unloaded or the system
+        // may save LSTAR for sleep right after.
+        //
+        VmmpHandleVmCallUnHookSyscall(VpData);
+
         //
         // Load guest state (currently host state is loaded).
         //
@@ -471,6 +625,19 @@ SvHandleVmExit (
         goto Exit;
     }
 
+    //
+    // Count emulated transitions between L1 and L2.
+    //
+    modeAfter = VmxGetVmxMode(VmmpGetVcpuVmx(VpData));
+    if ((modeBefore == VMX_MODE::RootMode) && (modeAfter == VMX_MODE::GuestMode))
+    {
+        VpData->HostStackLayout.pProcessNestData->Stats.Counters[SV_STATS_NESTED_ENTRIES]++;
+    }
+    else if ((modeBefore == VMX_MODE::GuestMode) && (modeAfter == VMX_MODE::RootMode))
+    {
+        VpData->HostStackLayout.pProcessNestData->Stats.Counters[SV_STATS_NESTED_EXITS]++;
+    }
+
     //
     // Reflect potentially updated guest's RAX to VMCB. Again, unlike other GPRs,
     // RAX is loaded from VMCB on VMRUN.
@@ -485,6 +652,14 @@ SvHandleVmExit (
 		pVmcbGuest02va->StateSaveArea.Rax = guestContext.VpRegs->Rax;
 	}
 
+    //
+    // Account time spent in the host for this #VMEXIT. The transitions
+    // themselves are not included, but they are the same for every exit,
+    // while this part depends on how the handlers and their data are laid out.
+    //
+    VpData->HostStackLayout.pProcessNestData->Stats.Counters[SV_STATS_EXIT_CYCLES] +=
+        __rdtsc() - entryTsc;
+
 Exit:
     NT_ASSERT(VpData->HostStackLayout.Reserved1 == MAXUINT64);
     return guestContext.ExitVm;
@@ -610,7 +785,7 @@ SvPrepareForVirtualization (
     )
 {
     DESCRIPTOR_TABLE_REGISTER gdtr, idtr;
-    PHYSICAL_ADDRESS guestVmcbPa, hostVmcbPa, hostStateAreaPa, pml4BasePa, msrpmPa;
+    PHYSICAL_ADDRESS guestVmcbPa, hostVmcbPa, hostStateAreaPa, pml4BasePa, msrpmPa, iopmPa;
 
     //
     // Capture the current GDTR and IDTR to use as initial values of the guest
@@ -622,13 +797,16 @@ SvPrepareForVirtualization (
     guestVmcbPa = MmGetPhysicalAddress(&VpData->GuestVmcb);
     hostVmcbPa = MmGetPhysicalAddress(&VpData->HostVmcb);
     hostStateAreaPa = MmGetPhysicalAddress(&VpData->HostStateArea);
-    pml4BasePa = MmGetPhysicalAddress(&SharedVpData->Pml4Entries);
+    pml4BasePa = MmGetPhysicalAddress(
+        &SharedVpData->NestedPageTables[VpData->HostStackLayout.pProcessNestData->NumaNode]->Pml4Entries);
     msrpmPa = MmGetPhysicalAddress(SharedVpData->MsrPermissionsMap);
+    iopmPa = MmGetPhysicalAddress(SharedVpData->IoPermissionsMap);
 
     VpData->HostStackLayout.pProcessNestData->vcpu_vmx = NULL;
     VpData->HostStackLayout.pProcessNestData->CpuMode = ProtectedMode;
     VpData->HostStackLayout.pProcessNestData->GuestMsrEFER.QuadPart = __readmsr((ULONGLONG)Msr::kIa32Efer);
     VpData->HostStackLayout.pProcessNestData->GuestSvmHsave12.QuadPart = 0;
+    VpData->HostStackLayout.pProcessNestData->OriginalMsrLstar = 0;
     //InterlockedIncrement(&VpData->HostStackLayout.pProcessNestData->shared_data->reference_count);
 
     //
@@ -659,6 +837,13 @@ SvPrepareForVirtualization (
     VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SVM_INTERCEPT_MISC1_MSR_PROT;
     VpData->GuestVmcb.ControlArea.MsrpmBasePa = msrpmPa.QuadPart;
 
+    //
+    // Likewise, trigger #VMEXIT on I/O port access as configured by the IOPM,
+    // which intercepts the ports registered with SvRegisterIoHandler only.
+    //
+    VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SVM_INTERCEPT_MISC1_IOIO_PROT;
+    VpData->GuestVmcb.ControlArea.IopmBasePa = iopmPa.QuadPart;
+
     //
     // Specify guest's address space ID (ASID). TLB is maintained by the ID for
     // guests. Use the same value for all processors since all of them run a
@@ -743,7 +928,6 @@ SvPrepareForVirtualization (
     // Store data to stack so that the host (hypervisor) can use those values.
     //
     VpData->HostStackLayout.Reserved1 = MAXUINT64;
-	//VpData->HostStackLayout.OriginalMsrLstar = 0;
     VpData->HostStackLayout.SharedVpData = SharedVpData;
     VpData->HostStackLayout.Self = VpData;
     VpData->HostStackLayout.HostVmcbPa = hostVmcbPa.QuadPart;
@@ -763,12 +947,446 @@ SvPrepareForVirtualization (
     __svm_vmsave(hostVmcbPa.QuadPart);
 }
 
+/*!
+    @brief      Gets the NUMA node a processor belongs to.
+
+    @param[in]  ProcessorIndex - A system-wide processor index.
+    @param[out] Node - A pointer to receive the node number.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvGetProcessorNode (
+    _In_ ULONG ProcessorIndex,
+    _Out_ PUSHORT Node
+    )
+{
+    NTSTATUS status;
+    PROCESSOR_NUMBER processorNumber;
+    GROUP_AFFINITY nodeAffinity;
+    USHORT node, highestNode;
+
+    *Node = 0;
+
+    status = KeGetProcessorNumberFromIndex(ProcessorIndex, &processorNumber);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    highestNode = KeQueryHighestNodeNumber();
+    for (node = 0; node <= highestNode; node++)
+    {
+        KeQueryNodeActiveAffinity(node, &nodeAffinity, nullptr);
+        if ((nodeAffinity.Group == processorNumber.Group) &&
+            ((nodeAffinity.Mask & (1ULL << processorNumber.Number)) != 0))
+        {
+            *Node = node;
+            return STATUS_SUCCESS;
+        }
+    }
+    return STATUS_NOT_FOUND;
+}
+
+/*!
+    @brief      Frees per processor data allocated by SvAllocateProcessorData.
+
+    @details    This function must be called after all processors are
+                de-virtualized or when none of them has been virtualized. It
+                frees partially allocated data as well.
+
+    @param[inout] SharedVpData - Shared data holding per processor data.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvFreeProcessorData (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    PVIRTUAL_PROCESSOR_DATA vpData;
+    USHORT node;
+
+    //
+    // Free slots allocated on their own first, as their node is read from
+    // slots, which may be in regions freed below.
+    //
+    if (SharedVpData->VpDataList != nullptr)
+    {
+        for (ULONG i = 0; i < SharedVpData->NumberOfProcessors; i++)
+        {
+            vpData = SharedVpData->VpDataList[i];
+            if (vpData == nullptr)
+            {
+                continue;
+            }
+
+            node = vpData->HostStackLayout.pProcessNestData->NumaNode;
+            if ((SharedVpData->SlotRegions == nullptr) ||
+                (node >= SharedVpData->NumberOfSlotRegions) ||
+                (SharedVpData->SlotRegions[node].Base == nullptr))
+            {
+                SvFreeContiguousMemory(vpData);
+            }
+        }
+
+        ExFreePoolWithTag(SharedVpData->VpDataList, 'MVSS');
+        SharedVpData->VpDataList = nullptr;
+        SharedVpData->NumberOfProcessors = 0;
+    }
+
+    if (SharedVpData->SlotRegions != nullptr)
+    {
+        for (ULONG i = 0; i < SharedVpData->NumberOfSlotRegions; i++)
+        {
+            if (SharedVpData->SlotRegions[i].Allocation != nullptr)
+            {
+                SvFreeContiguousMemory(SharedVpData->SlotRegions[i].Allocation);
+            }
+        }
+
+        ExFreePoolWithTag(SharedVpData->SlotRegions, 'MVSS');
+        SharedVpData->SlotRegions = nullptr;
+        SharedVpData->NumberOfSlotRegions = 0;
+    }
+}
+
+/*!
+    @brief      Frees nested page tables built by SvBuildNestedPageTables.
+
+    @param[inout] SharedVpData - Shared data holding nested page tables.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvFreeNestedPageTables (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    if (SharedVpData->NestedPageTables == nullptr)
+    {
+        return;
+    }
+
+    for (ULONG node = 0; node < SharedVpData->NumberOfNodes; node++)
+    {
+        if (SharedVpData->NestedPageTables[node] != nullptr)
+        {
+            SvFreeContiguousMemory(SharedVpData->NestedPageTables[node]);
+        }
+    }
+
+    ExFreePoolWithTag(SharedVpData->NestedPageTables, 'MVSS');
+    SharedVpData->NestedPageTables = nullptr;
+    SharedVpData->NumberOfNodes = 0;
+}
+
+/*!
+    @brief      Frees shared data and everything it holds.
+
+    @param[in]  SharedVpData - Shared data to free.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvFreeSharedData (
+    _In_ __drv_freesMem(Mem) PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    SvFreeProcessorData(SharedVpData);
+    SvFreeNestedPageTables(SharedVpData);
+    if (SharedVpData->MsrPermissionsMap != nullptr)
+    {
+        SvFreeContiguousMemory(SharedVpData->MsrPermissionsMap);
+    }
+    if (SharedVpData->IoPermissionsMap != nullptr)
+    {
+        SvFreeContiguousMemory(SharedVpData->IoPermissionsMap);
+    }
+    SvFreePageAlingedPhysicalMemory(SharedVpData);
+}
+
+/*!
+    @brief      Checks if kept nested page tables serve current processors.
+
+    @details    Nested page tables identity map a fixed range of guest physical
+                addresses and do not depend on the physical memory layout.
+                What they depend on is the node layout: there is one replica
+                for each node that had processors when they were built, and a
+                processor uses the replica of its node.
+
+    @param[in]  SharedVpData - Shared data holding nested page tables.
+
+    @result     TRUE when every node with processors has a replica.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvAreNestedPageTablesReusable (
+    _In_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    GROUP_AFFINITY nodeAffinity;
+    USHORT highestNode;
+
+    highestNode = KeQueryHighestNodeNumber();
+    if (highestNode >= SharedVpData->NumberOfNodes)
+    {
+        return FALSE;
+    }
+
+    for (USHORT node = 0; node <= highestNode; node++)
+    {
+        KeQueryNodeActiveAffinity(node, &nodeAffinity, nullptr);
+        if ((nodeAffinity.Mask != 0) &&
+            (SharedVpData->NestedPageTables[node] == nullptr))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*!
+    @brief      Takes shared data kept by SvSuspendAllProcessors.
+
+    @details    The kept nested page tables and MSRPM are reused only when the
+                nested page tables still have a replica for each node with
+                processors; otherwise, they are freed and must be built again.
+
+    @result     Shared data to reuse; or NULL.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+PSHARED_VIRTUAL_PROCESSOR_DATA
+SvTakeSuspendedSharedData (
+    VOID
+    )
+{
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+
+    sharedVpData = g_SuspendedSharedVpData;
+    g_SuspendedSharedVpData = nullptr;
+    if (sharedVpData == nullptr)
+    {
+        return nullptr;
+    }
+
+    if (SvAreNestedPageTablesReusable(sharedVpData) == FALSE)
+    {
+        SvDebugPrint("[SvmNest] Node layout changed. Rebuilding shared data.\n");
+        SvFreeSharedData(sharedVpData);
+        return nullptr;
+    }
+
+    SvDebugPrint("[SvmNest] Reusing nested page tables and MSRPM.\n");
+    return sharedVpData;
+}
+
+/*!
+    @brief      Allocates per processor data on the node of each processor.
+
+    @details    Every #VMEXIT runs on the host stack and accesses the VMCBs,
+                the host state area, ProcessorNestData and, while an L1
+                hypervisor runs, VCPUVMX. All of them for one processor are
+                laid out in one PROCESSOR_SLOT, and the slots of processors on
+                the same node are carved out of one region allocated from that
+                node in whole large pages, so that the memory manager can map
+                it with large pages and the exit path needs few TLB entries.
+                The region starts at a 2 MB aligned physical address: when the
+                allocation is not aligned, it is made again 2 MB - 4 KB larger
+                and the region starts at the first aligned address in it.
+                Whether it ended up mapped with large pages is recorded in
+                the region and in each ProcessorNestData.
+                If a region cannot be allocated, slots of the node are
+                allocated one by one from the node instead. Memory on another
+                node is used only when the node is out of free pages. The node
+                is recorded in ProcessorNestData.
+
+                On failure, the caller must free what has been allocated with
+                SvFreeProcessorData.
+
+    @param[inout] SharedVpData - Shared data to hold per processor data.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvAllocateProcessorData (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    NTSTATUS status;
+    ULONG numOfProcessors, numOfNodes;
+    USHORT node;
+    PSLOT_REGION region;
+    PPROCESSOR_SLOT slot;
+    ProcessorNestData* nestData;
+
+    numOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    numOfNodes = static_cast<ULONG>(KeQueryHighestNodeNumber()) + 1;
+
+#pragma prefast(disable : 28118 __WARNING_ERROR, "FP due to POOL_NX_OPTIN.")
+    SharedVpData->VpDataList = reinterpret_cast<PVIRTUAL_PROCESSOR_DATA*>(
+        ExAllocatePoolWithTag(NonPagedPool,
+                              sizeof(PVIRTUAL_PROCESSOR_DATA) * numOfProcessors,
+                              'MVSS'));
+    if (SharedVpData->VpDataList == nullptr)
+    {
+        SvDebugPrint("[SvmNest] Insufficient memory.\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(SharedVpData->VpDataList,
+                  sizeof(PVIRTUAL_PROCESSOR_DATA) * numOfProcessors);
+    SharedVpData->NumberOfProcessors = numOfProcessors;
+
+    SharedVpData->SlotRegions = reinterpret_cast<PSLOT_REGION>(
+        ExAllocatePoolWithTag(NonPagedPool,
+                              sizeof(SLOT_REGION) * numOfNodes,
+                              'MVSS'));
+    if (SharedVpData->SlotRegions == nullptr)
+    {
+        SvDebugPrint("[SvmNest] Insufficient memory.\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(SharedVpData->SlotRegions, sizeof(SLOT_REGION) * numOfNodes);
+    SharedVpData->NumberOfSlotRegions = numOfNodes;
+
+#if SV_SLOT_REGIONS
+    //
+    // Allocate a region for each node with processors.
+    //
+    for (node = 0; node < numOfNodes; node++)
+    {
+        USHORT numOfProcessorsInNode;
+        GROUP_AFFINITY nodeAffinity;
+        SIZE_T regionSize;
+        ULONG64 regionPa;
+
+        KeQueryNodeActiveAffinity(node, &nodeAffinity, &numOfProcessorsInNode);
+        if (numOfProcessorsInNode == 0)
+        {
+            continue;
+        }
+
+        region = &SharedVpData->SlotRegions[node];
+        regionSize = ROUND_TO_SIZE(numOfProcessorsInNode * sizeof(PROCESSOR_SLOT),
+                                   SV_LARGE_PAGE_SIZE);
+        region->Allocation = SvAllocateContiguousMemory(regionSize, node);
+        if ((region->Allocation != nullptr) &&
+            ((MmGetPhysicalAddress(region->Allocation).QuadPart &
+              (SV_LARGE_PAGE_SIZE - 1)) != 0))
+        {
+            SvFreeContiguousMemory(region->Allocation);
+            region->Allocation = SvAllocateContiguousMemory(
+                regionSize + SV_LARGE_PAGE_SIZE - PAGE_SIZE, node);
+        }
+        if (region->Allocation == nullptr)
+        {
+            SvDebugPrint("[SvmNest] No region on node %hu. Allocating slots one by one.\n",
+                         node);
+            continue;
+        }
+
+        regionPa = MmGetPhysicalAddress(region->Allocation).QuadPart;
+        region->Base = static_cast<PUCHAR>(region->Allocation) +
+            (ROUND_TO_SIZE(regionPa, SV_LARGE_PAGE_SIZE) - regionPa);
+        NT_ASSERT((MmGetPhysicalAddress(region->Base).QuadPart &
+                   (SV_LARGE_PAGE_SIZE - 1)) == 0);
+        region->SlotCount = static_cast<ULONG>(regionSize / sizeof(PROCESSOR_SLOT));
+
+        region->LargePages = TRUE;
+        for (SIZE_T offset = 0; offset < regionSize; offset += SV_LARGE_PAGE_SIZE)
+        {
+            if (!SvIsLargePageMapped(static_cast<PUCHAR>(region->Base) + offset))
+            {
+                region->LargePages = FALSE;
+                break;
+            }
+        }
+        SvDebugPrint("[SvmNest] Region on node %hu is %smapped with large pages.\n",
+                     node,
+                     region->LargePages ? "" : "not ");
+    }
+#endif
+
+    for (ULONG i = 0; i < numOfProcessors; i++)
+    {
+        status = SvGetProcessorNode(i, &node);
+        if (!NT_SUCCESS(status))
+        {
+            SvDebugPrint("[SvmNest] Node of processor %lu is unknown.\n", i);
+            return status;
+        }
+
+        region = &SharedVpData->SlotRegions[node];
+        if (region->Base != nullptr)
+        {
+            NT_ASSERT(region->SlotsUsed < region->SlotCount);
+            slot = reinterpret_cast<PPROCESSOR_SLOT>(region->Base) + region->SlotsUsed;
+            region->SlotsUsed++;
+        }
+        else
+        {
+            slot = reinterpret_cast<PPROCESSOR_SLOT>(
+                SvAllocateContiguousMemory(sizeof(PROCESSOR_SLOT), node));
+            if (slot == nullptr)
+            {
+                SvDebugPrint("[SvmNest] Insufficient memory.\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        }
+
+        nestData = reinterpret_cast<ProcessorNestData*>(slot->NestData);
+        slot->VpData.HostStackLayout.pProcessNestData = nestData;
+        nestData->NumaNode = node;
+        nestData->LargePageSlot = (region->Base != nullptr) && region->LargePages;
+        nestData->CpuidCache = reinterpret_cast<PSV_CPUID_CACHE>(slot->CpuidCache);
+        nestData->FetchCache = reinterpret_cast<PSV_FETCH_CACHE>(slot->FetchCache);
+        nestData->GuestXsaveArea = slot->GuestXsaveArea;
+        SharedVpData->VpDataList[i] = &slot->VpData;
+
+        //
+        // Set up the arena and slab caches host code allocates from while
+        // handling #VMEXIT, where the pool cannot be used.
+        //
+        SvArenaInitialize(&nestData->HostArena, slot->HostArena, SV_HOST_ARENA_PAGES);
+        SvSlabInitialize(&nestData->HostSlabs[HostSlabVcpuVmx],
+                         &nestData->HostArena,
+                         sizeof(VCPUVMX));
+
+        SvDebugPrint("[SvmNest] Processor %lu uses memory on node %hu.\n",
+                     i,
+                     node);
+    }
+    return STATUS_SUCCESS;
+}
+
 /*!
     @brief      Virtualize the current processor.
 
     @details    This function enables SVM, initialize VMCB with the current
                 processor state, and enters the guest mode on the current
-                processor.
+                processor. Per processor data must have been allocated with
+                SvAllocateProcessorData.
 
     @param[in]  Context - A pointer of share data.
 
@@ -788,11 +1406,10 @@ SvVirtualizeProcessor (
     PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
     PVIRTUAL_PROCESSOR_DATA vpData;
     CONTEXT contextRecord;
+    ULONG processorIndex;
 
     SV_DEBUG_BREAK();
 
-    vpData = nullptr;
-
     if (!ARGUMENT_PRESENT(Context))
     {
         status = STATUS_INVALID_PARAMETER_1;
@@ -800,29 +1417,24 @@ SvVirtualizeProcessor (
     }
 
     //
-    // Allocate per processor data.
+    // Take per processor data allocated on the node of this processor.
     //
-#pragma prefast(push)
-#pragma prefast(disable : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
-    vpData = reinterpret_cast<PVIRTUAL_PROCESSOR_DATA>(
-            SvAllocatePageAlingedPhysicalMemory(sizeof(VIRTUAL_PROCESSOR_DATA)));
-#pragma prefast(pop)
-    if (vpData == nullptr)
+    sharedVpData = reinterpret_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context);
+    processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+    if (processorIndex >= sharedVpData->NumberOfProcessors)
     {
-        SvDebugPrint("[SvmNest] Insufficient memory.\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
+        SvDebugPrint("[SvmNest] No per processor data for processor %lu.\n",
+                     processorIndex);
+        status = STATUS_INVALID_PARAMETER;
         goto Exit;
     }
+    vpData = sharedVpData->VpDataList[processorIndex];
 
-    vpData->HostStackLayout.pProcessNestData = reinterpret_cast<ProcessorNestData *>
-        (SvAllocatePageAlingedPhysicalMemory(PAGE_SIZE));
-    
-    if (nullptr == vpData->HostStackLayout.pProcessNestData)
-    {
-        SvDebugPrint("[SvmNest] error ProcessNestData");
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Exit;
-    }
+    //
+    // Snapshot CPUID results served to the guest while this processor is not
+    // virtualized yet. Some of them, such as APIC IDs, differ per processor.
+    //
+    SvCpuidCaptureCache(vpData->HostStackLayout.pProcessNestData->CpuidCache);
 
     //
     // Capture the current RIP, RSP, RFLAGS, and segment selectors. This
@@ -843,7 +1455,6 @@ SvVirtualizeProcessor (
     if (SvIsSimpleSvmHypervisorInstalled() == FALSE)
     {
         SvDebugPrint("[SvmNest] Attempting to virtualize the processor.\n");
-        sharedVpData = reinterpret_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context);
 
 	  //
 	  // Enable SVM by setting EFER.SVME. It has already been verified that this
@@ -873,114 +1484,6 @@ SvVirtualizeProcessor (
     status = STATUS_SUCCESS;
 
 Exit:
-    if ((!NT_SUCCESS(status)) && (vpData != nullptr))
-    {
-        //
-        // Frees per processor data if allocated and this function is
-        // unsuccessful.
-        //
-        SvFreePageAlingedPhysicalMemory(vpData);
-    }
-    return status;
-}
-
-/*!
-    @brief      Execute a callback on all processors one-by-one.
-
-    @details    This function execute Callback with Context as a parameter for
-                each processor on the current IRQL. If the callback returned
-                non-STATUS_SUCCESS value or any error occurred, this function
-                stops execution of the callback and returns the error code.
-
-                When NumOfProcessorCompleted is not NULL, this function always
-                set a number of processors that successfully executed the
-                callback.
-
-    @param[in]  Callback - A function to execute on all processors.
-    @param[in]  Context - A parameter to pass to the callback.
-    @param[out] NumOfProcessorCompleted - A pointer to receive a number of
-                processors executed the callback successfully.
-
-    @result     STATUS_SUCCESS when Callback executed and returned STATUS_SUCCESS
-	            on all processors; otherwise, an appropriate error code.
- */
-_IRQL_requires_max_(APC_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
-_IRQL_requires_same_
-_Check_return_
-static
-NTSTATUS
-SvExecuteOnEachProcessor (
-    _In_ NTSTATUS (*Callback)(PVOID),
-    _In_opt_ PVOID Context,
-    _Out_opt_ PULONG NumOfProcessorCompleted
-    )
-{
-    NTSTATUS status;
-    ULONG i, numOfProcessors;
-    PROCESSOR_NUMBER processorNumber;
-    GROUP_AFFINITY affinity, oldAffinity;
-
-    status = STATUS_SUCCESS;
-
-    //
-    // Get a number of processors on this system.
-    //
-    numOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
-
-    for (i = 0; i < numOfProcessors; i++)
-    {
-        //
-        // Convert from an index to a processor number.
-        //
-        status = KeGetProcessorNumberFromIndex(i, &processorNumber);
-        if (!NT_SUCCESS(status))
-        {
-            goto Exit;
-        }
-
-        //
-        // Switch execution of this code to a processor #i.
-        //
-        affinity.Group = processorNumber.Group;
-        affinity.Mask = 1ULL << processorNumber.Number;
-        affinity.Reserved[0] = affinity.Reserved[1] = affinity.Reserved[2] = 0;
-        KeSetSystemGroupAffinityThread(&affinity, &oldAffinity);
-
-        //
-        // Execute the callback.
-        //
-        status = Callback(Context);
-
-        //
-        // Revert the previously executed processor.
-        //
-        KeRevertToUserGroupAffinityThread(&oldAffinity);
-
-        //
-        // Exit if the callback returned error.
-        //
-        if (!NT_SUCCESS(status))
-        {
-            goto Exit;
-        }
-    }
-
-Exit:
-    //
-    // i must be the same as the number of processors on the system when this
-    // function returns STATUS_SUCCESS;
-    //
-    NT_ASSERT(!NT_SUCCESS(status) || (i == numOfProcessors));
-
-    //
-    // Set a number of processors that successfully executed callback if the
-    // out parameter is present.
-    //
-    if (ARGUMENT_PRESENT(NumOfProcessorCompleted))
-    {
-        *NumOfProcessorCompleted = i;
-    }
     return status;
 }
 
@@ -988,8 +1491,8 @@ Exit:
     @brief      De-virtualize the current processor if virtualized.
 
     @details    This function asks SimpleSVM hypervisor to deactivate itself
-                through CPUID with a back-door function id and frees per
-                processor data if it is returned. If the SimpleSvm is not
+                through CPUID with a back-door function id. Per processor data
+                is freed later by SvFreeProcessorData. If the SimpleSvm is not
                 installed, this function does nothing.
 
     @param[in]  Context - An out pointer to receive an address of shared data.
@@ -1038,17 +1541,11 @@ SvDevirtualizeProcessor (
     NT_ASSERT(vpData->HostStackLayout.Reserved1 == MAXUINT64);
 
     //
-    // Save an address of shared data, then free per processor data.
+    // Save an address of shared data. Per processor data is found through it
+    // and freed at PASSIVE_LEVEL once all processors are de-virtualized.
     //
     sharedVpDataPtr = reinterpret_cast<PSHARED_VIRTUAL_PROCESSOR_DATA*>(Context);
     *sharedVpDataPtr = vpData->HostStackLayout.SharedVpData;
-    
-    if (vpData->HostStackLayout.pProcessNestData)
-    {
-        SvFreePageAlingedPhysicalMemory(vpData->HostStackLayout.pProcessNestData);
-        vpData->HostStackLayout.pProcessNestData = NULL;
-    }
-    SvFreePageAlingedPhysicalMemory(vpData);
 
 Exit:
     return STATUS_SUCCESS;
@@ -1059,7 +1556,10 @@ Exit:
 
     @details    This function execute a callback to de-virtualize a processor on
                 all processors, and frees shared data when the callback returned
-                its pointer from a hypervisor.
+                its pointer from a hypervisor. Shared data kept by
+                SvSuspendAllProcessors is freed as well. UtilForEachProcessor
+                visits every processor even when it cannot allocate, so no
+                processor still uses shared data once it is freed.
  */
 _IRQL_requires_max_(APC_LEVEL)
 _IRQL_requires_min_(PASSIVE_LEVEL)
@@ -1076,14 +1576,55 @@ SvDevirtualizeAllProcessors (
     //
     // De-virtualize all processors and free shared data when returned.
     //
-    NT_VERIFY(NT_SUCCESS(SvExecuteOnEachProcessor(SvDevirtualizeProcessor,
-                                                  &sharedVpData,
-                                                  nullptr)));
+    NT_VERIFY(NT_SUCCESS(UtilForEachProcessor(SvDevirtualizeProcessor,
+                                              &sharedVpData)));
     if (sharedVpData != nullptr)
     {
-        SvFreeContiguousMemory(sharedVpData->MsrPermissionsMap);
-        SvFreePageAlingedPhysicalMemory(sharedVpData);
+        SvFreeSharedData(sharedVpData);
+    }
+
+    if (g_SuspendedSharedVpData != nullptr)
+    {
+        SvFreeSharedData(g_SuspendedSharedVpData);
+        g_SuspendedSharedVpData = nullptr;
+    }
+}
+
+/*!
+    @brief      De-virtualize all processors for the system to sleep.
+
+    @details    Unlike SvDevirtualizeAllProcessors, this function keeps nested
+                page tables and MSRPM so that SvVirtualizeAllProcessors can
+                reuse them on resume instead of building them again; only per
+                processor data is freed. Per processor state, including the
+                original LSTAR of the syscall hook, is not kept; the caller
+                suspends the hook with SyscallHookSuspend first. As with
+                SvDevirtualizeAllProcessors, every processor is devirtualized
+                even under low memory.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvSuspendAllProcessors (
+    VOID
+    )
+{
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+
+    sharedVpData = nullptr;
+
+    NT_VERIFY(NT_SUCCESS(UtilForEachProcessor(SvDevirtualizeProcessor,
+                                              &sharedVpData)));
+    if (sharedVpData == nullptr)
+    {
+        return;
     }
+
+    SvFreeProcessorData(sharedVpData);
+
+    NT_ASSERT(g_SuspendedSharedVpData == nullptr);
+    g_SuspendedSharedVpData = sharedVpData;
 }
 
 /*!
@@ -1221,13 +1762,13 @@ SvBuildMsrPermissionsMap (
                 translation is built. 1GB huge pages are not used due to VMware
                 not supporting this feature.
 
-    @param[out] SharedVpData - Out buffer to build nested page tables.
+    @param[out] NestedPageTables - Out buffer to build nested page tables.
  */
 _IRQL_requires_same_
 static
 VOID
-SvBuildNestedPageTables (
-    _Out_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+SvBuildNestedPageTablesReplica (
+    _Out_ PNESTED_PAGE_TABLES NestedPageTables
     )
 {
     ULONG64 pdpBasePa, pdeBasePa, translationPa;
@@ -1237,8 +1778,8 @@ SvBuildNestedPageTables (
     // 512GB physical memory. PFN points to a base physical address of the page
     // directory pointer table.
     //
-    pdpBasePa = MmGetPhysicalAddress(&SharedVpData->PdpEntries).QuadPart;
-    SharedVpData->Pml4Entries[0].Fields.PageFrameNumber = pdpBasePa >> PAGE_SHIFT;
+    pdpBasePa = MmGetPhysicalAddress(&NestedPageTables->PdpEntries).QuadPart;
+    NestedPageTables->Pml4Entries[0].Fields.PageFrameNumber = pdpBasePa >> PAGE_SHIFT;
 
     //
     // The US (User) bit of all nested page table entries to be translated
@@ -1254,9 +1795,9 @@ SvBuildNestedPageTables (
     // based on guest page tables, and nested page tables. See "Nested versus
     // Guest Page Faults, Fault Ordering" for more details.
     //
-    SharedVpData->Pml4Entries[0].Fields.Valid = 1;
-    SharedVpData->Pml4Entries[0].Fields.Write = 1;
-    SharedVpData->Pml4Entries[0].Fields.User = 1;
+    NestedPageTables->Pml4Entries[0].Fields.Valid = 1;
+    NestedPageTables->Pml4Entries[0].Fields.Write = 1;
+    NestedPageTables->Pml4Entries[0].Fields.User = 1;
 
     //
     // One PML4 entry controls 512 page directory pointer entires.
@@ -1266,11 +1807,11 @@ SvBuildNestedPageTables (
         //
         // PFN points to a base physical address of the page directory table.
         //
-        pdeBasePa = MmGetPhysicalAddress(&SharedVpData->PdeEntries[i][0]).QuadPart;
-        SharedVpData->PdpEntries[i].Fields.PageFrameNumber = pdeBasePa >> PAGE_SHIFT;
-        SharedVpData->PdpEntries[i].Fields.Valid = 1;
-        SharedVpData->PdpEntries[i].Fields.Write = 1;
-        SharedVpData->PdpEntries[i].Fields.User = 1;
+        pdeBasePa = MmGetPhysicalAddress(&NestedPageTables->PdeEntries[i][0]).QuadPart;
+        NestedPageTables->PdpEntries[i].Fields.PageFrameNumber = pdeBasePa >> PAGE_SHIFT;
+        NestedPageTables->PdpEntries[i].Fields.Valid = 1;
+        NestedPageTables->PdpEntries[i].Fields.Write = 1;
+        NestedPageTables->PdpEntries[i].Fields.User = 1;
 
         //
         // One page directory entry controls 512 page directory entries.
@@ -1284,15 +1825,93 @@ SvBuildNestedPageTables (
             // subtable exists.
             //
             translationPa = (i * 512) + j;
-            SharedVpData->PdeEntries[i][j].Fields.PageFrameNumber = translationPa;
-            SharedVpData->PdeEntries[i][j].Fields.Valid = 1;
-            SharedVpData->PdeEntries[i][j].Fields.Write = 1;
-            SharedVpData->PdeEntries[i][j].Fields.User = 1;
-            SharedVpData->PdeEntries[i][j].Fields.LargePage = 1;
+            NestedPageTables->PdeEntries[i][j].Fields.PageFrameNumber = translationPa;
+            NestedPageTables->PdeEntries[i][j].Fields.Valid = 1;
+            NestedPageTables->PdeEntries[i][j].Fields.Write = 1;
+            NestedPageTables->PdeEntries[i][j].Fields.User = 1;
+            NestedPageTables->PdeEntries[i][j].Fields.LargePage = 1;
+
+            //
+            // Leave pages with a device model unmapped so that accesses to
+            // them cause #VMEXIT(NPF) and are emulated. RAM in the same large
+            // page is emulated as well. See SvHandleNestedPageFault.
+            //
+            if (SvIsMmioHandled(translationPa * SV_LARGE_PAGE_SIZE, SV_LARGE_PAGE_SIZE))
+            {
+                NestedPageTables->PdeEntries[i][j].Fields.Valid = 0;
+            }
         }
     }
 }
 
+/*!
+    @brief      Build a replica of nested page tables on each NUMA node.
+
+    @details    Nested page walks on every TLB miss in the guest read nested
+                page tables, so each node with processors gets its own copy
+                allocated from that node, and SvPrepareForVirtualization points
+                NCr3 of each processor to the copy on its node. Nodes without
+                processors get none.
+
+                On failure, the caller must free what has been built with
+                SvFreeNestedPageTables.
+
+    @param[inout] SharedVpData - Shared data to hold nested page tables.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvBuildNestedPageTables (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    ULONG numOfNodes;
+    GROUP_AFFINITY nodeAffinity;
+    PNESTED_PAGE_TABLES nestedPageTables;
+
+    numOfNodes = static_cast<ULONG>(KeQueryHighestNodeNumber()) + 1;
+
+#pragma prefast(disable : 28118 __WARNING_ERROR, "FP due to POOL_NX_OPTIN.")
+    SharedVpData->NestedPageTables = reinterpret_cast<PNESTED_PAGE_TABLES*>(
+        ExAllocatePoolWithTag(NonPagedPool,
+                              sizeof(PNESTED_PAGE_TABLES) * numOfNodes,
+                              'MVSS'));
+    if (SharedVpData->NestedPageTables == nullptr)
+    {
+        SvDebugPrint("[SvmNest] Insufficient memory.\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(SharedVpData->NestedPageTables,
+                  sizeof(PNESTED_PAGE_TABLES) * numOfNodes);
+    SharedVpData->NumberOfNodes = numOfNodes;
+
+    for (ULONG node = 0; node < numOfNodes; node++)
+    {
+        KeQueryNodeActiveAffinity(static_cast<USHORT>(node), &nodeAffinity, nullptr);
+        if (nodeAffinity.Mask == 0)
+        {
+            continue;
+        }
+
+        nestedPageTables = reinterpret_cast<PNESTED_PAGE_TABLES>(
+            SvAllocateContiguousMemory(sizeof(NESTED_PAGE_TABLES), node));
+        if (nestedPageTables == nullptr)
+        {
+            SvDebugPrint("[SvmNest] Insufficient memory.\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        SharedVpData->NestedPageTables[node] = nestedPageTables;
+
+        SvBuildNestedPageTablesReplica(nestedPageTables);
+    }
+    return STATUS_SUCCESS;
+}
+
 /*!
     @brief      Test whether the current processor support the SVM feature.
 
@@ -1406,54 +2025,108 @@ SvVirtualizeAllProcessors (
     }
 
     //
-    // Allocate a data structure shared across all processors. This data is
-    // page tables used for Nested Page Tables.
+    // Select how handlers save the guest's extended state.
+    //
+    status = SvXstateInitialize();
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Reuse shared data kept while the system slept when possible, so that
+    // resume only has to set up per processor data.
     //
+    sharedVpData = SvTakeSuspendedSharedData();
+    if (sharedVpData == nullptr)
+    {
+        //
+        // Allocate a data structure shared across all processors. This data is
+        // page tables used for Nested Page Tables.
+        //
 #pragma prefast(push)
 #pragma prefast(disable : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
-    sharedVpData = reinterpret_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(
-        SvAllocatePageAlingedPhysicalMemory(sizeof(SHARED_VIRTUAL_PROCESSOR_DATA)));
+        sharedVpData = reinterpret_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(
+            SvAllocatePageAlingedPhysicalMemory(PAGE_SIZE));
 #pragma prefast(pop)
-    if (sharedVpData == nullptr)
-    {
-        SvDebugPrint("[SvmNest] Insufficient memory.\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Exit;
+        if (sharedVpData == nullptr)
+        {
+            SvDebugPrint("[SvmNest] Insufficient memory.\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        //
+        // Allocate MSR permissions map (MSRPM) onto contiguous physical memory.
+        //
+        sharedVpData->MsrPermissionsMap = SvAllocateContiguousMemory(
+                                                        SVM_MSR_PERMISSIONS_MAP_SIZE,
+                                                        MM_ANY_NODE_OK);
+        if (sharedVpData->MsrPermissionsMap == nullptr)
+        {
+            SvDebugPrint("[SvmNest] Insufficient memory.\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        //
+        // Allocate I/O permissions map (IOPM) onto contiguous physical memory.
+        //
+        sharedVpData->IoPermissionsMap = SvAllocateContiguousMemory(
+                                                        SVM_IO_PERMISSIONS_MAP_SIZE,
+                                                        MM_ANY_NODE_OK);
+        if (sharedVpData->IoPermissionsMap == nullptr)
+        {
+            SvDebugPrint("[SvmNest] Insufficient memory.\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        //
+        // Build nested page table, MSRPM and IOPM.
+        //
+        status = SvBuildNestedPageTables(sharedVpData);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+        SvBuildMsrPermissionsMap(sharedVpData->MsrPermissionsMap);
+        SvBuildIoPermissionsMap(sharedVpData->IoPermissionsMap);
     }
 
     //
-    // Allocate MSR permissions map (MSRPM) onto contiguous physical memory.
+    // Record which guest physical memory is RAM for the instruction
+    // emulator, which accesses nothing else but through a device model.
     //
-    sharedVpData->MsrPermissionsMap = SvAllocateContiguousMemory(
-                                                    SVM_MSR_PERMISSIONS_MAP_SIZE);
-    if (sharedVpData->MsrPermissionsMap == nullptr)
+    status = SvCapturePhysicalMemoryRanges();
+    if (!NT_SUCCESS(status))
     {
-        SvDebugPrint("[SvmNest] Insufficient memory.\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
         goto Exit;
     }
 
     //
-    // Build nested page table and MSRPM.
+    // Allocate per processor data on the node of each processor.
     //
-    SvBuildNestedPageTables(sharedVpData);
-    SvBuildMsrPermissionsMap(sharedVpData->MsrPermissionsMap);
+    status = SvAllocateProcessorData(sharedVpData);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
 
     //
-    // Execute SvVirtualizeProcessor on and virtualize each processor one-by-one.
+    // Execute SvVirtualizeProcessor on and virtualize all processors at once.
     // How many processors were successfully virtualized is stored in the third
     // parameter.
     //
     // STATUS_SUCCESS is returned if all processor are successfully virtualized.
-    // When any error occurs while virtualizing processors, this function does
-    // not attempt to virtualize the rest of processor. Therefore, only part of
-    // processors on the system may have been virtualized on error. In this case,
-    // it is a caller's responsibility to clean-up (de-virtualize) such
-    // processors.
+    // An error on one processor does not stop the others from being
+    // virtualized. Therefore, only part of processors on the system may have
+    // been virtualized on error. In this case, it is a caller's responsibility
+    // to clean-up (de-virtualize) such processors.
     //
-    status = SvExecuteOnEachProcessor(SvVirtualizeProcessor,
-                                      sharedVpData,
-                                      &numOfProcessorsCompleted);
+    status = UtilForEachProcessor(SvVirtualizeProcessor,
+                                  sharedVpData,
+                                  &numOfProcessorsCompleted);
 
 Exit:
     if (!NT_SUCCESS(status))
@@ -1478,11 +2151,7 @@ Exit:
             //
             if (sharedVpData != nullptr)
             {
-                if (sharedVpData->MsrPermissionsMap != nullptr)
-                {
-                    SvFreeContiguousMemory(sharedVpData->MsrPermissionsMap);
-                }
-                SvFreePageAlingedPhysicalMemory(sharedVpData);
+                SvFreeSharedData(sharedVpData);
             }
         }
     }
@@ -1528,6 +2197,17 @@ DriverEntry (
     //
     ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
 
+    //
+    // Exports log messages through a read-only section so that a user-mode
+    // collector can consume them without a kernel debugger attached. This is
+    // diagnostics only; failure to create the section is not fatal.
+    //
+    status = ExportLogInitialization();
+    if (!NT_SUCCESS(status))
+    {
+        SvDebugPrint("[SvmNest] Failed to export the log ring: %08x\n", status);
+    }
+
     //
     // Registers a power state callback (SvPowerCallbackRoutine) to handle
     // system sleep and resume to manage virtualization state.
@@ -1588,6 +2268,7 @@ Exit:
         {
             ExUnregisterCallback(callbackRegistration);
         }
+        ExportLogTermination();
     }
     return status;
 }
@@ -1621,6 +2302,11 @@ SvDriverUnload (
     //
     //SvDevirtualizeAllProcessors();
 	StopAmdSvm();
+
+    //
+    // Delete the log ring last; the hypervisor may log until it is gone.
+    //
+    ExportLogTermination();
 }
 
 /*!
@@ -1663,17 +2349,23 @@ SvPowerCallbackRoutine (
     if (Argument2 != FALSE)
     {
         //
-        // The system has just reentered S0. Re-virtualize all processors.
+        // The system has just reentered S0. Re-virtualize all processors, and
+        // then point LSTAR to the syscall hook again if it was on.
         //
-        NT_VERIFY(NT_SUCCESS(SvVirtualizeAllProcessors()));
+        if (NT_VERIFY(NT_SUCCESS(SvVirtualizeAllProcessors())))
+        {
+            NT_VERIFY(NT_SUCCESS(SyscallHookResume()));
+        }
     }
     else
     {
         //
-        // The system is about to exit system power state S0. De-virtualize all
-        // processors.
+        // The system is about to exit system power state S0. Put back the
+        // original LSTAR so that the system saves its own handler, then
+        // de-virtualize all processors, keeping shared data for resume.
         //
-        SvDevirtualizeAllProcessors();
+        SyscallHookSuspend();
+        SvSuspendAllProcessors();
     }
 
 Exit:
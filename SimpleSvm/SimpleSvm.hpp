@@ -20,6 +20,11 @@
 //
 #define SVM_MSR_PERMISSIONS_MAP_SIZE    PAGE_SIZE * 2
 
+//
+// A size of the I/O permissions map.
+//
+#define SVM_IO_PERMISSIONS_MAP_SIZE     PAGE_SIZE * 3
+
 //
 // See "SVM Related MSRs"
 //
@@ -32,6 +37,7 @@
 // See "VMCB Layout, Control Area"
 //
 #define SVM_INTERCEPT_MISC1_CPUID       (1UL << 18)
+#define SVM_INTERCEPT_MISC1_IOIO_PROT   (1UL << 27)
 #define SVM_INTERCEPT_MISC1_MSR_PROT    (1UL << 28)
 #define SVM_INTERCEPT_MISC2_VMRUN       (1UL << 0)
 #define SVM_INTERCEPT_MISC2_VMMCALL  (1UL << 1)
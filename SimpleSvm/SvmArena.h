@@ -0,0 +1,315 @@
+#pragma once
+
+//
+// Page arena and slab caches for memory the hypervisor allocates while it
+// handles #VMEXIT.
+//
+// The pool cannot be used there: the host runs with GIF cleared at an
+// arbitrary point of the guest, and pool calls take locks and may take long.
+// Instead, each processor gets an arena of pages allocated before it is
+// virtualized, and host code allocates from it and from slab caches carved
+// out of it. Every operation finishes in bounded time, takes no lock and
+// never calls the OS; an arena is only used by its own processor.
+//
+//  SvArenaAllocatePages    Takes pages from the start of the unused range.
+//  SvArenaAllocatePage     Takes a freed page, or one from the unused range.
+//  SvArenaFreePage         Returns a page from SvArenaAllocatePage.
+//  SvSlabAllocate          Takes an object of the size the slab was set up
+//                          with. An empty slab refills with one page, or with
+//                          the pages of one object for objects larger than a
+//                          page, which takes at most PAGE_SIZE / 16 steps.
+//  SvSlabFree              Returns an object to its slab.
+//
+// The free functions reject, and return 0 for, a pointer outside the memory
+// the arena has handed out, one not at the start of a page or object, one
+// already freed and a free with nothing in use, so that a bad free cannot
+// underflow the counters or link a block into a free list twice. A freed
+// block is marked with a cookie derived from its address; allocating it again
+// clears the mark.
+//
+// Memory is not zeroed. Pages given to a slab stay with it until the arena
+// is discarded as a whole; the arena tracks how many pages are handed out and
+// the most that ever were, and each slab the same for its objects.
+//
+// This file does not depend on the WDK so that the allocator can be built and
+// exercised in user mode, on Windows or Linux, as is.
+//
+#if defined(_MSC_VER)
+typedef unsigned __int32 SvArenaU32;
+typedef unsigned __int64 SvArenaUPtr;
+#else
+#include <stdint.h>
+typedef uint32_t SvArenaU32;
+typedef uintptr_t SvArenaUPtr;
+#endif
+
+#define SV_ARENA_PAGE_SIZE          0x1000
+#define SV_ARENA_MIN_OBJECT_SIZE    16
+#define SV_ARENA_FREE_COOKIE        ((SvArenaUPtr)0x5376417265466565ull)
+
+typedef struct _SV_ARENA_FREE
+{
+	struct _SV_ARENA_FREE* Next;
+	SvArenaUPtr Cookie;         // Address ^ SV_ARENA_FREE_COOKIE while free
+} SV_ARENA_FREE, *PSV_ARENA_FREE;
+
+typedef struct _SV_ARENA
+{
+	unsigned char* Base;
+	SvArenaU32 PageCount;       // Pages in [Base, Base + PageCount pages)
+	SvArenaU32 NextPage;        // First page never handed out
+	PSV_ARENA_FREE FreePages;   // Pages returned by SvArenaFreePage
+	SvArenaU32 PagesInUse;
+	SvArenaU32 PagesHighWater;
+} SV_ARENA, *PSV_ARENA;
+
+typedef struct _SV_SLAB
+{
+	PSV_ARENA Arena;
+	SvArenaU32 ObjectSize;
+	SvArenaU32 ObjectsInUse;
+	SvArenaU32 ObjectsHighWater;
+	SvArenaU32 Reserved;
+	PSV_ARENA_FREE FreeObjects;
+} SV_SLAB, *PSV_SLAB;
+
+//
+// Sets up Arena over PageCount pages at the page aligned Base.
+//
+static inline void SvArenaInitialize(
+	PSV_ARENA Arena,
+	void* Base,
+	SvArenaU32 PageCount)
+{
+	Arena->Base = (unsigned char*)Base;
+	Arena->PageCount = PageCount;
+	Arena->NextPage = 0;
+	Arena->FreePages = 0;
+	Arena->PagesInUse = 0;
+	Arena->PagesHighWater = 0;
+}
+
+static inline void SvArenapMarkFree(
+	PSV_ARENA_FREE Block)
+{
+	Block->Cookie = (SvArenaUPtr)Block ^ SV_ARENA_FREE_COOKIE;
+}
+
+static inline int SvArenapIsFree(
+	const SV_ARENA_FREE* Block)
+{
+	return Block->Cookie == ((SvArenaUPtr)Block ^ SV_ARENA_FREE_COOKIE);
+}
+
+//
+// Returns the offset of Block from the arena base if it lies in pages handed
+// out so far, or -1.
+//
+static inline SvArenaUPtr SvArenapOffsetOf(
+	const SV_ARENA* Arena,
+	const void* Block)
+{
+	SvArenaUPtr address = (SvArenaUPtr)Block;
+	SvArenaUPtr base = (SvArenaUPtr)Arena->Base;
+
+	if (address < base ||
+		address - base >= (SvArenaUPtr)Arena->NextPage * SV_ARENA_PAGE_SIZE)
+	{
+		return (SvArenaUPtr)-1;
+	}
+	return address - base;
+}
+
+static inline void SvArenapCountPages(
+	PSV_ARENA Arena,
+	SvArenaU32 Count)
+{
+	Arena->PagesInUse += Count;
+	if (Arena->PagesInUse > Arena->PagesHighWater)
+	{
+		Arena->PagesHighWater = Arena->PagesInUse;
+	}
+}
+
+//
+// Returns Count contiguous pages, or 0 if the unused range is too short.
+// They cannot be returned to the arena.
+//
+static inline void* SvArenaAllocatePages(
+	PSV_ARENA Arena,
+	SvArenaU32 Count)
+{
+	void* pages;
+
+	if (Count == 0 || Count > Arena->PageCount - Arena->NextPage)
+	{
+		return 0;
+	}
+	pages = Arena->Base + (SvArenaUPtr)Arena->NextPage * SV_ARENA_PAGE_SIZE;
+	Arena->NextPage += Count;
+	SvArenapCountPages(Arena, Count);
+	return pages;
+}
+
+//
+// Returns a page that may be freed with SvArenaFreePage, or 0 if the arena
+// is exhausted.
+//
+static inline void* SvArenaAllocatePage(
+	PSV_ARENA Arena)
+{
+	PSV_ARENA_FREE page = Arena->FreePages;
+
+	if (page == 0)
+	{
+		return SvArenaAllocatePages(Arena, 1);
+	}
+	Arena->FreePages = page->Next;
+	page->Cookie = 0;
+	SvArenapCountPages(Arena, 1);
+	return page;
+}
+
+//
+// Returns 1, or 0 without changing anything if Page is not a page in use.
+//
+static inline int SvArenaFreePage(
+	PSV_ARENA Arena,
+	void* Page)
+{
+	PSV_ARENA_FREE page = (PSV_ARENA_FREE)Page;
+	SvArenaUPtr offset = SvArenapOffsetOf(Arena, Page);
+
+	if (Arena->PagesInUse == 0 ||
+		offset == (SvArenaUPtr)-1 ||
+		offset % SV_ARENA_PAGE_SIZE != 0 ||
+		SvArenapIsFree(page))
+	{
+		return 0;
+	}
+	page->Next = Arena->FreePages;
+	SvArenapMarkFree(page);
+	Arena->FreePages = page;
+	Arena->PagesInUse--;
+	return 1;
+}
+
+//
+// Sets up Slab to hand out objects of ObjectSize bytes from Arena. Objects
+// are aligned to SV_ARENA_MIN_OBJECT_SIZE bytes, or to a page if they are
+// larger than a page.
+//
+static inline void SvSlabInitialize(
+	PSV_SLAB Slab,
+	PSV_ARENA Arena,
+	SvArenaU32 ObjectSize)
+{
+	Slab->Arena = Arena;
+	if (ObjectSize < SV_ARENA_MIN_OBJECT_SIZE)
+	{
+		ObjectSize = SV_ARENA_MIN_OBJECT_SIZE;
+	}
+	Slab->ObjectSize = (ObjectSize + SV_ARENA_MIN_OBJECT_SIZE - 1) &
+		~(SvArenaU32)(SV_ARENA_MIN_OBJECT_SIZE - 1);
+	Slab->ObjectsInUse = 0;
+	Slab->ObjectsHighWater = 0;
+	Slab->Reserved = 0;
+	Slab->FreeObjects = 0;
+}
+
+static inline int SvSlabpRefill(
+	PSV_SLAB Slab)
+{
+	unsigned char* memory;
+	SvArenaU32 pages;
+	SvArenaU32 offset;
+	PSV_ARENA_FREE object;
+
+	if (Slab->ObjectSize > SV_ARENA_PAGE_SIZE)
+	{
+		pages = (Slab->ObjectSize + SV_ARENA_PAGE_SIZE - 1) / SV_ARENA_PAGE_SIZE;
+		memory = (unsigned char*)SvArenaAllocatePages(Slab->Arena, pages);
+		if (memory == 0)
+		{
+			return 0;
+		}
+		object = (PSV_ARENA_FREE)memory;
+		object->Next = Slab->FreeObjects;
+		SvArenapMarkFree(object);
+		Slab->FreeObjects = object;
+		return 1;
+	}
+
+	memory = (unsigned char*)SvArenaAllocatePage(Slab->Arena);
+	if (memory == 0)
+	{
+		return 0;
+	}
+	for (offset = 0;
+		offset + Slab->ObjectSize <= SV_ARENA_PAGE_SIZE;
+		offset += Slab->ObjectSize)
+	{
+		object = (PSV_ARENA_FREE)(memory + offset);
+		object->Next = Slab->FreeObjects;
+		SvArenapMarkFree(object);
+		Slab->FreeObjects = object;
+	}
+	return 1;
+}
+
+//
+// Returns an object, or 0 if the slab is empty and the arena is exhausted.
+//
+static inline void* SvSlabAllocate(
+	PSV_SLAB Slab)
+{
+	PSV_ARENA_FREE object;
+
+	if (Slab->FreeObjects == 0 && !SvSlabpRefill(Slab))
+	{
+		return 0;
+	}
+	object = Slab->FreeObjects;
+	Slab->FreeObjects = object->Next;
+	object->Cookie = 0;
+	Slab->ObjectsInUse++;
+	if (Slab->ObjectsInUse > Slab->ObjectsHighWater)
+	{
+		Slab->ObjectsHighWater = Slab->ObjectsInUse;
+	}
+	return object;
+}
+
+//
+// Returns 1, or 0 without changing anything if Object is not an object of the
+// slab in use.
+//
+static inline int SvSlabFree(
+	PSV_SLAB Slab,
+	void* Object)
+{
+	PSV_ARENA_FREE object = (PSV_ARENA_FREE)Object;
+	SvArenaUPtr offset = SvArenapOffsetOf(Slab->Arena, Object);
+	SvArenaUPtr misalignment;
+
+	if (Slab->ObjectSize > SV_ARENA_PAGE_SIZE)
+	{
+		misalignment = offset % SV_ARENA_PAGE_SIZE;
+	}
+	else
+	{
+		misalignment = offset % SV_ARENA_PAGE_SIZE % Slab->ObjectSize;
+	}
+	if (Slab->ObjectsInUse == 0 ||
+		offset == (SvArenaUPtr)-1 ||
+		misalignment != 0 ||
+		SvArenapIsFree(object))
+	{
+		return 0;
+	}
+	object->Next = Slab->FreeObjects;
+	SvArenapMarkFree(object);
+	Slab->FreeObjects = object;
+	Slab->ObjectsInUse--;
+	return 1;
+}
@@ -0,0 +1,361 @@
+#include "SvmCpuid.h"
+
+//
+// What the hypervisor changes in CPUID results. Applied once to the snapshot
+// and again to results of CPUID executed for leaves not in it.
+//
+static const SV_CPUID_OVERLAY g_CpuidOverlay[] =
+{
+	//
+	// Indicate presence of a hypervisor by setting the bit that are reserved
+	// for use by hypervisor to indicate guest status. See "CPUID
+	// Fn0000_0001_ECX Feature Identifiers".
+	//
+	{ CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS, SV_CPUID_ANY_SUBLEAF, CpuidEcx,
+	  0, CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT },
+
+	//
+	// Advertise to L1 only SVM features the nested path honors.
+	//
+	{ CPUID_SVM_FEATURES, SV_CPUID_ANY_SUBLEAF, CpuidEdx, ~SV_NESTED_SVM_FEATURES, 0 },
+
+	//
+	// Return a maximum supported hypervisor CPUID leaf range and a vendor ID
+	// signature as required by the spec.
+	//
+	{ CPUID_HV_VENDOR_AND_MAX_FUNCTIONS, SV_CPUID_ANY_SUBLEAF, CpuidEax, MAXUINT32, CPUID_HV_MAX },
+	{ CPUID_HV_VENDOR_AND_MAX_FUNCTIONS, SV_CPUID_ANY_SUBLEAF, CpuidEbx, MAXUINT32, 'NmvS' },  // "SvmNest     "
+	{ CPUID_HV_VENDOR_AND_MAX_FUNCTIONS, SV_CPUID_ANY_SUBLEAF, CpuidEcx, MAXUINT32, ' tse' },
+	{ CPUID_HV_VENDOR_AND_MAX_FUNCTIONS, SV_CPUID_ANY_SUBLEAF, CpuidEdx, MAXUINT32, '    ' },
+
+	//
+	// Return non Hv#1 value. This indicate that the SimpleSvm does NOT conform
+	// to the Microsoft hypervisor interface.
+	//
+	{ CPUID_HV_INTERFACE, SV_CPUID_ANY_SUBLEAF, CpuidEax, MAXUINT32, '0#vH' },  // Hv#0
+	{ CPUID_HV_INTERFACE, SV_CPUID_ANY_SUBLEAF, CpuidEbx, MAXUINT32, 0 },
+	{ CPUID_HV_INTERFACE, SV_CPUID_ANY_SUBLEAF, CpuidEcx, MAXUINT32, 0 },
+	{ CPUID_HV_INTERFACE, SV_CPUID_ANY_SUBLEAF, CpuidEdx, MAXUINT32, 0 },
+};
+
+//
+// Leaves whose results depend on ECX, and how many subleaves of each are
+// snapshotted. Other subleaves are served by executing CPUID.
+//
+typedef struct _SV_CPUID_INDEXED_LEAF
+{
+	UINT32 Leaf;
+	UINT32 SubLeafCount;
+} SV_CPUID_INDEXED_LEAF;
+
+static const SV_CPUID_INDEXED_LEAF g_CpuidIndexedLeaves[] =
+{
+	{ 0x00000004, 8 },  // Deterministic cache parameters
+	{ 0x00000007, 4 },  // Structured extended features
+	{ 0x0000000b, 4 },  // Extended topology
+	{ 0x0000000f, 2 },  // Resource director technology monitoring
+	{ 0x00000010, 4 },  // Resource director technology allocation
+	{ 0x00000012, 4 },  // SGX
+	{ 0x00000014, 2 },  // Processor trace
+	{ 0x00000017, 4 },  // SoC vendor attributes
+	{ 0x00000018, 4 },  // Deterministic address translation parameters
+	{ 0x0000001d, 2 },  // Tile information
+	{ 0x0000001e, 1 },  // TMUL information
+	{ 0x0000001f, 6 },  // V2 extended topology
+	{ 0x00000020, 1 },  // Processor history reset
+	{ 0x8000001d, 8 },  // Cache topology
+	{ 0x80000020, 4 },  // Platform QoS enforcement
+	{ 0x80000026, 4 },  // Extended CPU topology
+};
+
+//
+// Leaves never snapshotted. The sizes in leaf 0xD follow XCR0 and IA32_XSS,
+// which the guest may change at any time; statistics leaves are answered from
+// counters by SvCpuidQueryStats.
+//
+static const UINT32 g_CpuidUncachedLeaves[] =
+{
+	0x0000000d,
+	SV_CPUID_STATS_INFO,
+	SV_CPUID_STATS_COUNTER,
+};
+
+//
+// The highest basic and extended leaves snapshotted; leaves above them are
+// rarely used and served by executing CPUID.
+//
+#define SV_CPUID_MAX_BASIC_LEAF     0x00000020
+#define SV_CPUID_MAX_EXTENDED_LEAF  0x80000028
+
+static VOID SvCpuidApplyOverlay(
+	_In_ UINT32 Leaf,
+	_In_ UINT32 SubLeaf,
+	_Inout_updates_(4) int Registers[4])
+{
+	for (ULONG i = 0; i < RTL_NUMBER_OF(g_CpuidOverlay); i++)
+	{
+		const auto overlay = &g_CpuidOverlay[i];
+		if (overlay->Leaf == Leaf &&
+			(overlay->SubLeaf == SV_CPUID_ANY_SUBLEAF || overlay->SubLeaf == SubLeaf))
+		{
+			Registers[overlay->Register] = static_cast<int>(
+				(static_cast<UINT32>(Registers[overlay->Register]) & ~overlay->Clear) | overlay->Set);
+		}
+	}
+}
+
+static BOOLEAN SvCpuidIsUncached(
+	_In_ UINT32 Leaf)
+{
+	for (ULONG i = 0; i < RTL_NUMBER_OF(g_CpuidUncachedLeaves); i++)
+	{
+		if (g_CpuidUncachedLeaves[i] == Leaf)
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static UINT32 SvCpuidGetSubLeafCount(
+	_In_ UINT32 Leaf)
+{
+	for (ULONG i = 0; i < RTL_NUMBER_OF(g_CpuidIndexedLeaves); i++)
+	{
+		if (g_CpuidIndexedLeaves[i].Leaf == Leaf)
+		{
+			return g_CpuidIndexedLeaves[i].SubLeafCount;
+		}
+	}
+	return 0;
+}
+
+static VOID SvCpuidCaptureLeaf(
+	_Inout_ PSV_CPUID_CACHE Cache,
+	_In_ UINT32 Leaf)
+{
+	UINT32 subLeafCount;
+	PSV_CPUID_ENTRY entry;
+
+	if (SvCpuidIsUncached(Leaf))
+	{
+		return;
+	}
+
+	subLeafCount = SvCpuidGetSubLeafCount(Leaf);
+	for (UINT32 subLeaf = 0; subLeaf < max(subLeafCount, 1u); subLeaf++)
+	{
+		if (Cache->Count >= SV_CPUID_CACHE_MAX_ENTRIES)
+		{
+			return;
+		}
+
+		entry = &Cache->Entries[Cache->Count++];
+		entry->Leaf = Leaf;
+		entry->SubLeaf = (subLeafCount == 0) ? SV_CPUID_ANY_SUBLEAF : subLeaf;
+		__cpuidex(entry->Registers, static_cast<int>(Leaf), static_cast<int>(subLeaf));
+		SvCpuidApplyOverlay(Leaf, subLeaf, entry->Registers);
+	}
+}
+
+//
+// Takes the snapshot on the current processor. Must run before the processor
+// is virtualized, since results such as the initial APIC ID differ between
+// processors.
+//
+VOID SvCpuidCaptureCache(
+	_Out_ PSV_CPUID_CACHE Cache)
+{
+	int registers[4];   // EAX, EBX, ECX, and EDX
+	UINT32 maxLeaf;
+
+	RtlZeroMemory(Cache, sizeof(*Cache));
+
+	//
+	// Ranges are captured in ascending order, which keeps entries sorted.
+	//
+	__cpuid(registers, CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING);
+	maxLeaf = min(static_cast<UINT32>(registers[0]), SV_CPUID_MAX_BASIC_LEAF);
+	for (UINT32 leaf = 0; leaf <= maxLeaf; leaf++)
+	{
+		SvCpuidCaptureLeaf(Cache, leaf);
+	}
+
+	for (UINT32 leaf = 0x40000000; leaf <= CPUID_HV_MAX; leaf++)
+	{
+		SvCpuidCaptureLeaf(Cache, leaf);
+	}
+
+	__cpuid(registers, 0x80000000);
+	maxLeaf = min(static_cast<UINT32>(registers[0]), SV_CPUID_MAX_EXTENDED_LEAF);
+	for (UINT32 leaf = 0x80000000; leaf <= maxLeaf; leaf++)
+	{
+		SvCpuidCaptureLeaf(Cache, leaf);
+	}
+}
+
+//
+// Returns the snapshot entry for Leaf and SubLeaf, or nullptr.
+//
+static const SV_CPUID_ENTRY* SvCpuidLookup(
+	_In_ const SV_CPUID_CACHE* Cache,
+	_In_ UINT32 Leaf,
+	_In_ UINT32 SubLeaf)
+{
+	UINT32 low, high, middle;
+
+	//
+	// Find the first entry of Leaf, then scan its subleaves.
+	//
+	low = 0;
+	high = Cache->Count;
+	while (low < high)
+	{
+		middle = (low + high) / 2;
+		if (Cache->Entries[middle].Leaf < Leaf)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	for (; low < Cache->Count && Cache->Entries[low].Leaf == Leaf; low++)
+	{
+		if (Cache->Entries[low].SubLeaf == SV_CPUID_ANY_SUBLEAF ||
+			Cache->Entries[low].SubLeaf == SubLeaf)
+		{
+			return &Cache->Entries[low];
+		}
+	}
+	return nullptr;
+}
+
+//
+// Answers the statistics leaves described in SvmStats.h.
+//
+static VOID SvCpuidQueryStats(
+	_In_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ UINT32 Leaf,
+	_In_ UINT32 SubLeaf,
+	_Out_writes_(4) int Registers[4])
+{
+	const auto nestData = VpData->HostStackLayout.pProcessNestData;
+	const auto stats = &nestData->Stats;
+	const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+	const RingHeader* logRing;
+	UINT64 value;
+
+	if (Leaf == SV_CPUID_STATS_INFO)
+	{
+		Registers[CpuidEax] = SV_STATS_VERSION;
+		Registers[CpuidEbx] = SV_STATS_COUNT;
+		Registers[CpuidEcx] = static_cast<int>(processor);
+		Registers[CpuidEdx] = 0;
+		return;
+	}
+
+	if (SubLeaf >= SV_STATS_COUNT)
+	{
+		Registers[CpuidEax] = Registers[CpuidEbx] = 0;
+		Registers[CpuidEcx] = static_cast<int>(processor);
+		Registers[CpuidEdx] = static_cast<int>(MAXUINT32);
+		return;
+	}
+
+	switch (SubLeaf)
+	{
+	case SV_STATS_LOG_DROPS:
+		logRing = ExportLogGetRing();
+		value = (logRing != nullptr) ? logRing->dropped : 0;
+		break;
+	case SV_STATS_LARGE_PAGE_SLOT:
+		value = nestData->LargePageSlot;
+		break;
+	case SV_STATS_ARENA_PAGES:
+		value = nestData->HostArena.PageCount;
+		break;
+	case SV_STATS_ARENA_PAGES_USED:
+		value = nestData->HostArena.PagesInUse;
+		break;
+	case SV_STATS_ARENA_PAGES_PEAK:
+		value = nestData->HostArena.PagesHighWater;
+		break;
+	case SV_STATS_SLAB_OBJECTS_USED:
+	case SV_STATS_SLAB_OBJECTS_PEAK:
+		value = 0;
+		for (ULONG i = 0; i < HostSlabMaximum; i++)
+		{
+			value += (SubLeaf == SV_STATS_SLAB_OBJECTS_USED) ?
+				nestData->HostSlabs[i].ObjectsInUse :
+				nestData->HostSlabs[i].ObjectsHighWater;
+		}
+		break;
+	default:
+		value = stats->Counters[SubLeaf];
+		break;
+	}
+	Registers[CpuidEax] = static_cast<int>(value & MAXUINT32);
+	Registers[CpuidEbx] = static_cast<int>(value >> 32);
+	Registers[CpuidEcx] = static_cast<int>(processor);
+	Registers[CpuidEdx] = static_cast<int>(SubLeaf);
+}
+
+//
+// Returns what CPUID with Leaf and SubLeaf returns to the guest; TRUE if it
+// came from the snapshot or from hypervisor counters rather than CPUID. Bits
+// that mirror the guest's CR4 are taken from the current guest state rather
+// than the snapshot.
+//
+BOOLEAN SvCpuidQuery(
+	_In_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ int Leaf,
+	_In_ int SubLeaf,
+	_Out_writes_(4) int Registers[4])
+{
+	const auto cache = VpData->HostStackLayout.pProcessNestData->CpuidCache;
+	const auto leaf = static_cast<UINT32>(Leaf);
+	const auto subLeaf = static_cast<UINT32>(SubLeaf);
+	const auto cr4 = VpData->GuestVmcb.StateSaveArea.Cr4;
+	const SV_CPUID_ENTRY* entry;
+	BOOLEAN cached;
+
+	if (leaf == SV_CPUID_STATS_INFO || leaf == SV_CPUID_STATS_COUNTER)
+	{
+		SvCpuidQueryStats(VpData, leaf, subLeaf, Registers);
+		return TRUE;
+	}
+
+	entry = (cache != nullptr) ? SvCpuidLookup(cache, leaf, subLeaf) : nullptr;
+	if (entry != nullptr)
+	{
+		RtlCopyMemory(Registers, entry->Registers, sizeof(entry->Registers));
+		cached = TRUE;
+	}
+	else
+	{
+		__cpuidex(Registers, Leaf, SubLeaf);
+		SvCpuidApplyOverlay(leaf, subLeaf, Registers);
+		cached = FALSE;
+	}
+
+	if (leaf == CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS)
+	{
+		Registers[CpuidEcx] &= ~CPUID_FN0000_0001_ECX_OSXSAVE;
+		if (cr4 & CR4_OSXSAVE)
+		{
+			Registers[CpuidEcx] |= CPUID_FN0000_0001_ECX_OSXSAVE;
+		}
+	}
+	else if (leaf == CPUID_STRUCTURED_EXTENDED_FEATURES && subLeaf == 0)
+	{
+		Registers[CpuidEcx] &= ~CPUID_FN0000_0007_ECX_OSPKE;
+		if (cr4 & CR4_PKE)
+		{
+			Registers[CpuidEcx] |= CPUID_FN0000_0007_ECX_OSPKE;
+		}
+	}
+	return cached;
+}
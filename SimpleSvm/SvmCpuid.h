@@ -0,0 +1,61 @@
+#pragma once
+#include "SvmHead.h"
+#include "SvmStruct.h"
+
+//
+// A per-processor snapshot of the CPUID leaves the hypervisor serves, taken
+// before the processor is virtualized, with the overlay in SvmCpuid.cpp
+// already applied. SvHandleCpuid answers from it and only executes CPUID for
+// leaves and subleaves not in it.
+//
+// Entries are sorted by Leaf, then SubLeaf. SubLeaf is SV_CPUID_ANY_SUBLEAF
+// for leaves whose results do not depend on ECX.
+//
+#define SV_CPUID_CACHE_MAX_ENTRIES  128
+#define SV_CPUID_ANY_SUBLEAF        MAXUINT32
+
+typedef enum _SV_CPUID_REGISTER
+{
+	CpuidEax,
+	CpuidEbx,
+	CpuidEcx,
+	CpuidEdx,
+} SV_CPUID_REGISTER;
+
+typedef struct _SV_CPUID_ENTRY
+{
+	UINT32 Leaf;
+	UINT32 SubLeaf;
+	int Registers[4];   // EAX, EBX, ECX, and EDX
+} SV_CPUID_ENTRY, *PSV_CPUID_ENTRY;
+static_assert(sizeof(SV_CPUID_ENTRY) == 24, "SV_CPUID_ENTRY Size Mismatch");
+
+typedef struct _SV_CPUID_CACHE
+{
+	UINT32 Count;
+	UINT32 Reserved;
+	SV_CPUID_ENTRY Entries[SV_CPUID_CACHE_MAX_ENTRIES];
+} SV_CPUID_CACHE, *PSV_CPUID_CACHE;
+static_assert(sizeof(SV_CPUID_CACHE) <= PAGE_SIZE, "SV_CPUID_CACHE Size Mismatch");
+
+//
+// One change the hypervisor makes to what CPUID returns: Register becomes
+// (value & ~Clear) | Set. Clear of MAXUINT32 overrides the register.
+//
+typedef struct _SV_CPUID_OVERLAY
+{
+	UINT32 Leaf;
+	UINT32 SubLeaf;     // Or SV_CPUID_ANY_SUBLEAF
+	SV_CPUID_REGISTER Register;
+	UINT32 Clear;
+	UINT32 Set;
+} SV_CPUID_OVERLAY, *PSV_CPUID_OVERLAY;
+
+VOID SvCpuidCaptureCache(
+	_Out_ PSV_CPUID_CACHE Cache);
+
+BOOLEAN SvCpuidQuery(
+	_In_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ int Leaf,
+	_In_ int SubLeaf,
+	_Out_writes_(4) int Registers[4]);
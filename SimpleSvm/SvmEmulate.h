@@ -0,0 +1,872 @@
+#pragma once
+
+//
+// Decoder and emulator for instructions that access memory, for #VMEXITs
+// such as #NPF where the hypervisor performs the access on behalf of the
+// guest instead of letting the guest single-step it, which would take two or
+// more extra #VMEXITs.
+//
+// Supported are the forms compilers emit for device and shared memory
+// access, with any legacy or REX prefix, in 32-bit and 64-bit code:
+//
+//  MOV     88, 89, 8A, 8B, C6 /0, C7 /0, A0-A3 (moffs)
+//  MOVZX   0F B6, 0F B7
+//  MOVSX   0F BE, 0F BF
+//  MOVS    A4, A5, with REP
+//  STOS    AA, AB, with REP
+//  ADD, OR, ADC, SBB, AND, SUB, XOR, CMP
+//          00-3B (memory and register forms), 80, 81, 83
+//  TEST    84, 85, F6 /0, F7 /0
+//
+// Decoding is driven by g_SvEmuOneByteMap, one entry per opcode byte, and
+// only instructions with a memory operand are accepted. Memory is accessed
+// through the callbacks in SV_EMU_MEMORY, once per operand access and never
+// more than 8 bytes at a time, in the order the processor would access it,
+// so that they can forward accesses to a device model. A REP string
+// instruction is emulated to completion in one call; if an access fails
+// part way, the registers reflect the iterations done and RIP is not
+// advanced, the same as an interrupted REP string instruction. LOCK is
+// accepted, but read-modify-write operands are not accessed atomically.
+//
+// This file does not depend on the WDK so that the emulator can be built,
+// fuzzed and benchmarked in user mode, on Windows or Linux, as is.
+//
+#if defined(_MSC_VER)
+typedef unsigned __int8 SvEmuU8;
+typedef unsigned __int16 SvEmuU16;
+typedef unsigned __int32 SvEmuU32;
+typedef unsigned __int64 SvEmuU64;
+typedef __int64 SvEmuS64;
+#else
+#include <stdint.h>
+typedef uint8_t SvEmuU8;
+typedef uint16_t SvEmuU16;
+typedef uint32_t SvEmuU32;
+typedef uint64_t SvEmuU64;
+typedef int64_t SvEmuS64;
+#endif
+
+#define SV_EMU_MAX_LENGTH       15
+
+typedef enum _SV_EMU_STATUS
+{
+	SvEmuOk = 0,
+	SvEmuUnsupported,           // Not an instruction this emulator handles
+	SvEmuTruncated,             // More instruction bytes are needed
+	SvEmuMemoryError,           // A memory callback failed
+	SvEmuIoError,               // An I/O port routine failed (SvmIoio.h)
+} SV_EMU_STATUS;
+
+//
+// General purpose registers in encoding order.
+//
+typedef enum _SV_EMU_REGISTER
+{
+	SvEmuRax, SvEmuRcx, SvEmuRdx, SvEmuRbx, SvEmuRsp, SvEmuRbp, SvEmuRsi, SvEmuRdi,
+	SvEmuR8, SvEmuR9, SvEmuR10, SvEmuR11, SvEmuR12, SvEmuR13, SvEmuR14, SvEmuR15,
+} SV_EMU_REGISTER;
+
+//
+// Segment registers in encoding order.
+//
+typedef enum _SV_EMU_SEGMENT
+{
+	SvEmuEs, SvEmuCs, SvEmuSs, SvEmuDs, SvEmuFs, SvEmuGs,
+} SV_EMU_SEGMENT;
+
+#define SV_EMU_RFLAGS_CF        (1u << 0)
+#define SV_EMU_RFLAGS_PF        (1u << 2)
+#define SV_EMU_RFLAGS_AF        (1u << 4)
+#define SV_EMU_RFLAGS_ZF        (1u << 6)
+#define SV_EMU_RFLAGS_SF        (1u << 7)
+#define SV_EMU_RFLAGS_DF        (1u << 10)
+#define SV_EMU_RFLAGS_OF        (1u << 11)
+#define SV_EMU_RFLAGS_ARITH     (SV_EMU_RFLAGS_CF | SV_EMU_RFLAGS_PF | SV_EMU_RFLAGS_AF | \
+                                 SV_EMU_RFLAGS_ZF | SV_EMU_RFLAGS_SF | SV_EMU_RFLAGS_OF)
+
+//
+// Guest state the emulator reads and updates.
+//
+typedef struct _SV_EMU_STATE
+{
+	SvEmuU64 Gpr[16];
+	SvEmuU64 Rip;
+	SvEmuU64 Rflags;
+	SvEmuU64 SegmentBase[6];
+	SvEmuU8 Is64BitCode;        // Otherwise 32-bit code; 16-bit is not supported
+	SvEmuU8 Reserved[7];
+} SV_EMU_STATE, *PSV_EMU_STATE;
+
+//
+// Accesses Size (1, 2, 4 or 8) bytes at the linear Address. Return 0 to
+// fail the instruction.
+//
+typedef struct _SV_EMU_MEMORY
+{
+	void* Context;
+	int (*Read)(void* Context, SvEmuU64 Address, SvEmuU32 Size, SvEmuU64* Value);
+	int (*Write)(void* Context, SvEmuU64 Address, SvEmuU32 Size, SvEmuU64 Value);
+} SV_EMU_MEMORY, *PSV_EMU_MEMORY;
+
+//
+// Operations.
+//
+#define SV_EMU_OP_NONE      0
+#define SV_EMU_OP_ADD       1   // ADD through CMP are in the order of the
+#define SV_EMU_OP_OR        2   //  ModRM.reg field of opcodes 80-83
+#define SV_EMU_OP_ADC       3
+#define SV_EMU_OP_SBB       4
+#define SV_EMU_OP_AND       5
+#define SV_EMU_OP_SUB       6
+#define SV_EMU_OP_XOR       7
+#define SV_EMU_OP_CMP       8
+#define SV_EMU_OP_TEST      9
+#define SV_EMU_OP_MOV       10
+#define SV_EMU_OP_MOVZX     11
+#define SV_EMU_OP_MOVSX     12
+#define SV_EMU_OP_MOVS      13
+#define SV_EMU_OP_STOS      14
+#define SV_EMU_OP_GROUP1    15  // Operation from ModRM.reg
+
+//
+// Operand forms. Values of the low nibble of a map entry.
+//
+#define SV_EMU_FORM_MR      1   // r/m <- r/m op reg
+#define SV_EMU_FORM_RM      2   // reg <- reg op r/m
+#define SV_EMU_FORM_MI      3   // r/m <- r/m op imm (Iz, or Ib for byte operands)
+#define SV_EMU_FORM_MI8     4   // r/m <- r/m op sign-extended Ib
+#define SV_EMU_FORM_LOAD    5   // rAX <- [moffs]
+#define SV_EMU_FORM_STORE   6   // [moffs] <- rAX
+#define SV_EMU_FORM_STRING  7   // Implicit rSI and rDI operands
+
+#define SV_EMU_FLAG_BYTE    0x10    // Byte operands
+#define SV_EMU_FLAG_REG0    0x20    // ModRM.reg must be 0
+#define SV_EMU_FLAG_WORD    0x40    // Word source operand (MOVZX and MOVSX)
+
+#define SV_EMU_ENTRY(Op, Form)  (SvEmuU16)(((Op) << 8) | (Form))
+#define SV_EMU_ALU(Op)  \
+	SV_EMU_ENTRY(Op, SV_EMU_FORM_MR | SV_EMU_FLAG_BYTE), SV_EMU_ENTRY(Op, SV_EMU_FORM_MR), \
+	SV_EMU_ENTRY(Op, SV_EMU_FORM_RM | SV_EMU_FLAG_BYTE), SV_EMU_ENTRY(Op, SV_EMU_FORM_RM), \
+	0, 0, 0, 0
+#define SV_EMU_NONE8    0, 0, 0, 0, 0, 0, 0, 0
+#define SV_EMU_NONE16   SV_EMU_NONE8, SV_EMU_NONE8
+
+static const SvEmuU16 g_SvEmuOneByteMap[256] =
+{
+	/* 00 */ SV_EMU_ALU(SV_EMU_OP_ADD), SV_EMU_ALU(SV_EMU_OP_OR),
+	/* 10 */ SV_EMU_ALU(SV_EMU_OP_ADC), SV_EMU_ALU(SV_EMU_OP_SBB),
+	/* 20 */ SV_EMU_ALU(SV_EMU_OP_AND), SV_EMU_ALU(SV_EMU_OP_SUB),
+	/* 30 */ SV_EMU_ALU(SV_EMU_OP_XOR), SV_EMU_ALU(SV_EMU_OP_CMP),
+	/* 40 */ SV_EMU_NONE16,
+	/* 50 */ SV_EMU_NONE16,
+	/* 60 */ SV_EMU_NONE16,
+	/* 70 */ SV_EMU_NONE16,
+	/* 80 */ SV_EMU_ENTRY(SV_EMU_OP_GROUP1, SV_EMU_FORM_MI | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_GROUP1, SV_EMU_FORM_MI),
+	         0,
+	         SV_EMU_ENTRY(SV_EMU_OP_GROUP1, SV_EMU_FORM_MI8),
+	         SV_EMU_ENTRY(SV_EMU_OP_TEST, SV_EMU_FORM_MR | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_TEST, SV_EMU_FORM_MR),
+	         0, 0,
+	/* 88 */ SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_MR | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_MR),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_RM | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_RM),
+	         0, 0, 0, 0,
+	/* 90 */ SV_EMU_NONE16,
+	/* A0 */ SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_LOAD | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_LOAD),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_STORE | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_STORE),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOVS, SV_EMU_FORM_STRING | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOVS, SV_EMU_FORM_STRING),
+	         0, 0,
+	/* A8 */ 0, 0,
+	         SV_EMU_ENTRY(SV_EMU_OP_STOS, SV_EMU_FORM_STRING | SV_EMU_FLAG_BYTE),
+	         SV_EMU_ENTRY(SV_EMU_OP_STOS, SV_EMU_FORM_STRING),
+	         0, 0, 0, 0,
+	/* B0 */ SV_EMU_NONE16,
+	/* C0 */ 0, 0, 0, 0, 0, 0,
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_MI | SV_EMU_FLAG_BYTE | SV_EMU_FLAG_REG0),
+	         SV_EMU_ENTRY(SV_EMU_OP_MOV, SV_EMU_FORM_MI | SV_EMU_FLAG_REG0),
+	/* C8 */ SV_EMU_NONE8,
+	/* D0 */ SV_EMU_NONE16,
+	/* E0 */ SV_EMU_NONE16,
+	/* F0 */ 0, 0, 0, 0, 0, 0,
+	         SV_EMU_ENTRY(SV_EMU_OP_TEST, SV_EMU_FORM_MI | SV_EMU_FLAG_BYTE | SV_EMU_FLAG_REG0),
+	         SV_EMU_ENTRY(SV_EMU_OP_TEST, SV_EMU_FORM_MI | SV_EMU_FLAG_REG0),
+	/* F8 */ SV_EMU_NONE8,
+};
+
+//
+// The two-byte opcodes (0F xx) handled. All take a ModRM byte.
+//
+static const SvEmuU16 g_SvEmuTwoByteMap[4][2] =
+{
+	{ 0xb6, SV_EMU_ENTRY(SV_EMU_OP_MOVZX, SV_EMU_FORM_RM | SV_EMU_FLAG_BYTE) },
+	{ 0xb7, SV_EMU_ENTRY(SV_EMU_OP_MOVZX, SV_EMU_FORM_RM | SV_EMU_FLAG_WORD) },
+	{ 0xbe, SV_EMU_ENTRY(SV_EMU_OP_MOVSX, SV_EMU_FORM_RM | SV_EMU_FLAG_BYTE) },
+	{ 0xbf, SV_EMU_ENTRY(SV_EMU_OP_MOVSX, SV_EMU_FORM_RM | SV_EMU_FLAG_WORD) },
+};
+
+//
+// A decoded instruction.
+//
+typedef struct _SV_EMU_INSTRUCTION
+{
+	SvEmuU64 Immediate;         // Sign-extended to 64 bits
+	SvEmuU64 Address;           // Linear address of the memory operand
+	SvEmuU8 Length;
+	SvEmuU8 Operation;          // SV_EMU_OP_*
+	SvEmuU8 Form;               // SV_EMU_FORM_*
+	SvEmuU8 OperandSize;        // 1, 2, 4 or 8
+	SvEmuU8 SourceSize;         // MOVZX and MOVSX; otherwise OperandSize
+	SvEmuU8 AddressSize;        // 4 or 8
+	SvEmuU8 Segment;            // SV_EMU_SEGMENT of the memory operand
+	SvEmuU8 Rep;                // 0, or 0xF2 or 0xF3
+	SvEmuU8 Reg;                // ModRM.reg with REX.R
+	SvEmuU8 Rex;                // REX prefix, or 0
+	SvEmuU8 Reserved[6];
+} SV_EMU_INSTRUCTION, *PSV_EMU_INSTRUCTION;
+
+static inline SvEmuU64 SvEmupMask(
+	SvEmuU32 Size)
+{
+	return (Size == 8) ? ~(SvEmuU64)0 : (((SvEmuU64)1 << (Size * 8)) - 1);
+}
+
+static inline SvEmuU64 SvEmupSignExtend(
+	SvEmuU64 Value,
+	SvEmuU32 Size)
+{
+	const SvEmuU32 shift = 64 - Size * 8;
+
+	return (SvEmuU64)((SvEmuS64)(Value << shift) >> shift);
+}
+
+//
+// Reads a little-endian value of Size bytes at Bytes[*Offset].
+//
+static inline int SvEmupFetch(
+	const SvEmuU8* Bytes,
+	SvEmuU32 Count,
+	SvEmuU32* Offset,
+	SvEmuU32 Size,
+	SvEmuU64* Value)
+{
+	SvEmuU32 i;
+
+	if (*Offset + Size > Count || *Offset + Size > SV_EMU_MAX_LENGTH)
+	{
+		return 0;
+	}
+	*Value = 0;
+	for (i = 0; i < Size; i++)
+	{
+		*Value |= (SvEmuU64)Bytes[*Offset + i] << (i * 8);
+	}
+	*Offset += Size;
+	return 1;
+}
+
+//
+// Decodes the ModRM, SIB and displacement bytes at Bytes[*Offset] of a
+// memory operand, and computes the effective address except for the
+// RIP-relative base, which is added by SvEmuDecode once the length is known.
+//
+static inline SV_EMU_STATUS SvEmupDecodeModRm(
+	const SV_EMU_STATE* State,
+	const SvEmuU8* Bytes,
+	SvEmuU32 Count,
+	SvEmuU32* Offset,
+	PSV_EMU_INSTRUCTION Instruction,
+	int* RipRelative)
+{
+	SvEmuU8 modRm, sib, mod, rm, base, index;
+	SvEmuU64 displacement = 0;
+	SvEmuU64 address = 0;
+
+	*RipRelative = 0;
+	if (*Offset >= Count)
+	{
+		return SvEmuTruncated;
+	}
+	modRm = Bytes[(*Offset)++];
+	mod = (SvEmuU8)(modRm >> 6);
+	rm = (SvEmuU8)(modRm & 7);
+	Instruction->Reg = (SvEmuU8)(((modRm >> 3) & 7) | ((Instruction->Rex & 0x4) << 1));
+	if (mod == 3)
+	{
+		return SvEmuUnsupported;    // No memory operand
+	}
+
+	if (rm == 4)
+	{
+		if (*Offset >= Count)
+		{
+			return SvEmuTruncated;
+		}
+		sib = Bytes[(*Offset)++];
+		base = (SvEmuU8)((sib & 7) | ((Instruction->Rex & 0x1) << 3));
+		index = (SvEmuU8)(((sib >> 3) & 7) | ((Instruction->Rex & 0x2) << 2));
+		if (index != SvEmuRsp)
+		{
+			address = State->Gpr[index] << (sib >> 6);
+		}
+		if ((sib & 7) == 5 && mod == 0)
+		{
+			if (!SvEmupFetch(Bytes, Count, Offset, 4, &displacement))
+			{
+				return SvEmuTruncated;
+			}
+			displacement = SvEmupSignExtend(displacement, 4);
+		}
+		else
+		{
+			address += State->Gpr[base];
+			if ((base & 7) == SvEmuRsp || (base & 7) == SvEmuRbp)
+			{
+				Instruction->Segment = SvEmuSs;
+			}
+		}
+	}
+	else if (rm == 5 && mod == 0)
+	{
+		if (!SvEmupFetch(Bytes, Count, Offset, 4, &displacement))
+		{
+			return SvEmuTruncated;
+		}
+		displacement = SvEmupSignExtend(displacement, 4);
+		*RipRelative = State->Is64BitCode;
+	}
+	else
+	{
+		base = (SvEmuU8)(rm | ((Instruction->Rex & 0x1) << 3));
+		address = State->Gpr[base];
+		if (rm == SvEmuRbp)
+		{
+			Instruction->Segment = SvEmuSs;
+		}
+	}
+
+	if (mod == 1)
+	{
+		if (!SvEmupFetch(Bytes, Count, Offset, 1, &displacement))
+		{
+			return SvEmuTruncated;
+		}
+		displacement = SvEmupSignExtend(displacement, 1);
+	}
+	else if (mod == 2)
+	{
+		if (!SvEmupFetch(Bytes, Count, Offset, 4, &displacement))
+		{
+			return SvEmuTruncated;
+		}
+		displacement = SvEmupSignExtend(displacement, 4);
+	}
+
+	Instruction->Address = address + displacement;
+	return SvEmuOk;
+}
+
+//
+// Decodes the Count bytes at Bytes, which start at State->Rip.
+//
+static inline SV_EMU_STATUS SvEmuDecode(
+	const SV_EMU_STATE* State,
+	const SvEmuU8* Bytes,
+	SvEmuU32 Count,
+	PSV_EMU_INSTRUCTION Instruction)
+{
+	SvEmuU32 offset = 0;
+	SvEmuU32 i, immediateSize;
+	SvEmuU16 entry = 0;
+	SvEmuU8 opcode, flags, segment = 0xff;
+	int operandSizePrefix = 0, addressSizePrefix = 0, ripRelative = 0;
+	SV_EMU_STATUS status;
+
+	Instruction->Immediate = 0;
+	Instruction->Address = 0;
+	Instruction->Rep = 0;
+	Instruction->Rex = 0;
+	Instruction->Reg = 0;
+	Instruction->Segment = SvEmuDs;
+
+	//
+	// Legacy prefixes and REX. REX is ignored unless it is right before the
+	// opcode.
+	//
+	for (;; offset++)
+	{
+		if (offset >= SV_EMU_MAX_LENGTH)
+		{
+			return SvEmuUnsupported;
+		}
+		if (offset >= Count)
+		{
+			return SvEmuTruncated;
+		}
+		opcode = Bytes[offset];
+		if (State->Is64BitCode && (opcode & 0xf0) == 0x40)
+		{
+			Instruction->Rex = opcode;
+			continue;
+		}
+		switch (opcode)
+		{
+		case 0x26: segment = SvEmuEs; break;
+		case 0x2e: segment = SvEmuCs; break;
+		case 0x36: segment = SvEmuSs; break;
+		case 0x3e: segment = SvEmuDs; break;
+		case 0x64: segment = SvEmuFs; break;
+		case 0x65: segment = SvEmuGs; break;
+		case 0x66: operandSizePrefix = 1; break;
+		case 0x67: addressSizePrefix = 1; break;
+		case 0xf0: break;
+		case 0xf2: case 0xf3: Instruction->Rep = opcode; break;
+		default:
+			opcode = 0;
+			break;
+		}
+		if (opcode == 0)
+		{
+			break;
+		}
+		Instruction->Rex = 0;
+	}
+
+	opcode = Bytes[offset++];
+	if (opcode == 0x0f)
+	{
+		if (offset >= Count)
+		{
+			return SvEmuTruncated;
+		}
+		opcode = Bytes[offset++];
+		for (i = 0; i < sizeof(g_SvEmuTwoByteMap) / sizeof(g_SvEmuTwoByteMap[0]); i++)
+		{
+			if (g_SvEmuTwoByteMap[i][0] == opcode)
+			{
+				entry = g_SvEmuTwoByteMap[i][1];
+				break;
+			}
+		}
+	}
+	else
+	{
+		entry = g_SvEmuOneByteMap[opcode];
+	}
+	if (entry == 0)
+	{
+		return SvEmuUnsupported;
+	}
+
+	Instruction->Operation = (SvEmuU8)(entry >> 8);
+	Instruction->Form = (SvEmuU8)(entry & 0xf);
+	flags = (SvEmuU8)(entry & 0xf0);
+
+	//
+	// Sizes. 16-bit addressing, in 32-bit code with 67, is not supported.
+	//
+	if (State->Is64BitCode)
+	{
+		Instruction->AddressSize = addressSizePrefix ? 4 : 8;
+	}
+	else
+	{
+		if (addressSizePrefix)
+		{
+			return SvEmuUnsupported;
+		}
+		Instruction->AddressSize = 4;
+	}
+	if (Instruction->Rex & 0x8)
+	{
+		Instruction->OperandSize = 8;
+	}
+	else
+	{
+		Instruction->OperandSize = operandSizePrefix ? 2 : 4;
+	}
+	Instruction->SourceSize = Instruction->OperandSize;
+	if (Instruction->Operation == SV_EMU_OP_MOVZX || Instruction->Operation == SV_EMU_OP_MOVSX)
+	{
+		Instruction->SourceSize = (flags & SV_EMU_FLAG_WORD) ? 2 : 1;
+	}
+	else if (flags & SV_EMU_FLAG_BYTE)
+	{
+		Instruction->OperandSize = Instruction->SourceSize = 1;
+	}
+
+	//
+	// Memory operand.
+	//
+	switch (Instruction->Form)
+	{
+	case SV_EMU_FORM_MR:
+	case SV_EMU_FORM_RM:
+	case SV_EMU_FORM_MI:
+	case SV_EMU_FORM_MI8:
+		status = SvEmupDecodeModRm(State, Bytes, Count, &offset, Instruction, &ripRelative);
+		if (status != SvEmuOk)
+		{
+			return status;
+		}
+		if ((flags & SV_EMU_FLAG_REG0) && (Instruction->Reg & 7) != 0)
+		{
+			return SvEmuUnsupported;
+		}
+		if (Instruction->Operation == SV_EMU_OP_GROUP1)
+		{
+			Instruction->Operation = (SvEmuU8)((Instruction->Reg & 7) + SV_EMU_OP_ADD);
+		}
+		break;
+	case SV_EMU_FORM_LOAD:
+	case SV_EMU_FORM_STORE:
+		if (!SvEmupFetch(Bytes, Count, &offset, Instruction->AddressSize, &Instruction->Address))
+		{
+			return SvEmuTruncated;
+		}
+		break;
+	default:
+		break;
+	}
+	if (segment != 0xff)
+	{
+		Instruction->Segment = segment;
+	}
+
+	//
+	// Immediate.
+	//
+	if (Instruction->Form == SV_EMU_FORM_MI || Instruction->Form == SV_EMU_FORM_MI8)
+	{
+		immediateSize = (Instruction->Form == SV_EMU_FORM_MI8) ? 1 :
+			(Instruction->OperandSize == 8) ? 4 : Instruction->OperandSize;
+		if (!SvEmupFetch(Bytes, Count, &offset, immediateSize, &Instruction->Immediate))
+		{
+			return SvEmuTruncated;
+		}
+		Instruction->Immediate = SvEmupSignExtend(Instruction->Immediate, immediateSize);
+	}
+
+	Instruction->Length = (SvEmuU8)offset;
+	if (ripRelative)
+	{
+		Instruction->Address += State->Rip + offset;
+	}
+	Instruction->Address &= SvEmupMask(Instruction->AddressSize);
+	if (!State->Is64BitCode || Instruction->Segment >= SvEmuFs)
+	{
+		Instruction->Address += State->SegmentBase[Instruction->Segment];
+	}
+	if (!State->Is64BitCode)
+	{
+		Instruction->Address &= 0xffffffff;
+	}
+	return SvEmuOk;
+}
+
+static inline SvEmuU64 SvEmupGetRegister(
+	const SV_EMU_STATE* State,
+	const SV_EMU_INSTRUCTION* Instruction,
+	SvEmuU8 Register,
+	SvEmuU32 Size)
+{
+	//
+	// Without REX, byte registers 4-7 are AH, CH, DH and BH.
+	//
+	if (Size == 1 && Instruction->Rex == 0 && Register >= 4)
+	{
+		return (State->Gpr[Register - 4] >> 8) & 0xff;
+	}
+	return State->Gpr[Register] & SvEmupMask(Size);
+}
+
+static inline void SvEmupSetRegister(
+	PSV_EMU_STATE State,
+	const SV_EMU_INSTRUCTION* Instruction,
+	SvEmuU8 Register,
+	SvEmuU32 Size,
+	SvEmuU64 Value)
+{
+	if (Size == 1 && Instruction->Rex == 0 && Register >= 4)
+	{
+		State->Gpr[Register - 4] = (State->Gpr[Register - 4] & ~(SvEmuU64)0xff00) |
+			((Value & 0xff) << 8);
+	}
+	else if (Size == 4)
+	{
+		State->Gpr[Register] = Value & 0xffffffff;  // Zero-extended to 64 bits
+	}
+	else
+	{
+		State->Gpr[Register] = (State->Gpr[Register] & ~SvEmupMask(Size)) |
+			(Value & SvEmupMask(Size));
+	}
+}
+
+//
+// Computes Destination Operation Source of Size bytes and the arithmetic
+// flags it sets.
+//
+static inline SvEmuU64 SvEmupAlu(
+	SvEmuU8 Operation,
+	SvEmuU32 Size,
+	SvEmuU64 Destination,
+	SvEmuU64 Source,
+	SvEmuU64* Rflags)
+{
+	const SvEmuU64 mask = SvEmupMask(Size);
+	const SvEmuU64 signBit = (SvEmuU64)1 << (Size * 8 - 1);
+	const SvEmuU64 carryIn = *Rflags & SV_EMU_RFLAGS_CF;
+	SvEmuU64 result, flags = 0;
+	SvEmuU8 parity;
+
+	Destination &= mask;
+	Source &= mask;
+	switch (Operation)
+	{
+	case SV_EMU_OP_ADD:
+	case SV_EMU_OP_ADC:
+		result = (Destination + Source + ((Operation == SV_EMU_OP_ADC) ? carryIn : 0)) & mask;
+		if (result < Destination || (result == Destination && Operation == SV_EMU_OP_ADC && carryIn))
+		{
+			flags |= SV_EMU_RFLAGS_CF;
+		}
+		if (((Destination ^ result) & (Source ^ result)) & signBit)
+		{
+			flags |= SV_EMU_RFLAGS_OF;
+		}
+		flags |= (Destination ^ Source ^ result) & SV_EMU_RFLAGS_AF;
+		break;
+	case SV_EMU_OP_SUB:
+	case SV_EMU_OP_SBB:
+	case SV_EMU_OP_CMP:
+		result = (Destination - Source - ((Operation == SV_EMU_OP_SBB) ? carryIn : 0)) & mask;
+		if (Destination < Source || (Destination == Source && Operation == SV_EMU_OP_SBB && carryIn))
+		{
+			flags |= SV_EMU_RFLAGS_CF;
+		}
+		if (((Destination ^ Source) & (Destination ^ result)) & signBit)
+		{
+			flags |= SV_EMU_RFLAGS_OF;
+		}
+		flags |= (Destination ^ Source ^ result) & SV_EMU_RFLAGS_AF;
+		break;
+	case SV_EMU_OP_OR:
+		result = Destination | Source;
+		break;
+	case SV_EMU_OP_XOR:
+		result = Destination ^ Source;
+		break;
+	default:    // AND and TEST
+		result = Destination & Source;
+		break;
+	}
+
+	if (result == 0)
+	{
+		flags |= SV_EMU_RFLAGS_ZF;
+	}
+	if (result & signBit)
+	{
+		flags |= SV_EMU_RFLAGS_SF;
+	}
+	parity = (SvEmuU8)result;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	if ((parity & 1) == 0)
+	{
+		flags |= SV_EMU_RFLAGS_PF;
+	}
+	*Rflags = (*Rflags & ~(SvEmuU64)SV_EMU_RFLAGS_ARITH) | flags;
+	return result;
+}
+
+//
+// Emulates a REP MOVS or STOS, or a single one.
+//
+static inline SV_EMU_STATUS SvEmupString(
+	PSV_EMU_STATE State,
+	const SV_EMU_INSTRUCTION* Instruction,
+	const SV_EMU_MEMORY* Memory)
+{
+	const SvEmuU64 addressMask = SvEmupMask(Instruction->AddressSize);
+	const SvEmuU32 size = Instruction->OperandSize;
+	const SvEmuU64 step = (State->Rflags & SV_EMU_RFLAGS_DF) ? (SvEmuU64)0 - size : size;
+	const SvEmuU64 sourceBase = (!State->Is64BitCode || Instruction->Segment >= SvEmuFs) ?
+		State->SegmentBase[Instruction->Segment] : 0;
+	const SvEmuU64 destinationBase = State->Is64BitCode ? 0 : State->SegmentBase[SvEmuEs];
+	SvEmuU64 value;
+
+	for (;;)
+	{
+		if (Instruction->Rep && (State->Gpr[SvEmuRcx] & addressMask) == 0)
+		{
+			break;
+		}
+		if (Instruction->Operation == SV_EMU_OP_MOVS)
+		{
+			if (!Memory->Read(Memory->Context,
+							  (sourceBase + (State->Gpr[SvEmuRsi] & addressMask)) & SvEmupMask(State->Is64BitCode ? 8 : 4),
+							  size,
+							  &value))
+			{
+				return SvEmuMemoryError;
+			}
+		}
+		else
+		{
+			value = State->Gpr[SvEmuRax] & SvEmupMask(size);
+		}
+		if (!Memory->Write(Memory->Context,
+						   (destinationBase + (State->Gpr[SvEmuRdi] & addressMask)) & SvEmupMask(State->Is64BitCode ? 8 : 4),
+						   size,
+						   value))
+		{
+			return SvEmuMemoryError;
+		}
+
+		//
+		// Index and count registers are updated at the address size, which
+		// zero-extends 32-bit ones in 64-bit code.
+		//
+		if (Instruction->Operation == SV_EMU_OP_MOVS)
+		{
+			State->Gpr[SvEmuRsi] = (State->Gpr[SvEmuRsi] + step) & addressMask;
+		}
+		State->Gpr[SvEmuRdi] = (State->Gpr[SvEmuRdi] + step) & addressMask;
+		if (!Instruction->Rep)
+		{
+			break;
+		}
+		State->Gpr[SvEmuRcx] = (State->Gpr[SvEmuRcx] - 1) & addressMask;
+	}
+	return SvEmuOk;
+}
+
+//
+// Emulates a decoded instruction and advances RIP past it. On failure, RIP
+// is left as is.
+//
+static inline SV_EMU_STATUS SvEmuExecute(
+	PSV_EMU_STATE State,
+	const SV_EMU_INSTRUCTION* Instruction,
+	const SV_EMU_MEMORY* Memory)
+{
+	const SvEmuU32 size = Instruction->OperandSize;
+	SvEmuU64 memory = 0, other, result;
+	SV_EMU_STATUS status;
+	int readsMemory, writesMemory;
+
+	switch (Instruction->Form)
+	{
+	case SV_EMU_FORM_STRING:
+		status = SvEmupString(State, Instruction, Memory);
+		if (status != SvEmuOk)
+		{
+			return status;
+		}
+		break;
+
+	case SV_EMU_FORM_LOAD:
+	case SV_EMU_FORM_STORE:
+		if (Instruction->Form == SV_EMU_FORM_LOAD)
+		{
+			if (!Memory->Read(Memory->Context, Instruction->Address, size, &memory))
+			{
+				return SvEmuMemoryError;
+			}
+			SvEmupSetRegister(State, Instruction, SvEmuRax, size, memory);
+		}
+		else if (!Memory->Write(Memory->Context,
+								Instruction->Address,
+								size,
+								State->Gpr[SvEmuRax] & SvEmupMask(size)))
+		{
+			return SvEmuMemoryError;
+		}
+		break;
+
+	default:
+		//
+		// The other operand is the register or the immediate.
+		//
+		other = (Instruction->Form == SV_EMU_FORM_MI || Instruction->Form == SV_EMU_FORM_MI8) ?
+			Instruction->Immediate :
+			SvEmupGetRegister(State, Instruction, Instruction->Reg, size);
+
+		readsMemory = (Instruction->Operation != SV_EMU_OP_MOV) ||
+			(Instruction->Form == SV_EMU_FORM_RM);
+		writesMemory = (Instruction->Form != SV_EMU_FORM_RM) &&
+			(Instruction->Operation != SV_EMU_OP_CMP) &&
+			(Instruction->Operation != SV_EMU_OP_TEST);
+
+		if (readsMemory &&
+			!Memory->Read(Memory->Context, Instruction->Address, Instruction->SourceSize, &memory))
+		{
+			return SvEmuMemoryError;
+		}
+
+		switch (Instruction->Operation)
+		{
+		case SV_EMU_OP_MOV:
+			result = (Instruction->Form == SV_EMU_FORM_RM) ? memory : other;
+			break;
+		case SV_EMU_OP_MOVZX:
+			result = memory;
+			break;
+		case SV_EMU_OP_MOVSX:
+			result = SvEmupSignExtend(memory, Instruction->SourceSize);
+			break;
+		default:
+			result = (Instruction->Form == SV_EMU_FORM_RM) ?
+				SvEmupAlu(Instruction->Operation, size, other, memory, &State->Rflags) :
+				SvEmupAlu(Instruction->Operation, size, memory, other, &State->Rflags);
+			break;
+		}
+
+		if (writesMemory)
+		{
+			if (!Memory->Write(Memory->Context, Instruction->Address, size, result & SvEmupMask(size)))
+			{
+				return SvEmuMemoryError;
+			}
+		}
+		else if (Instruction->Operation != SV_EMU_OP_CMP && Instruction->Operation != SV_EMU_OP_TEST)
+		{
+			SvEmupSetRegister(State, Instruction, Instruction->Reg, size, result);
+		}
+		break;
+	}
+
+	State->Rip += Instruction->Length;
+	if (!State->Is64BitCode)
+	{
+		State->Rip &= 0xffffffff;
+	}
+	return SvEmuOk;
+}
+
+//
+// Decodes and emulates the instruction in Bytes.
+//
+static inline SV_EMU_STATUS SvEmulateInstruction(
+	PSV_EMU_STATE State,
+	const SvEmuU8* Bytes,
+	SvEmuU32 Count,
+	const SV_EMU_MEMORY* Memory)
+{
+	SV_EMU_INSTRUCTION instruction;
+	SV_EMU_STATUS status;
+
+	status = SvEmuDecode(State, Bytes, Count, &instruction);
+	if (status != SvEmuOk)
+	{
+		return status;
+	}
+	return SvEmuExecute(State, &instruction, Memory);
+}
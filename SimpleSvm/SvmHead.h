@@ -9,4 +9,5 @@
 #include <minwindef.h>
 
 #include "log/log.h"
+#include "log/export.h"
 #include "common.h"
\ No newline at end of file
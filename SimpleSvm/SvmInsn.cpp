@@ -0,0 +1,341 @@
+#include "SvmInsn.h"
+#include "BaseUtil.h"
+
+#define SV_PAGE_FRAME_MASK      0x000ffffffffff000ULL
+#define SV_PAGE_ENTRY_PRESENT   (1ULL << 0)
+#define SV_PAGE_ENTRY_LARGE     (1ULL << 7)
+
+//
+// Whether the guest runs 64-bit code, where RIP is not truncated and REX
+// prefixes exist.
+//
+BOOLEAN SvIsGuest64BitCode(
+	_In_ PVMCB GuestVmcb)
+{
+	SEGMENT_ATTRIBUTE attribute;
+
+	attribute.AsUInt16 = GuestVmcb->StateSaveArea.CsAttrib;
+	return ((GuestVmcb->StateSaveArea.Efer & EFER_LMA) != 0) &&
+		(attribute.Fields.LongMode != 0);
+}
+
+//
+// Checks if every entry a cached walk read still has the value it read.
+//
+static BOOLEAN SvIsGuestWalkCurrent(
+	_In_ const SV_FETCH_CACHE_ENTRY* Cached)
+{
+	UINT64 changed = 0;
+
+	for (ULONG i = 0; i < Cached->Levels; i++)
+	{
+		changed |= *Cached->Entries[i] ^ Cached->Values[i];
+	}
+	return (changed == 0);
+}
+
+//
+// Translates LinearPage with the guest's 4 or 5 level page tables, reusing an
+// earlier walk when none of its entries changed.
+//
+static BOOLEAN SvTranslateGuestPage(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_In_ UINT64 LinearPage,
+	_Out_ UINT64* PhysicalPage)
+{
+	const auto nestData = VpData->HostStackLayout.pProcessNestData;
+	const UINT64 cr3 = GuestVmcb->StateSaveArea.Cr3 & SV_PAGE_FRAME_MASK;
+	PSV_FETCH_CACHE_ENTRY cached;
+	volatile UINT64* entry;
+	UINT64 table, entryPa, value, pageMask;
+	ULONG level, shift, walked;
+
+	cached = &nestData->FetchCache->Entries[(LinearPage >> PAGE_SHIFT) % SV_FETCH_CACHE_ENTRIES];
+	if (cached->Levels != 0 &&
+		cached->Cr3 == cr3 &&
+		cached->LinearPage == LinearPage &&
+		SvIsGuestWalkCurrent(cached) != FALSE)
+	{
+		*PhysicalPage = cached->PhysicalPage;
+		return TRUE;
+	}
+
+	nestData->Stats.Counters[SV_STATS_GUEST_PAGE_WALKS]++;
+
+	//
+	// Invalidate the entry until the walk completes.
+	//
+	cached->Levels = 0;
+	walked = 0;
+
+	table = cr3;
+	level = (GuestVmcb->StateSaveArea.Cr4 & CR4_LA57) ? 5 : 4;
+	for (; level > 0; level--)
+	{
+		shift = PAGE_SHIFT + 9 * (level - 1);
+		entryPa = table + ((LinearPage >> shift) & 0x1ff) * sizeof(UINT64);
+		entry = static_cast<volatile UINT64*>(UtilVaFromPa(entryPa));
+		if (entry == nullptr)
+		{
+			return FALSE;
+		}
+		value = *entry;
+		if ((value & SV_PAGE_ENTRY_PRESENT) == 0)
+		{
+			return FALSE;
+		}
+		cached->Entries[walked] = entry;
+		cached->Values[walked] = value;
+		walked++;
+
+		//
+		// A 4KB page, or a 2MB or 1GB page.
+		//
+		if (level == 1 || ((level <= 3) && (value & SV_PAGE_ENTRY_LARGE) != 0))
+		{
+			pageMask = (1ULL << shift) - 1;
+			*PhysicalPage = (value & SV_PAGE_FRAME_MASK & ~pageMask) | (LinearPage & pageMask);
+
+			cached->Cr3 = cr3;
+			cached->LinearPage = LinearPage;
+			cached->PhysicalPage = *PhysicalPage;
+			cached->Levels = walked;
+			return TRUE;
+		}
+		table = value & SV_PAGE_FRAME_MASK;
+	}
+	return FALSE;
+}
+
+//
+// Translates a guest linear address in system space to a physical address.
+//
+BOOLEAN SvTranslateGuestAddress(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_In_ UINT64 Linear,
+	_Out_ UINT64* Physical)
+{
+	UINT64 physicalPage;
+
+	*Physical = 0;
+	if ((GuestVmcb->StateSaveArea.Cr0 & CR0_PG) == 0 ||
+		(GuestVmcb->StateSaveArea.Efer & EFER_LMA) == 0 ||
+		(Linear >> 63) == 0)
+	{
+		return FALSE;
+	}
+	if (SvTranslateGuestPage(VpData,
+							 GuestVmcb,
+							 Linear & ~static_cast<UINT64>(PAGE_SIZE - 1),
+							 &physicalPage) == FALSE)
+	{
+		return FALSE;
+	}
+	*Physical = physicalPage + BYTE_OFFSET(Linear);
+	return TRUE;
+}
+
+//
+// Reads up to SV_MAX_INSTRUCTION_LENGTH bytes at the guest's RIP. Fewer are
+// returned if the next page is not present, which is fine for instructions
+// that end before it.
+//
+static BOOLEAN SvReadGuestCode(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_Out_ PSV_GUEST_INSTRUCTION Instruction)
+{
+	UINT64 linear, physical;
+	ULONG offset, chunk;
+	PVOID va;
+
+	Instruction->Count = 0;
+
+	linear = GuestVmcb->StateSaveArea.Rip;
+	if (SvIsGuest64BitCode(GuestVmcb) == FALSE)
+	{
+		linear = (GuestVmcb->StateSaveArea.CsBase + linear) & MAXUINT32;
+	}
+	if (GuestVmcb->StateSaveArea.Cpl != 0)
+	{
+		return FALSE;
+	}
+
+	while (Instruction->Count < SV_MAX_INSTRUCTION_LENGTH)
+	{
+		offset = static_cast<ULONG>(BYTE_OFFSET(linear + Instruction->Count));
+		if (SvTranslateGuestAddress(VpData,
+									GuestVmcb,
+									linear + Instruction->Count,
+									&physical) == FALSE)
+		{
+			break;
+		}
+		va = UtilVaFromPa(physical);
+		if (va == nullptr)
+		{
+			break;
+		}
+		chunk = min(static_cast<ULONG>(SV_MAX_INSTRUCTION_LENGTH - Instruction->Count),
+					PAGE_SIZE - offset);
+		RtlCopyMemory(&Instruction->Bytes[Instruction->Count], va, chunk);
+		Instruction->Count += static_cast<UINT8>(chunk);
+	}
+	return (Instruction->Count != 0);
+}
+
+//
+// Returns the length of an instruction the hypervisor intercepts, or 0 if it
+// is not one of them or is cut short.
+//
+static ULONG SvDecodeInstructionLength(
+	_In_ const SV_GUEST_INSTRUCTION* Instruction,
+	_In_ BOOLEAN Is64BitCode)
+{
+	const UINT8* bytes = Instruction->Bytes;
+	ULONG i = 0;
+
+	//
+	// Legacy prefixes, then REX.
+	//
+	for (; i < Instruction->Count; i++)
+	{
+		switch (bytes[i])
+		{
+		case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+		case 0x66: case 0x67: case 0xf0: case 0xf2: case 0xf3:
+			continue;
+		}
+		break;
+	}
+	if (Is64BitCode && i < Instruction->Count && (bytes[i] & 0xf0) == 0x40)
+	{
+		i++;
+	}
+	if (i >= Instruction->Count)
+	{
+		return 0;
+	}
+
+	switch (bytes[i])
+	{
+	case 0x0f:
+		if (i + 1 >= Instruction->Count)
+		{
+			return 0;
+		}
+		switch (bytes[i + 1])
+		{
+		case 0x30:  // WRMSR
+		case 0x31:  // RDTSC
+		case 0x32:  // RDMSR
+		case 0x33:  // RDPMC
+		case 0xa2:  // CPUID
+			return i + 2;
+		case 0x01:
+			//
+			// Register forms only: VMRUN, VMMCALL, VMLOAD, VMSAVE, STGI, CLGI,
+			// SKINIT, INVLPGA, RDTSCP, XSETBV, MONITOR, MWAIT and so on.
+			//
+			if (i + 2 < Instruction->Count && bytes[i + 2] >= 0xc0)
+			{
+				return i + 3;
+			}
+			return 0;
+		}
+		return 0;
+	case 0xe4: case 0xe5: case 0xe6: case 0xe7:    // IN and OUT with imm8
+		return (i + 1 < Instruction->Count) ? i + 2 : 0;
+	case 0x6c: case 0x6d: case 0x6e: case 0x6f:    // INS and OUTS
+	case 0xec: case 0xed: case 0xee: case 0xef:    // IN and OUT with DX
+	case 0x90:  // PAUSE
+	case 0xcc:  // INT3
+	case 0xf4:  // HLT
+		return i + 1;
+	}
+	return 0;
+}
+
+//
+// Returns the bytes of the instruction at the guest's RIP; FALSE if they
+// are not available.
+//
+BOOLEAN SvFetchGuestInstruction(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_Out_ PSV_GUEST_INSTRUCTION Instruction)
+{
+	const auto exitCode = GuestVmcb->ControlArea.ExitCode;
+	const auto fetched = GuestVmcb->ControlArea.NumOfBytesFetched;
+
+	if ((exitCode == VMEXIT_NPF || exitCode == VMEXIT_EXCEPTION_PF) && fetched != 0)
+	{
+		Instruction->Count = min(fetched, static_cast<UINT8>(SV_MAX_INSTRUCTION_LENGTH));
+		RtlCopyMemory(Instruction->Bytes,
+					  GuestVmcb->ControlArea.GuestInstructionBytes,
+					  Instruction->Count);
+		return TRUE;
+	}
+	return SvReadGuestCode(VpData, GuestVmcb, Instruction);
+}
+
+//
+// Returns the address of the instruction after the one that caused the
+// #VMEXIT; FALSE if it cannot be determined.
+//
+BOOLEAN SvGetNextGuestRip(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_Out_ UINT64* NextRip)
+{
+	SV_GUEST_INSTRUCTION instruction;
+	BOOLEAN is64BitCode;
+	ULONG length;
+
+	if (GuestVmcb->ControlArea.NRip != 0)
+	{
+		*NextRip = GuestVmcb->ControlArea.NRip;
+		return TRUE;
+	}
+
+	*NextRip = 0;
+	if (SvFetchGuestInstruction(VpData, GuestVmcb, &instruction) == FALSE)
+	{
+		return FALSE;
+	}
+	is64BitCode = SvIsGuest64BitCode(GuestVmcb);
+	length = SvDecodeInstructionLength(&instruction, is64BitCode);
+	if (length == 0)
+	{
+		return FALSE;
+	}
+
+	*NextRip = GuestVmcb->StateSaveArea.Rip + length;
+	if (is64BitCode == FALSE)
+	{
+		*NextRip &= MAXUINT32;
+	}
+	return TRUE;
+}
+
+//
+// Completes the instruction that caused the #VMEXIT by moving RIP past it.
+// If that is not possible, RIP is left as is and the guest executes the
+// instruction again.
+//
+BOOLEAN SvAdvanceGuestRip(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PVMCB GuestVmcb)
+{
+	UINT64 nextRip;
+
+	if (SvGetNextGuestRip(VpData, GuestVmcb, &nextRip) == FALSE)
+	{
+		SV_DEBUG_BREAK();
+		return FALSE;
+	}
+	GuestVmcb->StateSaveArea.Rip = nextRip;
+	return TRUE;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "SvmHead.h"
+#include "SvmStruct.h"
+
+//
+// Completion and fetch of the guest instruction that caused a #VMEXIT.
+//
+// Handlers do not assume instruction lengths. SvAdvanceGuestRip moves RIP
+// past the instruction using, in order:
+//  1. NRip, which the processor saves for instruction, MSR and IOIO intercepts
+//     when it has the NRIP save feature, and clears for other #VMEXITs;
+//  2. the length decoded from the bytes SvFetchGuestInstruction returns.
+// SvFetchGuestInstruction returns the bytes from, in order:
+//  1. GuestInstructionBytes, which the processor fills for #NPF and #PF
+//     intercepts when it has decode assists (NumOfBytesFetched is not 0).
+//     They are used for those #VMEXITs only; for others the fields hold
+//     whatever an earlier #VMEXIT left there;
+//  2. guest memory, through a per-processor cache of guest page walks.
+// Only the last steps read guest page tables. Processors with NPT have both
+// features, so handlers do not on the hot path; SV_STATS_GUEST_PAGE_WALKS
+// counts walks.
+//
+// The guest memory path, SvTranslateGuestAddress included, serves system
+// space addresses only, and instruction fetch kernel-mode code only. Host and
+// guest share the system half of the address space, so page tables are read
+// through UtilVaFromPa; other guest memory may not be mapped in the host.
+//
+#define SV_MAX_INSTRUCTION_LENGTH   15
+#define SV_MAX_PAGING_LEVELS        5
+#define SV_FETCH_CACHE_ENTRIES      32
+
+typedef struct _SV_GUEST_INSTRUCTION
+{
+	UINT8 Bytes[SV_MAX_INSTRUCTION_LENGTH];
+	UINT8 Count;        // Bytes valid in Bytes
+} SV_GUEST_INSTRUCTION, *PSV_GUEST_INSTRUCTION;
+
+//
+// A guest page walk. It is reused while Cr3 is the same and every entry the
+// walk read, at every level, still has the value it read: the guest may
+// change any level, and L0 does not intercept the CR3 writes or INVLPG that
+// would tell it. Checking the entries takes loads that do not depend on each
+// other, unlike the walk's.
+//
+typedef struct _SV_FETCH_CACHE_ENTRY
+{
+	UINT64 Cr3;
+	UINT64 LinearPage;
+	UINT64 PhysicalPage;
+	ULONG Levels;       // Entries the walk read, from the top level down
+	volatile UINT64* Entries[SV_MAX_PAGING_LEVELS];
+	UINT64 Values[SV_MAX_PAGING_LEVELS];
+} SV_FETCH_CACHE_ENTRY, *PSV_FETCH_CACHE_ENTRY;
+
+typedef struct _SV_FETCH_CACHE
+{
+	SV_FETCH_CACHE_ENTRY Entries[SV_FETCH_CACHE_ENTRIES];
+} SV_FETCH_CACHE, *PSV_FETCH_CACHE;
+static_assert(sizeof(SV_FETCH_CACHE) <= PAGE_SIZE, "SV_FETCH_CACHE Size Mismatch");
+
+BOOLEAN SvIsGuest64BitCode(
+	_In_ PVMCB GuestVmcb);
+
+BOOLEAN SvTranslateGuestAddress(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_In_ UINT64 Linear,
+	_Out_ UINT64* Physical);
+
+BOOLEAN SvFetchGuestInstruction(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_Out_ PSV_GUEST_INSTRUCTION Instruction);
+
+BOOLEAN SvGetNextGuestRip(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_Out_ UINT64* NextRip);
+
+BOOLEAN SvAdvanceGuestRip(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PVMCB GuestVmcb);
@@ -0,0 +1,467 @@
+#pragma once
+
+//
+// I/O port interception: the I/O permissions map (IOPM), a registry of
+// per-port handlers, and the engine that performs an intercepted IN, OUT,
+// INS or OUTS through them.
+//
+// A handler covers a range of ports and is called once per port access of
+// 1, 2 or 4 bytes, with the port the instruction addressed. The IOPM is
+// built from the registry, so only registered ports cause #VMEXIT(IOIO).
+// An access that spans ports of a handler and ports outside it goes to that
+// handler; one no handler covers goes to the default routine.
+//
+// A REP INS or OUTS is performed for up to MaxCount elements in one
+// #VMEXIT instead of one #VMEXIT per element, so that monitoring a port
+// that a driver streams through does not multiply exits. When more remain,
+// RIP is left at the instruction with the registers updated, the same as an
+// interrupted REP string instruction, and the guest executes it again for
+// the rest after taking pending interrupts. If a handler or memory access
+// fails part way, the registers likewise reflect the elements done; an
+// element read from a port whose write to memory failed is lost.
+//
+// This file does not depend on the WDK so that the IOPM builder and the
+// engine can be built and tested in user mode, on Windows or Linux, as is.
+//
+#include "SvmEmulate.h"
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#define SV_IOPM_TARGET_AVX2
+#else
+#define SV_IOPM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+//
+// The IOPM has a bit per port, set to intercept the port. An access of N
+// bytes at port P is intercepted when any of bits P through P+N-1 is set;
+// the bits after 0xFFFF are for accesses that run past the last port.
+//
+#define SV_IOPM_SIZE            (3 * 4096)
+#define SV_IOPM_PAGE_SIZE       4096
+#define SV_IO_PORT_COUNT        0x10000
+
+//
+// EXITINFO1 of #VMEXIT(IOIO). EXITINFO2 is the RIP of the next instruction.
+//
+#define SV_IOIO_TYPE_IN         (1u << 0)
+#define SV_IOIO_STRING          (1u << 2)
+#define SV_IOIO_REP             (1u << 3)
+#define SV_IOIO_SIZE8           (1u << 4)
+#define SV_IOIO_SIZE16          (1u << 5)
+#define SV_IOIO_SIZE32          (1u << 6)
+#define SV_IOIO_ADDRESS16       (1u << 7)
+#define SV_IOIO_ADDRESS32       (1u << 8)
+#define SV_IOIO_ADDRESS64       (1u << 9)
+#define SV_IOIO_SEGMENT_SHIFT   10
+#define SV_IOIO_PORT_SHIFT      16
+
+//
+// A decoded EXITINFO1.
+//
+typedef struct _SV_IO_ACCESS
+{
+	SvEmuU16 Port;
+	SvEmuU8 Size;               // 1, 2 or 4
+	SvEmuU8 AddressSize;        // 2, 4 or 8
+	SvEmuU8 Segment;            // SV_EMU_SEGMENT of OUTS
+	SvEmuU8 IsIn;
+	SvEmuU8 IsString;
+	SvEmuU8 IsRep;
+} SV_IO_ACCESS, *PSV_IO_ACCESS;
+
+//
+// Performs one access of Size bytes at Port. For IN, the routine stores the
+// value read to Value; for OUT, Value holds the value to write. Return 0 to
+// fail the instruction.
+//
+typedef int (*SV_IO_ROUTINE)(void* Context, SvEmuU16 Port, SvEmuU32 Size, int IsIn, SvEmuU32* Value);
+
+#define SV_IO_MAX_HANDLERS      16
+
+typedef struct _SV_IO_HANDLER
+{
+	SvEmuU32 FirstPort;
+	SvEmuU32 PortCount;
+	SV_IO_ROUTINE Routine;
+	void* Context;
+} SV_IO_HANDLER, *PSV_IO_HANDLER;
+
+typedef struct _SV_IO_REGISTRY
+{
+	SV_IO_HANDLER Handlers[SV_IO_MAX_HANDLERS];
+	SvEmuU32 Count;                 // Entries used in Handlers
+	SV_IO_ROUTINE DefaultRoutine;   // For ports without a handler; may be NULL
+	void* DefaultContext;
+} SV_IO_REGISTRY, *PSV_IO_REGISTRY;
+
+//
+// Adds a handler for PortCount ports from FirstPort. Fails when the registry
+// is full, or the ports are out of range or overlap another handler's.
+//
+static inline int SvIoRegisterHandler(
+	PSV_IO_REGISTRY Registry,
+	SvEmuU32 FirstPort,
+	SvEmuU32 PortCount,
+	SV_IO_ROUTINE Routine,
+	void* Context)
+{
+	SvEmuU32 i;
+	PSV_IO_HANDLER handler;
+
+	if (Registry->Count >= SV_IO_MAX_HANDLERS ||
+		Routine == 0 ||
+		PortCount == 0 ||
+		FirstPort >= SV_IO_PORT_COUNT ||
+		PortCount > SV_IO_PORT_COUNT - FirstPort)
+	{
+		return 0;
+	}
+	for (i = 0; i < Registry->Count; i++)
+	{
+		handler = &Registry->Handlers[i];
+		if (FirstPort < handler->FirstPort + handler->PortCount &&
+			handler->FirstPort < FirstPort + PortCount)
+		{
+			return 0;
+		}
+	}
+
+	handler = &Registry->Handlers[Registry->Count++];
+	handler->FirstPort = FirstPort;
+	handler->PortCount = PortCount;
+	handler->Routine = Routine;
+	handler->Context = Context;
+	return 1;
+}
+
+//
+// Returns the handler that covers any of the Size ports from Port, or NULL.
+//
+static inline const SV_IO_HANDLER* SvIoLookupHandler(
+	const SV_IO_REGISTRY* Registry,
+	SvEmuU32 Port,
+	SvEmuU32 Size)
+{
+	SvEmuU32 i;
+	const SV_IO_HANDLER* handler;
+
+	for (i = 0; i < Registry->Count; i++)
+	{
+		handler = &Registry->Handlers[i];
+		if (Port < handler->FirstPort + handler->PortCount &&
+			handler->FirstPort < Port + Size)
+		{
+			return handler;
+		}
+	}
+	return 0;
+}
+
+static inline void SvIopmSetPorts(
+	SvEmuU8* Iopm,
+	SvEmuU32 FirstPort,
+	SvEmuU32 PortCount)
+{
+	SvEmuU32 port;
+
+	for (port = FirstPort; port < FirstPort + PortCount; port++)
+	{
+		Iopm[port / 8] = (SvEmuU8)(Iopm[port / 8] | (1u << (port % 8)));
+	}
+}
+
+//
+// Whether the IOPM intercepts an access of Size bytes at Port.
+//
+static inline int SvIopmIsIntercepted(
+	const SvEmuU8* Iopm,
+	SvEmuU16 Port,
+	SvEmuU32 Size)
+{
+	SvEmuU32 port;
+
+	for (port = Port; port < (SvEmuU32)Port + Size; port++)
+	{
+		if (Iopm[port / 8] & (1u << (port % 8)))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// SvIopmIsIntercepted for an IOPM whose pages are not contiguous, such as a
+// nested guest's mapped a page at a time.
+//
+static inline int SvIopmPagesIsIntercepted(
+	const volatile SvEmuU64* const* Pages,
+	SvEmuU16 Port,
+	SvEmuU32 Size)
+{
+	const SvEmuU32 bitsPerPage = SV_IOPM_PAGE_SIZE * 8;
+	SvEmuU32 port, bit;
+
+	for (port = Port; port < (SvEmuU32)Port + Size; port++)
+	{
+		bit = port % bitsPerPage;
+		if (Pages[port / bitsPerPage][bit / 64] & ((SvEmuU64)1 << (bit % 64)))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// Builds an IOPM of SV_IOPM_SIZE bytes that intercepts the registered
+// ports and no others.
+//
+static inline void SvIoBuildIopm(
+	const SV_IO_REGISTRY* Registry,
+	SvEmuU8* Iopm)
+{
+	SvEmuU32 i;
+
+	for (i = 0; i < SV_IOPM_SIZE; i++)
+	{
+		Iopm[i] = 0;
+	}
+	for (i = 0; i < Registry->Count; i++)
+	{
+		SvIopmSetPorts(Iopm, Registry->Handlers[i].FirstPort, Registry->Handlers[i].PortCount);
+	}
+}
+
+//
+// Brings one page of a nested guest's IOPM up to date. Merged is Host ORed
+// with Guest, and Snapshot the copy of Guest it was computed from; a NULL
+// Guest intercepts every port. The page is rebuilt only if Force is set or
+// Guest differs from Snapshot, and 1 is returned if it was.
+//
+static inline int SvIopmMergePage(
+	SvEmuU64* Merged,
+	SvEmuU64* Snapshot,
+	const SvEmuU64* Host,
+	const volatile SvEmuU64* Guest,
+	int Force)
+{
+	const SvEmuU32 count = SV_IOPM_PAGE_SIZE / sizeof(SvEmuU64);
+	SvEmuU64 value;
+	SvEmuU32 i;
+
+	if (!Force)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if ((Guest ? Guest[i] : ~(SvEmuU64)0) != Snapshot[i])
+			{
+				break;
+			}
+		}
+		if (i == count)
+		{
+			return 0;
+		}
+	}
+	for (i = 0; i < count; i++)
+	{
+		value = Guest ? Guest[i] : ~(SvEmuU64)0;
+		Snapshot[i] = value;
+		Merged[i] = Host[i] | value;
+	}
+	return 1;
+}
+
+//
+// SvIopmMergePage 32 bytes at a time. The caller must be allowed to use YMM
+// registers: the processor has AVX2, XCR0 enables YMM state and, in the
+// hypervisor, the guest's state has been saved with SvXstateAcquire.
+//
+SV_IOPM_TARGET_AVX2
+static inline int SvIopmMergePageAvx2(
+	SvEmuU64* Merged,
+	SvEmuU64* Snapshot,
+	const SvEmuU64* Host,
+	const volatile SvEmuU64* Guest,
+	int Force)
+{
+	const SvEmuU32 count = SV_IOPM_PAGE_SIZE / sizeof(__m256i);
+	const __m256i all = _mm256_set1_epi64x(-1);
+	__m256i value;
+	SvEmuU32 i;
+
+	if (!Force)
+	{
+		for (i = 0; i < count; i++)
+		{
+			value = Guest ? _mm256_loadu_si256((const __m256i*)Guest + i) : all;
+			value = _mm256_cmpeq_epi64(value, _mm256_loadu_si256((const __m256i*)Snapshot + i));
+			if (_mm256_movemask_epi8(value) != -1)
+			{
+				break;
+			}
+		}
+		if (i == count)
+		{
+			return 0;
+		}
+	}
+	for (i = 0; i < count; i++)
+	{
+		value = Guest ? _mm256_loadu_si256((const __m256i*)Guest + i) : all;
+		_mm256_storeu_si256((__m256i*)Snapshot + i, value);
+		_mm256_storeu_si256((__m256i*)Merged + i,
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i*)Host + i), value));
+	}
+	return 1;
+}
+
+//
+// Decodes EXITINFO1. Fails if the operand size is not valid.
+//
+static inline int SvIoDecodeExitInfo(
+	SvEmuU64 ExitInfo1,
+	PSV_IO_ACCESS Access)
+{
+	Access->Port = (SvEmuU16)(ExitInfo1 >> SV_IOIO_PORT_SHIFT);
+	Access->Size = (ExitInfo1 & SV_IOIO_SIZE32) ? 4 :
+		(ExitInfo1 & SV_IOIO_SIZE16) ? 2 :
+		(ExitInfo1 & SV_IOIO_SIZE8) ? 1 : 0;
+	Access->AddressSize = (ExitInfo1 & SV_IOIO_ADDRESS64) ? 8 :
+		(ExitInfo1 & SV_IOIO_ADDRESS32) ? 4 : 2;
+	Access->Segment = (SvEmuU8)((ExitInfo1 >> SV_IOIO_SEGMENT_SHIFT) & 7);
+	Access->IsIn = (ExitInfo1 & SV_IOIO_TYPE_IN) != 0;
+	Access->IsString = (ExitInfo1 & SV_IOIO_STRING) != 0;
+	Access->IsRep = (ExitInfo1 & SV_IOIO_REP) != 0;
+	return (Access->Size != 0) && (Access->Segment <= SvEmuGs);
+}
+
+//
+// Performs the access and sets RIP to NextRip once the instruction is
+// complete. Elements receives the number of port accesses made.
+//
+static inline SV_EMU_STATUS SvIoExecute(
+	const SV_IO_REGISTRY* Registry,
+	const SV_IO_ACCESS* Access,
+	SvEmuU64 NextRip,
+	SvEmuU32 MaxCount,
+	PSV_EMU_STATE State,
+	const SV_EMU_MEMORY* Memory,
+	SvEmuU32* Elements)
+{
+	const SV_IO_HANDLER* handler = SvIoLookupHandler(Registry, Access->Port, Access->Size);
+	const SV_IO_ROUTINE routine = handler ? handler->Routine : Registry->DefaultRoutine;
+	void* const context = handler ? handler->Context : Registry->DefaultContext;
+	const SvEmuU32 size = Access->Size;
+	SvEmuU64 addressMask, linearMask, step, base, memory;
+	SvEmuU32 value;
+	SV_EMU_REGISTER index;
+
+	*Elements = 0;
+	if (routine == 0)
+	{
+		return SvEmuUnsupported;
+	}
+
+	if (!Access->IsString)
+	{
+		value = (SvEmuU32)(State->Gpr[SvEmuRax] & SvEmupMask(size));
+		if (!routine(context, Access->Port, size, Access->IsIn, &value))
+		{
+			return SvEmuIoError;
+		}
+		*Elements = 1;
+		if (Access->IsIn)
+		{
+			//
+			// Like other 32-bit writes, IN EAX zero-extends to RAX.
+			//
+			State->Gpr[SvEmuRax] = (size == 4) ? value :
+				(State->Gpr[SvEmuRax] & ~SvEmupMask(size)) | (value & SvEmupMask(size));
+		}
+		State->Rip = NextRip;
+		return SvEmuOk;
+	}
+
+	//
+	// INS writes to ES:rDI, OUTS reads from rSI in any segment. Only FS and
+	// GS have a base in 64-bit code.
+	//
+	if (Access->AddressSize < 4)
+	{
+		return SvEmuUnsupported;
+	}
+	addressMask = SvEmupMask(Access->AddressSize);
+	linearMask = SvEmupMask(State->Is64BitCode ? 8 : 4);
+	step = (State->Rflags & SV_EMU_RFLAGS_DF) ? (SvEmuU64)0 - size : size;
+	if (Access->IsIn)
+	{
+		index = SvEmuRdi;
+		base = State->Is64BitCode ? 0 : State->SegmentBase[SvEmuEs];
+	}
+	else
+	{
+		index = SvEmuRsi;
+		base = (!State->Is64BitCode || Access->Segment >= SvEmuFs) ?
+			State->SegmentBase[Access->Segment] : 0;
+	}
+
+	for (;;)
+	{
+		if (Access->IsRep)
+		{
+			if ((State->Gpr[SvEmuRcx] & addressMask) == 0)
+			{
+				break;
+			}
+			if (*Elements >= MaxCount)
+			{
+				return SvEmuOk;     // The guest executes the rest again
+			}
+		}
+
+		if (Access->IsIn)
+		{
+			value = 0;
+			if (!routine(context, Access->Port, size, 1, &value))
+			{
+				return SvEmuIoError;
+			}
+			(*Elements)++;
+			if (!Memory->Write(Memory->Context,
+							   (base + (State->Gpr[index] & addressMask)) & linearMask,
+							   size,
+							   value & SvEmupMask(size)))
+			{
+				return SvEmuMemoryError;
+			}
+		}
+		else
+		{
+			if (!Memory->Read(Memory->Context,
+							  (base + (State->Gpr[index] & addressMask)) & linearMask,
+							  size,
+							  &memory))
+			{
+				return SvEmuMemoryError;
+			}
+			value = (SvEmuU32)(memory & SvEmupMask(size));
+			if (!routine(context, Access->Port, size, 0, &value))
+			{
+				return SvEmuIoError;
+			}
+			(*Elements)++;
+		}
+
+		State->Gpr[index] = (State->Gpr[index] + step) & addressMask;
+		if (!Access->IsRep)
+		{
+			break;
+		}
+		State->Gpr[SvEmuRcx] = (State->Gpr[SvEmuRcx] - 1) & addressMask;
+	}
+	State->Rip = NextRip;
+	return SvEmuOk;
+}
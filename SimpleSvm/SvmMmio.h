@@ -0,0 +1,217 @@
+#pragma once
+
+//
+// Guest physical memory as the emulators see it: RAM, and MMIO ranges a
+// device model is registered for.
+//
+// An operand access of the instruction emulator (SvmEmulate.h) reaches a
+// guest physical address that is either
+//  - in a range with a handler: the handler performs it, once per access of
+//    1, 2, 4 or 8 bytes;
+//  - in RAM: the hypervisor accesses it through its own mapping;
+//  - anything else, such as MMIO without a handler or a hole: the access
+//    fails, and the instruction with it. Such memory is never dereferenced,
+//    since it may not be mapped or may have side effects on read.
+// An access that is partly in a handler's range fails as well.
+//
+// RAM ranges are captured from the OS before processors are virtualized,
+// in ascending order. If there are more than SV_MMIO_MAX_RAM_RANGES, the last
+// one is extended to cover the rest, holes included.
+//
+// This file does not depend on the WDK so that it can be built and tested in
+// user mode, on Windows or Linux, as is.
+//
+#include "SvmEmulate.h"
+
+#define SV_MMIO_MAX_HANDLERS    16
+#define SV_MMIO_MAX_RAM_RANGES  64
+
+//
+// Performs one access of Size bytes at Address. For a read, the routine
+// stores the value read to Value; for a write, Value holds the value to
+// write. Return 0 to fail the instruction.
+//
+typedef int (*SV_MMIO_ROUTINE)(void* Context, SvEmuU64 Address, SvEmuU32 Size, int IsWrite, SvEmuU64* Value);
+
+typedef struct _SV_MMIO_HANDLER
+{
+	SvEmuU64 Base;
+	SvEmuU64 Length;
+	SV_MMIO_ROUTINE Routine;
+	void* Context;
+} SV_MMIO_HANDLER, *PSV_MMIO_HANDLER;
+
+typedef struct _SV_MMIO_RANGE
+{
+	SvEmuU64 Base;
+	SvEmuU64 Length;
+} SV_MMIO_RANGE, *PSV_MMIO_RANGE;
+
+typedef struct _SV_MMIO_MAP
+{
+	SV_MMIO_HANDLER Handlers[SV_MMIO_MAX_HANDLERS];
+	SvEmuU32 HandlerCount;          // Entries used in Handlers
+	SvEmuU32 RamCount;              // Entries used in Ram
+	SV_MMIO_RANGE Ram[SV_MMIO_MAX_RAM_RANGES];
+} SV_MMIO_MAP, *PSV_MMIO_MAP;
+
+typedef enum _SV_MMIO_KIND
+{
+	SvMmioUnbacked = 0,             // Neither RAM nor a handler's range
+	SvMmioRam,
+	SvMmioDevice,
+} SV_MMIO_KIND;
+
+//
+// Whether [Base, Base + Length) overlaps the range of any handler.
+//
+static inline int SvMmioOverlapsHandler(
+	const SV_MMIO_MAP* Map,
+	SvEmuU64 Base,
+	SvEmuU64 Length)
+{
+	SvEmuU32 i;
+	const SV_MMIO_HANDLER* handler;
+
+	for (i = 0; i < Map->HandlerCount; i++)
+	{
+		handler = &Map->Handlers[i];
+		if (Base < handler->Base + handler->Length &&
+			handler->Base < Base + Length)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// Adds a handler for Length bytes from Base. Fails when the map is full, or
+// the range is empty, wraps around or overlaps another handler's.
+//
+static inline int SvMmioRegisterHandler(
+	PSV_MMIO_MAP Map,
+	SvEmuU64 Base,
+	SvEmuU64 Length,
+	SV_MMIO_ROUTINE Routine,
+	void* Context)
+{
+	PSV_MMIO_HANDLER handler;
+
+	if (Map->HandlerCount >= SV_MMIO_MAX_HANDLERS ||
+		Routine == 0 ||
+		Length == 0 ||
+		Base + Length < Base ||
+		SvMmioOverlapsHandler(Map, Base, Length))
+	{
+		return 0;
+	}
+
+	handler = &Map->Handlers[Map->HandlerCount++];
+	handler->Base = Base;
+	handler->Length = Length;
+	handler->Routine = Routine;
+	handler->Context = Context;
+	return 1;
+}
+
+//
+// Adds a RAM range above the previous one. Fails if the range is empty,
+// wraps around or is not above the previous one.
+//
+static inline int SvMmioAddRam(
+	PSV_MMIO_MAP Map,
+	SvEmuU64 Base,
+	SvEmuU64 Length)
+{
+	PSV_MMIO_RANGE last;
+
+	if (Length == 0 || Base + Length < Base)
+	{
+		return 0;
+	}
+	if (Map->RamCount != 0)
+	{
+		last = &Map->Ram[Map->RamCount - 1];
+		if (Base < last->Base + last->Length)
+		{
+			return 0;
+		}
+		if (Base == last->Base + last->Length ||
+			Map->RamCount == SV_MMIO_MAX_RAM_RANGES)
+		{
+			last->Length = Base + Length - last->Base;
+			return 1;
+		}
+	}
+	Map->Ram[Map->RamCount].Base = Base;
+	Map->Ram[Map->RamCount].Length = Length;
+	Map->RamCount++;
+	return 1;
+}
+
+//
+// Tells what an access of Size bytes at Address reaches, and for
+// SvMmioDevice, stores the handler to Handler.
+//
+static inline SV_MMIO_KIND SvMmioClassify(
+	const SV_MMIO_MAP* Map,
+	SvEmuU64 Address,
+	SvEmuU32 Size,
+	const SV_MMIO_HANDLER** Handler)
+{
+	SvEmuU32 i;
+	SvEmuU32 low, high, middle;
+	const SV_MMIO_HANDLER* handler;
+	const SV_MMIO_RANGE* range;
+
+	*Handler = 0;
+	if (Size == 0 || Address + Size < Address)
+	{
+		return SvMmioUnbacked;
+	}
+
+	for (i = 0; i < Map->HandlerCount; i++)
+	{
+		handler = &Map->Handlers[i];
+		if (Address < handler->Base + handler->Length &&
+			handler->Base < Address + Size)
+		{
+			if (Address < handler->Base ||
+				Address + Size > handler->Base + handler->Length)
+			{
+				return SvMmioUnbacked;
+			}
+			*Handler = handler;
+			return SvMmioDevice;
+		}
+	}
+
+	//
+	// The last range that starts at or below Address.
+	//
+	low = 0;
+	high = Map->RamCount;
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+		if (Map->Ram[middle].Base <= Address)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	if (low == 0)
+	{
+		return SvMmioUnbacked;
+	}
+	range = &Map->Ram[low - 1];
+	if (Address + Size > range->Base + range->Length)
+	{
+		return SvMmioUnbacked;
+	}
+	return SvMmioRam;
+}
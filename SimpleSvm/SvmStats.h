@@ -0,0 +1,129 @@
+#pragma once
+
+//
+// Hypervisor statistics CPUID leaves.
+//
+// Any guest code, in kernel or user mode, can sample per-processor counters
+// kept by the hypervisor by executing CPUID:
+//
+//  CPUID_HV_VENDOR_AND_MAX_FUNCTIONS (0x40000002)
+//      EAX         The highest hypervisor leaf; at least SV_CPUID_STATS_COUNTER
+//                  when statistics are available.
+//      EBX:ECX:EDX "SvmNest     "
+//
+//  SV_CPUID_STATS_INFO (0x40000003)
+//      EAX         SV_STATS_VERSION
+//      EBX         Number of counters (SV_STATS_COUNT)
+//      ECX         Index of the processor that executed CPUID
+//      EDX         0
+//
+//  SV_CPUID_STATS_COUNTER (0x40000004), ECX = counter ID (SV_STATS_*)
+//      EAX         Bits 31:0 of the counter
+//      EBX         Bits 63:32 of the counter
+//      ECX         Index of the processor that executed CPUID
+//      EDX         The counter ID, or MAXUINT32 if the ID is not known
+//
+// Counters other than SV_STATS_LOG_DROPS count events on, or memory of, the
+// processor that executed CPUID only; sum samples taken on every processor
+// for totals. The processor index in each result tells which processor a
+// sample belongs to, since a thread may migrate between two CPUIDs. Every
+// sample is itself a CPUID exit, so SV_STATS_TOTAL_EXITS and
+// SV_STATS_CPUID_EXITS include them.
+//
+// This file does not depend on the WDK so that a user-mode sampler on
+// Windows, or on Linux running under an L1 hypervisor on SvmNest, can include
+// it as is. For example, on Linux:
+//
+//  #include <cpuid.h>
+//  #include "SvmStats.h"
+//
+//  unsigned int regs[4];
+//  SV_STATS_SAMPLE sample;
+//
+//  __cpuid_count(SV_CPUID_STATS_COUNTER, SV_STATS_TOTAL_EXITS,
+//                regs[0], regs[1], regs[2], regs[3]);
+//  if (SvStatsDecodeCounter(regs, SV_STATS_TOTAL_EXITS, &sample))
+//  {
+//      printf("cpu %u: %llu exits\n", sample.Processor, sample.Value);
+//  }
+//
+#if defined(_MSC_VER)
+typedef unsigned __int32 SvStatsU32;
+typedef unsigned __int64 SvStatsU64;
+#else
+#include <stdint.h>
+typedef uint32_t SvStatsU32;
+typedef uint64_t SvStatsU64;
+#endif
+
+#define SV_CPUID_STATS_INFO         0x40000003
+#define SV_CPUID_STATS_COUNTER      0x40000004
+
+#define SV_STATS_VERSION            1
+
+//
+// Counter IDs.
+//
+#define SV_STATS_TOTAL_EXITS        0   // Every #VMEXIT
+#define SV_STATS_CPUID_EXITS        1   // #VMEXIT by class, L1 and L2 together
+#define SV_STATS_MSR_EXITS          2
+#define SV_STATS_VMRUN_EXITS        3
+#define SV_STATS_VMMCALL_EXITS      4
+#define SV_STATS_NPF_EXITS          5
+#define SV_STATS_OTHER_EXITS        6
+#define SV_STATS_L2_EXITS           7   // #VMEXIT while L2 runs
+#define SV_STATS_NESTED_ENTRIES     8   // Emulated VMRUN entering L2
+#define SV_STATS_NESTED_EXITS       9   // #VMEXIT reflected to L1
+#define SV_STATS_LOG_DROPS          10  // Log messages dropped; all processors
+#define SV_STATS_ARENA_PAGES        11  // Pages in the host arena
+#define SV_STATS_ARENA_PAGES_USED   12  // Host arena pages handed out
+#define SV_STATS_ARENA_PAGES_PEAK   13  //  and the most ever handed out
+#define SV_STATS_SLAB_OBJECTS_USED  14  // Objects in use in all host slabs
+#define SV_STATS_SLAB_OBJECTS_PEAK  15  //  and the sum of their high-water marks
+#define SV_STATS_EXIT_CYCLES        16  // TSC cycles spent in the host handling
+                                        //  #VMEXIT; divide by TOTAL_EXITS
+#define SV_STATS_XSTATE_SAVES       17  // #VMEXITs that saved guest extended state
+#define SV_STATS_GUEST_PAGE_WALKS   18  // Guest page walks for instructions and operands
+#define SV_STATS_NPF_EMULATED       19  // NPF exits completed by emulation
+#define SV_STATS_IOIO_EXITS         20  // #VMEXIT(IOIO), L1 and L2 together
+#define SV_STATS_IO_ELEMENTS        21  // Port accesses those performed; a REP
+                                        //  INS or OUTS counts every element
+#define SV_STATS_IOPM_MERGES        22  // Pages of nested IOPMs rebuilt because
+                                        //  L1's IOPM changed
+#define SV_STATS_LARGE_PAGE_SLOT    23  // 1 if the processor's hypervisor data is
+                                        //  mapped with large pages; otherwise 0
+#define SV_STATS_COUNT              24
+
+//
+// The counters the hypervisor keeps for each processor.
+//
+typedef struct _SV_STATS
+{
+	SvStatsU64 Counters[SV_STATS_COUNT];
+} SV_STATS, *PSV_STATS;
+
+typedef struct _SV_STATS_SAMPLE
+{
+	SvStatsU64 Value;
+	SvStatsU32 Processor;
+	SvStatsU32 Id;
+} SV_STATS_SAMPLE, *PSV_STATS_SAMPLE;
+
+//
+// Decodes EAX, EBX, ECX and EDX returned by SV_CPUID_STATS_COUNTER for Id.
+// Returns 0 if the hypervisor does not know Id.
+//
+static inline int SvStatsDecodeCounter(
+	const SvStatsU32 Registers[4],
+	SvStatsU32 Id,
+	SV_STATS_SAMPLE* Sample)
+{
+	if (Registers[3] != Id)
+	{
+		return 0;
+	}
+	Sample->Value = ((SvStatsU64)Registers[1] << 32) | Registers[0];
+	Sample->Processor = Registers[2];
+	Sample->Id = Id;
+	return 1;
+}
@@ -158,13 +158,45 @@ static_assert(sizeof(SEGMENT_ATTRIBUTE) == 2,
 // SimpleSVM specific structures.
 //
 
-typedef struct _SHARED_VIRTUAL_PROCESSOR_DATA
+//
+// Nested page tables. One replica is built on each NUMA node that has
+// processors, and processors use the one on their node. They must always
+// translate the same way; any change has to be made to every replica.
+//
+typedef struct _NESTED_PAGE_TABLES
 {
-	PVOID MsrPermissionsMap;
 	DECLSPEC_ALIGN(PAGE_SIZE) PML4_ENTRY_2MB Pml4Entries[1];    // Just for 512 GB
 	DECLSPEC_ALIGN(PAGE_SIZE) PDP_ENTRY_2MB PdpEntries[512];
 	DECLSPEC_ALIGN(PAGE_SIZE) PD_ENTRY_2MB PdeEntries[512][512];
+} NESTED_PAGE_TABLES, *PNESTED_PAGE_TABLES;
+
+//
+// A region holding per processor data of processors on one NUMA node, carved
+// into slots. See SvAllocateProcessorData.
+//
+typedef struct _SLOT_REGION
+{
+	PVOID Allocation;   // What SvAllocateContiguousMemory returned
+	PVOID Base;         // First 2 MB aligned physical address in Allocation;
+	                    // NULL if the region could not be allocated
+	ULONG SlotCount;
+	ULONG SlotsUsed;
+	BOOLEAN LargePages; // Whether every 2 MB of it is mapped with a large page
+} SLOT_REGION, *PSLOT_REGION;
+
+typedef struct _SHARED_VIRTUAL_PROCESSOR_DATA
+{
+	PVOID MsrPermissionsMap;
+	PVOID IoPermissionsMap;
+	struct _VIRTUAL_PROCESSOR_DATA** VpDataList;    // Indexed by processor index
+	ULONG NumberOfProcessors;                       // Entries in VpDataList
+	ULONG NumberOfSlotRegions;                      // Entries in SlotRegions
+	PSLOT_REGION SlotRegions;                       // Indexed by node
+	ULONG NumberOfNodes;                            // Entries in NestedPageTables
+	PNESTED_PAGE_TABLES* NestedPageTables;          // Indexed by node; NULL for nodes without processors
 } SHARED_VIRTUAL_PROCESSOR_DATA, *PSHARED_VIRTUAL_PROCESSOR_DATA;
+static_assert(sizeof(SHARED_VIRTUAL_PROCESSOR_DATA) <= PAGE_SIZE,
+	"SHARED_VIRTUAL_PROCESSOR_DATA Size Mismatch");
 
 
 
@@ -187,7 +219,6 @@ typedef struct _VIRTUAL_PROCESSOR_DATA
 			struct _VIRTUAL_PROCESSOR_DATA* Self;
 			PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData;
 			//UINT64 Padding1;        // To keep HostRsp 16 bytes aligned
-			//UINT64 OriginalMsrLstar;
 			ProcessorNestData * pProcessNestData = NULL;
 			UINT64 Reserved1;
 		} HostStackLayout;
@@ -242,17 +273,58 @@ typedef struct _GUEST_CONTEXT
 #define IA32_MSR_LSTR   0xC0000082
 #define IA32_MSR_VM_HSAVE           0xc0010117
 
+#define EFER_LMA        (1UL << 10)
 #define EFER_SVME       (1UL << 12)
 
+#define CR0_PG          (1ULL << 31)
+
+#define NPF_FAULT_FINAL_ADDRESS     (1ULL << 32)    // EXITINFO1 of #VMEXIT(NPF)
+#define NPF_FAULT_PAGE_TABLE_WALK   (1ULL << 33)
+
+#define CR4_LA57        (1ULL << 12)
+#define CR4_OSXSAVE     (1ULL << 18)
+#define CR4_PKE         (1ULL << 22)
+
 #define RPL_MASK        3
 #define DPL_SYSTEM      0
 
 #define CPUID_FN8000_0001_ECX_SVM                   (1UL << 2)
 #define CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT    (1UL << 31)
+#define CPUID_FN0000_0001_ECX_XSAVE                 (1UL << 26)
+#define CPUID_FN0000_0001_ECX_OSXSAVE               (1UL << 27)
+#define CPUID_FN0000_0007_EBX_AVX2                  (1UL << 5)
+#define CPUID_FN0000_0007_ECX_OSPKE                 (1UL << 4)
+#define CPUID_FN0000_000D_EAX_XSAVEOPT              (1UL << 0)  // ECX = 1
+#define CPUID_FN0000_000D_EAX_XSAVES                (1UL << 3)  // ECX = 1
 #define CPUID_FN8000_000A_EDX_NP                    (1UL << 0)
+#define CPUID_FN8000_000A_EDX_NRIPS                 (1UL << 3)
+#define CPUID_FN8000_000A_EDX_VMCB_CLEAN            (1UL << 5)
+#define CPUID_FN8000_000A_EDX_DECODE_ASSISTS        (1UL << 7)
+
+//
+// SVM features of CPUID Fn8000_000A_EDX the nested path can honor for L1,
+// and so the only ones L1 is told about (if the processor has them too).
+//
+// NRIPS         - NRip of VMCB02 is copied to VMCB12 on every reflected #VMEXIT.
+// VMCB_CLEAN    - Clean bits are only hints. L0 keeps them clear in VMCB02
+//                 and ignores those of VMCB12, IOPM included; see
+//                 SvLoadNestedIopm.
+// DECODE_ASSISTS - Exit information and fetched instruction bytes are copied
+//                 to VMCB12 on every reflected #VMEXIT.
+//
+// Others, such as AVIC, pause filtering, LBR virtualization and flush by ASID,
+// would need VMCB12 fields that are not translated into VMCB02. NP is not
+// offered either: L2 always runs on L0's nested page tables, and L1's would
+// have to be shadowed into them for its NCr3 to take effect.
+//
+#define SV_NESTED_SVM_FEATURES      (CPUID_FN8000_000A_EDX_NRIPS | \
+                                     CPUID_FN8000_000A_EDX_VMCB_CLEAN | \
+                                     CPUID_FN8000_000A_EDX_DECODE_ASSISTS)
 
 #define CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING          0x00000000
 #define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS       0x00000001
+#define CPUID_STRUCTURED_EXTENDED_FEATURES                      0x00000007
+#define CPUID_PROCESSOR_EXTENDED_STATE_ENUMERATION              0x0000000d
 #define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX    0x80000001
 #define CPUID_SVM_FEATURES                                      0x8000000a
 //
@@ -265,7 +337,7 @@ typedef struct _GUEST_CONTEXT
 // SimpleSVM specific constants.
 //
 #define CPUID_UNLOAD_SIMPLE_SVM     0x51515151
-#define CPUID_HV_MAX                0x40000002
+#define CPUID_HV_MAX                SV_CPUID_STATS_COUNTER
 
 /*!
 @brief      Breaks into a kernel debugger when it is present.
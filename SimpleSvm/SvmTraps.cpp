@@ -1,5 +1,8 @@
 #include "SvmTraps.h"
 #include "BaseUtil.h"
+#include "SvmInsn.h"
+#include "SvmIoio.h"
+#include "SvmXstate.h"
 #include "log/log.h"
 
 /*!
@@ -54,8 +57,7 @@ VOID SvHandleEFERWrite(
 	//
 	// Then, advance RIP to "complete" the instruction.
 	//
-	VpData->GuestVmcb.StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip;
-	//VpData->GuestVmcb.StateSaveArea.Rip += 2;
+	SvAdvanceGuestRip(VpData, &VpData->GuestVmcb);
 }
 
 VOID SvHandleLstrRead(
@@ -69,23 +71,26 @@ VOID SvHandleLstrRead(
 
 	if (0 == VpData->GuestVmcb.ControlArea.ExitInfo1) // read
 	{
-// 		if (0 == VpData->HostStackLayout.OriginalMsrLstar)
-// 		{
- 			MsrValue.QuadPart = VpData->GuestVmcb.StateSaveArea.LStar;
-// 		}
-// 		else
-// 		{
-// 			MsrValue.QuadPart = VpData->HostStackLayout.OriginalMsrLstar;
-// 		}
- 		GuestContext->VpRegs->Rax = MsrValue.LowPart;
- 		GuestContext->VpRegs->Rdx = MsrValue.HighPart;
+		//
+		// While the syscall hook is on, the guest sees the LSTAR it had before.
+		//
+		if (0 == VpData->HostStackLayout.pProcessNestData->OriginalMsrLstar)
+		{
+			MsrValue.QuadPart = VpData->GuestVmcb.StateSaveArea.LStar;
+		}
+		else
+		{
+			MsrValue.QuadPart = VpData->HostStackLayout.pProcessNestData->OriginalMsrLstar;
+		}
+		GuestContext->VpRegs->Rax = MsrValue.LowPart;
+		GuestContext->VpRegs->Rdx = MsrValue.HighPart;
 	}
 	else // write
 	{
 		// never write success
 	}
 
-	VpData->GuestVmcb.StateSaveArea.Rip += 2;
+	SvAdvanceGuestRip(VpData, &VpData->GuestVmcb);
 }
 
 VOID SvHandleSvmHsave(
@@ -105,7 +110,7 @@ VOID SvHandleSvmHsave(
         VpData->HostStackLayout.pProcessNestData->GuestSvmHsave12.HighPart = (ULONG)GuestContext->VpRegs->Rdx;
     }
 
-    VpData->GuestVmcb.StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip; // need npt
+    SvAdvanceGuestRip(VpData, &VpData->GuestVmcb);
 }
 
 VOID SvHandleEffer(
@@ -125,7 +130,117 @@ VOID SvHandleEffer(
         VpData->HostStackLayout.pProcessNestData->GuestMsrEFER.HighPart = (ULONG)GuestContext->VpRegs->Rdx;
     }
 
-    VpData->GuestVmcb.StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip; // need npt
+    SvAdvanceGuestRip(VpData, &VpData->GuestVmcb);
+}
+
+//
+// Maps the pages of L1's IOPM at IOPM_BASE_PA of GuestVmcb12, a guest
+// physical address translated through L1's nested page tables. Fails if any
+// page is not RAM.
+//
+static BOOLEAN SvMapNestedIopm(
+	_In_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb12,
+	_Out_writes_(SV_IOPM_SIZE / PAGE_SIZE) volatile UINT64** Pages)
+{
+	const UINT64 sourcePa = GuestVmcb12->ControlArea.IopmBasePa & ~static_cast<UINT64>(PAGE_SIZE - 1);
+	UINT64 pa;
+
+	for (ULONG i = 0; i < SV_IOPM_SIZE / PAGE_SIZE; i++)
+	{
+		if (SvTranslateL1PhysicalAddress(VpData, sourcePa + i * PAGE_SIZE, &pa) == FALSE)
+		{
+			return FALSE;
+		}
+		Pages[i] = static_cast<volatile UINT64*>(UtilVaFromPa(pa));
+		if (Pages[i] == nullptr)
+		{
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+//
+// Points VMCB02 at the IOPM for L2. When L1 intercepts IOIO, that is L0's
+// IOPM ORed with L1's, kept with the L2 context so ports neither level
+// intercepts run without #VMEXIT. Otherwise L0's IOPM is used as is. While
+// L1 runs, VMCB02 uses L0's IOPM; see SaveGuestVmcb12FromGuestVmcb02.
+//
+// If L1's IOPM cannot be mapped (see SvMapNestedIopm), nothing is changed and
+// FALSE is returned so that the caller fails VMRUN with VMEXIT_INVALID, as
+// the processor does for a bad IOPM_BASE_PA.
+//
+// Every VMRUN compares L1's IOPM with the snapshot and merges again only the
+// pages that differ, or all of them when IOPM_BASE_PA changed. The IOPM clean
+// bit of VMCB12 is not trusted: L1 may change its IOPM without clearing it.
+//
+static BOOLEAN SvLoadNestedIopm(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb01,
+	_In_ PVMCB GuestVmcb12,
+	_Inout_ PVMCB GuestVmcb02)
+{
+	const auto vcpu = VmmpGetVcpuVmx(VpData);
+	const UINT64 sourcePa = GuestVmcb12->ControlArea.IopmBasePa & ~static_cast<UINT64>(PAGE_SIZE - 1);
+	const ULONG pages = SV_IOPM_SIZE / PAGE_SIZE;
+	volatile UINT64* source[SV_IOPM_SIZE / PAGE_SIZE];
+	BOOLEAN force;
+
+	if ((GuestVmcb12->ControlArea.InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) == 0)
+	{
+		GuestVmcb02->ControlArea.IopmBasePa = GuestVmcb01->ControlArea.IopmBasePa;
+		return TRUE;
+	}
+
+	if (SvMapNestedIopm(VpData, GuestVmcb12, source) == FALSE)
+	{
+		return FALSE;
+	}
+
+	//
+	// Compare and merge 32 bytes at a time where the guest enabled AVX; the
+	// guest's YMM registers are saved first.
+	//
+	const auto merge = SvXstateIsAvx2Usable() ? SvIopmMergePageAvx2 : SvIopmMergePage;
+	if (merge == SvIopmMergePageAvx2)
+	{
+		SvXstateAcquire(VpData);
+	}
+
+	force = (vcpu->NestedIopmSourcePa != sourcePa);
+	vcpu->NestedIopmSourcePa = sourcePa;
+	for (ULONG i = 0; i < pages; i++)
+	{
+		if (merge(
+				reinterpret_cast<PUINT64>(static_cast<PUCHAR>(vcpu->NestedIopm) + i * PAGE_SIZE),
+				reinterpret_cast<PUINT64>(static_cast<PUCHAR>(vcpu->NestedIopmSnapshot) + i * PAGE_SIZE),
+				static_cast<PUINT64>(UtilVaFromPa(GuestVmcb01->ControlArea.IopmBasePa + i * PAGE_SIZE)),
+				source[i],
+				force) != 0)
+		{
+			VpData->HostStackLayout.pProcessNestData->Stats.Counters[SV_STATS_IOPM_MERGES]++;
+		}
+	}
+	GuestVmcb02->ControlArea.IopmBasePa = vcpu->NestedIopmPa;
+	return TRUE;
+}
+
+//
+// Completes L1's VMRUN without entering L2, as the processor does when VMCB12
+// fails its consistency checks: EXITCODE of VMCB12 is VMEXIT_INVALID and L1
+// continues after VMRUN. L1RunningVmcb is the VMCB L1 runs on.
+//
+static VOID SvFailNestedVmrun(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PVMCB GuestVmcb12,
+	_Inout_ PVMCB L1RunningVmcb)
+{
+	GuestVmcb12->ControlArea.ExitCode = static_cast<UINT64>(VMEXIT_INVALID);
+	GuestVmcb12->ControlArea.ExitInfo1 = 0;
+	GuestVmcb12->ControlArea.ExitInfo2 = 0;
+	GuestVmcb12->ControlArea.ExitIntInfo = 0;
+	SvAdvanceGuestRip(VpData, L1RunningVmcb);
 }
 
 _IRQL_requires_same_
@@ -143,8 +258,60 @@ SvHandleVmrunEx(
     {
         VCPUVMX *	 nested_vmx = NULL;
         PROCESSOR_NUMBER      number = { 0 };
-        nested_vmx = (VCPUVMX*)ExAllocatePool(NonPagedPoolNx, sizeof(VCPUVMX));
+        auto nestData = VpData->HostStackLayout.pProcessNestData;
+        PVMCB pVmcbGuest12va = (PVMCB)UtilVaFromPa(GuestContext->VpRegs->Rax);
+        volatile UINT64* iopmPages[SV_IOPM_SIZE / PAGE_SIZE];
+
+        //
+        // A VMCB12 with a bad IOPM fails VMRUN before any nested state is set
+        // up, so that L1 can run it again once it is fixed.
+        //
+        if ((pVmcbGuest12va->ControlArea.InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) != 0 &&
+            SvMapNestedIopm(VpData, pVmcbGuest12va, iopmPages) == FALSE)
+        {
+            SvFailNestedVmrun(VpData, pVmcbGuest12va, &VpData->GuestVmcb);
+            return;
+        }
+
+        //
+        // This runs in the host, so memory comes from the per processor arena
+        // rather than the pool.
+        //
+        nested_vmx = (VCPUVMX*)SvSlabAllocate(&nestData->HostSlabs[HostSlabVcpuVmx]);
+        PVOID pVmcb02VaGuest = SvArenaAllocatePage(&nestData->HostArena);
+        PVOID pVmcb02VaHost = SvArenaAllocatePage(&nestData->HostArena);
+        PUCHAR pNestedIopm = NULL;
+        if (NULL != nested_vmx && NULL != pVmcb02VaGuest && NULL != pVmcb02VaHost)
+        {
+            //
+            // The merged IOPM and its snapshot of L1's. The arena is in
+            // physically contiguous memory, so the IOPM is too.
+            //
+            pNestedIopm = (PUCHAR)SvArenaAllocatePages(&nestData->HostArena,
+                                                       SV_IOPM_SIZE / PAGE_SIZE * 2);
+        }
+        if (NULL == pNestedIopm)
+        {
+            if (NULL != nested_vmx)
+            {
+                NT_VERIFY(SvSlabFree(&nestData->HostSlabs[HostSlabVcpuVmx], nested_vmx));
+            }
+            if (NULL != pVmcb02VaGuest)
+            {
+                NT_VERIFY(SvArenaFreePage(&nestData->HostArena, pVmcb02VaGuest));
+            }
+            if (NULL != pVmcb02VaHost)
+            {
+                NT_VERIFY(SvArenaFreePage(&nestData->HostArena, pVmcb02VaHost));
+            }
+            SvInjectGeneralProtectionException(VpData);
+            return;
+        }
         memset(nested_vmx, 0, sizeof(VCPUVMX));
+        nested_vmx->NestedIopm = pNestedIopm;
+        nested_vmx->NestedIopmPa = UtilPaFromVa(pNestedIopm);
+        nested_vmx->NestedIopmSnapshot = pNestedIopm + SV_IOPM_SIZE;
+        nested_vmx->NestedIopmSourcePa = MAXUINT64;
         nested_vmx->inRoot = VMX_MODE::RootMode;
         nested_vmx->blockINITsignal = TRUE;
         nested_vmx->blockAndDisableA20M = TRUE;
@@ -158,8 +325,6 @@ SvHandleVmrunEx(
              nested_vmx->InitialCpuNumber, number.Group, number.Number);
         
         // Load VMCB02 into physical cpu , And perform some check on VMCB12
-        PVOID pVmcb02VaGuest = ExAllocatePool(NonPagedPoolNx, PAGE_SIZE);
-        PVOID pVmcb02VaHost = ExAllocatePool(NonPagedPoolNx, PAGE_SIZE);
         RtlZeroMemory(pVmcb02VaGuest, PAGE_SIZE);
         RtlZeroMemory(pVmcb02VaHost, PAGE_SIZE);
         
@@ -193,19 +358,20 @@ SvHandleVmrunEx(
 		// 01 -> 02
 		// PrepareHostAndControlField
 		PVMCB pVmcbGuest02va = (PVMCB)UtilVaFromPa(VpData->HostStackLayout.pProcessNestData->vcpu_vmx->vmcb_guest_02_pa);
-		PVMCB pVmcbGuest12va = (PVMCB)UtilVaFromPa(VpData->HostStackLayout.pProcessNestData->vcpu_vmx->vmcb_guest_12_pa);
 		PVMCB pVmcbGuest01va = &VpData->GuestVmcb;
 
 		// 01 and 12 -> 02  ControlField
 		pVmcbGuest02va->ControlArea.InterceptMisc1 = pVmcbGuest01va->ControlArea.InterceptMisc1 | pVmcbGuest12va->ControlArea.InterceptMisc1;
 		pVmcbGuest02va->ControlArea.InterceptMisc2 = pVmcbGuest01va->ControlArea.InterceptMisc2 | pVmcbGuest12va->ControlArea.InterceptMisc2;
 		pVmcbGuest02va->ControlArea.MsrpmBasePa = pVmcbGuest01va->ControlArea.MsrpmBasePa; // only use 01 msr int
+		NT_VERIFY(SvLoadNestedIopm(VpData, pVmcbGuest01va, pVmcbGuest12va, pVmcbGuest02va)); // checked above
         pVmcbGuest02va->ControlArea.InterceptException = pVmcbGuest01va->ControlArea.InterceptException; // only use 01 int
 		pVmcbGuest02va->ControlArea.GuestAsid = pVmcbGuest01va->ControlArea.GuestAsid;
 		pVmcbGuest02va->ControlArea.NpEnable = pVmcbGuest01va->ControlArea.NpEnable;
 		pVmcbGuest02va->ControlArea.NCr3 = pVmcbGuest01va->ControlArea.NCr3;
 		pVmcbGuest02va->ControlArea.LbrVirtualizationEnable = pVmcbGuest01va->ControlArea.LbrVirtualizationEnable;
 		pVmcbGuest02va->ControlArea.VIntr = pVmcbGuest01va->ControlArea.VIntr;
+		pVmcbGuest02va->ControlArea.VmcbClean = 0; // see SV_NESTED_SVM_FEATURES
 		
 		// 12 -> 02 statesavearea and guestfield
 		pVmcbGuest02va->StateSaveArea.GdtrBase = pVmcbGuest12va->StateSaveArea.GdtrBase;
@@ -273,10 +439,22 @@ SvHandleVmrunExForL1ToL2(
     {
         PVMCB pVmcbGuest02va = (PVMCB)UtilVaFromPa(VpData->HostStackLayout.pProcessNestData->vcpu_vmx->vmcb_guest_02_pa);
         PVMCB pVmcbGuest12va = (PVMCB)UtilVaFromPa(VpData->HostStackLayout.pProcessNestData->vcpu_vmx->vmcb_guest_12_pa);
+        if (SvLoadNestedIopm(VpData, &VpData->GuestVmcb, pVmcbGuest12va, pVmcbGuest02va) == FALSE)
+        {
+            SvFailNestedVmrun(VpData, pVmcbGuest12va, pVmcbGuest02va);
+            return;
+        }
         pVmcbGuest02va->StateSaveArea.Rflags = pVmcbGuest12va->StateSaveArea.Rflags;
         pVmcbGuest02va->StateSaveArea.Rsp = pVmcbGuest12va->StateSaveArea.Rsp;
         pVmcbGuest02va->StateSaveArea.Rip = pVmcbGuest12va->StateSaveArea.Rip;
         pVmcbGuest02va->StateSaveArea.LStar = pVmcbGuest12va->StateSaveArea.LStar;
+
+        //
+        // L0 rewrites VMCB02 from VMCB12 without tracking what changed, so
+        // VMCB12 clean bits other than IOPM are ignored and VMCB02 ones are
+        // kept clear.
+        //
+        pVmcbGuest02va->ControlArea.VmcbClean = 0;
 		GuestContext->VpRegs->Rax = pVmcbGuest12va->StateSaveArea.Rax;
 		pVmcbGuest02va->StateSaveArea.Rax = pVmcbGuest12va->StateSaveArea.Rax;
 
@@ -289,6 +467,80 @@ SvHandleVmrunExForL1ToL2(
     }
 }
 
+//
+// Performs one hypercall for SvHandleVmmcall, or for an entry of a kBatch
+// hypercall. kBatch itself is not accepted here so batches cannot nest.
+//
+static NTSTATUS SvDispatchHypercall(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ HypercallNumber HyperNum,
+	_In_ unsigned __int64 context)
+{
+	switch (HyperNum)
+	{
+	case HypercallNumber::kTerminateVmm:
+		return STATUS_SUCCESS;
+	case HypercallNumber::kHookSyscall:
+		if (0 == context)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+		VmmpHandleVmCallHookSyscall(VpData, (void *)context);
+		return STATUS_SUCCESS;
+	case HypercallNumber::kUnhookSyscall:
+		VmmpHandleVmCallUnHookSyscall(VpData);
+		return STATUS_SUCCESS;
+	default:
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+}
+
+//
+// Performs every entry of the HYPERCALL_BATCH at guest physical address
+// BatchPa in this exit and writes each result to the entry's Status. Fails
+// only when the batch itself cannot be used; a failing entry does not stop
+// the ones after it.
+//
+// The batch is guest memory other processors may write to, so Count and
+// each entry are read once before use.
+//
+static NTSTATUS SvHandleHypercallBatch(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ unsigned __int64 BatchPa)
+{
+	PHYPERCALL_BATCH batch;
+	UINT32 count;
+
+	if ((0 == BatchPa) || (0 != BYTE_OFFSET(BatchPa)))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	batch = (PHYPERCALL_BATCH)UtilVaFromPa(BatchPa);
+	if (nullptr == batch)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	count = *(volatile UINT32 *)&batch->Count;
+	if (count > HYPERCALL_BATCH_MAX_ENTRIES)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (UINT32 i = 0; i < count; i++)
+	{
+		volatile HYPERCALL_DESCRIPTOR* entry = &batch->Entries[i];
+		HypercallNumber number = entry->Number;
+		unsigned __int64 context = entry->Context;
+
+		entry->Status = (HypercallNumber::kBatch == number) ?
+			STATUS_INVALID_DEVICE_REQUEST :
+			SvDispatchHypercall(VpData, number, context);
+	}
+	return STATUS_SUCCESS;
+}
+
 //Mnemonic Opcode Description
 //VMMCALL 0F 01 D9 Explicit communication with the VMM.
 VOID SvHandleVmmcall(
@@ -299,21 +551,21 @@ VOID SvHandleVmmcall(
 	{
 		auto HyperNum = (HypercallNumber)(GuestContext->VpRegs->Rcx);
 		unsigned __int64 context = (unsigned __int64)GuestContext->VpRegs->Rdx;
+		NTSTATUS status;
 		//SV_DEBUG_BREAK();
-		switch (HyperNum)
+		if (HypercallNumber::kBatch == HyperNum)
+		{
+			status = SvHandleHypercallBatch(VpData, context);
+		}
+		else
+		{
+			status = SvDispatchHypercall(VpData, HyperNum, context);
+		}
+		if (!NT_SUCCESS(status))
 		{
-		case HypercallNumber::kTerminateVmm:
-			break;
-		case HypercallNumber::kHookSyscall:
-			VmmpHandleVmCallHookSyscall(VpData, (void *)context);
-			break;
-		case HypercallNumber::kUnhookSyscall:
-			VmmpHandleVmCallUnHookSyscall(VpData);
-			break;
-		default:
 			SvInjectGeneralProtectionException(VpData);
 		}
-		VpData->GuestVmcb.StateSaveArea.Rip += 3; 
+		SvAdvanceGuestRip(VpData, &VpData->GuestVmcb);
 	}
 	else
 	{
@@ -329,7 +581,7 @@ VOID SvHandleVmmcallNest(
     if (VMX_MODE::RootMode == VmxGetVmxMode(VmmpGetVcpuVmx(VpData)))
     {
         PVMCB pVmcbGuest02va = (PVMCB)UtilVaFromPa(VpData->HostStackLayout.pProcessNestData->vcpu_vmx->vmcb_guest_02_pa);
-        pVmcbGuest02va->StateSaveArea.Rip = pVmcbGuest02va->ControlArea.NRip;
+        SvAdvanceGuestRip(VpData, pVmcbGuest02va);
         return; // return L1
     }
 
@@ -338,20 +590,39 @@ VOID SvHandleVmmcallNest(
     LEAVE_GUEST_MODE(VmmpGetVcpuVmx(VpData));     // retrun L1 host
 }
 
+//
+// Points the guest's LSTAR to NewSysCallEntry. LSTAR is part of the state
+// VMLOAD loads from the guest VMCB right before VMRUN, so the change takes
+// effect when this processor resumes the guest. The original value is kept
+// for SvHandleLstrRead and for unhooking; hooking again only replaces the
+// entry point.
+//
 void VmmpHandleVmCallHookSyscall(
 	PVIRTUAL_PROCESSOR_DATA VpData, void * NewSysCallEntry)
 {
-    UNREFERENCED_PARAMETER(VpData);
-    UNREFERENCED_PARAMETER(NewSysCallEntry);
-// 	VpData->HostStackLayout.OriginalMsrLstar = UtilReadMsr64(Msr::kIa32Lstar); // read from host
-// 	VpData->GuestVmcb.StateSaveArea.LStar = (UINT64)NewSysCallEntry;
+	auto nestData = VpData->HostStackLayout.pProcessNestData;
+
+	if (0 == nestData->OriginalMsrLstar)
+	{
+		nestData->OriginalMsrLstar = VpData->GuestVmcb.StateSaveArea.LStar;
+	}
+	VpData->GuestVmcb.StateSaveArea.LStar = (UINT64)NewSysCallEntry;
 }
 
+//
+// Restores the guest's LSTAR saved by VmmpHandleVmCallHookSyscall; does
+// nothing when the syscall hook is off. Also called when the processor is
+// devirtualized, so LSTAR never outlives the hypervisor pointing to the hook.
+//
 void VmmpHandleVmCallUnHookSyscall(PVIRTUAL_PROCESSOR_DATA VpData)
 {
-    UNREFERENCED_PARAMETER(VpData);
-// 	VpData->GuestVmcb.StateSaveArea.LStar = VpData->HostStackLayout.OriginalMsrLstar;
-// 	VpData->HostStackLayout.OriginalMsrLstar = NULL;
+	auto nestData = VpData->HostStackLayout.pProcessNestData;
+
+	if (0 != nestData->OriginalMsrLstar)
+	{
+		VpData->GuestVmcb.StateSaveArea.LStar = nestData->OriginalMsrLstar;
+		nestData->OriginalMsrLstar = 0;
+	}
 }
 
 VOID SvHandleCpuidForL2ToL1(
@@ -399,7 +670,7 @@ VOID SvHandleCpuidForL2ToL1(
 		GuestContext->VpRegs->Rcx = registers[2];
 		GuestContext->VpRegs->Rdx = registers[3];
         PVMCB pVmcbGuest02va = (PVMCB)UtilVaFromPa(VpData->HostStackLayout.pProcessNestData->vcpu_vmx->vmcb_guest_02_pa);
-        pVmcbGuest02va->StateSaveArea.Rip = pVmcbGuest02va->ControlArea.NRip;
+        SvAdvanceGuestRip(VpData, pVmcbGuest02va);
         return; // return L1
     }
 
@@ -418,7 +689,7 @@ SvHandleMsrAccessNest(
 	if (VMX_MODE::RootMode == VmxGetVmxMode(VmmpGetVcpuVmx(VpData)))
 	{
         HandleMsrReadAndWrite(VpData, GuestContext);
-		pVmcbGuest02va->StateSaveArea.Rip = pVmcbGuest02va->ControlArea.NRip;
+		SvAdvanceGuestRip(VpData, pVmcbGuest02va);
 		return; // return L1
 	}
 
@@ -432,7 +703,7 @@ SvHandleMsrAccessNest(
     else
     {
         HandleMsrReadAndWrite(VpData, GuestContext);
-        pVmcbGuest02va->StateSaveArea.Rip = pVmcbGuest02va->ControlArea.NRip;
+        SvAdvanceGuestRip(VpData, pVmcbGuest02va);
         return;
     }
 }
@@ -447,7 +718,7 @@ VOID SvHandleBreakPointExceptionNest(
     if (VMX_MODE::RootMode == VmxGetVmxMode(VmmpGetVcpuVmx(VpData)))
     {
         SvInjectBPExceptionVmcb02(VpData);
-        pVmcbGuest02va->StateSaveArea.Rip = pVmcbGuest02va->ControlArea.NRip;
+        SvAdvanceGuestRip(VpData, pVmcbGuest02va);
         return;
     }
 
@@ -462,7 +733,470 @@ VOID SvHandleBreakPointExceptionNest(
     else // return L2
     {
         SvInjectBPExceptionVmcb02(VpData);
-        pVmcbGuest02va->StateSaveArea.Rip = pVmcbGuest02va->ControlArea.NRip; 
+        SvAdvanceGuestRip(VpData, pVmcbGuest02va); 
         return; 
     }
-}
\ No newline at end of file
+}
+
+//
+// Guest physical memory behind the emulators: RAM captured from the OS and
+// MMIO ranges with a device model. Filled at PASSIVE_LEVEL before processors
+// are virtualized and only read while handling #VMEXIT.
+//
+static SV_MMIO_MAP g_SvMmioMap;
+
+//
+// Registers Routine for Length bytes of guest physical memory from Base.
+// Must be called before SvVirtualizeAllProcessors, which leaves the range
+// unmapped in the nested page tables so that accesses to it cause #NPF.
+//
+NTSTATUS SvRegisterMmioHandler(
+	_In_ UINT64 Base,
+	_In_ UINT64 Length,
+	_In_ SV_MMIO_ROUTINE Routine,
+	_In_opt_ PVOID Context)
+{
+	if (SvMmioRegisterHandler(&g_SvMmioMap, Base, Length, Routine, Context) == 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	return STATUS_SUCCESS;
+}
+
+//
+// Whether any of Length bytes of guest physical memory from Base has a
+// device model.
+//
+BOOLEAN SvIsMmioHandled(
+	_In_ UINT64 Base,
+	_In_ UINT64 Length)
+{
+	return SvMmioOverlapsHandler(&g_SvMmioMap, Base, Length) != 0;
+}
+
+//
+// Translates Gpa, a guest physical address of L1, to a physical address
+// through the nested page tables of VMCB01, which map 512 GB with large
+// pages. Fails if it is not mapped, as pages with a device model are not, or
+// if the page is not RAM.
+//
+BOOLEAN SvTranslateL1PhysicalAddress(
+	_In_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ UINT64 Gpa,
+	_Out_ PUINT64 Pa)
+{
+	const auto tables = static_cast<PNESTED_PAGE_TABLES>(
+		UtilVaFromPa(VpData->GuestVmcb.ControlArea.NCr3 & ~static_cast<UINT64>(PAGE_SIZE - 1)));
+	const SV_MMIO_HANDLER* handler;
+	PD_ENTRY_2MB pde;
+
+	*Pa = 0;
+	if (tables == nullptr ||
+		(Gpa >> 39) != 0 ||
+		tables->Pml4Entries[0].Fields.Valid == 0 ||
+		tables->PdpEntries[(Gpa >> 30) & 0x1ff].Fields.Valid == 0)
+	{
+		return FALSE;
+	}
+	pde = tables->PdeEntries[(Gpa >> 30) & 0x1ff][(Gpa >> 21) & 0x1ff];
+	if (pde.Fields.Valid == 0 || pde.Fields.LargePage == 0)
+	{
+		return FALSE;
+	}
+	*Pa = (static_cast<UINT64>(pde.Fields.PageFrameNumber) << 21) | (Gpa & 0x1fffff);
+	return SvMmioClassify(&g_SvMmioMap, *Pa, PAGE_SIZE, &handler) == SvMmioRam;
+}
+
+//
+// Records which guest physical memory is RAM. Called before processors are
+// virtualized, and again before they are on resume since memory may have
+// been added.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS SvCapturePhysicalMemoryRanges(VOID)
+{
+	PPHYSICAL_MEMORY_RANGE ranges;
+
+	ranges = MmGetPhysicalMemoryRanges();
+	if (ranges == nullptr)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	g_SvMmioMap.RamCount = 0;
+	for (ULONG i = 0; ranges[i].NumberOfBytes.QuadPart != 0; i++)
+	{
+		NT_VERIFY(SvMmioAddRam(&g_SvMmioMap,
+							   ranges[i].BaseAddress.QuadPart,
+							   ranges[i].NumberOfBytes.QuadPart));
+	}
+	ExFreePool(ranges);
+	return STATUS_SUCCESS;
+}
+
+//
+// Guest memory access for the emulators. An operand is translated to a guest
+// physical address, which goes to its device model, is accessed through the
+// host mapping if it is RAM, or fails otherwise; see SvmMmio.h. Either way it
+// is one access of the exact size, so that it reaches a device the same way
+// the guest's would. Accesses that cross a page are rejected.
+//
+typedef struct _SV_GUEST_MEMORY_CONTEXT
+{
+	PVIRTUAL_PROCESSOR_DATA VpData;
+	PVMCB GuestVmcb;
+} SV_GUEST_MEMORY_CONTEXT, *PSV_GUEST_MEMORY_CONTEXT;
+
+static int SvAccessGuestOperand(
+	_In_ PSV_GUEST_MEMORY_CONTEXT Context,
+	_In_ SvEmuU64 Address,
+	_In_ SvEmuU32 Size,
+	_In_ int IsWrite,
+	_Inout_ SvEmuU64* Value)
+{
+	const SV_MMIO_HANDLER* handler;
+	UINT64 physical;
+	volatile VOID* va = nullptr;
+
+	if (BYTE_OFFSET(Address) + Size > PAGE_SIZE ||
+		SvTranslateGuestAddress(Context->VpData,
+								Context->GuestVmcb,
+								Address,
+								&physical) == FALSE)
+	{
+		return 0;
+	}
+
+	switch (SvMmioClassify(&g_SvMmioMap, physical, Size, &handler))
+	{
+	case SvMmioDevice:
+		return handler->Routine(handler->Context, physical, Size, IsWrite, Value);
+	case SvMmioRam:
+		va = UtilVaFromPa(physical);
+		break;
+	default:
+		return 0;
+	}
+	if (va == nullptr)
+	{
+		return 0;
+	}
+
+	if (IsWrite)
+	{
+		switch (Size)
+		{
+		case 1: *static_cast<volatile UINT8*>(va) = static_cast<UINT8>(*Value); break;
+		case 2: *static_cast<volatile UINT16*>(va) = static_cast<UINT16>(*Value); break;
+		case 4: *static_cast<volatile UINT32*>(va) = static_cast<UINT32>(*Value); break;
+		default: *static_cast<volatile UINT64*>(va) = *Value; break;
+		}
+		return 1;
+	}
+	switch (Size)
+	{
+	case 1: *Value = *static_cast<volatile UINT8*>(va); break;
+	case 2: *Value = *static_cast<volatile UINT16*>(va); break;
+	case 4: *Value = *static_cast<volatile UINT32*>(va); break;
+	default: *Value = *static_cast<volatile UINT64*>(va); break;
+	}
+	return 1;
+}
+
+static int SvReadGuestOperand(
+	_In_ void* Context,
+	_In_ SvEmuU64 Address,
+	_In_ SvEmuU32 Size,
+	_Out_ SvEmuU64* Value)
+{
+	*Value = 0;
+	return SvAccessGuestOperand(static_cast<PSV_GUEST_MEMORY_CONTEXT>(Context),
+								Address, Size, FALSE, Value);
+}
+
+static int SvWriteGuestOperand(
+	_In_ void* Context,
+	_In_ SvEmuU64 Address,
+	_In_ SvEmuU32 Size,
+	_In_ SvEmuU64 Value)
+{
+	return SvAccessGuestOperand(static_cast<PSV_GUEST_MEMORY_CONTEXT>(Context),
+								Address, Size, TRUE, &Value);
+}
+
+static VOID SvInitializeGuestMemory(
+	_In_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb,
+	_Out_ PSV_GUEST_MEMORY_CONTEXT Context,
+	_Out_ PSV_EMU_MEMORY Memory)
+{
+	Context->VpData = VpData;
+	Context->GuestVmcb = GuestVmcb;
+	Memory->Context = Context;
+	Memory->Read = SvReadGuestOperand;
+	Memory->Write = SvWriteGuestOperand;
+}
+
+//
+// Copies guest state between the VMCB and GPRs and SV_EMU_STATE.
+// GUEST_REGISTERS is in the reverse of encoding order, and its Rsp is not
+// the guest's; RSP lives in the VMCB.
+//
+static VOID SvLoadEmulatorState(
+	_In_ PGUEST_CONTEXT GuestContext,
+	_In_ PVMCB GuestVmcb,
+	_Out_ PSV_EMU_STATE State)
+{
+	const auto registers = &GuestContext->VpRegs->R15;
+
+	for (ULONG i = 0; i < RTL_NUMBER_OF(State->Gpr); i++)
+	{
+		State->Gpr[i] = registers[RTL_NUMBER_OF(State->Gpr) - 1 - i];
+	}
+	State->Gpr[SvEmuRsp] = GuestVmcb->StateSaveArea.Rsp;
+	State->Rip = GuestVmcb->StateSaveArea.Rip;
+	State->Rflags = GuestVmcb->StateSaveArea.Rflags;
+	State->SegmentBase[SvEmuEs] = GuestVmcb->StateSaveArea.EsBase;
+	State->SegmentBase[SvEmuCs] = GuestVmcb->StateSaveArea.CsBase;
+	State->SegmentBase[SvEmuSs] = GuestVmcb->StateSaveArea.SsBase;
+	State->SegmentBase[SvEmuDs] = GuestVmcb->StateSaveArea.DsBase;
+	State->SegmentBase[SvEmuFs] = GuestVmcb->StateSaveArea.FsBase;
+	State->SegmentBase[SvEmuGs] = GuestVmcb->StateSaveArea.GsBase;
+	State->Is64BitCode = SvIsGuest64BitCode(GuestVmcb);
+}
+
+static VOID SvStoreEmulatorState(
+	_In_ const SV_EMU_STATE* State,
+	_Inout_ PGUEST_CONTEXT GuestContext,
+	_Inout_ PVMCB GuestVmcb)
+{
+	const auto registers = &GuestContext->VpRegs->R15;
+
+	for (ULONG i = 0; i < RTL_NUMBER_OF(State->Gpr); i++)
+	{
+		if (i != SvEmuRsp)
+		{
+			registers[RTL_NUMBER_OF(State->Gpr) - 1 - i] = State->Gpr[i];
+		}
+	}
+	GuestVmcb->StateSaveArea.Rsp = State->Gpr[SvEmuRsp];
+	GuestVmcb->StateSaveArea.Rip = State->Rip;
+	GuestVmcb->StateSaveArea.Rflags = State->Rflags;
+}
+
+//
+// Handles #VMEXIT(NPF) by emulating the faulting instruction with
+// SvEmulateInstruction, so the guest continues after it without the nested
+// page tables being changed. Operands go to RAM or to the device model of
+// their range; see SvAccessGuestOperand. Only faults on the final guest
+// physical address of an access are emulated; a fault while the processor
+// walked the guest's page tables has no instruction operand to perform.
+//
+// An instruction that cannot be emulated, or whose operand is neither RAM nor
+// handled, gets #GP: resuming it would fault again forever. A REP string
+// instruction keeps the iterations done, as after an interrupted one.
+//
+VOID SvHandleNestedPageFault(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PGUEST_CONTEXT GuestContext)
+{
+	const auto vmcb = &VpData->GuestVmcb;
+	SV_GUEST_MEMORY_CONTEXT context;
+	SV_EMU_MEMORY memory;
+	SV_EMU_STATE state;
+	SV_GUEST_INSTRUCTION instruction;
+	SV_EMU_STATUS status;
+
+	if ((vmcb->ControlArea.ExitInfo1 & NPF_FAULT_FINAL_ADDRESS) == 0 ||
+		SvFetchGuestInstruction(VpData, vmcb, &instruction) == FALSE)
+	{
+		SV_DEBUG_BREAK();
+		SvInjectGeneralProtectionException(VpData);
+		return;
+	}
+
+	SvLoadEmulatorState(GuestContext, vmcb, &state);
+	SvInitializeGuestMemory(VpData, vmcb, &context, &memory);
+
+	//
+	// A REP string instruction that fails part way still made progress, so
+	// the registers are written back whatever the result.
+	//
+	status = SvEmulateInstruction(&state, instruction.Bytes, instruction.Count, &memory);
+	SvStoreEmulatorState(&state, GuestContext, vmcb);
+	if (status != SvEmuOk)
+	{
+		SV_DEBUG_BREAK();
+		SvInjectGeneralProtectionException(VpData);
+		return;
+	}
+	VpData->HostStackLayout.pProcessNestData->Stats.Counters[SV_STATS_NPF_EMULATED]++;
+}
+
+//
+// Performs port accesses on the hardware, for ports without a handler.
+//
+static int SvPassThroughIo(
+	_In_ void* Context,
+	_In_ SvEmuU16 Port,
+	_In_ SvEmuU32 Size,
+	_In_ int IsIn,
+	_Inout_ SvEmuU32* Value)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	if (IsIn)
+	{
+		switch (Size)
+		{
+		case 1: *Value = __inbyte(Port); break;
+		case 2: *Value = __inword(Port); break;
+		default: *Value = __indword(Port); break;
+		}
+	}
+	else
+	{
+		switch (Size)
+		{
+		case 1: __outbyte(Port, static_cast<UCHAR>(*Value)); break;
+		case 2: __outword(Port, static_cast<USHORT>(*Value)); break;
+		default: __outdword(Port, *Value); break;
+		}
+	}
+	return 1;
+}
+
+//
+// Port handlers. Filled at PASSIVE_LEVEL before processors are virtualized
+// and only read while handling #VMEXIT.
+//
+static SV_IO_REGISTRY g_SvIoRegistry = { {}, 0, SvPassThroughIo, nullptr };
+
+//
+// Registers Routine for PortCount ports from FirstPort. Must be called before
+// SvVirtualizeAllProcessors, which builds the IOPM from the registry.
+//
+NTSTATUS SvRegisterIoHandler(
+	_In_ ULONG FirstPort,
+	_In_ ULONG PortCount,
+	_In_ SV_IO_ROUTINE Routine,
+	_In_opt_ PVOID Context)
+{
+	if (SvIoRegisterHandler(&g_SvIoRegistry, FirstPort, PortCount, Routine, Context) == 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	return STATUS_SUCCESS;
+}
+
+static_assert(SV_IOPM_SIZE == SVM_IO_PERMISSIONS_MAP_SIZE, "IOPM Size Mismatch");
+
+//
+// Builds the IOPM to intercept the registered ports.
+//
+VOID SvBuildIoPermissionsMap(
+	_Out_writes_bytes_(SV_IOPM_SIZE) PVOID IoPermissionsMap)
+{
+	SvIoBuildIopm(&g_SvIoRegistry, static_cast<SvEmuU8*>(IoPermissionsMap));
+}
+
+//
+// Injects #GP into the guest of GuestVmcb, L1 or L2.
+//
+static VOID SvInjectIoFailure(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ PVMCB GuestVmcb)
+{
+	SV_DEBUG_BREAK();
+	if (GuestVmcb == &VpData->GuestVmcb)
+	{
+		SvInjectGeneralProtectionException(VpData);
+	}
+	else
+	{
+		SvInjectGeneralProtectionExceptionVmcb02(VpData);
+	}
+}
+
+//
+// Performs an intercepted IN, OUT, INS or OUTS of GuestVmcb through the
+// registry. RIP is set from EXITINFO2 once the instruction is complete; a
+// REP INS or OUTS longer than SV_IO_STRING_BATCH elements is completed over
+// several #VMEXITs so that interrupts are not held off for long.
+//
+// An access that fails gets #GP, since resuming the guest at the instruction
+// would only intercept it again. Ports without a handler are passed through
+// and do not fail this way. Elements of a string done before the failure
+// stay done, as after an interrupted REP.
+//
+static VOID SvEmulateIoAccess(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PGUEST_CONTEXT GuestContext,
+	_Inout_ PVMCB GuestVmcb)
+{
+	SV_GUEST_MEMORY_CONTEXT context;
+	SV_EMU_MEMORY memory;
+	SV_EMU_STATE state;
+	SV_IO_ACCESS access;
+	SV_EMU_STATUS status;
+	SvEmuU32 elements;
+
+	if (SvIoDecodeExitInfo(GuestVmcb->ControlArea.ExitInfo1, &access) == 0)
+	{
+		SvInjectIoFailure(VpData, GuestVmcb);
+		return;
+	}
+
+	SvLoadEmulatorState(GuestContext, GuestVmcb, &state);
+	SvInitializeGuestMemory(VpData, GuestVmcb, &context, &memory);
+	status = SvIoExecute(&g_SvIoRegistry,
+						 &access,
+						 GuestVmcb->ControlArea.ExitInfo2,
+						 SV_IO_STRING_BATCH,
+						 &state,
+						 &memory,
+						 &elements);
+	SvStoreEmulatorState(&state, GuestContext, GuestVmcb);
+	VpData->HostStackLayout.pProcessNestData->Stats.Counters[SV_STATS_IO_ELEMENTS] += elements;
+	if (status != SvEmuOk)
+	{
+		SvInjectIoFailure(VpData, GuestVmcb);
+	}
+}
+
+VOID SvHandleIoio(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PGUEST_CONTEXT GuestContext)
+{
+	SvEmulateIoAccess(VpData, GuestContext, &VpData->GuestVmcb);
+}
+
+//
+// While L2 runs, VMCB02 intercepts the ports of both L0 and L1; see
+// SvLoadNestedIopm. An access L1's IOPM intercepts is reflected to L1, even
+// if L0 intercepts it too; L0 performs the others. L1's IOPM is read as it is
+// now, not as last merged, and an access is reflected if it cannot be read.
+// While L1 runs, only L0's ports are intercepted.
+//
+VOID SvHandleIoioNest(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PGUEST_CONTEXT GuestContext)
+{
+	PVMCB pVmcbGuest02va = GetCurrentVmcbGuest02(VpData);
+	volatile UINT64* iopmPages[SV_IOPM_SIZE / PAGE_SIZE];
+	SV_IO_ACCESS access;
+
+	if (VMX_MODE::GuestMode == VmxGetVmxMode(VmmpGetVcpuVmx(VpData)))
+	{
+		PVMCB pVmcbGuest12va = GetCurrentVmcbGuest12(VpData);
+		if ((pVmcbGuest12va->ControlArea.InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) != 0 &&
+			SvIoDecodeExitInfo(pVmcbGuest02va->ControlArea.ExitInfo1, &access) != 0 &&
+			(SvMapNestedIopm(VpData, pVmcbGuest12va, iopmPages) == FALSE ||
+			 SvIopmPagesIsIntercepted(iopmPages, access.Port, access.Size) != 0))
+		{
+			SaveGuestVmcb12FromGuestVmcb02(VpData, GuestContext);
+			LEAVE_GUEST_MODE(VmmpGetVcpuVmx(VpData));     // retrun L1 host
+			return;
+		}
+	}
+	SvEmulateIoAccess(VpData, GuestContext, pVmcbGuest02va);
+}
@@ -2,6 +2,8 @@
 #include "SvmHead.h"
 #include "SvmStruct.h"
 #include "SvmUtil.h"
+#include "SvmIoio.h"
+#include "SvmMmio.h"
 
 VOID SvHandleVmmcall(
 	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
@@ -57,4 +59,48 @@ SvHandleMsrAccessNest(
 VOID SvHandleBreakPointExceptionNest(
     _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
     _Inout_ PGUEST_CONTEXT GuestContext
-);
\ No newline at end of file
+);
+
+VOID SvHandleNestedPageFault(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PGUEST_CONTEXT GuestContext);
+
+NTSTATUS SvRegisterMmioHandler(
+	_In_ UINT64 Base,
+	_In_ UINT64 Length,
+	_In_ SV_MMIO_ROUTINE Routine,
+	_In_opt_ PVOID Context);
+
+BOOLEAN SvIsMmioHandled(
+	_In_ UINT64 Base,
+	_In_ UINT64 Length);
+
+BOOLEAN SvTranslateL1PhysicalAddress(
+	_In_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_In_ UINT64 Gpa,
+	_Out_ PUINT64 Pa);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS SvCapturePhysicalMemoryRanges(VOID);
+
+//
+// Elements of a REP INS or OUTS performed per #VMEXIT.
+//
+#define SV_IO_STRING_BATCH  1024
+
+NTSTATUS SvRegisterIoHandler(
+	_In_ ULONG FirstPort,
+	_In_ ULONG PortCount,
+	_In_ SV_IO_ROUTINE Routine,
+	_In_opt_ PVOID Context);
+
+VOID SvBuildIoPermissionsMap(
+	_Out_writes_bytes_(SV_IOPM_SIZE) PVOID IoPermissionsMap);
+
+VOID SvHandleIoio(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PGUEST_CONTEXT GuestContext);
+
+VOID SvHandleIoioNest(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+	_Inout_ PGUEST_CONTEXT GuestContext);
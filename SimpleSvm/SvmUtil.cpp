@@ -20,6 +20,10 @@ SvDebugPrint(
 	va_start(argList, Format);
 	vDbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, Format, argList);
 	va_end(argList);
+
+	va_start(argList, Format);
+	ExportLogVPrint(Format, argList);
+	va_end(argList);
 }
 
 NTSTATUS UtilVmCall(HypercallNumber hypercall_number,
@@ -36,6 +40,32 @@ NTSTATUS UtilVmCall(HypercallNumber hypercall_number,
 	}
 }
 
+// Performs every entry of batch with one VMMCALL on the current processor.
+// Returns the status of the first entry that failed, or STATUS_SUCCESS when
+// all succeeded; each entry's own result is left in its Status.
+NTSTATUS UtilVmCallBatch(PHYPERCALL_BATCH batch) {
+	if (BYTE_OFFSET(batch) != 0 || batch->Count > HYPERCALL_BATCH_MAX_ENTRIES) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (ULONG i = 0; i < batch->Count; i++) {
+		batch->Entries[i].Status = STATUS_PENDING;
+	}
+
+	auto status = UtilVmCall(HypercallNumber::kBatch,
+		reinterpret_cast<void *>(UtilPaFromVa(batch)));
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	for (ULONG i = 0; i < batch->Count; i++) {
+		if (!NT_SUCCESS(batch->Entries[i].Status)) {
+			return batch->Entries[i].Status;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
 /*!
 @brief          Injects #GP with 0 of error code.
 
@@ -109,36 +139,184 @@ ULONG64 UtilReadMsr64(Msr msr) {
 	return __readmsr(static_cast<unsigned long>(msr));
 }
 
-NTSTATUS UtilForEachProcessor(NTSTATUS(*callback_routine)(void *), void *context) {
+static const ULONG kUtilpBroadcastPoolTag = 'bcvS';
+
+struct UtilBroadcast;
+
+// A DPC of UtilForEachProcessor() and the status its processor returned
+struct UtilBroadcastDpc {
+	KDPC dpc;
+	NTSTATUS status;
+	UtilBroadcast *broadcast;
+};
+
+// State of one UtilForEachProcessor() call shared by all of its DPCs
+struct UtilBroadcast {
+	NTSTATUS(*callback_routine)(void *);
+	void *context;
+	volatile LONG remaining;
+	KEVENT all_done;
+	UtilBroadcastDpc dpcs[ANYSIZE_ARRAY];
+};
+
+static KDEFERRED_ROUTINE UtilpBroadcastDpcRoutine;
+
+// Runs the callback on the processor the DPC is targeted to and wakes up
+// UtilForEachProcessor() when it is the last one
+_Use_decl_annotations_ static void UtilpBroadcastDpcRoutine(
+	PKDPC dpc, PVOID deferred_context, PVOID system_argument1,
+	PVOID system_argument2) {
+	UNREFERENCED_PARAMETER(dpc);
+	UNREFERENCED_PARAMETER(system_argument1);
+	UNREFERENCED_PARAMETER(system_argument2);
+
+	const auto broadcast_dpc = static_cast<UtilBroadcastDpc *>(deferred_context);
+	const auto broadcast = broadcast_dpc->broadcast;
+
+	broadcast_dpc->status = broadcast->callback_routine(broadcast->context);
+	if (InterlockedDecrement(&broadcast->remaining) == 0) {
+		KeSetEvent(&broadcast->all_done, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+// Executes callback_routine on each processor in turn by switching the
+// affinity of the current thread, raising to DISPATCH_LEVEL around the call so
+// that the callback runs as it does from UtilpBroadcastDpcRoutine(). This is
+// the fallback of UtilForEachProcessor() when the broadcast cannot be
+// allocated; it needs no memory, so that devirtualizing processors on unload or
+// on suspend never depends on pool being available. Like the broadcast, it
+// visits every processor even when some fail.
+_IRQL_requires_max_(APC_LEVEL) static NTSTATUS UtilpForEachProcessorSerially(
+	NTSTATUS(*callback_routine)(void *), void *context,
+	ULONG *number_of_succeeded) {
 	PAGED_CODE();
 
 	const auto number_of_processors =
 		KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto status = STATUS_SUCCESS;
+	ULONG succeeded = 0;
 	for (ULONG processor_index = 0; processor_index < number_of_processors;
 	processor_index++) {
 		PROCESSOR_NUMBER processor_number = {};
-		auto status =
+		auto processor_status =
 			KeGetProcessorNumberFromIndex(processor_index, &processor_number);
-		if (!NT_SUCCESS(status)) {
-			return status;
+		if (NT_SUCCESS(processor_status)) {
+			GROUP_AFFINITY affinity = {};
+			affinity.Group = processor_number.Group;
+			affinity.Mask = 1ull << processor_number.Number;
+			GROUP_AFFINITY previous_affinity = {};
+			KeSetSystemGroupAffinityThread(&affinity, &previous_affinity);
+
+			KIRQL old_irql;
+			KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+			processor_status = callback_routine(context);
+			KeLowerIrql(old_irql);
+
+			KeRevertToUserGroupAffinityThread(&previous_affinity);
 		}
+		if (NT_SUCCESS(processor_status)) {
+			succeeded++;
+			continue;
+		}
+		HYPERPLATFORM_LOG_WARN("Processor %lu failed (status %08x)",
+			processor_index, processor_status);
+		if (NT_SUCCESS(status)) {
+			status = processor_status;
+		}
+	}
 
-		// Switch the current processor
-		GROUP_AFFINITY affinity = {};
-		affinity.Group = processor_number.Group;
-		affinity.Mask = 1ull << processor_number.Number;
-		GROUP_AFFINITY previous_affinity = {};
-		KeSetSystemGroupAffinityThread(&affinity, &previous_affinity);
+	if (number_of_succeeded) {
+		*number_of_succeeded = succeeded;
+	}
+	return status;
+}
+
+// Executes callback_routine on all processors at the same time. Each
+// processor runs it from a DPC, that is, at DISPATCH_LEVEL, and the function
+// returns once every processor has returned from it.
+//
+// Unlike visiting processors one after another, a failure on one processor
+// does not keep the others from executing the callback. The function returns
+// the status of the processor with the lowest index that failed, or
+// STATUS_SUCCESS, and stores how many processors succeeded in
+// number_of_succeeded when it is not nullptr. When the broadcast cannot be
+// allocated, it falls back to visiting processors one after another.
+_Use_decl_annotations_ NTSTATUS UtilForEachProcessor(
+	NTSTATUS(*callback_routine)(void *), void *context,
+	ULONG *number_of_succeeded) {
+	PAGED_CODE();
+
+	if (number_of_succeeded) {
+		*number_of_succeeded = 0;
+	}
+
+	const auto number_of_processors =
+		KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	const auto broadcast = static_cast<UtilBroadcast *>(ExAllocatePoolWithTag(
+		NonPagedPool,
+		FIELD_OFFSET(UtilBroadcast, dpcs[number_of_processors]),
+		kUtilpBroadcastPoolTag));
+	if (!broadcast) {
+		return UtilpForEachProcessorSerially(callback_routine, context,
+			number_of_succeeded);
+	}
 
-		// Execute callback
-		status = callback_routine(context);
+	broadcast->callback_routine = callback_routine;
+	broadcast->context = context;
+	broadcast->remaining = static_cast<LONG>(number_of_processors);
+	KeInitializeEvent(&broadcast->all_done, NotificationEvent, FALSE);
 
-		KeRevertToUserGroupAffinityThread(&previous_affinity);
+	// Resolve every processor before queuing any DPC so that either all
+	// processors or none execute the callback
+	for (ULONG processor_index = 0; processor_index < number_of_processors;
+	processor_index++) {
+		const auto broadcast_dpc = &broadcast->dpcs[processor_index];
+		PROCESSOR_NUMBER processor_number = {};
+		auto status =
+			KeGetProcessorNumberFromIndex(processor_index, &processor_number);
+		if (NT_SUCCESS(status)) {
+			KeInitializeDpc(&broadcast_dpc->dpc, UtilpBroadcastDpcRoutine,
+				broadcast_dpc);
+			KeSetImportanceDpc(&broadcast_dpc->dpc, HighImportance);
+			status = KeSetTargetProcessorDpcEx(&broadcast_dpc->dpc,
+				&processor_number);
+		}
 		if (!NT_SUCCESS(status)) {
+			ExFreePoolWithTag(broadcast, kUtilpBroadcastPoolTag);
 			return status;
 		}
+		broadcast_dpc->status = STATUS_PENDING;
+		broadcast_dpc->broadcast = broadcast;
 	}
-	return STATUS_SUCCESS;
+
+	for (ULONG processor_index = 0; processor_index < number_of_processors;
+	processor_index++) {
+		KeInsertQueueDpc(&broadcast->dpcs[processor_index].dpc, nullptr, nullptr);
+	}
+	KeWaitForSingleObject(&broadcast->all_done, Executive, KernelMode, FALSE,
+		nullptr);
+
+	auto status = STATUS_SUCCESS;
+	ULONG succeeded = 0;
+	for (ULONG processor_index = 0; processor_index < number_of_processors;
+	processor_index++) {
+		const auto processor_status = broadcast->dpcs[processor_index].status;
+		if (NT_SUCCESS(processor_status)) {
+			succeeded++;
+			continue;
+		}
+		HYPERPLATFORM_LOG_WARN("Processor %lu failed (status %08x)",
+			processor_index, processor_status);
+		if (NT_SUCCESS(status)) {
+			status = processor_status;
+		}
+	}
+	ExFreePoolWithTag(broadcast, kUtilpBroadcastPoolTag);
+
+	if (number_of_succeeded) {
+		*number_of_succeeded = succeeded;
+	}
+	return status;
 }
 
 BOOL StartAmdSvmAndHookMsr()
@@ -155,9 +333,17 @@ BOOL StartAmdSvmAndHookMsr()
 		goto EXIT;
 	}
 
+	status = SyscallHookInitialization();
+	if (!NT_SUCCESS(status))
+	{
+		SvDevirtualizeAllProcessors();
+		goto EXIT;
+	}
+
 	status = SyscallHookEnable();
 	if (!NT_SUCCESS(status))
 	{
+		SyscallHookTermination();
 		SvDevirtualizeAllProcessors();
 		goto EXIT;
 	}
@@ -171,6 +357,9 @@ EXIT:
 
 VOID StopAmdSvm()
 {
+	SyscallTraceStop();
+	SyscallHistogramStop();
 	SyscallHookDisable();
+	SyscallHookTermination();
 	SvDevirtualizeAllProcessors();
 }
\ No newline at end of file
@@ -11,8 +11,39 @@ enum class HypercallNumber : unsigned __int32 {
 	kShDisablePageShadowing,  //!< Calls ShVmCallDisablePageShadowing()
 	kHookSyscall,
 	kUnhookSyscall,
+	kBatch,                   //!< Performs a HYPERCALL_BATCH; see UtilVmCallBatch()
 };
 
+//
+// One operation of a kBatch hypercall. Number and Context are what
+// UtilVmCall() would take; the hypervisor writes the result to Status.
+//
+typedef struct _HYPERCALL_DESCRIPTOR
+{
+	HypercallNumber Number;
+	UINT32 Reserved1;
+	UINT64 Context;
+	NTSTATUS Status;
+	UINT32 Reserved2;
+} HYPERCALL_DESCRIPTOR, *PHYPERCALL_DESCRIPTOR;
+static_assert(sizeof(HYPERCALL_DESCRIPTOR) == 24, "HYPERCALL_DESCRIPTOR Size Mismatch");
+
+#define HYPERCALL_BATCH_MAX_ENTRIES \
+	((PAGE_SIZE - 2 * sizeof(UINT32)) / sizeof(HYPERCALL_DESCRIPTOR))
+
+//
+// A batch of hypercalls performed in a single #VMEXIT. The hypervisor reads
+// it through its physical address, so it must be page aligned non-paged
+// memory, for example a page from ExAllocatePoolWithTag(NonPagedPool, ...).
+//
+typedef struct _HYPERCALL_BATCH
+{
+	UINT32 Count;
+	UINT32 Reserved;
+	HYPERCALL_DESCRIPTOR Entries[HYPERCALL_BATCH_MAX_ENTRIES];
+} HYPERCALL_BATCH, *PHYPERCALL_BATCH;
+static_assert(sizeof(HYPERCALL_BATCH) <= PAGE_SIZE, "HYPERCALL_BATCH Size Mismatch");
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _IRQL_requires_same_
 VOID
@@ -27,6 +58,8 @@ extern "C" VOID NTAPI AsmSvmCall(_In_ ULONG_PTR hypercall_number,
 NTSTATUS UtilVmCall(HypercallNumber hypercall_number,
 	void *context);
 
+NTSTATUS UtilVmCallBatch(PHYPERCALL_BATCH batch);
+
 _IRQL_requires_same_
 VOID
 SvInjectGeneralProtectionException(
@@ -47,7 +80,11 @@ void UtilWriteMsr64(Msr msr, ULONG64 value);
 
 ULONG64 UtilReadMsr64(Msr msr);
 
-NTSTATUS UtilForEachProcessor(NTSTATUS(*callback_routine)(void *), void *context);
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS UtilForEachProcessor(
+	_In_ NTSTATUS(*callback_routine)(void *),
+	_In_opt_ void *context,
+	_Out_opt_ ULONG *number_of_succeeded = nullptr);
 
 _IRQL_requires_max_(APC_LEVEL)
 _IRQL_requires_min_(PASSIVE_LEVEL)
@@ -0,0 +1,152 @@
+#include "SvmXstate.h"
+#include "SvmUtil.h"
+
+typedef enum _SV_XSTATE_METHOD
+{
+	SvXstateFxsave,
+	SvXstateXsave,
+	SvXstateXsaveopt,
+	SvXstateXsaves,
+} SV_XSTATE_METHOD;
+
+//
+// How guest state is saved, and which components. The same on all processors.
+//
+static SV_XSTATE_METHOD g_XstateMethod;
+static UINT64 g_XstateMask;
+static BOOLEAN g_XstateAvx2;
+
+//
+// Selects how guest state is saved. Called at PASSIVE_LEVEL before any
+// processor is virtualized; fails if the largest XSAVE area the processor can
+// write does not fit in SV_XSAVE_AREA_PAGES.
+//
+// Only user state components are saved, even with XSAVES; host code does not
+// use supervisor state such as CET or trace configuration. XSAVES is still
+// preferred because it writes the compacted format and, like XSAVEOPT, skips
+// components the guest has not modified since the last restore.
+//
+NTSTATUS SvXstateInitialize(VOID)
+{
+	int registers[4];
+	UINT32 maxSize;
+
+	__cpuid(registers, CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS);
+	if ((registers[2] & CPUID_FN0000_0001_ECX_XSAVE) == 0 ||
+		(registers[2] & CPUID_FN0000_0001_ECX_OSXSAVE) == 0)
+	{
+		g_XstateMethod = SvXstateFxsave;
+		g_XstateMask = 0;
+		g_XstateAvx2 = FALSE;
+		SvDebugPrint("[SvmNest] Guest extended state is saved with FXSAVE.\n");
+		return STATUS_SUCCESS;
+	}
+
+	__cpuidex(registers, CPUID_PROCESSOR_EXTENDED_STATE_ENUMERATION, 0);
+	g_XstateMask = (static_cast<UINT64>(static_cast<UINT32>(registers[3])) << 32) |
+		static_cast<UINT32>(registers[0]);
+	maxSize = static_cast<UINT32>(registers[2]);
+	if (maxSize > SV_XSAVE_AREA_PAGES * PAGE_SIZE)
+	{
+		SvDebugPrint("[SvmNest] XSAVE area of %lu bytes is not supported.\n", maxSize);
+		return STATUS_HV_FEATURE_UNAVAILABLE;
+	}
+
+	__cpuidex(registers, CPUID_STRUCTURED_EXTENDED_FEATURES, 0);
+	g_XstateAvx2 = ((registers[1] & CPUID_FN0000_0007_EBX_AVX2) != 0);
+
+	__cpuidex(registers, CPUID_PROCESSOR_EXTENDED_STATE_ENUMERATION, 1);
+	if ((registers[0] & CPUID_FN0000_000D_EAX_XSAVES) != 0)
+	{
+		g_XstateMethod = SvXstateXsaves;
+	}
+	else if ((registers[0] & CPUID_FN0000_000D_EAX_XSAVEOPT) != 0)
+	{
+		g_XstateMethod = SvXstateXsaveopt;
+	}
+	else
+	{
+		g_XstateMethod = SvXstateXsave;
+	}
+	SvDebugPrint("[SvmNest] Guest extended state is saved with method %d, mask %llx.\n",
+		g_XstateMethod,
+		g_XstateMask);
+	return STATUS_SUCCESS;
+}
+
+//
+// Saves the guest's extended state unless it already has been in this
+// #VMEXIT. After this, the caller may use any extended register the guest
+// enabled in XCR0.
+//
+VOID SvXstateAcquire(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData)
+{
+	const auto nestData = VpData->HostStackLayout.pProcessNestData;
+
+	if (nestData->GuestXstateSaved != FALSE)
+	{
+		return;
+	}
+
+	switch (g_XstateMethod)
+	{
+	case SvXstateXsaves:
+		_xsaves64(nestData->GuestXsaveArea, g_XstateMask);
+		break;
+	case SvXstateXsaveopt:
+		_xsaveopt64(nestData->GuestXsaveArea, g_XstateMask);
+		break;
+	case SvXstateXsave:
+		_xsave64(nestData->GuestXsaveArea, g_XstateMask);
+		break;
+	default:
+		_fxsave64(nestData->GuestXsaveArea);
+		break;
+	}
+	nestData->GuestXstateSaved = TRUE;
+	nestData->Stats.Counters[SV_STATS_XSTATE_SAVES]++;
+}
+
+//
+// Restores the guest's extended state if a handler saved it. Called once
+// every #VMEXIT, after the handlers.
+//
+VOID SvXstateRelease(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData)
+{
+	const auto nestData = VpData->HostStackLayout.pProcessNestData;
+
+	if (nestData->GuestXstateSaved == FALSE)
+	{
+		return;
+	}
+
+	switch (g_XstateMethod)
+	{
+	case SvXstateXsaves:
+		_xrstors64(nestData->GuestXsaveArea, g_XstateMask);
+		break;
+	case SvXstateXsaveopt:
+	case SvXstateXsave:
+		_xrstor64(nestData->GuestXsaveArea, g_XstateMask);
+		break;
+	default:
+		_fxrstor64(nestData->GuestXsaveArea);
+		break;
+	}
+	nestData->GuestXstateSaved = FALSE;
+}
+
+//
+// Checks if a handler may use AVX2 once it has called SvXstateAcquire: the
+// processor has it and the guest enabled YMM state in XCR0, which is not
+// switched on #VMEXIT. Without XSAVE, FXSAVE would not save the upper halves.
+//
+BOOLEAN SvXstateIsAvx2Usable(VOID)
+{
+	const UINT64 ymm = XSTATE_MASK_LEGACY_SSE | XSTATE_MASK_AVX;
+
+	return g_XstateAvx2 != FALSE &&
+		(_xgetbv(0) & ymm) == ymm;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "SvmHead.h"
+#include "SvmStruct.h"
+
+//
+// Lazy save of the guest's extended processor state.
+//
+// SvLaunchVm saves only XMM0-5, the volatile registers compiled host code may
+// use. A handler that uses any other extended register, such as YMM or ZMM,
+// calls SvXstateAcquire before it does. The first call in a #VMEXIT saves the
+// guest's state into a per-processor area with XSAVES, XSAVEOPT or XSAVE,
+// whichever is available, or with FXSAVE when XSAVE is not enabled, and
+// SvXstateRelease restores it after the handlers, before the guest resumes.
+// A #VMEXIT whose handlers do not call SvXstateAcquire costs one test.
+//
+// XCR0 is not switched on #VMEXIT, so the components saved are the ones the
+// guest enabled; those are also the only ones host code can use.
+//
+#define SV_XSAVE_AREA_PAGES 3
+
+NTSTATUS SvXstateInitialize(VOID);
+
+VOID SvXstateAcquire(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData);
+
+VOID SvXstateRelease(
+	_Inout_ PVIRTUAL_PROCESSOR_DATA VpData);
+
+BOOLEAN SvXstateIsAvx2Usable(VOID);
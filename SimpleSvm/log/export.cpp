@@ -0,0 +1,332 @@
+/// @file
+/// Implements sections exporting rings to user-mode consumers.
+
+#include "export.h"
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include <intrin.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kExportpPoolTag = 'pxeS';
+
+/// A size of a slot of the log ring
+static const auto kExportpLogSlotSize =
+    static_cast<RingU32>(kExportLogMessageSize + sizeof(RingSlotHeader));
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    ExportpCreateSecurityDescriptor(_Out_ SECURITY_DESCRIPTOR *descriptor,
+                                    _Outptr_ PACL *dacl);
+
+static void ExportpLogWrite(_In_reads_(length) const char *message,
+                            _In_ size_t length);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static ExportSection g_exportp_log_section = {};
+static RingHeader *volatile g_exportp_log_ring = nullptr;
+
+/// Number of writers may be referencing g_exportp_log_ring
+static volatile LONG g_exportp_log_writers = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Builds a security descriptor granting read-only mapping to SYSTEM and
+// Administrators. The caller frees *dacl.
+_Use_decl_annotations_ static NTSTATUS ExportpCreateSecurityDescriptor(
+    SECURITY_DESCRIPTOR *descriptor, PACL *dacl) {
+  PAGED_CODE();
+
+  const auto system_sid = SeExports->SeLocalSystemSid;
+  const auto admins_sid = SeExports->SeAliasAdminsSid;
+  const auto dacl_size =
+      static_cast<ULONG>(sizeof(ACL) +
+                         2 * (sizeof(ACCESS_ALLOWED_ACE) - sizeof(ULONG)) +
+                         RtlLengthSid(system_sid) + RtlLengthSid(admins_sid));
+  *dacl = reinterpret_cast<PACL>(
+      ExAllocatePoolWithTag(PagedPool, dacl_size, kExportpPoolTag));
+  if (!*dacl) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  auto status = RtlCreateAcl(*dacl, dacl_size, ACL_REVISION);
+  if (NT_SUCCESS(status)) {
+    status = RtlAddAccessAllowedAce(*dacl, ACL_REVISION,
+                                    SECTION_MAP_READ | SECTION_QUERY,
+                                    system_sid);
+  }
+  if (NT_SUCCESS(status)) {
+    status = RtlAddAccessAllowedAce(*dacl, ACL_REVISION,
+                                    SECTION_MAP_READ | SECTION_QUERY,
+                                    admins_sid);
+  }
+  if (NT_SUCCESS(status)) {
+    status =
+        RtlCreateSecurityDescriptor(descriptor, SECURITY_DESCRIPTOR_REVISION);
+  }
+  if (NT_SUCCESS(status)) {
+    status = RtlSetDaclSecurityDescriptor(descriptor, TRUE, *dacl, FALSE);
+  }
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(*dacl, kExportpPoolTag);
+    *dacl = nullptr;
+  }
+  return status;
+}
+
+// Creates a named section and maps it to nonpaged system space.
+_Use_decl_annotations_ NTSTATUS ExportCreateSection(const wchar_t *name,
+                                                    SIZE_T size,
+                                                    ExportSection *section) {
+  PAGED_CODE();
+
+  RtlZeroMemory(section, sizeof(*section));
+
+  SECURITY_DESCRIPTOR descriptor = {};
+  PACL dacl = nullptr;
+  auto status = ExportpCreateSecurityDescriptor(&descriptor, &dacl);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  // The kernel handle bypasses the descriptor; user mode is bound by it.
+  UNICODE_STRING name_u = {};
+  RtlInitUnicodeString(&name_u, name);
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &name_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             &descriptor);
+  LARGE_INTEGER maximum_size = {};
+  maximum_size.QuadPart = size;
+  status = ZwCreateSection(&section->section_handle, SECTION_ALL_ACCESS, &oa,
+                           &maximum_size, PAGE_READWRITE, SEC_COMMIT, nullptr);
+  ExFreePoolWithTag(dacl, kExportpPoolTag);
+  if (!NT_SUCCESS(status)) {
+    section->section_handle = nullptr;
+    return status;
+  }
+
+  // Map the section to system space. The view is pageable, so lock it and use
+  // a separate mapping of locked pages so that writers may run at any IRQL.
+  PVOID section_object = nullptr;
+  status = ObReferenceObjectByHandle(section->section_handle,
+                                     SECTION_MAP_READ | SECTION_MAP_WRITE,
+                                     nullptr, KernelMode, &section_object,
+                                     nullptr);
+  if (!NT_SUCCESS(status)) {
+    ExportDeleteSection(section);
+    return status;
+  }
+  SIZE_T view_size = size;
+  status = MmMapViewInSystemSpace(section_object, &section->view, &view_size);
+  ObDereferenceObject(section_object);
+  if (!NT_SUCCESS(status)) {
+    section->view = nullptr;
+    ExportDeleteSection(section);
+    return status;
+  }
+
+  section->mdl = IoAllocateMdl(section->view, static_cast<ULONG>(size), FALSE,
+                               FALSE, nullptr);
+  if (!section->mdl) {
+    ExportDeleteSection(section);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  __try {
+    MmProbeAndLockPages(section->mdl, KernelMode, IoWriteAccess);
+  } __except (EXCEPTION_EXECUTE_HANDLER) {
+    IoFreeMdl(section->mdl);
+    section->mdl = nullptr;
+    ExportDeleteSection(section);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  section->base =
+      MmGetSystemAddressForMdlSafe(section->mdl, NormalPagePriority);
+  if (!section->base) {
+    ExportDeleteSection(section);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  section->size = size;
+  RtlZeroMemory(section->base, size);
+  return STATUS_SUCCESS;
+}
+
+// Unmaps and closes a section. Handles a partially created section too.
+_Use_decl_annotations_ void ExportDeleteSection(ExportSection *section) {
+  PAGED_CODE();
+
+  if (section->mdl) {
+    MmUnlockPages(section->mdl);
+    IoFreeMdl(section->mdl);
+  }
+  if (section->view) {
+    MmUnmapViewInSystemSpace(section->view);
+  }
+  if (section->section_handle) {
+    ZwClose(section->section_handle);
+  }
+  RtlZeroMemory(section, sizeof(*section));
+}
+
+// Formats memory as an empty ring.
+_Use_decl_annotations_ RingHeader *ExportInitializeRing(void *base,
+                                                        RingU32 slot_size,
+                                                        RingU32 slot_count) {
+  NT_ASSERT(slot_count && (slot_count & (slot_count - 1)) == 0);
+  NT_ASSERT(slot_size > sizeof(RingSlotHeader));
+
+  const auto ring = static_cast<RingHeader *>(base);
+  RtlZeroMemory(ring, static_cast<SIZE_T>(RingGetSize(slot_size, slot_count)));
+  ring->header_size = sizeof(RingHeader);
+  ring->slot_size = slot_size;
+  ring->slot_count = slot_count;
+  ring->version = kRingVersion;
+  // Zero is a valid sequence number; mark unused slots as not yet written.
+  for (RingU32 i = 0; i < slot_count; ++i) {
+    RingGetSlot(ring, i)->sequence = kRingSlotEmpty;
+  }
+
+  // Publish the magic last so that a consumer never sees a partial header.
+  KeMemoryBarrier();
+  ring->magic = kRingMagic;
+  return ring;
+}
+
+// Reserves a sequence number, then claims a slot exclusively and fills it
+// while it is marked busy so that a consumer can tell a torn record from a
+// complete one. A record is dropped when its slot is still being filled for
+// the previous lap.
+_Use_decl_annotations_ void ExportRingWrite(RingHeader *ring,
+                                            const void *payload,
+                                            RingU32 size) {
+  const auto capacity =
+      ring->slot_size - static_cast<RingU32>(sizeof(RingSlotHeader));
+  if (size > capacity) {
+    InterlockedIncrement64(reinterpret_cast<volatile LONG64 *>(&ring->dropped));
+    size = capacity;
+  }
+
+  const auto sequence = static_cast<RingU64>(InterlockedIncrement64(
+                            reinterpret_cast<volatile LONG64 *>(&ring->head))) -
+                        1;
+  if (sequence >= ring->slot_count) {
+    ring->tail = sequence - ring->slot_count + 1;
+  }
+
+  const auto slot = RingClaimSlot(ring, sequence);
+  if (!slot) {
+    InterlockedIncrement64(reinterpret_cast<volatile LONG64 *>(&ring->dropped));
+    return;
+  }
+  slot->timestamp = __rdtsc();
+  slot->size = size;
+  slot->processor = KeGetCurrentProcessorNumberEx(nullptr);
+  RtlCopyMemory(slot + 1, payload, size);
+  RingPublishSlot(slot, sequence);
+}
+
+// Stores a message to the log ring unless it is being deleted.
+_Use_decl_annotations_ static void ExportpLogWrite(const char *message,
+                                                   size_t length) {
+  InterlockedIncrement(&g_exportp_log_writers);
+  const auto ring = g_exportp_log_ring;
+  if (ring) {
+    ExportRingWrite(ring, message, static_cast<RingU32>(length));
+  }
+  InterlockedDecrement(&g_exportp_log_writers);
+}
+
+// Creates the log ring section.
+_Use_decl_annotations_ NTSTATUS ExportLogInitialization() {
+  PAGED_CODE();
+
+  const auto size = static_cast<SIZE_T>(
+      RingGetSize(kExportpLogSlotSize, kExportLogSlotCount));
+  auto status = ExportCreateSection(SVMNEST_EXPORT_LOG_SECTION_NAME, size,
+                                    &g_exportp_log_section);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  g_exportp_log_ring = ExportInitializeRing(
+      g_exportp_log_section.base, kExportpLogSlotSize, kExportLogSlotCount);
+  return status;
+}
+
+// Unpublishes the log ring, waits for writers already using it, and then
+// deletes the section.
+_Use_decl_annotations_ void ExportLogTermination() {
+  PAGED_CODE();
+
+  if (!g_exportp_log_ring) {
+    return;
+  }
+  g_exportp_log_ring = nullptr;
+  KeMemoryBarrier();
+
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -10000;  // 1 ms
+  while (g_exportp_log_writers) {
+    KeDelayExecutionThread(KernelMode, FALSE, &interval);
+  }
+  ExportDeleteSection(&g_exportp_log_section);
+}
+
+// Stores a message to the log ring.
+_Use_decl_annotations_ void ExportLogMessage(const char *message) {
+  // Ask for one more character than fits so that truncation is counted.
+  size_t length = 0;
+  if (!NT_SUCCESS(
+          RtlStringCchLengthA(message, kExportLogMessageSize + 1, &length))) {
+    length = kExportLogMessageSize + 1;
+  }
+  ExportpLogWrite(message, length);
+}
+
+// Formats and stores a message to the log ring.
+_Use_decl_annotations_ void ExportLogVPrint(const char *format,
+                                            va_list args) {
+  if (!g_exportp_log_ring) {
+    return;
+  }
+
+  // One extra character lets a truncated message be detected as too long.
+  char message[kExportLogMessageSize + 2];
+  size_t remaining = 0;
+  const auto status =
+      RtlStringCchVPrintfExA(message, RTL_NUMBER_OF(message), nullptr,
+                             &remaining, 0, format, args);
+  if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW) {
+    return;
+  }
+  ExportpLogWrite(message, RTL_NUMBER_OF(message) - remaining);
+}
+
+// Returns the log ring.
+const RingHeader *ExportLogGetRing() { return g_exportp_log_ring; }
+
+}  // extern "C"
@@ -0,0 +1,128 @@
+/// @file
+/// Declares interfaces to sections exporting rings to user-mode consumers.
+
+#ifndef SVMNEST_LOG_EXPORT_H_
+#define SVMNEST_LOG_EXPORT_H_
+
+#include <fltKernel.h>
+#include "ring.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// A name of a section exporting log messages. User-mode consumers open it as
+/// "Global\SvmNestLog" with FILE_MAP_READ.
+#define SVMNEST_EXPORT_LOG_SECTION_NAME L"\\BaseNamedObjects\\SvmNestLog"
+
+/// A maximum size of a log message stored in the log ring, excluding a null
+/// terminator. Longer messages are truncated and counted as dropped.
+static const auto kExportLogMessageSize = 512ul;
+
+/// A number of slots of the log ring
+static const auto kExportLogSlotCount = 2048ul;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Represents a section exported read-only to user mode
+struct ExportSection {
+  HANDLE section_handle;  //!< Keeps the section and its name alive
+  void *view;             //!< A view of the section in system space
+  PMDL mdl;               //!< Locks pages of the view
+  void *base;             //!< A nonpaged mapping of the locked view
+  SIZE_T size;            //!< A size of the section in bytes
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Creates a named section user mode can only map read-only
+/// @param name   A full path name of the section
+/// @param size   A size of the section in bytes
+/// @param section  Receives the created section
+/// @return STATUS_SUCCESS on success
+///
+/// Only SYSTEM and Administrators are granted access, and only for
+/// SECTION_MAP_READ and SECTION_QUERY. The section is locked and zero filled;
+/// ExportSection::base is safe to write at any IRQL, including the host
+/// context.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    ExportCreateSection(_In_ const wchar_t *name, _In_ SIZE_T size,
+                        _Out_ ExportSection *section);
+
+/// Deletes a section created by ExportCreateSection()
+/// @param section  A section to delete
+///
+/// A view a consumer mapped stays valid until the consumer unmaps it.
+_IRQL_requires_max_(PASSIVE_LEVEL) void ExportDeleteSection(
+    _Inout_ ExportSection *section);
+
+/// Formats memory as an empty ring
+/// @param base   An address to place the ring
+/// @param slot_size  A size of a slot including RingSlotHeader
+/// @param slot_count   A number of slots; must be a power of two
+/// @return \a base as a ring
+///
+/// \a base must be at least RingGetSize(slot_size, slot_count) bytes.
+RingHeader *ExportInitializeRing(_Out_ void *base, _In_ RingU32 slot_size,
+                                 _In_ RingU32 slot_count);
+
+/// Stores a record to a ring
+/// @param ring   A ring to store the record
+/// @param payload  A record to store
+/// @param size   A size of \a payload in bytes
+///
+/// Safe at any IRQL, including the host context, and from any number of
+/// processors at once. Never waits for consumers or other writers; the oldest
+/// record is overwritten when the ring is full, \a payload larger than a slot
+/// is truncated and counted as dropped, and a record whose slot is still being
+/// filled by a writer one lap behind is dropped and counted.
+void ExportRingWrite(_Inout_ RingHeader *ring,
+                     _In_reads_bytes_(size) const void *payload,
+                     _In_ RingU32 size);
+
+/// Creates the log ring section
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS ExportLogInitialization();
+
+/// Deletes the log ring section after in-flight writers have finished
+_IRQL_requires_max_(PASSIVE_LEVEL) void ExportLogTermination();
+
+/// Stores a null-terminated message to the log ring if it exists
+/// @param message  A message to store
+void ExportLogMessage(_In_z_ const char *message);
+
+/// Formats and stores a message to the log ring if it exists
+/// @param format   A format string
+/// @param args   Arguments for \a format
+void ExportLogVPrint(_In_z_ _Printf_format_string_ const char *format,
+                     _In_ va_list args);
+
+/// Returns the log ring, or nullptr when it is not initialized
+const RingHeader *ExportLogGetRing();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // SVMNEST_LOG_EXPORT_H_
@@ -6,6 +6,7 @@
 /// Implements logging functions.
 
 #include "log.h"
+#include "export.h"
 #define NTSTRSAFE_NO_CB_FUNCTIONS
 #include <ntstrsafe.h>
 
@@ -565,6 +566,9 @@ _Use_decl_annotations_ static NTSTATUS LogpPut(char *message, ULONG attribute) {
     }
   }
 
+  // Export it to user mode before LogpDoDbgPrint() modifies it.
+  ExportLogMessage(message);
+
   // Can it safely be printed?
   if (do_DbgPrint) {
     LogpDoDbgPrint(message);
@@ -0,0 +1,268 @@
+/// @file
+/// Declares a layout of rings shared with user-mode consumers.
+///
+/// A ring is a RingHeader followed by a power-of-two number of fixed-size
+/// slots, each of which is a RingSlotHeader followed by a payload. Any number
+/// of processors may write to a ring at once: a writer reserves a sequence
+/// number from RingHeader::head and then claims its slot with RingClaimSlot(),
+/// which fails rather than sharing the slot with another writer that has not
+/// published yet. A consumer maps the section read-only, polls
+/// RingHeader::head and copies records out with RingRead(). Nothing is ever
+/// written back by a consumer, so a slow or dead consumer cannot stall the
+/// driver; it only loses the oldest records.
+///
+/// This header must not depend on the WDK so that a user-mode collector or an
+/// off-box reader of a dumped section image can include it as is.
+
+#ifndef SVMNEST_LOG_RING_H_
+#define SVMNEST_LOG_RING_H_
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+typedef unsigned __int32 RingU32;
+typedef unsigned __int64 RingU64;
+#define SVMNEST_RING_READ_BARRIER() _ReadWriteBarrier()
+#define SVMNEST_RING_WRITE_BARRIER() _ReadWriteBarrier()
+#else
+#include <stdint.h>
+typedef uint32_t RingU32;
+typedef uint64_t RingU64;
+#define SVMNEST_RING_READ_BARRIER() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define SVMNEST_RING_WRITE_BARRIER() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// "SRNG"; RingHeader::magic of a valid ring
+static const RingU32 kRingMagic = 0x474e5253;
+
+/// RingHeader::version of a ring this header describes
+static const RingU32 kRingVersion = 2;
+
+/// RingSlotHeader::sequence while a writer is filling the slot
+static const RingU64 kRingSlotBusy = ~0ull;
+
+/// RingSlotHeader::sequence of a slot no record has been stored to
+static const RingU64 kRingSlotEmpty = ~0ull - 1;
+
+/// "SRDR"; RingDirectory::magic of a valid directory
+static const RingU32 kRingDirectoryMagic = 0x52445253;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Describes a ring. Located at the beginning of each ring.
+struct RingHeader {
+  RingU32 magic;        //!< kRingMagic
+  RingU32 version;      //!< kRingVersion
+  RingU32 header_size;  //!< Offset from this header to the first slot
+  RingU32 slot_size;    //!< Size of a slot including RingSlotHeader
+  RingU32 slot_count;   //!< Number of slots; always a power of two
+  RingU32 reserved;
+
+  /// A sequence number the next record will get. Records [tail, head) may
+  /// be available.
+  volatile RingU64 head;
+
+  /// The oldest sequence number that may still be stored. Updated by the
+  /// writer when it wraps around; a hint only, as RingRead() is authoritative.
+  volatile RingU64 tail;
+
+  /// Number of records that were truncated or could not be stored
+  volatile RingU64 dropped;
+};
+static_assert(sizeof(RingHeader) == 48, "RingHeader Size Mismatch");
+
+/// Precedes a payload in each slot.
+struct RingSlotHeader {
+  /// A sequence number of the record stored in this slot, kRingSlotBusy or
+  /// kRingSlotEmpty
+  volatile RingU64 sequence;
+  RingU64 timestamp;  //!< TSC when the record was written
+  RingU32 size;       //!< Bytes of valid payload
+  RingU32 processor;  //!< An index of a processor wrote the record
+};
+static_assert(sizeof(RingSlotHeader) == 24, "RingSlotHeader Size Mismatch");
+
+/// Describes a section holding one ring per processor. Located at the
+/// beginning of such a section; ring i starts ring_offset + i * ring_stride
+/// bytes from it.
+struct RingDirectory {
+  RingU32 magic;        //!< kRingDirectoryMagic
+  RingU32 version;      //!< kRingVersion
+  RingU32 ring_count;   //!< Number of rings; indexed by a processor index
+  RingU32 reserved;
+  RingU64 ring_offset;  //!< Offset from this directory to the first ring
+  RingU64 ring_stride;  //!< Distance between two rings in bytes
+};
+static_assert(sizeof(RingDirectory) == 32, "RingDirectory Size Mismatch");
+
+/// Results of RingRead()
+enum RingReadResult {
+  kRingReadOk,      //!< A record was copied
+  kRingReadNotYet,  //!< The record has not been published yet
+  kRingReadLost,    //!< The record has been overwritten
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Returns a size of a ring in bytes
+/// @param slot_size  A size of a slot including RingSlotHeader
+/// @param slot_count  A number of slots; must be a power of two
+/// @return A size of the ring including RingHeader
+inline RingU64 RingGetSize(RingU32 slot_size, RingU32 slot_count) {
+  return sizeof(RingHeader) + static_cast<RingU64>(slot_size) * slot_count;
+}
+
+/// Returns a slot holding a record with a given sequence number
+/// @param ring   A ring
+/// @param sequence   A sequence number of a record
+/// @return A slot header
+inline RingSlotHeader *RingGetSlot(const RingHeader *ring, RingU64 sequence) {
+  const auto index = sequence & (ring->slot_count - 1);
+  return reinterpret_cast<RingSlotHeader *>(
+      const_cast<char *>(reinterpret_cast<const char *>(ring)) +
+      ring->header_size + index * ring->slot_size);
+}
+
+/// Checks if a header describes a ring this header can read
+/// @param ring   A ring
+/// @param ring_size  A size of memory holding the ring in bytes
+/// @return true if the ring can be read with RingRead()
+inline bool RingIsValid(const RingHeader *ring, RingU64 ring_size) {
+  if (ring_size < sizeof(RingHeader) || ring->magic != kRingMagic ||
+      ring->version != kRingVersion) {
+    return false;
+  }
+  if (ring->slot_count == 0 ||
+      (ring->slot_count & (ring->slot_count - 1)) != 0 ||
+      ring->slot_size <= sizeof(RingSlotHeader) ||
+      ring->header_size < sizeof(RingHeader)) {
+    return false;
+  }
+  return ring->header_size +
+             static_cast<RingU64>(ring->slot_size) * ring->slot_count <=
+         ring_size;
+}
+
+/// Returns a ring in a directory
+/// @param directory  A directory
+/// @param section_size   A size of memory holding the directory in bytes
+/// @param index  An index of a ring
+/// @return A ring validated with RingIsValid(), or nullptr
+inline const RingHeader *RingDirectoryGetRing(const RingDirectory *directory,
+                                              RingU64 section_size,
+                                              RingU32 index) {
+  if (section_size < sizeof(RingDirectory) ||
+      directory->magic != kRingDirectoryMagic ||
+      directory->version != kRingVersion || index >= directory->ring_count) {
+    return nullptr;
+  }
+  const auto offset = directory->ring_offset + directory->ring_stride * index;
+  if (offset >= section_size || directory->ring_stride == 0) {
+    return nullptr;
+  }
+  const auto ring = reinterpret_cast<const RingHeader *>(
+      reinterpret_cast<const char *>(directory) + offset);
+  return RingIsValid(ring, section_size - offset) ? ring : nullptr;
+}
+
+/// Claims a slot to store a record with a given sequence number
+/// @param ring   A ring
+/// @param sequence   A sequence number reserved from RingHeader::head
+/// @return A slot marked kRingSlotBusy, or nullptr if the record cannot be
+///         stored
+///
+/// The slot is claimed only when it is idle and holds an older record, so that
+/// two writers whose sequence numbers are slot_count apart never fill the same
+/// slot at once. A writer that gets nullptr must drop the record; the slot
+/// then reads as kRingReadNotYet until a later record replaces it.
+inline RingSlotHeader *RingClaimSlot(RingHeader *ring, RingU64 sequence) {
+  const auto slot = RingGetSlot(ring, sequence);
+  for (;;) {
+    const RingU64 current = slot->sequence;
+    if (current == kRingSlotBusy ||
+        (current != kRingSlotEmpty && current >= sequence)) {
+      return nullptr;
+    }
+#if defined(_MSC_VER)
+    const auto previous = static_cast<RingU64>(_InterlockedCompareExchange64(
+        reinterpret_cast<volatile __int64 *>(&slot->sequence),
+        static_cast<__int64>(kRingSlotBusy), static_cast<__int64>(current)));
+#else
+    const auto previous = __sync_val_compare_and_swap(&slot->sequence, current,
+                                                      kRingSlotBusy);
+#endif
+    if (previous == current) {
+      return slot;
+    }
+  }
+}
+
+/// Publishes a slot claimed with RingClaimSlot()
+/// @param slot   A slot filled by the caller
+/// @param sequence   A sequence number the slot was claimed for
+inline void RingPublishSlot(RingSlotHeader *slot, RingU64 sequence) {
+  SVMNEST_RING_WRITE_BARRIER();
+  slot->sequence = sequence;
+}
+
+/// Copies a record out of a ring
+/// @param ring   A ring validated with RingIsValid()
+/// @param sequence   A sequence number of a record to read
+/// @param slot   A buffer to receive the slot header
+/// @param payload  A buffer to receive the payload
+/// @param payload_size  A size of \a payload in bytes
+/// @return kRingReadOk when \a slot and \a payload were filled
+///
+/// A payload larger than \a payload_size is truncated; slot->size still
+/// reports the stored size.
+inline RingReadResult RingRead(const RingHeader *ring, RingU64 sequence,
+                               RingSlotHeader *slot, void *payload,
+                               RingU32 payload_size) {
+  const RingU64 head = ring->head;
+  SVMNEST_RING_READ_BARRIER();
+  if (sequence >= head) {
+    return kRingReadNotYet;
+  }
+  if (head - sequence > ring->slot_count) {
+    return kRingReadLost;
+  }
+
+  const auto stored = RingGetSlot(ring, sequence);
+  const RingU64 before = stored->sequence;
+  SVMNEST_RING_READ_BARRIER();
+  if (before != sequence) {
+    // Either the writer has reserved but not yet filled the slot, or a newer
+    // record has already replaced it.
+    return (before == kRingSlotBusy || before == kRingSlotEmpty ||
+            before < sequence)
+               ? kRingReadNotYet
+               : kRingReadLost;
+  }
+
+  slot->sequence = before;
+  slot->timestamp = stored->timestamp;
+  slot->size = stored->size;
+  slot->processor = stored->processor;
+  const auto capacity = ring->slot_size - sizeof(RingSlotHeader);
+  auto size = (slot->size < capacity) ? slot->size : capacity;
+  size = (size < payload_size) ? size : payload_size;
+  const auto source = reinterpret_cast<const volatile char *>(stored + 1);
+  for (RingU32 i = 0; i < size; ++i) {
+    static_cast<char *>(payload)[i] = source[i];
+  }
+
+  SVMNEST_RING_READ_BARRIER();
+  return (stored->sequence == sequence) ? kRingReadOk : kRingReadLost;
+}
+
+#endif  // SVMNEST_LOG_RING_H_
@@ -10,6 +10,8 @@
 #define HYPERPLATFORM_VMM_H_
 
 #include <fltKernel.h>
+#include "SvmStats.h"
+#include "SvmArena.h"
 ////////////////////////////////////////////////////////////////////////////////
 //
 // macro utilities
@@ -32,6 +34,15 @@ typedef enum {
 	GuestMode,
 }VMX_MODE;
 
+/// Pages of the arena host code allocates from on each processor
+#define SV_HOST_ARENA_PAGES 24
+
+/// Slab caches in the host arena of each processor
+typedef enum {
+	HostSlabVcpuVmx = 0,
+	HostSlabMaximum,
+}HOST_SLAB;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -62,6 +73,10 @@ typedef struct _VCPU_VMX
 	USHORT	  kVirtualProcessorId;		///NOT USED 
 	ULONG_PTR   guest_irql;
 	ULONG_PTR   guest_cr8;    
+	PVOID     NestedIopm;				///L0's IOPM ORed with L1's, for VMCB02 while L2 runs
+	ULONG64   NestedIopmPa;
+	PVOID     NestedIopmSnapshot;		///L1's IOPM NestedIopm was built from
+	ULONG64   NestedIopmSourcePa;		///VMCB12 IopmBasePa of it, or MAXUINT64 if none
 }VCPUVMX, *PVCPUVMX;
 
 /// Represents VMM related data associated with each processor
@@ -76,8 +91,19 @@ struct ProcessorNestData {
 	VCPUVMX*		vcpu_vmx;				  //!< For nested vmx context
 	CPU_MODE		CpuMode;				  //!< For CPU Mode 
     LARGE_INTEGER        GuestMsrEFER;          // for amd nest 
+	ULONG64		OriginalMsrLstar;		  //!< Guest LSTAR while the syscall hook is on, or 0
+	struct _SV_CPUID_CACHE* CpuidCache;	  //!< CPUID results served to the guest
+	struct _SV_FETCH_CACHE* FetchCache;	  //!< Guest page walks for instruction fetch
+	SV_STATS		Stats;					  //!< Counters served by SV_CPUID_STATS_COUNTER
+	USHORT			NumaNode;				  //!< Node this processor's data is allocated on
+	SV_ARENA		HostArena;				  //!< Pages for allocation in host context
+	SV_SLAB			HostSlabs[HostSlabMaximum]; //!< Slab caches over HostArena
+	PVOID			GuestXsaveArea;			  //!< Guest extended state; see SvmXstate.h
+	BOOLEAN			GuestXstateSaved;		  //!< GuestXsaveArea holds the current state
+	BOOLEAN			LargePageSlot;			  //!< This data is in a slot region mapped with large pages
 
 };
+static_assert(sizeof(ProcessorNestData) <= PAGE_SIZE, "ProcessorNestData Size Mismatch");
 
 
 
@@ -157,7 +157,8 @@ SvLV10: ;
         ; Allocate stack for homing space (0x20) and volatile XMM registers
         ; (0x60). Save those registers because subsequent host code may destroy
         ; any of those registers. XMM6-15 are not saved because those should be
-        ; preserved (those are non volatile registers).
+        ; preserved (those are non volatile registers). Handlers that use other
+        ; extended registers save and restore them with SvXstateAcquire.
         ;
         sub rsp, 80h
         movaps xmmword ptr [rsp + 20h], xmm0
@@ -0,0 +1,184 @@
+// Tests of the host-context page arena and slab caches in SvmArena.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include "SvmArena.h"
+#include "test.h"
+
+namespace {
+
+const SvArenaU32 kPageCount = 8;
+
+// A page aligned arena whose memory holds garbage, as the driver's does
+struct TestArena {
+  TestArena() {
+    memory = static_cast<unsigned char *>(
+        aligned_alloc(SV_ARENA_PAGE_SIZE, kPageCount * SV_ARENA_PAGE_SIZE));
+    memset(memory, 0xcc, kPageCount * SV_ARENA_PAGE_SIZE);
+    SvArenaInitialize(&arena, memory, kPageCount);
+  }
+  ~TestArena() { free(memory); }
+
+  unsigned char *Page(SvArenaU32 index) {
+    return memory + index * SV_ARENA_PAGE_SIZE;
+  }
+
+  unsigned char *memory;
+  SV_ARENA arena;
+};
+
+void TestPages() {
+  TestArena test;
+  auto &arena = test.arena;
+
+  TEST_CHECK(SvArenaAllocatePages(&arena, 0) == nullptr);
+  TEST_CHECK(SvArenaAllocatePages(&arena, 3) == test.Page(0));
+  TEST_CHECK(SvArenaAllocatePage(&arena) == test.Page(3));
+  TEST_CHECK(SvArenaAllocatePage(&arena) == test.Page(4));
+  TEST_CHECK(arena.PagesInUse == 5);
+
+  // Freed pages are reused before the unused range, last freed first.
+  TEST_CHECK(SvArenaFreePage(&arena, test.Page(3)));
+  TEST_CHECK(SvArenaFreePage(&arena, test.Page(4)));
+  TEST_CHECK(arena.PagesInUse == 3);
+  TEST_CHECK(arena.PagesHighWater == 5);
+  TEST_CHECK(SvArenaAllocatePage(&arena) == test.Page(4));
+  TEST_CHECK(SvArenaAllocatePage(&arena) == test.Page(3));
+  TEST_CHECK(SvArenaAllocatePage(&arena) == test.Page(5));
+
+  // Exhaustion
+  TEST_CHECK(SvArenaAllocatePages(&arena, 3) == nullptr);
+  TEST_CHECK(SvArenaAllocatePages(&arena, 2) == test.Page(6));
+  TEST_CHECK(SvArenaAllocatePage(&arena) == nullptr);
+  TEST_CHECK(arena.PagesInUse == kPageCount);
+  TEST_CHECK(arena.PagesHighWater == kPageCount);
+}
+
+void TestBadPageFree() {
+  TestArena test;
+  auto &arena = test.arena;
+
+  // Nothing in use yet
+  TEST_CHECK(!SvArenaFreePage(&arena, test.Page(0)));
+
+  auto page = static_cast<unsigned char *>(SvArenaAllocatePage(&arena));
+  TEST_CHECK(page == test.Page(0));
+
+  // Not handed out, outside the arena, not page aligned
+  TEST_CHECK(!SvArenaFreePage(&arena, test.Page(1)));
+  TEST_CHECK(!SvArenaFreePage(&arena, test.memory - SV_ARENA_PAGE_SIZE));
+  TEST_CHECK(!SvArenaFreePage(&arena, page + 16));
+  TEST_CHECK(arena.PagesInUse == 1);
+
+  // Double free
+  TEST_CHECK(SvArenaFreePage(&arena, page));
+  TEST_CHECK(!SvArenaFreePage(&arena, page));
+  TEST_CHECK(arena.PagesInUse == 0);
+
+  // Allocating the page again clears its free mark, so it can be freed again.
+  TEST_CHECK(SvArenaAllocatePage(&arena) == page);
+  TEST_CHECK(SvArenaAllocatePage(&arena) == test.Page(1));
+  TEST_CHECK(SvArenaFreePage(&arena, page));
+  TEST_CHECK(SvArenaAllocatePage(&arena) == page);
+  TEST_CHECK(arena.FreePages == nullptr);
+  TEST_CHECK(arena.PagesInUse == 2);
+}
+
+void TestSlab() {
+  TestArena test;
+  SV_SLAB slab;
+  SvSlabInitialize(&slab, &test.arena, 40);
+  TEST_CHECK(slab.ObjectSize == 48);
+
+  // One page refills the slab with as many objects as fit.
+  const unsigned kPerPage = SV_ARENA_PAGE_SIZE / 48;
+  unsigned char *objects[kPerPage + 1];
+  for (unsigned i = 0; i < kPerPage + 1; ++i) {
+    objects[i] = static_cast<unsigned char *>(SvSlabAllocate(&slab));
+    TEST_CHECK(objects[i] != nullptr);
+    TEST_CHECK((objects[i] - test.memory) % SV_ARENA_PAGE_SIZE % 48 == 0);
+  }
+  TEST_CHECK(test.arena.PagesInUse == 2);
+  TEST_CHECK(slab.ObjectsInUse == kPerPage + 1);
+  for (unsigned i = 0; i < kPerPage + 1; ++i) {
+    for (unsigned j = i + 1; j < kPerPage + 1; ++j) {
+      TEST_CHECK(objects[i] != objects[j]);
+    }
+  }
+
+  TEST_CHECK(SvSlabFree(&slab, objects[5]));
+  TEST_CHECK(SvSlabAllocate(&slab) == objects[5]);
+  TEST_CHECK(slab.ObjectsInUse == kPerPage + 1);
+  TEST_CHECK(slab.ObjectsHighWater == kPerPage + 1);
+
+  // Objects smaller than the free list link are rounded up.
+  SV_SLAB tiny;
+  SvSlabInitialize(&tiny, &test.arena, 0);
+  TEST_CHECK(tiny.ObjectSize == SV_ARENA_MIN_OBJECT_SIZE);
+}
+
+void TestBadSlabFree() {
+  TestArena test;
+  SV_SLAB slab;
+  SvSlabInitialize(&slab, &test.arena, 48);
+
+  auto object = static_cast<unsigned char *>(SvSlabAllocate(&slab));
+  TEST_CHECK(object != nullptr);
+
+  // Inside an object, outside handed out pages, outside the arena
+  TEST_CHECK(!SvSlabFree(&slab, object + 16));
+  TEST_CHECK(!SvSlabFree(&slab, test.Page(3)));
+  TEST_CHECK(!SvSlabFree(&slab, test.memory + kPageCount * SV_ARENA_PAGE_SIZE));
+  TEST_CHECK(slab.ObjectsInUse == 1);
+
+  // Double free, and a free with nothing in use
+  TEST_CHECK(SvSlabFree(&slab, object));
+  TEST_CHECK(!SvSlabFree(&slab, object));
+  TEST_CHECK(slab.ObjectsInUse == 0);
+  TEST_CHECK(SvSlabAllocate(&slab) == object);
+  TEST_CHECK(SvSlabFree(&slab, object));
+  auto other = SvSlabAllocate(&slab);
+  TEST_CHECK(other == object);
+  TEST_CHECK(SvSlabFree(&slab, other));
+  TEST_CHECK(!SvSlabFree(&slab, other));
+  TEST_CHECK(slab.ObjectsInUse == 0);
+
+  // The free list is intact after the rejected frees.
+  unsigned count = 0;
+  for (auto entry = slab.FreeObjects; entry; entry = entry->Next) {
+    ++count;
+  }
+  TEST_CHECK(count == SV_ARENA_PAGE_SIZE / 48);
+}
+
+void TestLargeObjects() {
+  TestArena test;
+  SV_SLAB slab;
+  SvSlabInitialize(&slab, &test.arena, SV_ARENA_PAGE_SIZE + 1);
+
+  auto first = static_cast<unsigned char *>(SvSlabAllocate(&slab));
+  auto second = static_cast<unsigned char *>(SvSlabAllocate(&slab));
+  TEST_CHECK(first == test.Page(0));
+  TEST_CHECK(second == test.Page(2));
+  TEST_CHECK(test.arena.PagesInUse == 4);
+  TEST_CHECK(SvSlabAllocate(&slab) != nullptr);
+  TEST_CHECK(SvSlabAllocate(&slab) != nullptr);
+  TEST_CHECK(SvSlabAllocate(&slab) == nullptr);
+
+  TEST_CHECK(!SvSlabFree(&slab, first + 16));
+  TEST_CHECK(SvSlabFree(&slab, first));
+  TEST_CHECK(!SvSlabFree(&slab, first));
+  TEST_CHECK(SvSlabAllocate(&slab) == first);
+  TEST_CHECK(slab.ObjectsInUse == 4);
+}
+
+}  // namespace
+
+int main() {
+  TEST_RUN(TestPages);
+  TEST_RUN(TestBadPageFree);
+  TEST_RUN(TestSlab);
+  TEST_RUN(TestBadSlabFree);
+  TEST_RUN(TestLargeObjects);
+  return TEST_RESULT();
+}
@@ -0,0 +1,100 @@
+// Measures decoding and emulation through SvmEmulate.h.
+//
+// Prints nanoseconds per instruction for forms #NPF handlers see, decoding
+// alone and decoding with emulation against memory callbacks that do
+// nothing but a plain load or store.
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include "SvmEmulate.h"
+
+namespace {
+
+const unsigned kRounds = 1000000;
+
+SvEmuU64 g_memory[512];
+
+int BenchRead(void *context, SvEmuU64 address, SvEmuU32 size,
+              SvEmuU64 *value) {
+  (void)context;
+  *value = 0;
+  memcpy(value, reinterpret_cast<unsigned char *>(g_memory) + (address & 0xff8),
+         size);
+  return 1;
+}
+
+int BenchWrite(void *context, SvEmuU64 address, SvEmuU32 size,
+               SvEmuU64 value) {
+  (void)context;
+  memcpy(reinterpret_cast<unsigned char *>(g_memory) + (address & 0xff8),
+         &value, size);
+  return 1;
+}
+
+struct Case {
+  const char *name;
+  SvEmuU8 bytes[SV_EMU_MAX_LENGTH];
+  SvEmuU32 count;
+};
+
+const Case kCases[] = {
+    {"mov [rax], ecx", {0x89, 0x08}, 2},
+    {"mov rax, [rip+disp32]", {0x48, 0x8b, 0x05, 0x10, 0x00, 0x00, 0x00}, 7},
+    {"mov dword [rbx+rcx*4+8], imm32",
+     {0xc7, 0x44, 0x8b, 0x08, 0x78, 0x56, 0x34, 0x12}, 8},
+    {"movzx eax, word [rdx]", {0x0f, 0xb7, 0x02}, 3},
+    {"or dword [r8+0x10], imm8", {0x41, 0x83, 0x48, 0x10, 0x01}, 5},
+    {"lock add [rsi], edx", {0xf0, 0x01, 0x16}, 3},
+    {"rep stosb (rcx = 16)", {0xf3, 0xaa}, 2},
+};
+
+void InitializeState(SV_EMU_STATE *state) {
+  memset(state, 0, sizeof(*state));
+  state->Is64BitCode = 1;
+  state->Rip = 0xfffff80000001000ull;
+  state->Gpr[SvEmuRax] = 0x100;
+  state->Gpr[SvEmuRbx] = 0x200;
+  state->Gpr[SvEmuRcx] = 16;
+  state->Gpr[SvEmuRdx] = 0x300;
+  state->Gpr[SvEmuRsi] = 0x400;
+  state->Gpr[SvEmuRdi] = 0x500;
+  state->Gpr[SvEmuR8] = 0x600;
+}
+
+double NanosecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+
+int main() {
+  const SV_EMU_MEMORY memory = {nullptr, BenchRead, BenchWrite};
+  SV_EMU_STATE state;
+  SV_EMU_INSTRUCTION instruction;
+  volatile unsigned sink = 0;
+
+  printf("%-34s %10s %10s\n", "instruction", "decode", "emulate");
+  for (const auto &c : kCases) {
+    InitializeState(&state);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kRounds; ++i) {
+      sink = sink + SvEmuDecode(&state, c.bytes, c.count, &instruction);
+    }
+    const auto decode = NanosecondsSince(start) / kRounds;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kRounds; ++i) {
+      InitializeState(&state);
+      if (SvEmulateInstruction(&state, c.bytes, c.count, &memory) != SvEmuOk) {
+        fprintf(stderr, "%s: not emulated\n", c.name);
+        return 1;
+      }
+    }
+    const auto emulate = NanosecondsSince(start) / kRounds;
+    printf("%-34s %7.2f ns %7.2f ns\n", c.name, decode, emulate);
+  }
+  return 0;
+}
@@ -0,0 +1,166 @@
+// Tests of the syscall hook dispatch thunks in HookSyscall/SvmHookThunk.h.
+
+#include <string.h>
+#include "HookSyscall/SvmHookThunk.h"
+#include "test.h"
+
+namespace {
+
+// What the last call to a copy routine asked for
+const void *g_copy_source;
+size_t g_copy_size;
+int g_copy_calls;
+
+bool CopyPlain(void *destination, const void *source, size_t size) {
+  g_copy_source = source;
+  g_copy_size = size;
+  ++g_copy_calls;
+  memcpy(destination, source, size);
+  return true;
+}
+
+bool CopyFail(void *destination, const void *source, size_t size) {
+  (void)destination;
+  g_copy_source = source;
+  g_copy_size = size;
+  ++g_copy_calls;
+  return false;
+}
+
+typedef HOOK_THUNK_TABLE<CopyPlain> PlainThunks;
+typedef HOOK_THUNK_TABLE<CopyFail> FailThunks;
+
+// Arguments the last hook was called with
+HOOK_ARG g_args[HOOK_THUNK_MAX_PARAM];
+unsigned g_arg_count;
+int g_hook_calls;
+
+HOOK_ARG Hook0() {
+  ++g_hook_calls;
+  g_arg_count = 0;
+  return 0x1000;
+}
+
+template <typename... Args>
+HOOK_ARG Record(Args... args) {
+  const HOOK_ARG values[] = {args...};
+  ++g_hook_calls;
+  g_arg_count = sizeof...(args);
+  for (unsigned i = 0; i < g_arg_count; ++i) {
+    g_args[i] = values[i];
+  }
+  return 0x1000 + g_arg_count;
+}
+
+typedef HOOK_ARG A;
+const void *const kHooks[HOOK_THUNK_MAX_PARAM + 1] = {
+    reinterpret_cast<const void *>(&Hook0),
+    reinterpret_cast<const void *>(&Record<A>),
+    reinterpret_cast<const void *>(&Record<A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(&Record<A, A, A, A, A, A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(
+        &Record<A, A, A, A, A, A, A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(
+        &Record<A, A, A, A, A, A, A, A, A, A, A, A, A, A>),
+    reinterpret_cast<const void *>(
+        &Record<A, A, A, A, A, A, A, A, A, A, A, A, A, A, A>),
+};
+
+// A user stack as SYSCALL sees it: a return address, home space for four
+// registers, then the fifth and later arguments.
+struct UserStack {
+  HOOK_ARG return_address;
+  HOOK_ARG home[4];
+  HOOK_ARG arguments[HOOK_THUNK_MAX_PARAM - 4];
+  HOOK_ARG guard;
+};
+
+HOOK_SYSCALL_FRAME MakeFrame(UserStack *stack) {
+  stack->return_address = 0xdead;
+  for (auto &home : stack->home) {
+    home = 0xbad;
+  }
+  for (unsigned i = 0; i < HOOK_THUNK_MAX_PARAM - 4; ++i) {
+    stack->arguments[i] = 500 + i;
+  }
+  stack->guard = 0xbad;
+  HOOK_SYSCALL_FRAME frame = {{100, 101, 102, 103},
+                              reinterpret_cast<HOOK_ARG>(stack)};
+  return frame;
+}
+
+void TestEveryArity() {
+  UserStack stack;
+  const auto frame = MakeFrame(&stack);
+  for (unsigned n = 0; n <= HOOK_THUNK_MAX_PARAM; ++n) {
+    const auto thunk = PlainThunks::Get(n);
+    TEST_CHECK(thunk != nullptr);
+    if (!thunk) {
+      continue;
+    }
+    g_hook_calls = 0;
+    g_copy_calls = 0;
+    memset(g_args, 0, sizeof(g_args));
+    HOOK_ARG result = 0;
+    TEST_CHECK(thunk(kHooks[n], &frame, &result));
+    TEST_CHECK(g_hook_calls == 1);
+    TEST_CHECK(g_arg_count == n);
+    TEST_CHECK(result == 0x1000 + n);
+    for (unsigned i = 0; i < n; ++i) {
+      TEST_CHECK(g_args[i] == ((i < 4) ? 100 + i : 500 + i - 4));
+    }
+
+    // Registers only below five arguments, and one bounded copy above.
+    if (n <= 4) {
+      TEST_CHECK(g_copy_calls == 0);
+    } else {
+      TEST_CHECK(g_copy_calls == 1);
+      TEST_CHECK(g_copy_source == &stack.arguments[0]);
+      TEST_CHECK(g_copy_size == (n - 4) * sizeof(HOOK_ARG));
+    }
+  }
+}
+
+void TestStackOffset() {
+  TEST_CHECK(HOOK_USER_STACK_ARG_OFFSET == offsetof(UserStack, arguments));
+}
+
+void TestCopyFailure() {
+  UserStack stack;
+  const auto frame = MakeFrame(&stack);
+  for (unsigned n = 0; n <= HOOK_THUNK_MAX_PARAM; ++n) {
+    g_hook_calls = 0;
+    HOOK_ARG result = 0x55;
+    const auto called = FailThunks::Get(n)(kHooks[n], &frame, &result);
+    // Register-only hooks never copy, so they cannot fail.
+    TEST_CHECK(called == (n <= 4));
+    TEST_CHECK(g_hook_calls == (called ? 1 : 0));
+    if (!called) {
+      TEST_CHECK(result == 0x55);
+    }
+  }
+}
+
+void TestOutOfRange() {
+  TEST_CHECK(PlainThunks::Get(HOOK_THUNK_MAX_PARAM + 1) == nullptr);
+  TEST_CHECK(PlainThunks::Get(~0ull) == nullptr);
+}
+
+}  // namespace
+
+int main() {
+  TEST_RUN(TestEveryArity);
+  TEST_RUN(TestStackOffset);
+  TEST_RUN(TestCopyFailure);
+  TEST_RUN(TestOutOfRange);
+  return TEST_RESULT();
+}
@@ -0,0 +1,420 @@
+// Tests of the I/O port registry, IOPM and IOIO engine in SvmIoio.h.
+
+#include <stdio.h>
+#include <string.h>
+#include "SvmIoio.h"
+#include "test.h"
+
+namespace {
+
+// Guest memory of the string forms, at linear addresses 0 to its size
+SvEmuU8 g_memory[4096];
+
+int MemoryRead(void *context, SvEmuU64 address, SvEmuU32 size,
+               SvEmuU64 *value) {
+  (void)context;
+  *value = 0;
+  if (address + size > sizeof(g_memory)) {
+    return 0;
+  }
+  memcpy(value, g_memory + address, size);
+  return 1;
+}
+
+int MemoryWrite(void *context, SvEmuU64 address, SvEmuU32 size,
+                SvEmuU64 value) {
+  (void)context;
+  if (address + size > sizeof(g_memory)) {
+    return 0;
+  }
+  memcpy(g_memory + address, &value, size);
+  return 1;
+}
+
+const SV_EMU_MEMORY kMemory = {nullptr, MemoryRead, MemoryWrite};
+
+// A device that returns 0x40 plus the number of accesses on IN and records
+// the last value written on OUT
+struct Device {
+  unsigned calls;
+  SvEmuU16 last_port;
+  SvEmuU32 last_size;
+  SvEmuU32 last_written;
+  bool fail;
+};
+
+int DeviceRoutine(void *context, SvEmuU16 port, SvEmuU32 size, int is_in,
+                  SvEmuU32 *value) {
+  auto device = static_cast<Device *>(context);
+  if (device->fail) {
+    return 0;
+  }
+  device->calls++;
+  device->last_port = port;
+  device->last_size = size;
+  if (is_in) {
+    *value = 0x40 + device->calls;
+  } else {
+    device->last_written = *value;
+  }
+  return 1;
+}
+
+SvEmuU64 ExitInfo(SvEmuU16 port, SvEmuU64 flags) {
+  return (static_cast<SvEmuU64>(port) << SV_IOIO_PORT_SHIFT) | flags;
+}
+
+void InitializeState(SV_EMU_STATE *state) {
+  memset(state, 0, sizeof(*state));
+  state->Is64BitCode = 1;
+  state->Rip = 0x1000;
+}
+
+void TestRegister() {
+  SV_IO_REGISTRY registry = {};
+  Device device = {};
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x60, 5, DeviceRoutine, &device));
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0xffff, 1, DeviceRoutine, &device));
+
+  // Overlap, past the last port, empty, no routine
+  TEST_CHECK(!SvIoRegisterHandler(&registry, 0x64, 1, DeviceRoutine, &device));
+  TEST_CHECK(!SvIoRegisterHandler(&registry, 0x5f, 2, DeviceRoutine, &device));
+  TEST_CHECK(!SvIoRegisterHandler(&registry, 0xfffe, 3, DeviceRoutine, &device));
+  TEST_CHECK(!SvIoRegisterHandler(&registry, 0x10000, 1, DeviceRoutine, &device));
+  TEST_CHECK(!SvIoRegisterHandler(&registry, 0x70, 0, DeviceRoutine, &device));
+  TEST_CHECK(!SvIoRegisterHandler(&registry, 0x70, 1, nullptr, &device));
+  TEST_CHECK(registry.Count == 2);
+
+  for (unsigned i = 2; i < SV_IO_MAX_HANDLERS; ++i) {
+    TEST_CHECK(SvIoRegisterHandler(&registry, 0x100 * i, 1, DeviceRoutine,
+                                   &device));
+  }
+  TEST_CHECK(!SvIoRegisterHandler(&registry, 0x80, 1, DeviceRoutine, &device));
+}
+
+void TestLookup() {
+  SV_IO_REGISTRY registry = {};
+  Device first = {}, second = {};
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x60, 1, DeviceRoutine, &first));
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x64, 1, DeviceRoutine, &second));
+
+  TEST_CHECK(SvIoLookupHandler(&registry, 0x60, 1)->Context == &first);
+  TEST_CHECK(SvIoLookupHandler(&registry, 0x64, 1)->Context == &second);
+  TEST_CHECK(SvIoLookupHandler(&registry, 0x61, 2) == nullptr);
+
+  // An access that spans a handler's port goes to it.
+  TEST_CHECK(SvIoLookupHandler(&registry, 0x5e, 4)->Context == &first);
+  TEST_CHECK(SvIoLookupHandler(&registry, 0x63, 2)->Context == &second);
+}
+
+void TestIopm() {
+  static SvEmuU8 iopm[SV_IOPM_SIZE];
+  SV_IO_REGISTRY registry = {};
+  Device device = {};
+  memset(iopm, 0xff, sizeof(iopm));
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x60, 5, DeviceRoutine, &device));
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0xffff, 1, DeviceRoutine, &device));
+  SvIoBuildIopm(&registry, iopm);
+
+  TEST_CHECK(SvIopmIsIntercepted(iopm, 0x60, 1));
+  TEST_CHECK(SvIopmIsIntercepted(iopm, 0x64, 1));
+  TEST_CHECK(SvIopmIsIntercepted(iopm, 0x5f, 2));
+  TEST_CHECK(!SvIopmIsIntercepted(iopm, 0x5e, 2));
+  TEST_CHECK(!SvIopmIsIntercepted(iopm, 0x65, 4));
+  TEST_CHECK(!SvIopmIsIntercepted(iopm, 0x3f8, 1));
+  TEST_CHECK(SvIopmIsIntercepted(iopm, 0xfffe, 4));
+
+  // Only the registered ports are set.
+  unsigned bits = 0;
+  for (unsigned i = 0; i < SV_IOPM_SIZE; ++i) {
+    bits += __builtin_popcount(iopm[i]);
+  }
+  TEST_CHECK(bits == 6);
+}
+
+// The paged lookup must agree with the contiguous one, across page borders
+// too.
+void TestIopmPages() {
+  static SvEmuU64 iopm[SV_IOPM_SIZE / 8];
+  SV_IO_REGISTRY registry = {};
+  Device device = {};
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x60, 5, DeviceRoutine, &device));
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x8000, 1, DeviceRoutine, &device));
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0xffff, 1, DeviceRoutine, &device));
+  SvIoBuildIopm(&registry, reinterpret_cast<SvEmuU8 *>(iopm));
+
+  const volatile SvEmuU64 *pages[SV_IOPM_SIZE / SV_IOPM_PAGE_SIZE];
+  for (unsigned i = 0; i < SV_IOPM_SIZE / SV_IOPM_PAGE_SIZE; ++i) {
+    pages[i] = iopm + i * (SV_IOPM_PAGE_SIZE / 8);
+  }
+  for (unsigned port = 0; port <= 0xffff; ++port) {
+    for (unsigned size = 1; size <= 4; size *= 2) {
+      TEST_CHECK(SvIopmPagesIsIntercepted(pages, port, size) ==
+                 SvIopmIsIntercepted(reinterpret_cast<SvEmuU8 *>(iopm), port, size));
+    }
+  }
+  TEST_CHECK(SvIopmPagesIsIntercepted(pages, 0x7ffe, 4));
+  TEST_CHECK(!SvIopmPagesIsIntercepted(pages, 0x7ffc, 4));
+  TEST_CHECK(SvIopmPagesIsIntercepted(pages, 0xfffe, 4));
+}
+
+void TestMergePage() {
+  static SvEmuU64 merged[SV_IOPM_PAGE_SIZE / 8], snapshot[SV_IOPM_PAGE_SIZE / 8];
+  static SvEmuU64 host[SV_IOPM_PAGE_SIZE / 8], guest[SV_IOPM_PAGE_SIZE / 8];
+  host[0] = 0x1;
+  guest[1] = 0x2;
+
+  TEST_CHECK(SvIopmMergePage(merged, snapshot, host, guest, 1));
+  TEST_CHECK(merged[0] == 0x1 && merged[1] == 0x2 && merged[2] == 0);
+  TEST_CHECK(snapshot[1] == 0x2);
+
+  // Unchanged guest pages are not rebuilt, changed ones are.
+  TEST_CHECK(!SvIopmMergePage(merged, snapshot, host, guest, 0));
+  guest[511] = 0x80;
+  TEST_CHECK(SvIopmMergePage(merged, snapshot, host, guest, 0));
+  TEST_CHECK(merged[511] == 0x80);
+
+  // No guest page intercepts every port.
+  TEST_CHECK(SvIopmMergePage(merged, snapshot, host, nullptr, 0));
+  TEST_CHECK(merged[0] == ~0ull && merged[300] == ~0ull);
+  TEST_CHECK(!SvIopmMergePage(merged, snapshot, host, nullptr, 0));
+}
+
+// The AVX2 merge must agree with the scalar one, including on which pages it
+// rebuilds.
+void TestMergePageAvx2() {
+  if (!__builtin_cpu_supports("avx2")) {
+    printf("SKIP TestMergePageAvx2: no AVX2\n");
+    return;
+  }
+  const unsigned count = SV_IOPM_PAGE_SIZE / 8;
+  static SvEmuU64 merged[count], snapshot[count], merged2[count], snapshot2[count];
+  static SvEmuU64 host[count], guest[count];
+  SvEmuU64 seed = 0x9e3779b97f4a7c15ull;
+  for (unsigned i = 0; i < count; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    host[i] = seed & 0x0101010101010101ull;
+    guest[i] = seed >> 7;
+  }
+
+  TEST_CHECK(SvIopmMergePage(merged, snapshot, host, guest, 1));
+  TEST_CHECK(SvIopmMergePageAvx2(merged2, snapshot2, host, guest, 1));
+  TEST_CHECK(memcmp(merged, merged2, sizeof(merged)) == 0);
+  TEST_CHECK(memcmp(snapshot, snapshot2, sizeof(snapshot)) == 0);
+  TEST_CHECK(!SvIopmMergePageAvx2(merged2, snapshot2, host, guest, 0));
+
+  // A change in any lane of any 32-byte block is seen.
+  const unsigned changed[] = {0, 1, 2, 3, 4, 255, 508, 511};
+  for (unsigned i = 0; i < sizeof(changed) / sizeof(changed[0]); ++i) {
+    guest[changed[i]] ^= 0x10;
+    TEST_CHECK(SvIopmMergePage(merged, snapshot, host, guest, 0));
+    TEST_CHECK(SvIopmMergePageAvx2(merged2, snapshot2, host, guest, 0));
+    TEST_CHECK(memcmp(merged, merged2, sizeof(merged)) == 0);
+    TEST_CHECK(!SvIopmMergePageAvx2(merged2, snapshot2, host, guest, 0));
+  }
+
+  TEST_CHECK(SvIopmMergePageAvx2(merged2, snapshot2, host, nullptr, 0));
+  TEST_CHECK(merged2[0] == ~0ull && merged2[511] == ~0ull);
+  TEST_CHECK(!SvIopmMergePageAvx2(merged2, snapshot2, host, nullptr, 0));
+}
+
+void TestDecodeExitInfo() {
+  SV_IO_ACCESS access;
+  TEST_CHECK(SvIoDecodeExitInfo(
+      ExitInfo(0x3f8, SV_IOIO_TYPE_IN | SV_IOIO_STRING | SV_IOIO_REP |
+                          SV_IOIO_SIZE16 | SV_IOIO_ADDRESS32 |
+                          (SvEmuFs << SV_IOIO_SEGMENT_SHIFT)),
+      &access));
+  TEST_CHECK(access.Port == 0x3f8);
+  TEST_CHECK(access.Size == 2);
+  TEST_CHECK(access.AddressSize == 4);
+  TEST_CHECK(access.Segment == SvEmuFs);
+  TEST_CHECK(access.IsIn && access.IsString && access.IsRep);
+
+  TEST_CHECK(SvIoDecodeExitInfo(ExitInfo(0x80, SV_IOIO_SIZE32), &access));
+  TEST_CHECK(access.Size == 4 && access.AddressSize == 2 && !access.IsIn);
+
+  // No operand size, or a segment past GS
+  TEST_CHECK(!SvIoDecodeExitInfo(ExitInfo(0x80, 0), &access));
+  TEST_CHECK(!SvIoDecodeExitInfo(
+      ExitInfo(0x80, SV_IOIO_SIZE8 | (7u << SV_IOIO_SEGMENT_SHIFT)), &access));
+}
+
+void TestInOut() {
+  SV_IO_REGISTRY registry = {};
+  Device device = {};
+  SV_EMU_STATE state;
+  SV_IO_ACCESS access;
+  SvEmuU32 elements;
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x60, 5, DeviceRoutine, &device));
+
+  // IN AL merges into RAX, IN EAX zero-extends.
+  InitializeState(&state);
+  state.Gpr[SvEmuRax] = 0xaaaaaaaaaaaaaaaaull;
+  TEST_CHECK(SvIoDecodeExitInfo(
+      ExitInfo(0x60, SV_IOIO_TYPE_IN | SV_IOIO_SIZE8 | SV_IOIO_ADDRESS64),
+      &access));
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(elements == 1 && state.Rip == 0x1002);
+  TEST_CHECK(state.Gpr[SvEmuRax] == 0xaaaaaaaaaaaaaa41ull);
+  access.Size = 4;
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1004, 64, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(state.Gpr[SvEmuRax] == 0x42);
+
+  // OUT DX, AX passes the low word.
+  state.Gpr[SvEmuRax] = 0x12345678;
+  TEST_CHECK(SvIoDecodeExitInfo(
+      ExitInfo(0x62, SV_IOIO_SIZE16 | SV_IOIO_ADDRESS64), &access));
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1005, 64, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(device.last_port == 0x62 && device.last_size == 2);
+  TEST_CHECK(device.last_written == 0x5678);
+
+  // A failing handler fails the instruction without moving RIP.
+  device.fail = true;
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1006, 64, &state, &kMemory,
+                         &elements) == SvEmuIoError);
+  TEST_CHECK(elements == 0 && state.Rip == 0x1005);
+}
+
+void TestDefaultRoutine() {
+  SV_IO_REGISTRY registry = {};
+  Device device = {}, fallback = {};
+  SV_EMU_STATE state;
+  SV_IO_ACCESS access;
+  SvEmuU32 elements;
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x60, 1, DeviceRoutine, &device));
+  TEST_CHECK(SvIoDecodeExitInfo(
+      ExitInfo(0x70, SV_IOIO_TYPE_IN | SV_IOIO_SIZE8 | SV_IOIO_ADDRESS64),
+      &access));
+
+  // Without a default routine, unregistered ports cannot be performed.
+  InitializeState(&state);
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuUnsupported);
+  TEST_CHECK(state.Rip == 0x1000);
+
+  registry.DefaultRoutine = DeviceRoutine;
+  registry.DefaultContext = &fallback;
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(fallback.calls == 1 && device.calls == 0);
+  TEST_CHECK(fallback.last_port == 0x70);
+}
+
+void TestRepOutsBatched() {
+  SV_IO_REGISTRY registry = {};
+  Device device = {};
+  SV_EMU_STATE state;
+  SV_IO_ACCESS access;
+  SvEmuU32 elements;
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x60, 1, DeviceRoutine, &device));
+  for (unsigned i = 0; i < 64; ++i) {
+    g_memory[100 + i] = static_cast<SvEmuU8>(i);
+  }
+
+  // REP OUTSW of 10 elements, up to 4 per #VMEXIT
+  InitializeState(&state);
+  state.Gpr[SvEmuRsi] = 100;
+  state.Gpr[SvEmuRcx] = 10;
+  TEST_CHECK(SvIoDecodeExitInfo(
+      ExitInfo(0x60, SV_IOIO_STRING | SV_IOIO_REP | SV_IOIO_SIZE16 |
+                         SV_IOIO_ADDRESS64 |
+                         (SvEmuDs << SV_IOIO_SEGMENT_SHIFT)),
+      &access));
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 4, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(elements == 4 && device.calls == 4);
+  TEST_CHECK(state.Rip == 0x1000);
+  TEST_CHECK(state.Gpr[SvEmuRcx] == 6 && state.Gpr[SvEmuRsi] == 108);
+  TEST_CHECK(device.last_written == (6u | (7u << 8)));
+
+  // The guest executes it again for the rest.
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(elements == 6 && device.calls == 10);
+  TEST_CHECK(state.Rip == 0x1002 && state.Gpr[SvEmuRcx] == 0);
+  TEST_CHECK(device.last_written == (18u | (19u << 8)));
+
+  // A zero count completes without an access.
+  state.Rip = 0x1000;
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(elements == 0 && device.calls == 10 && state.Rip == 0x1002);
+}
+
+void TestRepInsBackward() {
+  SV_IO_REGISTRY registry = {};
+  Device device = {};
+  SV_EMU_STATE state;
+  SV_IO_ACCESS access;
+  SvEmuU32 elements;
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x61, 1, DeviceRoutine, &device));
+
+  // REP INSB with DF set and a 32-bit address size, which ignores and clears
+  // the upper halves of RDI and RCX
+  InitializeState(&state);
+  state.Rflags = SV_EMU_RFLAGS_DF;
+  state.Gpr[SvEmuRdi] = 0xffffffff00000200ull;
+  state.Gpr[SvEmuRcx] = 0xffffffff00000003ull;
+  TEST_CHECK(SvIoDecodeExitInfo(
+      ExitInfo(0x61, SV_IOIO_TYPE_IN | SV_IOIO_STRING | SV_IOIO_REP |
+                         SV_IOIO_SIZE8 | SV_IOIO_ADDRESS32),
+      &access));
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuOk);
+  TEST_CHECK(elements == 3);
+  TEST_CHECK(state.Gpr[SvEmuRdi] == 0x1fd && state.Gpr[SvEmuRcx] == 0);
+  TEST_CHECK(g_memory[0x200] == 0x41 && g_memory[0x1ff] == 0x42 &&
+             g_memory[0x1fe] == 0x43);
+
+  // A 16-bit address size is not supported.
+  access.AddressSize = 2;
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuUnsupported);
+}
+
+void TestMemoryFailure() {
+  SV_IO_REGISTRY registry = {};
+  Device device = {};
+  SV_EMU_STATE state;
+  SV_IO_ACCESS access;
+  SvEmuU32 elements;
+  TEST_CHECK(SvIoRegisterHandler(&registry, 0x61, 1, DeviceRoutine, &device));
+
+  // REP INSB running off the end of guest memory keeps the elements done;
+  // the element read for the failed write is lost.
+  InitializeState(&state);
+  state.Gpr[SvEmuRdi] = sizeof(g_memory) - 2;
+  state.Gpr[SvEmuRcx] = 5;
+  TEST_CHECK(SvIoDecodeExitInfo(
+      ExitInfo(0x61, SV_IOIO_TYPE_IN | SV_IOIO_STRING | SV_IOIO_REP |
+                         SV_IOIO_SIZE8 | SV_IOIO_ADDRESS64),
+      &access));
+  TEST_CHECK(SvIoExecute(&registry, &access, 0x1002, 64, &state, &kMemory,
+                         &elements) == SvEmuMemoryError);
+  TEST_CHECK(elements == 3 && device.calls == 3);
+  TEST_CHECK(state.Gpr[SvEmuRcx] == 3);
+  TEST_CHECK(state.Gpr[SvEmuRdi] == sizeof(g_memory));
+  TEST_CHECK(state.Rip == 0x1000);
+}
+
+}  // namespace
+
+int main() {
+  TEST_RUN(TestRegister);
+  TEST_RUN(TestLookup);
+  TEST_RUN(TestIopm);
+  TEST_RUN(TestIopmPages);
+  TEST_RUN(TestMergePage);
+  TEST_RUN(TestMergePageAvx2);
+  TEST_RUN(TestDecodeExitInfo);
+  TEST_RUN(TestInOut);
+  TEST_RUN(TestDefaultRoutine);
+  TEST_RUN(TestRepOutsBatched);
+  TEST_RUN(TestRepInsBackward);
+  TEST_RUN(TestMemoryFailure);
+  return TEST_RESULT();
+}
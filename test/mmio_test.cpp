@@ -0,0 +1,106 @@
+// Tests of the guest physical memory map in SvmMmio.h.
+
+#include "SvmMmio.h"
+#include "test.h"
+
+namespace {
+
+int Device(void *context, SvEmuU64 address, SvEmuU32 size, int is_write,
+           SvEmuU64 *value) {
+  (void)context;
+  (void)address;
+  (void)size;
+  (void)is_write;
+  (void)value;
+  return 1;
+}
+
+void TestRegister() {
+  SV_MMIO_MAP map = {};
+  TEST_CHECK(SvMmioRegisterHandler(&map, 0xfed00000, 0x1000, Device, nullptr));
+  TEST_CHECK(SvMmioRegisterHandler(&map, 0xfed01000, 0x1000, Device, nullptr));
+
+  // Overlap, empty, wrap-around, no routine
+  TEST_CHECK(!SvMmioRegisterHandler(&map, 0xfed00800, 0x1000, Device, nullptr));
+  TEST_CHECK(!SvMmioRegisterHandler(&map, 0xfecff000, 0x1001, Device, nullptr));
+  TEST_CHECK(!SvMmioRegisterHandler(&map, 0xfee00000, 0, Device, nullptr));
+  TEST_CHECK(!SvMmioRegisterHandler(&map, ~0ull - 0xfff, 0x2000, Device, nullptr));
+  TEST_CHECK(!SvMmioRegisterHandler(&map, 0xfee00000, 0x1000, nullptr, nullptr));
+  TEST_CHECK(map.HandlerCount == 2);
+
+  for (unsigned i = 2; i < SV_MMIO_MAX_HANDLERS; ++i) {
+    TEST_CHECK(SvMmioRegisterHandler(&map, 0x100000000ull * i, 0x1000, Device,
+                                     nullptr));
+  }
+  TEST_CHECK(!SvMmioRegisterHandler(&map, 0x10, 0x10, Device, nullptr));
+
+  TEST_CHECK(SvMmioOverlapsHandler(&map, 0xfee00000 - 0x200000, 0x200000));
+  TEST_CHECK(!SvMmioOverlapsHandler(&map, 0xfee00000, 0x200000));
+}
+
+void TestRam() {
+  SV_MMIO_MAP map = {};
+  TEST_CHECK(SvMmioAddRam(&map, 0x1000, 0x9e000));
+  TEST_CHECK(SvMmioAddRam(&map, 0x100000, 0x100000));
+  TEST_CHECK(SvMmioAddRam(&map, 0x200000, 0x100000));   // Merged
+  TEST_CHECK(map.RamCount == 2);
+  TEST_CHECK(map.Ram[1].Length == 0x200000);
+
+  // Below the last range, empty, wrap-around
+  TEST_CHECK(!SvMmioAddRam(&map, 0x2ff000, 0x1000));
+  TEST_CHECK(!SvMmioAddRam(&map, 0x400000, 0));
+  TEST_CHECK(!SvMmioAddRam(&map, ~0ull - 0xfff, 0x2000));
+
+  // A full table extends the last range over the rest.
+  SV_MMIO_MAP full = {};
+  for (unsigned i = 0; i < SV_MMIO_MAX_RAM_RANGES + 2; ++i) {
+    TEST_CHECK(SvMmioAddRam(&full, 0x2000ull * i, 0x1000));
+  }
+  TEST_CHECK(full.RamCount == SV_MMIO_MAX_RAM_RANGES);
+  const SV_MMIO_HANDLER *handler;
+  TEST_CHECK(SvMmioClassify(&full, 0x2000ull * (SV_MMIO_MAX_RAM_RANGES + 1), 8,
+                            &handler) == SvMmioRam);
+  TEST_CHECK(SvMmioClassify(&full, 0x2000ull * (SV_MMIO_MAX_RAM_RANGES + 1) +
+                                       0x1000,
+                            8, &handler) == SvMmioUnbacked);
+}
+
+void TestClassify() {
+  SV_MMIO_MAP map = {};
+  const SV_MMIO_HANDLER *handler;
+  TEST_CHECK(SvMmioAddRam(&map, 0x1000, 0x9e000));
+  TEST_CHECK(SvMmioAddRam(&map, 0x100000, 0xdff00000));
+  TEST_CHECK(SvMmioAddRam(&map, 0x100000000ull, 0x100000000ull));
+  TEST_CHECK(SvMmioRegisterHandler(&map, 0xfed00000, 0x1000, Device, &map));
+
+  TEST_CHECK(SvMmioClassify(&map, 0x1000, 8, &handler) == SvMmioRam);
+  TEST_CHECK(handler == nullptr);
+  TEST_CHECK(SvMmioClassify(&map, 0x9eff8, 8, &handler) == SvMmioRam);
+  TEST_CHECK(SvMmioClassify(&map, 0x1ffffffffull, 1, &handler) == SvMmioRam);
+
+  // Holes, below the first range, straddling the end of a range
+  TEST_CHECK(SvMmioClassify(&map, 0, 4, &handler) == SvMmioUnbacked);
+  TEST_CHECK(SvMmioClassify(&map, 0xa0000, 4, &handler) == SvMmioUnbacked);
+  TEST_CHECK(SvMmioClassify(&map, 0x9effc, 8, &handler) == SvMmioUnbacked);
+  TEST_CHECK(SvMmioClassify(&map, 0xfee00000, 4, &handler) == SvMmioUnbacked);
+  TEST_CHECK(SvMmioClassify(&map, 0x200000000ull, 4, &handler) ==
+             SvMmioUnbacked);
+  TEST_CHECK(SvMmioClassify(&map, ~0ull - 3, 8, &handler) == SvMmioUnbacked);
+
+  // Device ranges, and accesses partly in one
+  TEST_CHECK(SvMmioClassify(&map, 0xfed000f0, 4, &handler) == SvMmioDevice);
+  TEST_CHECK(handler == &map.Handlers[0]);
+  TEST_CHECK(handler->Context == &map);
+  TEST_CHECK(SvMmioClassify(&map, 0xfed00ffc, 8, &handler) == SvMmioUnbacked);
+  TEST_CHECK(SvMmioClassify(&map, 0xfecffffc, 8, &handler) == SvMmioUnbacked);
+  TEST_CHECK(handler == nullptr);
+}
+
+}  // namespace
+
+int main() {
+  TEST_RUN(TestRegister);
+  TEST_RUN(TestRam);
+  TEST_RUN(TestClassify);
+  return TEST_RESULT();
+}
@@ -0,0 +1,279 @@
+// Tests of the ring layout and its slot claim protocol in log/ring.h.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "ring.h"
+#include "test.h"
+
+namespace {
+
+const RingU32 kSlotSize = 64 + sizeof(RingSlotHeader);
+const RingU32 kSlotCount = 16;
+
+// Small enough for concurrent writers to lap each other on one processor
+const RingU32 kConcurrentSlotCount = 2;
+
+// Formats memory as ExportInitializeRing() does.
+RingHeader *InitializeRing(std::vector<RingU64> *memory, RingU32 slot_size,
+                           RingU32 slot_count) {
+  memory->assign((RingGetSize(slot_size, slot_count) + 7) / 8, 0);
+  const auto ring = reinterpret_cast<RingHeader *>(memory->data());
+  ring->header_size = sizeof(RingHeader);
+  ring->slot_size = slot_size;
+  ring->slot_count = slot_count;
+  ring->version = kRingVersion;
+  for (RingU32 i = 0; i < slot_count; ++i) {
+    RingGetSlot(ring, i)->sequence = kRingSlotEmpty;
+  }
+  ring->magic = kRingMagic;
+  return ring;
+}
+
+// Stores a record as ExportRingWrite() does. The payload is a sequence number
+// followed by its low byte repeated, so that a reader can tell a record mixed
+// from two writers. \a interleave yields halfway through some records so that
+// writers are preempted mid-fill even on a single processor.
+bool WriteRecord(RingHeader *ring, RingU32 size, bool interleave = false) {
+  const auto sequence = __atomic_fetch_add(&ring->head, 1, __ATOMIC_SEQ_CST);
+  const auto slot = RingClaimSlot(ring, sequence);
+  if (!slot) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_SEQ_CST);
+    return false;
+  }
+  slot->timestamp = sequence * 3;
+  slot->size = size;
+  slot->processor = 0;
+  const auto payload = reinterpret_cast<volatile unsigned char *>(slot + 1);
+  for (RingU32 i = 0; i < size; ++i) {
+    payload[i] = (i < sizeof(sequence))
+                     ? static_cast<unsigned char>(sequence >> (i * 8))
+                     : static_cast<unsigned char>(sequence);
+    if (interleave && i == size / 2 && sequence % 64 == 0) {
+      sched_yield();
+    }
+  }
+  RingPublishSlot(slot, sequence);
+  return true;
+}
+
+bool IsConsistent(const RingSlotHeader &slot, const unsigned char *payload) {
+  RingU64 stored = 0;
+  memcpy(&stored, payload, sizeof(stored));
+  if (stored != slot.sequence || slot.timestamp != slot.sequence * 3) {
+    return false;
+  }
+  for (RingU32 i = sizeof(stored); i < slot.size; ++i) {
+    if (payload[i] != static_cast<unsigned char>(slot.sequence)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TestReadWrite() {
+  std::vector<RingU64> memory;
+  const auto ring = InitializeRing(&memory, kSlotSize, kSlotCount);
+  TEST_CHECK(RingIsValid(ring, memory.size() * 8));
+  TEST_CHECK(!RingIsValid(ring, memory.size() * 8 - 8));
+
+  RingSlotHeader slot = {};
+  unsigned char payload[64] = {};
+  TEST_CHECK(RingRead(ring, 0, &slot, payload, sizeof(payload)) ==
+             kRingReadNotYet);
+
+  for (int i = 0; i < 3; ++i) {
+    TEST_CHECK(WriteRecord(ring, 16 + i));
+  }
+  for (RingU64 i = 0; i < 3; ++i) {
+    TEST_CHECK(RingRead(ring, i, &slot, payload, sizeof(payload)) ==
+               kRingReadOk);
+    TEST_CHECK(slot.sequence == i && slot.size == 16 + i);
+    TEST_CHECK(IsConsistent(slot, payload));
+  }
+  TEST_CHECK(RingRead(ring, 3, &slot, payload, sizeof(payload)) ==
+             kRingReadNotYet);
+
+  // Wrap around; the first records are gone.
+  for (RingU32 i = 0; i < kSlotCount; ++i) {
+    TEST_CHECK(WriteRecord(ring, 32));
+  }
+  TEST_CHECK(RingRead(ring, 2, &slot, payload, sizeof(payload)) ==
+             kRingReadLost);
+  TEST_CHECK(RingRead(ring, 3, &slot, payload, sizeof(payload)) ==
+             kRingReadOk);
+  TEST_CHECK(IsConsistent(slot, payload));
+
+  // A short buffer truncates the copy but reports the stored size.
+  unsigned char small[8] = {};
+  TEST_CHECK(RingRead(ring, 4, &slot, small, sizeof(small)) == kRingReadOk);
+  TEST_CHECK(slot.size == 32);
+}
+
+void TestExclusiveClaim() {
+  std::vector<RingU64> memory;
+  const auto ring = InitializeRing(&memory, kSlotSize, kSlotCount);
+
+  // A writer of sequence 1 reserves and claims but has not published yet.
+  ring->head = 2;
+  const auto first = RingClaimSlot(ring, 1);
+  TEST_CHECK(first != nullptr);
+  TEST_CHECK(first->sequence == kRingSlotBusy);
+
+  // A writer one lap ahead must not fill the same slot meanwhile.
+  TEST_CHECK(RingClaimSlot(ring, 1 + kSlotCount) == nullptr);
+
+  RingSlotHeader slot = {};
+  unsigned char payload[64] = {};
+  TEST_CHECK(RingRead(ring, 1, &slot, payload, sizeof(payload)) ==
+             kRingReadNotYet);
+  RingPublishSlot(first, 1);
+  TEST_CHECK(RingRead(ring, 1, &slot, payload, sizeof(payload)) ==
+             kRingReadOk);
+
+  // Once published, the next lap may claim it, but a stale writer may not.
+  const auto next = RingClaimSlot(ring, 1 + kSlotCount);
+  TEST_CHECK(next == first);
+  RingPublishSlot(next, 1 + kSlotCount);
+  TEST_CHECK(RingClaimSlot(ring, 1) == nullptr);
+  TEST_CHECK(RingClaimSlot(ring, 1 + kSlotCount) == nullptr);
+  TEST_CHECK(RingClaimSlot(ring, 1 + 2 * kSlotCount) == next);
+}
+
+struct ConcurrentContext {
+  RingHeader *ring;
+  volatile bool stop;
+  unsigned long long written;
+  unsigned long long read;
+  unsigned long long torn;
+};
+
+void *ConcurrentWriter(void *parameter) {
+  const auto context = static_cast<ConcurrentContext *>(parameter);
+  for (int i = 0; i < 20000; ++i) {
+    if (WriteRecord(context->ring, 8 + (i % 56), true)) {
+      __atomic_fetch_add(&context->written, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return nullptr;
+}
+
+void *ConcurrentReader(void *parameter) {
+  const auto context = static_cast<ConcurrentContext *>(parameter);
+  unsigned char payload[64] = {};
+  while (!context->stop) {
+    const RingU64 head = context->ring->head;
+    for (auto sequence =
+             (head > kConcurrentSlotCount) ? head - kConcurrentSlotCount : 0;
+         sequence < head; ++sequence) {
+      RingSlotHeader slot = {};
+      if (RingRead(context->ring, sequence, &slot, payload, sizeof(payload)) !=
+          kRingReadOk) {
+        continue;
+      }
+      ++context->read;
+      if (slot.sequence != sequence || !IsConsistent(slot, payload)) {
+        ++context->torn;
+      }
+    }
+  }
+  return nullptr;
+}
+
+// Many writers lapping a small ring must never publish a record mixed from
+// two of them, and every reserved sequence number is either stored or dropped.
+void TestConcurrentWriters() {
+  std::vector<RingU64> memory;
+  ConcurrentContext context = {};
+  context.ring = InitializeRing(&memory, kSlotSize, kConcurrentSlotCount);
+
+  pthread_t reader;
+  pthread_t writers[8];
+  TEST_CHECK(pthread_create(&reader, nullptr, ConcurrentReader, &context) == 0);
+  for (auto &writer : writers) {
+    TEST_CHECK(pthread_create(&writer, nullptr, ConcurrentWriter, &context) ==
+               0);
+  }
+  for (auto &writer : writers) {
+    pthread_join(writer, nullptr);
+  }
+  context.stop = true;
+  pthread_join(reader, nullptr);
+
+  TEST_CHECK(context.ring->head == 8 * 20000ull);
+  TEST_CHECK(context.written + context.ring->dropped == context.ring->head);
+  TEST_CHECK(context.read != 0);
+  TEST_CHECK(context.torn == 0);
+
+  // Every slot is idle again.
+  for (RingU32 i = 0; i < kConcurrentSlotCount; ++i) {
+    TEST_CHECK(RingGetSlot(context.ring, i)->sequence != kRingSlotBusy);
+  }
+}
+
+void TestDirectory() {
+  const RingU32 count = 2;
+  const auto stride = RingGetSize(kSlotSize, kSlotCount);
+  std::vector<RingU64> memory((sizeof(RingDirectory) + stride * count) / 8);
+  const auto directory = reinterpret_cast<RingDirectory *>(memory.data());
+  directory->magic = kRingDirectoryMagic;
+  directory->version = kRingVersion;
+  directory->ring_count = count;
+  directory->ring_offset = sizeof(RingDirectory);
+  directory->ring_stride = stride;
+  std::vector<RingU64> ring;
+  InitializeRing(&ring, kSlotSize, kSlotCount);
+  for (RingU32 i = 0; i < count; ++i) {
+    memcpy(reinterpret_cast<char *>(memory.data()) + sizeof(RingDirectory) +
+               stride * i,
+           ring.data(), stride);
+  }
+
+  const auto size = memory.size() * 8;
+  TEST_CHECK(RingDirectoryGetRing(directory, size, 0) != nullptr);
+  TEST_CHECK(RingDirectoryGetRing(directory, size, 1) != nullptr);
+  TEST_CHECK(RingDirectoryGetRing(directory, size, 2) == nullptr);
+  TEST_CHECK(RingDirectoryGetRing(directory, size - 8, 1) == nullptr);
+  directory->version = kRingVersion - 1;
+  TEST_CHECK(RingDirectoryGetRing(directory, size, 0) == nullptr);
+}
+
+// Writes an image of a log ring for the reference reader to consume.
+void WriteImage(const char *path) {
+  std::vector<RingU64> memory;
+  const auto ring = InitializeRing(&memory, kSlotSize, kSlotCount);
+  const char *messages[] = {"hello", "ring", "reader"};
+  for (auto message : messages) {
+    const auto sequence = ring->head++;
+    const auto slot = RingClaimSlot(ring, sequence);
+    slot->timestamp = 100 + sequence;
+    slot->size = static_cast<RingU32>(strlen(message));
+    slot->processor = static_cast<RingU32>(sequence);
+    memcpy(slot + 1, message, slot->size);
+    RingPublishSlot(slot, sequence);
+  }
+  // A reserved but never published record
+  ring->head++;
+
+  const auto file = fopen(path, "wb");
+  TEST_CHECK(file != nullptr);
+  if (file) {
+    TEST_CHECK(fwrite(memory.data(), 8, memory.size(), file) == memory.size());
+    fclose(file);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  TEST_RUN(TestReadWrite);
+  TEST_RUN(TestExclusiveClaim);
+  TEST_RUN(TestConcurrentWriters);
+  TEST_RUN(TestDirectory);
+  if (argc > 1) {
+    WriteImage(argv[1]);
+  }
+  return TEST_RESULT();
+}
@@ -0,0 +1,31 @@
+/*
+ * Minimal checks shared by the user-mode tests of the WDK-independent headers.
+ * Each test program returns non-zero when any check fails.
+ */
+#ifndef SVMNEST_TEST_H_
+#define SVMNEST_TEST_H_
+
+#include <stdio.h>
+
+static int g_TestFailures;
+
+#define TEST_CHECK(Expression)                                              \
+    do {                                                                    \
+        if (!(Expression)) {                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #Expression);                                           \
+            ++g_TestFailures;                                               \
+        }                                                                   \
+    } while (0)
+
+#define TEST_RUN(Test)                                                      \
+    do {                                                                    \
+        int failures_ = g_TestFailures;                                     \
+        Test();                                                             \
+        printf("%s %s\n", (g_TestFailures == failures_) ? "PASS" : "FAIL",  \
+               #Test);                                                      \
+    } while (0)
+
+#define TEST_RESULT() ((g_TestFailures == 0) ? 0 : 1)
+
+#endif
@@ -0,0 +1,150 @@
+/// @file
+/// Measures #VMEXIT latency on each processor through the statistics leaves.
+///
+/// Runs in a guest of SvmNest, on Windows or Linux:
+///
+///   cl /O2 /EHsc /I..\SimpleSvm exitlat.cpp
+///   g++ -std=c++11 -O2 -I../SimpleSvm -o exitlat exitlat.cpp
+///   exitlat [iterations]
+///
+/// On each processor in turn, it executes CPUID, which always exits, in a
+/// loop and prints the TSC cycles the hypervisor spent per exit
+/// (SV_STATS_EXIT_CYCLES over SV_STATS_TOTAL_EXITS) and the round trip seen
+/// by the guest. SV_STATS_LARGE_PAGE_SLOT tells whether the processor's data
+/// is mapped with large pages.
+///
+/// To compare layouts of per processor data, run it against a driver built
+/// as is and one built with SV_SLOT_REGIONS defined to 0, which allocates
+/// each processor's data on its own, on an otherwise idle system.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "SvmStats.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <windows.h>
+#else
+#include <cpuid.h>
+#include <sched.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+static void ExitLatCpuid(SvStatsU32 leaf, SvStatsU32 sub_leaf,
+                         SvStatsU32 registers[4]) {
+#if defined(_MSC_VER)
+  int values[4];
+  __cpuidex(values, static_cast<int>(leaf), static_cast<int>(sub_leaf));
+  for (int i = 0; i < 4; ++i) {
+    registers[i] = static_cast<SvStatsU32>(values[i]);
+  }
+#else
+  __cpuid_count(leaf, sub_leaf, registers[0], registers[1], registers[2],
+                registers[3]);
+#endif
+}
+
+static unsigned ExitLatProcessorCount() {
+#if defined(_MSC_VER)
+  return GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#else
+  return static_cast<unsigned>(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+}
+
+// Pins the current thread to a processor. Returns false on failure.
+static bool ExitLatPin(unsigned processor) {
+#if defined(_MSC_VER)
+  WORD group = 0;
+  while (group < GetActiveProcessorGroupCount() &&
+         processor >= GetActiveProcessorCount(group)) {
+    processor -= GetActiveProcessorCount(group);
+    ++group;
+  }
+  if (group == GetActiveProcessorGroupCount()) {
+    return false;
+  }
+  GROUP_AFFINITY affinity = {};
+  affinity.Group = group;
+  affinity.Mask = 1ull << processor;
+  return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(processor, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+// Reads a counter of the current processor. Returns false if the hypervisor
+// does not provide it or the thread moved to another processor.
+static bool ExitLatRead(SvStatsU32 id, SvStatsU32 processor,
+                        SvStatsU64 *value) {
+  SvStatsU32 registers[4];
+  SV_STATS_SAMPLE sample;
+  ExitLatCpuid(SV_CPUID_STATS_COUNTER, id, registers);
+  if (!SvStatsDecodeCounter(registers, id, &sample) ||
+      sample.Processor != processor) {
+    return false;
+  }
+  *value = sample.Value;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const unsigned long iterations =
+      (argc > 1) ? strtoul(argv[1], nullptr, 0) : 100000;
+  SvStatsU32 registers[4];
+
+  ExitLatCpuid(SV_CPUID_STATS_INFO, 0, registers);
+  if (registers[0] != SV_STATS_VERSION ||
+      registers[1] <= SV_STATS_LARGE_PAGE_SLOT) {
+    fprintf(stderr, "SvmNest statistics are not available\n");
+    return 1;
+  }
+
+  printf("cpu large_page host_cycles/exit round_trip_cycles/cpuid\n");
+  const auto count = ExitLatProcessorCount();
+  for (unsigned processor = 0; processor < count; ++processor) {
+    if (!ExitLatPin(processor)) {
+      fprintf(stderr, "cpu %u: cannot pin\n", processor);
+      continue;
+    }
+    ExitLatCpuid(SV_CPUID_STATS_INFO, 0, registers);
+    const auto index = registers[2];
+
+    // The counter reads are exits as well, which is negligible next to
+    // iterations.
+    SvStatsU64 large_page = 0, exits_before = 0, cycles_before = 0;
+    SvStatsU64 exits_after = 0, cycles_after = 0;
+    if (!ExitLatRead(SV_STATS_LARGE_PAGE_SLOT, index, &large_page) ||
+        !ExitLatRead(SV_STATS_TOTAL_EXITS, index, &exits_before) ||
+        !ExitLatRead(SV_STATS_EXIT_CYCLES, index, &cycles_before)) {
+      fprintf(stderr, "cpu %u: cannot read counters\n", processor);
+      continue;
+    }
+    const auto start = __rdtsc();
+    for (unsigned long i = 0; i < iterations; ++i) {
+      ExitLatCpuid(0, 0, registers);
+    }
+    const auto round_trip = __rdtsc() - start;
+    if (!ExitLatRead(SV_STATS_TOTAL_EXITS, index, &exits_after) ||
+        !ExitLatRead(SV_STATS_EXIT_CYCLES, index, &cycles_after) ||
+        exits_after == exits_before) {
+      fprintf(stderr, "cpu %u: cannot read counters\n", processor);
+      continue;
+    }
+    printf("%u %llu %.1f %.1f\n", index,
+           static_cast<unsigned long long>(large_page),
+           static_cast<double>(cycles_after - cycles_before) /
+               static_cast<double>(exits_after - exits_before),
+           static_cast<double>(round_trip) / static_cast<double>(iterations));
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+/// @file
+/// Prints records of a dumped log or trace section image.
+///
+/// This is the reference reader of the ring format described in ring.h. It
+/// builds on Linux without the WDK:
+///
+///   g++ -std=c++11 -I../SimpleSvm/log -o ringread ringread.cpp
+///   ringread <image>
+///
+/// An image is either a single ring (the log section) or a RingDirectory
+/// followed by one ring per processor (the trace section). Payloads made of
+/// printable characters are printed as text, others as hex.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "ring.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Prints a payload as text when every byte is printable, and as hex otherwise.
+static void RingReadPrintPayload(const unsigned char *payload, RingU32 size) {
+  auto text = true;
+  for (RingU32 i = 0; i < size; ++i) {
+    if (!isprint(payload[i]) && payload[i] != '\t') {
+      text = false;
+      break;
+    }
+  }
+  if (text) {
+    printf(" \"%.*s\"\n", static_cast<int>(size),
+           reinterpret_cast<const char *>(payload));
+    return;
+  }
+  for (RingU32 i = 0; i < size; ++i) {
+    printf("%s%02x", i ? "" : " ", payload[i]);
+  }
+  printf("\n");
+}
+
+// Prints all records still stored in a ring. Returns the number of records
+// that were published but could not be read.
+static unsigned long long RingReadDumpRing(const RingHeader *ring,
+                                           RingU32 index) {
+  const RingU64 head = ring->head;
+  const RingU64 first = (head > ring->slot_count) ? head - ring->slot_count : 0;
+  printf("ring %u: head %llu tail %llu dropped %llu\n", index,
+         static_cast<unsigned long long>(head),
+         static_cast<unsigned long long>(ring->tail),
+         static_cast<unsigned long long>(ring->dropped));
+
+  std::vector<unsigned char> payload(ring->slot_size);
+  unsigned long long missing = 0;
+  for (auto sequence = first; sequence < head; ++sequence) {
+    RingSlotHeader slot = {};
+    const auto result = RingRead(ring, sequence, &slot, payload.data(),
+                                 static_cast<RingU32>(payload.size()));
+    if (result != kRingReadOk) {
+      // An image never changes, so a record not ready now never will be.
+      ++missing;
+      continue;
+    }
+    const auto capacity =
+        ring->slot_size - static_cast<RingU32>(sizeof(RingSlotHeader));
+    const auto size = (slot.size < capacity) ? slot.size : capacity;
+    printf("%u %llu %llu %u %u", index,
+           static_cast<unsigned long long>(slot.sequence),
+           static_cast<unsigned long long>(slot.timestamp), slot.processor,
+           slot.size);
+    RingReadPrintPayload(payload.data(), size);
+  }
+  return missing;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <image>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const auto file = fopen(argv[1], "rb");
+  if (!file) {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  std::vector<unsigned char> image;
+  unsigned char buffer[4096];
+  size_t read = 0;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+    image.insert(image.end(), buffer, buffer + read);
+  }
+  fclose(file);
+  // RingDirectory and RingHeader are read in place, so keep them aligned.
+  std::vector<RingU64> aligned((image.size() + 7) / 8);
+  if (!image.empty()) {
+    memcpy(aligned.data(), image.data(), image.size());
+  }
+  const auto base = reinterpret_cast<const char *>(aligned.data());
+  const RingU64 size = image.size();
+
+  unsigned long long missing = 0;
+  if (size >= sizeof(RingU32) &&
+      *reinterpret_cast<const RingU32 *>(base) == kRingDirectoryMagic) {
+    const auto directory = reinterpret_cast<const RingDirectory *>(base);
+    if (size < sizeof(RingDirectory) || directory->version != kRingVersion) {
+      fprintf(stderr, "%s: unsupported directory\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+    for (RingU32 i = 0; i < directory->ring_count; ++i) {
+      const auto ring = RingDirectoryGetRing(directory, size, i);
+      if (!ring) {
+        fprintf(stderr, "%s: ring %u is invalid\n", argv[1], i);
+        return EXIT_FAILURE;
+      }
+      missing += RingReadDumpRing(ring, i);
+    }
+  } else {
+    const auto ring = reinterpret_cast<const RingHeader *>(base);
+    if (!RingIsValid(ring, size)) {
+      fprintf(stderr, "%s: not a ring of version %u\n", argv[1], kRingVersion);
+      return EXIT_FAILURE;
+    }
+    missing += RingReadDumpRing(ring, 0);
+  }
+  printf("missing %llu\n", missing);
+  return EXIT_SUCCESS;
+}